@@ -0,0 +1,378 @@
+#include "shell_library.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Benchmarks for the shell library. Each result is printed as one JSON line, so that the output of two commits can be
+ * compared with a script (make bench writes it to bench_output.txt). Run it from the repository directory.
+ */
+
+// Internals of shell_library.c that are measured directly.
+extern bool utilshell_use_fork;
+extern bool utilshell_prompt_dirty;
+extern int utilshell_lex_level;
+int utilshell_lex_best();
+int utilshell_lex_classify(const char*, int, uint64_t*, uint64_t*, int);
+void utilshell_prompt_refresh_cwd();
+void utilshell_prompt_render();
+struct utilshell_var;
+struct utilshell_var *utilshell_var_set(const char*, size_t, const char*, bool);
+const char *utilshell_var_get(const char*);
+void utilshell_var_unset(const char*, size_t);
+
+// Command lines like the ones people type, without anything that needs expanding.
+const char *bench_literal_corpus[] = {
+    "ls -la",
+    "cd ..",
+    "git status",
+    "git commit -m \"Fix the build on older compilers\"",
+    "grep -rn utilshell_expand shell_library.c",
+    "cat access.log | grep 404 | sort | uniq -c | sort -rn | head -20",
+    "make -j8 all > build.log 2> errors.log",
+    "find . -name core -type f -delete",
+    "tar czf backup.tar.gz src include docs",
+    "ps aux | grep -v grep | grep sshd",
+    "echo 'single quoted | not a pipe' \"double quoted > not a redirect\"",
+    "sed -e s/foo/bar/g < input.txt >> output.txt",
+    "sleep 10 &",
+    NULL
+};
+
+// Command lines that need variables, tildes, quotes and globs expanded (when they run, not when they are tokenized).
+const char *bench_expand_corpus[] = {
+    "cd ~",
+    "ls $HOME/.config",
+    "echo \"$USER is in ${HOME}\" '$NOT_EXPANDED'",
+    "cp ~/notes.txt ~root/notes.txt",
+    "echo pid $$ path $PATH",
+    "ls /etc/host*",
+    "cat \"$HOME\"/.profile | wc -l",
+    "echo a\\ b \"c d\" 'e f' ${MISSING}g",
+    NULL
+};
+
+// Returns the current time in seconds.
+double bench_now() {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+
+}
+
+// Prints a result line. bytes may be 0 if the benchmark has no throughput.
+void bench_report(const char *revision, const char *name, long long ops, double seconds, long long bytes) {
+
+    printf("{\"revision\":\"%s\",\"bench\":\"%s\",\"ops\":%lld,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"ops_per_s\":%.1f",
+        revision, name, ops, seconds, seconds * 1e9 / ops, ops / seconds);
+    if(bytes > 0)
+        printf(",\"bytes\":%lld,\"mb_per_s\":%.2f,\"gb_per_s\":%.3f", bytes, bytes / seconds / 1e6, bytes / seconds / 1e9);
+    printf("}\n");
+    fflush(stdout);
+
+}
+
+// Tokenizes every line of the corpus over and over for about a second.
+void bench_tokenize(const char *revision, const char *name, const char **corpus) {
+
+    long long ops = 0;
+    long long bytes = 0;
+    double start = bench_now();
+    double seconds;
+    do {
+        for(int round = 0; round < 1000; ++round) {
+            for(int i = 0; corpus[i] != NULL; ++i) {
+                char **tokens = shell_tokenize((char*)corpus[i]);
+                if(tokens == NULL) {
+                    fprintf(stderr, "Could not tokenize \"%s\".\n", corpus[i]);
+                    exit(EXIT_FAILURE);
+                }
+                shell_free_tokens(tokens);
+                bytes += strlen(corpus[i]);
+                ++ops;
+            }
+        }
+        seconds = bench_now() - start;
+    } while(seconds < 1.0);
+
+    bench_report(revision, name, ops, seconds, bytes);
+
+}
+
+/* Tokenizes one long generated command line (about 512KB) over and over for about a second, with every tokenizer
+ * front end from byte at a time (level 0) to the best one of the CPU, and then classifies it alone (see
+ * utilshell_lex_classify()). The arguments are many short words, or long quoted ones if quoted is true.
+ */
+void bench_tokenize_long(const char *revision, const char *name, bool quoted) {
+
+    const int size = 512 << 10;
+    char *line = (char*)malloc(size + 64);
+    int n = snprintf(line, size, "printf '%%s\\n'");
+    for(int i = 0; n < size - 64; ++i) {
+        if(quoted)
+            n += snprintf(line + n, 64, " \"%s chunk %06d of a long argument with $HOME in it\"", i % 2 ? "next" : "one", i);
+        else
+            n += snprintf(line + n, 64, " --input=/data/run/file_%06d.txt", i);
+    }
+    strcpy(line + n, " > /dev/null");
+    n += strlen(line + n);
+
+    int best = utilshell_lex_best();
+    for(int level = 0; level <= best; ++level) {
+
+        utilshell_lex_level = level;
+        long long ops = 0;
+        double start = bench_now();
+        double seconds;
+        do {
+            char **tokens = shell_tokenize(line);
+            if(tokens == NULL) {
+                fprintf(stderr, "Could not tokenize the long line.\n");
+                exit(EXIT_FAILURE);
+            }
+            shell_free_tokens(tokens);
+            ++ops;
+            seconds = bench_now() - start;
+        } while(seconds < 1.0);
+
+        char level_name[64];
+        snprintf(level_name, sizeof(level_name), "%s_level_%d", name, level);
+        bench_report(revision, level_name, ops, seconds, ops * n);
+
+        // The classification of the line alone (there is none byte at a time).
+        if(level == 0)
+            continue;
+        uint64_t *bits = (uint64_t*)malloc(2 * ((n + 63) / 64) * sizeof(uint64_t));
+        ops = 0;
+        start = bench_now();
+        do {
+            for(int round = 0; round < 100; ++round)
+                utilshell_lex_classify(line, n, bits, bits + (n + 63) / 64, level);
+            ops += 100;
+            seconds = bench_now() - start;
+        } while(seconds < 1.0);
+        snprintf(level_name, sizeof(level_name), "%s_classify_level_%d", name, level);
+        bench_report(revision, level_name, ops, seconds, ops * n);
+        free(bits);
+
+    }
+    utilshell_lex_level = best;
+    free(line);
+
+}
+
+// Runs a command line count times through the whole shell (tokenize, expand, launch and wait).
+void bench_command(const char *revision, const char *name, const char *line, int count, long long bytes_per_run) {
+
+    double start = bench_now();
+    for(int i = 0; i < count; ++i) {
+        char **tokens = shell_tokenize((char*)line);
+        if(tokens == NULL || shell_exec(tokens) != EXIT_SUCCESS) {
+            fprintf(stderr, "Could not run \"%s\".\n", line);
+            exit(EXIT_FAILURE);
+        }
+        shell_free_tokens(tokens);
+    }
+    double seconds = bench_now() - start;
+
+    bench_report(revision, name, count, seconds, bytes_per_run * count);
+
+}
+
+/* Runs a command line count times in a context, capturing its output, and the same through popen() (a new /bin/sh
+ * for every run) for comparison.
+ */
+void bench_ctx(const char *revision, const char *name, const char *line, int count) {
+
+    struct shell_ctx *ctx = shell_ctx_create("./shell");
+    if(ctx == NULL) {
+        fprintf(stderr, "Could not create a context.\n");
+        exit(EXIT_FAILURE);
+    }
+    struct shell_result result;
+    memset(&result, 0, sizeof(result));
+
+    double start = bench_now();
+    long long bytes = 0;
+    for(int i = 0; i < count; ++i) {
+        if(shell_run(ctx, line, &result) != EXIT_SUCCESS || result.status != EXIT_SUCCESS) {
+            fprintf(stderr, "Could not run \"%s\" in a context.\n", line);
+            exit(EXIT_FAILURE);
+        }
+        bytes += result.out.len;
+    }
+    bench_report(revision, name, count, bench_now() - start, bytes);
+
+    free(result.out.data);
+    free(result.err.data);
+    shell_ctx_free(ctx);
+
+    char popen_name[64];
+    snprintf(popen_name, sizeof(popen_name), "%s_popen", name);
+    char buffer[4096];
+    start = bench_now();
+    bytes = 0;
+    for(int i = 0; i < count; ++i) {
+        FILE *out = popen(line, "r");
+        if(out == NULL) {
+            fprintf(stderr, "Could not run \"%s\" with popen().\n", line);
+            exit(EXIT_FAILURE);
+        }
+        size_t got;
+        while((got = fread(buffer, 1, sizeof(buffer), out)) > 0)
+            bytes += got;
+        pclose(out);
+    }
+    bench_report(revision, popen_name, count, bench_now() - start, bytes);
+
+}
+
+// Renders the prompt over and over, with and without looking up the current directory again.
+void bench_prompt(const char *revision) {
+
+    const int count = 1000000;
+
+    double start = bench_now();
+    for(int i = 0; i < count; ++i) {
+        utilshell_prompt_dirty = true;
+        utilshell_prompt_render();
+    }
+    bench_report(revision, "prompt_render", count, bench_now() - start, 0);
+
+    start = bench_now();
+    for(int i = 0; i < count / 10; ++i) {
+        utilshell_prompt_refresh_cwd();
+        utilshell_prompt_render();
+    }
+    bench_report(revision, "prompt_render_after_cd", count / 10, bench_now() - start, 0);
+
+}
+
+// Sets and reads back 10000 shell variables, then removes them again.
+void bench_vars(const char *revision) {
+
+    const int count = 10000;
+    char name[32];
+
+    double start = bench_now();
+    for(int i = 0; i < count; ++i) {
+        int n = snprintf(name, sizeof(name), "BENCH_VAR_%d", i);
+        utilshell_var_set(name, n, name, false);
+    }
+    bench_report(revision, "vars_set_10k", count, bench_now() - start, 0);
+
+    long long ops = 0;
+    start = bench_now();
+    for(int round = 0; round < 100; ++round) {
+        for(int i = 0; i < count; ++i) {
+            snprintf(name, sizeof(name), "BENCH_VAR_%d", i);
+            if(utilshell_var_get(name) == NULL) {
+                fprintf(stderr, "Could not find variable \"%s\".\n", name);
+                exit(EXIT_FAILURE);
+            }
+            ++ops;
+        }
+    }
+    bench_report(revision, "vars_get_10k", ops, bench_now() - start, 0);
+
+    for(int i = 0; i < count; ++i) {
+        int n = snprintf(name, sizeof(name), "BENCH_VAR_%d", i);
+        utilshell_var_unset(name, n);
+    }
+
+}
+
+int main(int argc, char *argv[]) {
+
+    // The revision being measured is passed in by make bench.
+    const char *revision = argc > 1 ? argv[1] : "unknown";
+
+    // Commands must not read the terminal, and the shell must not take it over.
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+
+    char *shell_argv[] = {(char*)"bench", (char*)"-t", (char*)"-c", NULL};
+    if(shell_init(3, shell_argv) != EXIT_SUCCESS) {
+        fprintf(stderr, "Could not initialize shell.\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_tokenize(revision, "tokenize_literal", bench_literal_corpus);
+    bench_tokenize(revision, "tokenize_expand", bench_expand_corpus);
+    bench_tokenize_long(revision, "tokenize_long_words", false);
+    bench_tokenize_long(revision, "tokenize_long_quoted", true);
+
+    bench_command(revision, "command_builtin", "true", 100000, 0);
+    bench_command(revision, "command_builtin_expand", "true ~ $HOME \"$USER\" 'a b' /etc/host*", 100000, 0);
+    // Five nested loops of ten words run the builtin 100000 times from one parse.
+    const char *loop = "for a in 0 1 2 3 4 5 6 7 8 9; do for b in 0 1 2 3 4 5 6 7 8 9; do "
+        "for c in 0 1 2 3 4 5 6 7 8 9; do for d in 0 1 2 3 4 5 6 7 8 9; do "
+        "for e in 0 1 2 3 4 5 6 7 8 9; do true $e; done; done; done; done; done";
+    bench_command(revision, "loop_builtin_100k", loop, 10, 0);
+    // The same loop, setting a variable and reading it back in every iteration.
+    const char *assign_loop = "for a in 0 1 2 3 4 5 6 7 8 9; do for b in 0 1 2 3 4 5 6 7 8 9; do "
+        "for c in 0 1 2 3 4 5 6 7 8 9; do for d in 0 1 2 3 4 5 6 7 8 9; do "
+        "for e in 0 1 2 3 4 5 6 7 8 9; do X=$e; true $X; done; done; done; done; done";
+    bench_command(revision, "loop_assign_100k", assign_loop, 10, 0);
+    bench_command(revision, "command_spawn", "/bin/true", 2000, 0);
+    utilshell_use_fork = true;
+    bench_command(revision, "command_fork", "/bin/true", 2000, 0);
+    utilshell_use_fork = false;
+
+    // head and N-1 cats, moving 256MB from /dev/zero to /dev/null.
+    const long long bytes = 256LL << 20;
+    char line[256];
+    char name[64];
+    for(int stages = 1; stages <= 4; ++stages) {
+        int n = snprintf(line, sizeof(line), "head -c %lld /dev/zero", bytes);
+        for(int i = 1; i < stages; ++i)
+            n += snprintf(line + n, sizeof(line) - n, " | cat");
+        snprintf(line + n, sizeof(line) - n, " > /dev/null");
+        snprintf(name, sizeof(name), "pipeline_%d_stages", stages);
+        bench_command(revision, name, line, 3, bytes);
+    }
+
+    // The 4 stages again, with the pipes between them grown to 1MB.
+    char *set_argv[] = {(char*)"set", (char*)"pipe-size=1M", NULL};
+    if(shell_set(2, set_argv) == EXIT_SUCCESS)
+        bench_command(revision, "pipeline_4_stages_1m_pipes", line, 3, bytes);
+    set_argv[1] = (char*)"pipe-size=default";
+    shell_set(2, set_argv);
+
+    // parallel running /bin/true for 2000 arguments, 4 at a time.
+    const int jobs = 2000;
+    char **parallel_argv = (char**)calloc(jobs + 6, sizeof(char*));
+    char numbers[jobs][8];
+    int parallel_argc = 0;
+    parallel_argv[parallel_argc++] = (char*)"parallel";
+    parallel_argv[parallel_argc++] = (char*)"-j4";
+    parallel_argv[parallel_argc++] = (char*)"/bin/true";
+    parallel_argv[parallel_argc++] = (char*)":::";
+    for(int i = 0; i < jobs; ++i) {
+        snprintf(numbers[i], sizeof(numbers[i]), "%d", i);
+        parallel_argv[parallel_argc++] = numbers[i];
+    }
+    double start = bench_now();
+    if(shell_parallel(parallel_argc, parallel_argv) != EXIT_SUCCESS) {
+        fprintf(stderr, "Could not run parallel.\n");
+        exit(EXIT_FAILURE);
+    }
+    bench_report(revision, "parallel_true_j4", jobs, bench_now() - start, 0);
+    free(parallel_argv);
+
+    bench_ctx(revision, "ctx_run_echo", "echo hello", 5000);
+    bench_ctx(revision, "ctx_run_pipeline", "echo hello | cat", 1000);
+
+    bench_prompt(revision);
+    bench_vars(revision);
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,115 @@
+#include "shell_library.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Differential fuzz test for the tokenizer. Random command lines are tokenized once with every byte going through the
+ * state machine (UTILSHELL_LEX_BYTES) and once with each of the ways of skipping plain text, and the tokens have to
+ * be the same. make fuzz runs it; it can also be given the number of lines and a seed.
+ */
+
+// Internals of shell_library.c that are tested directly. Levels run from UTILSHELL_LEX_BYTES (0) to utilshell_lex_best().
+const int FUZZ_LEVEL_BYTES = 0;
+int utilshell_lex_best();
+char *utilshell_lex_describe(const char*, int, int*);
+
+// Bytes the tokenizer treats specially are picked far more often than others.
+const char fuzz_alphabet[] = "ab2- \t\n|||<<>>&&;;''\"\"\\\\$~*(){}-EOF#";
+
+// Writes a random line of up to max bytes (without the terminating null) to line. Returns its length.
+int fuzz_line(char *line, int max) {
+
+    // Mostly short lines, sometimes long ones so that every block size and offset is hit.
+    int len = rand() % 8 == 0 ? rand() % max : rand() % 200;
+
+    // Long runs of one kind of byte are what the classifier skips, so lines are built from runs.
+    int i = 0;
+    while(i < len) {
+        int run = rand() % 4 == 0 ? rand() % 300 : 1 + rand() % 8;
+        int kind = rand() % 4;
+        for(int k = 0; k < run && i < len; ++k) {
+            char c;
+            if(kind == 0)
+                c = 'a' + rand() % 26;
+            else if(kind == 1)
+                c = (char)(1 + rand() % 255);
+            else
+                c = fuzz_alphabet[rand() % (sizeof(fuzz_alphabet) - 1)];
+            line[i++] = c;
+        }
+        // A here-document now and then, with its body and delimiter.
+        if(rand() % 64 == 0 && i + 16 < len) {
+            memcpy(line + i, " <<EOF\nx $y\nEOF\n", 16);
+            i += 16;
+        }
+    }
+    line[len] = '\0';
+    return len;
+
+}
+
+// Prints a line that the levels disagree on to stderr, escaped, with what each of them made of it.
+void fuzz_report(const char *line, int level, const char *expected, const char *actual) {
+
+    fprintf(stderr, "Level %d differs from the byte at a time tokenizer on:\n\"", level);
+    for(const char *p = line; *p != '\0'; ++p) {
+        if(*p >= ' ' && *p <= '~' && *p != '"' && *p != '\\')
+            fputc(*p, stderr);
+        else
+            fprintf(stderr, "\\x%02x", (unsigned char)*p);
+    }
+    fprintf(stderr, "\"\nExpected:\n%s\nGot:\n%s\n", expected, actual);
+
+}
+
+int main(int argc, char *argv[]) {
+
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    unsigned int seed = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 1;
+    srand(seed);
+
+    const int max = 1 << 14;
+    char *line = (char*)malloc(max + 1);
+    if(line == NULL) {
+        fprintf(stderr, "Could not allocate line.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Syntax errors in the random lines are expected, and not worth printing. Stderr is put back for a failure.
+    int stderr_fd = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    int best = utilshell_lex_best();
+    long long bytes = 0;
+    for(int n = 0; n < count; ++n) {
+
+        bytes += fuzz_line(line, max);
+
+        int expected_status;
+        char *expected = utilshell_lex_describe(line, FUZZ_LEVEL_BYTES, &expected_status);
+        for(int level = FUZZ_LEVEL_BYTES + 1; level <= best && expected != NULL; ++level) {
+            int status;
+            char *actual = utilshell_lex_describe(line, level, &status);
+            if(actual == NULL || strcmp(expected, actual) != 0) {
+                fflush(stderr);
+                dup2(stderr_fd, STDERR_FILENO);
+                fuzz_report(line, level, expected, actual != NULL ? actual : "(nothing)");
+                return EXIT_FAILURE;
+            }
+            free(actual);
+        }
+        free(expected);
+
+    }
+
+    printf("fuzz: %d lines (%lld bytes, seed %u) tokenized the same by levels 0 to %d.\n", count, bytes, seed, best);
+    free(line);
+    return EXIT_SUCCESS;
+
+}
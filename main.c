@@ -10,10 +10,6 @@
 
 int main(int argc, char *argv[]) {
         
-    // Variables for user input.
-    const int BUFFER_LEN = 4096;
-    char buffer[BUFFER_LEN];
-
     // Initialize prompt.
     if(shell_init(argc, argv) != EXIT_SUCCESS) {
         shell_error("Could not initialize prompt.\n");
@@ -24,15 +20,23 @@ int main(int argc, char *argv[]) {
     while(is_running) {
 
         // Print prompt and retrieve user input.
-        if(shell_prompt(buffer, BUFFER_LEN) != EXIT_SUCCESS) {
+        char *buffer;
+        if(shell_prompt(&buffer) != EXIT_SUCCESS) {
             shell_error("Could not retrieve input.\n");
+            return EXIT_FAILURE;
         }
 
+        // Stop at the end of the input (end of the script, or Ctrl-D).
+        if(buffer == NULL)
+            break;
+
         // Tokenize input (separate by command/|/</>/&).
         char **tokens;
         
         if((tokens = shell_tokenize(buffer)) == NULL) {
-            shell_error("Could not tokenize input.\n");
+            // shell_tokenize() has reported why. A script does not go on after a syntax error.
+            if(!shell_interactive())
+                return 2;
         }
 
         // Execute command.
@@ -45,6 +49,7 @@ int main(int argc, char *argv[]) {
 
     }
 
-    return EXIT_SUCCESS;
+    // The end of the input ends the shell like exit does, with the status of the last command.
+    return shell_status();
 
 }
\ No newline at end of file
@@ -5,29 +5,809 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <dirent.h>
-#include <wordexp.h>
+#include <spawn.h>
+#include <glob.h>
+#include <pwd.h>
+#include <sched.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 
 // Variables for use in functions below.
 bool utilshell_prompt_visible;
 bool utilshell_colors;
+bool utilshell_use_fork;    // True if commands are launched with fork() instead of posix_spawn().
+bool utilshell_interactive; // True if stdin is a terminal that the shell hands to foreground pipelines.
+
+// An entry of the command hash table, which maps command names to the absolute paths found in $PATH.
+struct utilshell_hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct utilshell_hash_entry *next;
+};
+
+struct utilshell_hash_entry **utilshell_hash_table; // Buckets of the command hash table.
+int utilshell_hash_buckets;                         // Number of buckets (always a power of two).
+int utilshell_hash_count;                           // Number of entries in the table.
+char *utilshell_hash_path;                          // The value of $PATH the table was filled with.
+
+/* A variable of the shell. Its text is "NAME=value" in one allocation, so that exported variables can go into the
+ * environment of commands as they are.
+ */
+struct utilshell_var {
+    char *text;       // NULL for an empty slot or a removed variable.
+    size_t name_len;
+    unsigned int hash;
+    bool exported;
+    bool removed;     // True if the slot held a variable that was unset (it is reused, but does not end a probe).
+};
+
+/* The variables, in a hash table with open addressing that is filled from environ by shell_init(). The environment
+ * of commands (utilshell_envp) is built from the exported variables when it is needed, and only again after one of
+ * them has changed.
+ */
+struct utilshell_var *utilshell_vars;
+int utilshell_var_slots; // A power of two.
+int utilshell_var_used;  // Slots that hold a variable or a removed one.
+int utilshell_var_count; // Variables set.
+char **utilshell_envp;
+bool utilshell_envp_dirty;
+
+// Names given to export before they were set (export NAME). They stay unset, and are exported once they are set.
+char **utilshell_export_names;
+int utilshell_num_export_names;
+
+/* A bump allocator that owns everything allocated for one input line (tokens, expanded words, argv, ...). Nothing is
+ * freed on its own; the whole arena is reset in one step once the line has been executed.
+ */
+struct utilshell_arena_block {
+    struct utilshell_arena_block *next;
+    size_t size; // Bytes of data in the block (the data follows the header).
+    size_t used;
+};
+
+struct utilshell_arena {
+    struct utilshell_arena_block *head; // The block allocations are currently made from.
+    void *last;                         // The most recent allocation (it can be grown in place).
+    size_t total;                       // Bytes of data in all blocks.
+};
+
+struct utilshell_arena *utilshell_spare_arena; // A reset arena kept around for the next line.
+
+// Allocation counters for the current line (see -a).
+bool utilshell_alloc_stats;
+int utilshell_arena_allocs; // Allocations served by the arena.
+int utilshell_heap_allocs;  // Allocations that had to go to malloc().
+
+// A growable string. If arena is not NULL, the string is allocated from it.
+struct utilshell_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    struct utilshell_arena *arena;
+};
+
+/* State of the word being built by utilshell_expand(). The value is the expanded word. The pattern is the same word
+ * with every quoted glob character escaped by a backslash, so that it can be handed to glob().
+ */
+struct utilshell_word {
+    struct utilshell_buf value;
+    struct utilshell_buf pattern;
+    bool started;  // True once the word exists, even if empty (eg. "").
+    bool has_glob; // True if the word contains an unquoted *, ? or [.
+};
+
+// A segment of the compiled prompt (see utilshell_prompt_compile()).
+const int UTILSHELL_PROMPT_TEXT = 0;     // Literal text (including user and host, which never change).
+const int UTILSHELL_PROMPT_CWD = 1;      // The current directory (\w).
+const int UTILSHELL_PROMPT_CWD_BASE = 2; // The last component of the current directory (\W).
+
+struct utilshell_prompt_segment {
+    int type;
+    char *text;
+    size_t len;
+};
+
+// The prompt cache. User, host and home are looked up once by shell_init(), the cwd whenever cd succeeds.
+struct utilshell_prompt_segment *utilshell_prompt_segments;
+int utilshell_prompt_num_segments;
+char *utilshell_user;
+char *utilshell_host;
+char *utilshell_home;
+char *utilshell_cwd;
+struct utilshell_buf utilshell_prompt_cache; // The rendered prompt.
+bool utilshell_prompt_dirty;                 // True if the prompt has to be rendered again.
+
+/* A streaming line reader. Input is read in large blocks into a growable buffer and split into lines with memchr(),
+ * so lines can be of any length. Either fd is a file descriptor, or data holds a command string (see -e).
+ */
+struct utilshell_reader {
+    int fd;
+    char *data;
+    size_t start;      // Start of the unread data.
+    size_t end;        // End of the data read so far.
+    size_t cap;
+    bool eof;
+    bool seekable;     // True if fd is shared with the commands and can be rewound (see utilshell_input_release()).
+    off_t released_at; // The offset fd was rewound to by utilshell_input_release(), or -1.
+};
+
+struct utilshell_reader utilshell_input;
+
+// A builtin command, run inside the shell instead of being executed.
+struct utilshell_builtin {
+    const char *name;
+    int (*func)(int, char**);
+};
+
+const struct utilshell_builtin utilshell_builtins[] = {
+    { "exit", shell_exit },
+    { "cd", shell_cd },
+    { "hash", shell_hash },
+    { "echo", shell_echo },
+    { "printf", shell_printf },
+    { "true", shell_true },
+    { "false", shell_false },
+    { "test", shell_test },
+    { "[", shell_test },
+    { "pwd", shell_pwd },
+    { "export", shell_export },
+    { "unset", shell_unset },
+    { "jobs", shell_jobs },
+    { "fg", shell_fg },
+    { "bg", shell_bg },
+    { "wait", shell_wait },
+    { "kill", shell_kill },
+    { "cat", shell_cat },
+    { "tee", shell_tee },
+    { "set", shell_set },
+    { "parallel", shell_parallel },
+    { "history", shell_history },
+    { "memo", shell_memo },
+};
+const int UTILSHELL_NUM_BUILTINS = sizeof(utilshell_builtins) / sizeof(utilshell_builtins[0]);
+
+/* The builtins are found through a perfect hash table: utilshell_builtin_init() picks a seed for which
+ * utilshell_builtin_hash() gives every builtin its own slot, so a lookup costs one hash and one strcmp().
+ */
+const int UTILSHELL_BUILTIN_SLOTS = 64;
+const struct utilshell_builtin *utilshell_builtin_table[UTILSHELL_BUILTIN_SLOTS];
+unsigned int utilshell_builtin_seed;
+
+int utilshell_last_status; // Exit status of the last command.
+
+// Bytes moved per call by cat and tee (see utilshell_copy()), and the size of the buffer they fall back to.
+const int UTILSHELL_COPY_LEN = 1 << 20;
+
+/* A job slot of the parallel builtin. With -j N, slot k runs jobs k, k + N, k + 2N, ... and keeps its buffers from one
+ * job to the next, so memory does not grow with the number of jobs.
+ */
+struct utilshell_parallel_slot {
+    pid_t pid;
+    int pidfd;                      // -1 if pidfd_open() is unavailable (the job is then waited for once its output ends).
+    int fds[2];                     // Read ends of the pipes on stdout and stderr of the job (-1 once they are at EOF).
+    struct utilshell_buf output[2]; // Output of the job that has to wait until every earlier job is done.
+    bool exited;
+    int status;                     // Wait status once the job has exited.
+    struct timespec started;
+    struct timespec ended;
+};
+
+// Latencies of parallel jobs are counted in power-of-two buckets: bucket k counts the jobs that took less than 2^k us.
+const int UTILSHELL_LATENCY_BUCKETS = 40;
+
+// A process of a job (one stage of its pipeline).
+struct utilshell_proc {
+    pid_t pid;
+    int pidfd;                        // Becomes readable when the process exits (-1 if pidfd_open() is unavailable).
+    int status;                       // Wait status once the process has exited.
+    struct rusage usage;              // Resource usage once the process has exited (from wait4()).
+    struct timespec started;          // When the process was started.
+    struct timespec ended;            // When the shell saw the process exit.
+    long long rchar;                  // Bytes the process read and wrote through system calls, on any fd: pipes, files and
+    long long wchar;                  // terminals alike (from /proc/<pid>/io, only if its job is profiled).
+    char name[32];                    // args[0] of the process, for reports (cut short if needed).
+    char cpus[32];                    // The CPUs the process was pinned to, for reports ("" if it was not pinned).
+    int cpu;                          // The CPU it last ran on (only if its job is profiled, -1 if unknown).
+    bool done;
+    bool stopped;
+    int stop_signal;                  // The signal that stopped the process, while it is stopped.
+    struct utilshell_job *job;
+    struct utilshell_proc *hash_next; // Next process in the same bucket of utilshell_proc_table.
+};
+
+// A job: a pipeline started by the shell, in its own process group.
+struct utilshell_job {
+    int id;        // The job number (%n).
+    pid_t pgid;
+    int num_procs;
+    int num_done;
+    int num_stopped;
+    struct utilshell_proc *procs;
+    char *command;
+    bool background;
+    bool notify;   // True if a change of state should be reported before the next prompt.
+    int status;    // Exit status of the job (the status of its last process) once every process has exited.
+    int unstarted_status; // The status of the job if its last stage could not be started, otherwise -1.
+    bool timed;    // True if the job was started with the time builtin.
+    bool profiled; // True if the job is timed or profiled with -p.
+    struct rusage shell_usage; // Resource usage of the shell itself when the job was started.
+    int pipe_size; // Size of the pipes between its stages in bytes (0 if it has none).
+    int jobserver_slot; // The jobserver token held by a background job, UTILSHELL_JOBSERVER_IMPLICIT, or -1.
+};
+
+// The file that -p appends a JSON line to for every job, or -1.
+int utilshell_profile_fd;
+
+/* The GNU make jobserver: a pipe that holds one byte (a token) for every job that may run besides the first. The
+ * shell creates it with --jobs N, or uses the one named in $MAKEFLAGS if it was started by make. Every background job
+ * needs a token, except for one, which runs on the slot of the shell itself (as the first job of make does). Tokens
+ * are taken through a non-blocking file description of the pipe of the shell's own, so that the shell can reap jobs
+ * (which gives their tokens back) while it waits for one.
+ */
+int utilshell_jobserver_read;      // -1 if the shell does not use a jobserver.
+int utilshell_jobserver_write;
+bool utilshell_jobserver_implicit; // True if a background job runs on the slot of the shell.
+const int UTILSHELL_JOBSERVER_IMPLICIT = 256;
+const int UTILSHELL_JOBSERVER_INTERRUPTED = -2; // Ctrl-C while waiting for a token (see utilshell_jobserver_acquire()).
+pid_t utilshell_jobserver_pid;                  // The shell that attached to the jobserver (not one of its children).
+
+/* A context of the embedding API. Its shell is a process of its own, the shell program started with --serve, so that
+ * contexts share nothing (not even the working directory or fds 0 to 2) and run at the same time. The shell gets
+ * command lines over a socket and answers each with its exit status. Its stdout and stderr are two memfds that the
+ * caller reads back once the command line is done.
+ */
+struct shell_ctx {
+    char *path; // The shell program (looked up in $PATH if it has no slash).
+    pid_t pid;  // -1 if the shell is not running (it has not been started yet, or it exited).
+    int sock;   // Our end of the socket to the shell.
+    int out_fd;
+    int err_fd;
+};
+
+/* Options of the set builtin. The pipes between stages are grown to utilshell_pipe_size bytes (0 keeps the default of
+ * the kernel). If utilshell_pinned is true, every stage is pinned to the CPUs in utilshell_cpus, or with
+ * utilshell_cpus_spread, stage n to the n-th CPU of the set alone.
+ */
+int utilshell_pipe_size;
+bool utilshell_pinned;
+bool utilshell_cpus_spread;
+cpu_set_t utilshell_cpus;
+
+// The job table. Job n is stored at index n-1.
+struct utilshell_job **utilshell_jobs;
+int utilshell_max_jobs;
+int utilshell_current_job; // The job used when no job is given to fg, bg, ... (0 if there is none).
+
+// Processes of every job, hashed by pid, so that an event for a pid is handled in O(1).
+const int UTILSHELL_PROC_BUCKETS = 256;
+struct utilshell_proc *utilshell_proc_table[UTILSHELL_PROC_BUCKETS];
+
+/* The event loop. Every pidfd is registered in an epoll instance together with a signalfd for SIGCHLD (which is
+ * blocked for the shell itself). A readable pidfd means that its process exited; SIGCHLD is only used to learn about
+ * stopped and continued processes.
+ */
+int utilshell_epoll_fd;
+int utilshell_signal_fd;
+bool utilshell_have_pidfd; // False if the kernel does not support pidfd_open(); exits then come through SIGCHLD too.
+struct termios utilshell_tmodes; // Terminal modes of the shell, restored after a foreground job.
+
+// The types of tokens produced by shell_tokenize().
+enum utilshell_token_type {
+    UTILSHELL_TOKEN_WORD,
+    UTILSHELL_TOKEN_PIPE,       // |
+    UTILSHELL_TOKEN_REDIR_IN,   // <
+    UTILSHELL_TOKEN_REDIR_OUT,  // >
+    UTILSHELL_TOKEN_REDIR_APP,  // >>
+    UTILSHELL_TOKEN_REDIR_ERR,  // 2>
+    UTILSHELL_TOKEN_HEREDOC,    // << or <<-
+    UTILSHELL_TOKEN_HERESTRING, // <<<
+    UTILSHELL_TOKEN_BACKGROUND, // &
+    UTILSHELL_TOKEN_SEMICOLON,  // ;
+    UTILSHELL_TOKEN_NEWLINE,    // A newline (only inside input that spans several lines).
+    UTILSHELL_TOKEN_AND,        // &&
+    UTILSHELL_TOKEN_OR          // ||
+};
+
+struct utilshell_token {
+    enum utilshell_token_type type;
+    char *text;   // The token as it was typed.
+    bool literal; // True if the token is a word that expands to itself (no quotes, variables, globs, ...).
+    struct utilshell_pipeline *subst; // The pipeline of a process substitution (<(cmd) or >(cmd)), NULL otherwise.
+    char *here;   // The body of a here-document, for the delimiter after <<. literal is true if it is not expanded.
+};
+
+/* A command of a pipeline, as parsed by utilshell_parse() (eg. "grep foo < in.txt" in "cat *.c | grep foo < in.txt").
+ * Redirects are stored by type; if one is given twice, the last one wins.
+ */
+struct utilshell_command {
+    struct utilshell_token **words;
+    int num_words;
+    struct utilshell_token **assigns;        // Leading NAME=value words (set by utilshell_lower(), not part of words).
+    int num_assigns;
+    struct utilshell_token *redir_in;
+    bool redir_here;                         // redir_in is a here-document or here-string rather than a file.
+    struct utilshell_token *redir_out;
+    struct utilshell_token *redir_app;
+    struct utilshell_token *redir_err;
+    char **argv;                             // Set by utilshell_lower() if every word is literal, NULL otherwise.
+    const struct utilshell_builtin *builtin; // The builtin to run, if argv is set.
+};
+
+/* A parsed pipeline. It is lowered into a plan once by utilshell_lower(): the argv of literal commands is built up
+ * front and the stages and pipes are allocated, so running it again only expands the words that need it.
+ */
+struct utilshell_pipeline {
+    struct utilshell_command *commands;
+    int num_commands;
+    bool background; // The pipeline ended with &.
+    bool timed;      // The pipeline started with the time builtin (which is not part of the first command).
+    char *text;      // The pipeline as it is shown by jobs.
+    struct utilshell_stage *stages;
+    int *pipes;
+};
+
+// The types of nodes of a parsed command line.
+enum utilshell_node_type {
+    UTILSHELL_NODE_PIPELINE,
+    UTILSHELL_NODE_AND,   // left && right
+    UTILSHELL_NODE_OR,    // left || right
+    UTILSHELL_NODE_IF,    // if cond; then body; else else_body; fi (elif is an if in else_body)
+    UTILSHELL_NODE_WHILE, // while cond; do body; done (or until, if negate is set)
+    UTILSHELL_NODE_FOR    // for name in words; do body; done
+};
+
+/* A node of a parsed command line. The nodes of a list (commands separated by ;, & or newlines) are linked through
+ * next. Loop bodies are run straight from their nodes, so they are parsed only once however often they run.
+ */
+struct utilshell_node {
+    enum utilshell_node_type type;
+    struct utilshell_pipeline *pipeline;
+    struct utilshell_node *left;
+    struct utilshell_node *right;
+    struct utilshell_node *cond;
+    struct utilshell_node *body;
+    struct utilshell_node *else_body;
+    bool negate;
+    struct utilshell_token *name;
+    struct utilshell_token **words;
+    int num_words;
+    struct utilshell_node *next;
+};
+
+// The state of the parser, which reads the tokens of shell_tokenize() from left to right.
+struct utilshell_parser {
+    struct utilshell_token *tokens;
+    int num_tokens;
+    int pos;
+    struct utilshell_arena *arena;
+};
+
+// Results of the utilshell_parse_* functions.
+const int UTILSHELL_PARSE_OK = 0;
+const int UTILSHELL_PARSE_ERROR = 1;
+const int UTILSHELL_PARSE_INCOMPLETE = 2; // The input ended in the middle of a command; more lines are needed.
+
+/* How utilshell_lex() finds the bytes that mean something to it. With UTILSHELL_LEX_BYTES every byte goes through its
+ * state machine. The others classify the whole buffer up front, 16 or 32 bytes at a time with SSE2 or AVX2 (or with
+ * a table, one byte at a time), into bitmaps of the bytes that end a word and of the quotes and backslashes, so that
+ * runs of plain text inside words and quotes are skipped at once. They all give the same tokens (make fuzz checks).
+ */
+const int UTILSHELL_LEX_BYTES = 0;
+const int UTILSHELL_LEX_SCALAR = 1;
+const int UTILSHELL_LEX_SSE2 = 2;
+const int UTILSHELL_LEX_AVX2 = 3;
+int utilshell_lex_level; // The best one the CPU supports, set by shell_init().
+
+/* The classification of a buffer for utilshell_lex(): bit k of stops is set if buffer[k] ends a word (whitespace, an
+ * operator, a quote or a backslash), and bit k of quotes if it is a quote or a backslash. The buffer is classified
+ * as the lexer gets to it, in chunks that start at UTILSHELL_LEX_CHUNK bytes and double, so that a buffer that is
+ * lexed only in part (eg. one that ends in a here-document, lexed again for each line of it) is classified in part.
+ */
+struct utilshell_lex_bits {
+    const char *buffer;
+    int n;          // The length of the buffer.
+    int level;
+    int classified; // Bytes classified so far.
+    uint64_t *stops;
+    uint64_t *quotes;
+};
+const int UTILSHELL_LEX_CHUNK = 256;
+
+// An unfinished command carried over to the next line (see shell_tokenize()).
+struct utilshell_buf utilshell_pending;
+bool utilshell_pending_escape; // True if the pending text ends with a backslash that joins it with the next line.
+
+// Words are expanded into this arena when a pipeline runs. It is reset before the next pipeline runs.
+struct utilshell_arena *utilshell_scratch_arena;
+
+// A single stage of a pipeline while it runs.
+struct utilshell_stage {
+    char **args;
+    const char *path; // The resolved path of args[0].
+    const struct utilshell_builtin *builtin; // The builtin to run instead of args[0], or NULL.
+    struct utilshell_command *command;       // The command the stage runs (for its redirects).
+    int fds[3];       // The fds that become stdin, stdout and stderr of the stage (-1 to inherit from the shell).
+    bool owned[3];    // True if the matching fd is a redirect file that the shell has to close after launching.
+    pid_t pid;
+    int status;       // The exit status of the stage if it could not be started (127, or 126 if it is not executable).
+    struct timespec started;
+    char cpus[32];    // The CPUs the stage was pinned to ("" if it was not pinned).
+    int *pass_fds;    // Pipe ends of process substitutions in the words of the stage, passed to it as they are.
+    int num_pass_fds;
+    char **assigns;   // The expanded NAME=value assignments of its command.
+    int num_assigns;
+    char **envp;      // The environment of the stage, if the assignments change it (NULL for utilshell_var_envp()).
+};
+
+/* Here-documents and here-strings up to this size are written into a pipe (which holds 64KB unless the user has run
+ * out of pipe pages), larger ones into a sealed memfd that the command can also mmap.
+ */
+const int UTILSHELL_HERE_PIPE = 1 << 16;
+
+// A process substitution started for the pipeline being run (see utilshell_subst_start()).
+struct utilshell_subst {
+    struct utilshell_pipeline *pipeline;
+    struct utilshell_subst *next;
+};
 
+/* The pipeline being started. utilshell_subst_stage is the stage whose words are being expanded (NULL where a process
+ * substitution is not allowed, eg. in the words of a for loop). The process substitutions run in the process group
+ * of the pipeline, utilshell_pgid (0 until its first process starts).
+ */
+struct utilshell_subst *utilshell_substs;
+struct utilshell_stage *utilshell_subst_stage;
+pid_t utilshell_pgid;
+
+/* The history, shared by all shells of the user through an append-only file ($HISTFILE, or ~/.shell_history). Every
+ * entry is one line of the file (newlines inside a command are stored as UTILSHELL_HISTORY_NEWLINE) and is added with
+ * a single write() to the file opened with O_APPEND, so the entries of concurrent shells never mix. Nothing is read
+ * when the shell starts: the file is mapped the first time the history is used, and again whenever it has grown.
+ */
+int utilshell_history_fd;          // -1 if the history file is not open.
+bool utilshell_history_on;         // True if commands are added to the history and ! references are expanded.
+const char *utilshell_history_map; // The mapping of the file, or NULL.
+size_t utilshell_history_mapped;   // Bytes mapped.
+size_t utilshell_history_len;      // Bytes of complete entries in the mapping (up to its last newline).
+struct utilshell_buf utilshell_history_line; // A line of input with its history references expanded.
+const char UTILSHELL_HISTORY_NEWLINE = '\x1f';
+const int UTILSHELL_HISTORY_RECENT = 65536; // Entries searched without the trigram index (see utilshell_history_find()).
+const int UTILSHELL_HISTORY_TAIL = 65536;   // Bytes at the end of the file indexed first.
+const int UTILSHELL_HISTORY_ALL = INT_MAX;  // Passed to utilshell_history_index() to have every entry indexed.
+
+/* The indexes of the history. Both are built when they are first needed and then only extended by the entries added
+ * since. utilshell_history_offsets starts with the entries in the last UTILSHELL_HISTORY_TAIL bytes of the file, and is
+ * extended backwards only as far as !-n or a search goes, so that !! does not read the whole file. Entry n (counting
+ * from 1) of the index starts at utilshell_history_offsets[n-1]; that is its number in the history only once the index
+ * reaches the start of the file (utilshell_history_start is 0).
+ */
+size_t *utilshell_history_offsets;
+int utilshell_history_count;
+int utilshell_history_cap;
+size_t utilshell_history_start;   // Bytes of the file in front of the first entry in utilshell_history_offsets.
+size_t utilshell_history_indexed; // Bytes of the file up to the end of the last entry in utilshell_history_offsets.
+
+/* The trigram index lists the entries that contain each sequence of three bytes, in ascending order and delta-encoded
+ * as varints, so that a search only has to look at the entries of the rarest trigram of what it searches for.
+ */
+struct utilshell_trigram {
+    unsigned int key;      // The three bytes plus one (0 marks an empty slot).
+    int count;             // Number of entries in the list.
+    int last;              // The last entry in the list.
+    size_t len;
+    size_t cap;
+    unsigned char *deltas;
+};
+
+struct utilshell_trigram *utilshell_trigrams; // Hash table with open addressing.
+int utilshell_trigram_slots;                  // A power of two.
+int utilshell_trigram_used;
+int utilshell_trigram_entries;                // Number of entries that have been added to the trigram index.
+
+/* The line editor, used for commands typed at a terminal. The terminal is only in raw mode while a line is being
+ * edited. Keys that have been read but not handled yet (eg. the lines after the first of a paste) stay in keys.
+ */
+struct utilshell_editor {
+    struct utilshell_buf line;
+    size_t pos;             // The cursor, as an offset into line.
+    int cursor_row;         // The row of the cursor as last drawn, counted from the row the prompt ends on.
+    bool dirty;             // True if the line has to be drawn again before waiting for more keys.
+    bool tab_failed;        // True if the last key was a Tab that could not complete anything.
+    unsigned char keys[256];
+    int num_keys;
+    int next_key;
+};
+
+bool utilshell_editing; // True if input is read with the line editor.
+struct utilshell_editor utilshell_editor;
+
+/* Command names for completion, in a prefix trie of the executables in the directories of $PATH. It is built when
+ * it is first needed, and again when $PATH or the mtime of one of its directories has changed.
+ */
+struct utilshell_trie {
+    struct utilshell_trie *child;   // The first child. Children are sorted by c.
+    struct utilshell_trie *sibling;
+    char c;
+    bool terminal;                  // True if the characters from the root to here name a command.
+};
+
+struct utilshell_trie *utilshell_commands;         // The root of the trie, or NULL.
+struct utilshell_arena *utilshell_commands_arena;  // Owns the nodes of the trie.
+char *utilshell_commands_path;                     // The value of $PATH the trie was built from.
+struct timespec *utilshell_commands_mtimes;        // The mtimes of the directories of $PATH then.
+int utilshell_commands_dirs;
+
+/* Listings of directories for completing paths. A listing is used for as long as the mtime of its directory stays
+ * the same, so a directory is only read again after entries were added to it or removed from it. When every slot is
+ * taken, the least recently used listing is dropped.
+ */
+struct utilshell_dirent {
+    const char *name;
+    unsigned char type;     // DT_DIR, DT_REG, ... (DT_UNKNOWN until it has been looked up, for some filesystems).
+};
+
+struct utilshell_listing {
+    dev_t dev;              // The directory (both 0 for an empty slot).
+    ino_t ino;
+    struct timespec mtime;
+    struct utilshell_dirent *entries; // Sorted by name, without . and ..
+    int num_entries;
+    struct utilshell_arena *arena;    // Owns the entries and their names.
+    unsigned long used;     // The value of utilshell_listing_clock when it was last used.
+};
+
+const int UTILSHELL_LISTINGS = 16;
+struct utilshell_listing utilshell_listings[UTILSHELL_LISTINGS];
+unsigned long utilshell_listing_clock;
+
+// Completions of the word being completed (see utilshell_complete()). Directories end with a /.
+struct utilshell_completions {
+    char **names;
+    int num;
+    int cap;
+    struct utilshell_arena *arena;
+};
+
+struct utilshell_arena *utilshell_complete_arena; // Everything allocated for one Tab. It is reset on the next one.
+const int UTILSHELL_COMPLETE_LOOKUPS = 256;       // Names whose type is looked up with stat() per Tab, at most.
+const int UTILSHELL_COMPLETE_LISTED = 400;        // Completions listed by a second Tab, at most.
+
+
+/* The memo cache (see shell_memo()). Outputs are stored once, in objects/ under the hash of their contents, and every
+ * run of a command in entries/ under the hash of what it depends on (its key), as a line with its exit status and the
+ * hashes of its stdout and stderr. The mtime of an entry is the last time it was used.
+ */
+struct utilshell_memo_hash {
+    unsigned long long h1;
+    unsigned long long h2;
+    unsigned char tail[16]; // Bytes not hashed yet (less than a block).
+    size_t tail_len;
+    unsigned long long len;
+};
+
+// A file of the store, while it is being evicted from.
+struct utilshell_memo_file {
+    char name[33];
+    long long size;
+    struct timespec mtime;
+    int refs;               // For outputs: the number of entries that use it.
+    char outputs[2][33];    // For entries: the outputs it uses.
+};
+
+long long utilshell_memo_size; // Bytes the store may take before entries are evicted (set memo-size=SIZE).
+struct stat utilshell_memo_stdin; // The stdin of the shell itself, which memo does not read (st_ino 0 if it has none).
+const long long UTILSHELL_MEMO_SIZE = 256LL << 20;
 
 
 // Utility functions: Only used within this source file.
 
+int utilshell_prompt_compile(const char*);
+void utilshell_prompt_refresh_cwd();
+void utilshell_prompt_render();
 int utilshell_print_prompt();
-int utilshell_get_input(char[], const int);
-char **utilshell_append_token(char*, char**, int, int*, int*);
-int utilshell_exec(char**, bool);
+const char *utilshell_prompt_text(size_t*);
+int utilshell_get_input(char**);
+int utilshell_edit_line(char**);
+int utilshell_editor_key();
+void utilshell_editor_refresh();
+void utilshell_editor_insert(const char*, size_t);
+void utilshell_editor_erase(size_t, size_t);
+int utilshell_text_width(const char*, size_t);
+int utilshell_terminal_columns();
+void utilshell_complete(bool);
+int utilshell_complete_add(struct utilshell_completions*, const char*, size_t, bool);
+void utilshell_complete_list(struct utilshell_completions*);
+int utilshell_commands_refresh();
+int utilshell_trie_add(const char*);
+int utilshell_trie_collect(struct utilshell_trie*, struct utilshell_buf*, struct utilshell_completions*);
+struct utilshell_listing *utilshell_listing_get(const char*);
+int utilshell_string_compare(const void*, const void*);
+int utilshell_dirent_compare(const void*, const void*);
+int utilshell_reader_line(struct utilshell_reader*, char**);
+void utilshell_input_release();
+void utilshell_input_reclaim();
+struct utilshell_arena *utilshell_arena_create();
+void *utilshell_arena_alloc(struct utilshell_arena*, size_t);
+void *utilshell_arena_realloc(struct utilshell_arena*, void*, size_t, size_t);
+char *utilshell_arena_strndup(struct utilshell_arena*, const char*, size_t);
+void utilshell_arena_reset(struct utilshell_arena*);
+void utilshell_arena_destroy(struct utilshell_arena*);
+struct utilshell_arena *utilshell_tokens_arena(char**);
+struct utilshell_node *utilshell_tokens_root(char**);
+char **utilshell_tokens_create(struct utilshell_arena*, int);
+int utilshell_lex(struct utilshell_arena*, const char*, struct utilshell_token**, int*, bool*);
+int utilshell_lex_best();
+int utilshell_lex_class(unsigned char);
+int utilshell_lex_classify(const char*, int, uint64_t*, uint64_t*, int);
+int utilshell_lex_next(struct utilshell_lex_bits*, const uint64_t*, int);
+char *utilshell_lex_describe(const char*, int, int*);
+int utilshell_lex_paren(const char*, int);
+int utilshell_lex_add(struct utilshell_arena*, struct utilshell_token**, int*, int*, enum utilshell_token_type, const char*, size_t);
+int utilshell_lex_heredocs(struct utilshell_arena*, const char*, int*, struct utilshell_token*, int, int);
+int utilshell_parse_list(struct utilshell_parser*, struct utilshell_node**, bool);
+int utilshell_parse_and_or(struct utilshell_parser*, struct utilshell_node**);
+int utilshell_parse_command(struct utilshell_parser*, struct utilshell_node**);
+int utilshell_parse_if(struct utilshell_parser*, struct utilshell_node**);
+int utilshell_parse_while(struct utilshell_parser*, struct utilshell_node**);
+int utilshell_parse_for(struct utilshell_parser*, struct utilshell_node**);
+int utilshell_parse_pipeline(struct utilshell_parser*, struct utilshell_pipeline**);
+int utilshell_parse_subst(struct utilshell_parser*, struct utilshell_token*);
+bool utilshell_parse_at(struct utilshell_parser*, const char*);
+int utilshell_parse_expect(struct utilshell_parser*, const char*);
+struct utilshell_node *utilshell_parse_node(struct utilshell_parser*, enum utilshell_node_type);
+int utilshell_lower(struct utilshell_pipeline*, struct utilshell_arena*);
+char **utilshell_expand_words(struct utilshell_token**, int, struct utilshell_arena*);
+char *utilshell_expand_word(struct utilshell_token*, struct utilshell_arena*);
+int utilshell_reserve_tokens(char***, int, int*, int);
+int utilshell_buf_append(struct utilshell_buf*, const char*, size_t);
+int utilshell_word_append(struct utilshell_word*, const char*, size_t, bool);
+int utilshell_word_finish(struct utilshell_word*, char***, int*, int*);
+int utilshell_word_append_split(struct utilshell_word*, const char*, char***, int*, int*);
+bool utilshell_expand_parameter(const char**, const char*, const char**);
+bool utilshell_expand_tilde(const char**, const char*, struct utilshell_word*);
+int utilshell_expand(const char*, int, char***, int*, int*, bool);
+int utilshell_open_redirects(struct utilshell_stage*);
+void utilshell_close_redirects(struct utilshell_stage*);
+pid_t utilshell_launch_spawn(struct utilshell_stage*, pid_t);
+pid_t utilshell_launch_fork(struct utilshell_stage*, pid_t);
+void utilshell_stage_pin(struct utilshell_stage*, int);
+int utilshell_run(struct utilshell_node*);
+int utilshell_exec(struct utilshell_pipeline*);
+int utilshell_expand_stages(struct utilshell_pipeline*);
+int utilshell_start_stages(struct utilshell_pipeline*, int, int, int*);
+char *utilshell_subst_start(struct utilshell_token*, struct utilshell_arena*);
+struct utilshell_stage *utilshell_substs_stages(struct utilshell_stage*, int*);
+void utilshell_substs_wait();
+void utilshell_close_fds(int*, int);
+int utilshell_run_builtin(struct utilshell_stage*);
+int utilshell_pidfd_open(pid_t);
+struct utilshell_job *utilshell_job_add(struct utilshell_stage*, int, pid_t, const char*, bool);
+void utilshell_job_remove(struct utilshell_job*);
+struct utilshell_job *utilshell_job_parse(const char*, const char*);
+void utilshell_proc_stop(struct utilshell_proc*, int);
+void utilshell_proc_continue(struct utilshell_proc*);
+void utilshell_proc_update(struct utilshell_proc*, int);
+struct utilshell_proc *utilshell_proc_find(pid_t);
+void utilshell_proc_reap(struct utilshell_proc*);
+void utilshell_jobs_poll(int);
+double utilshell_seconds(struct timespec, struct timespec);
+double utilshell_tv_seconds(struct timeval);
+void utilshell_json_string(struct utilshell_buf*, const char*);
+void utilshell_job_report(struct utilshell_job*);
+void utilshell_time_report(double, double, double);
+void utilshell_jobs_notify();
+int utilshell_job_wait(struct utilshell_job*);
+int utilshell_job_foreground(struct utilshell_job*, bool);
+const char *utilshell_job_state(struct utilshell_job*);
+int utilshell_signal_number(const char*);
+unsigned int utilshell_builtin_hash(const char*, size_t, unsigned int);
+int utilshell_builtin_init();
+const struct utilshell_builtin *utilshell_builtin_find(const char*);
+int utilshell_write_all(int, const char*, size_t);
+int utilshell_copy(int, int);
+int utilshell_splice_all(int, int, size_t);
+char *utilshell_copy_buffer();
+int utilshell_size_parse(const char*, long long, long long*);
+char **utilshell_parallel_argv(char**, int, const char*, struct utilshell_arena*);
+int utilshell_parallel_start(struct utilshell_parallel_slot*, char**, int, int, int);
+void utilshell_parallel_read(struct utilshell_parallel_slot*, int, bool);
+void utilshell_parallel_report(int, char**, long long, long long, int, double, const long long*, double, bool);
+void utilshell_duration_string(double, char*, size_t);
+int utilshell_cpus_parse(const char*, cpu_set_t*);
+void utilshell_cpus_format(const cpu_set_t*, char*, size_t);
+int utilshell_history_open();
+void utilshell_history_add(const char*);
+int utilshell_history_remap();
+bool utilshell_history_intact();
+int utilshell_history_grow(int);
+int utilshell_history_index(int);
+const char *utilshell_history_entry(int, size_t*);
+int utilshell_history_print(int);
+struct utilshell_trigram *utilshell_trigram_find(unsigned int, bool);
+int utilshell_trigram_index();
+int *utilshell_history_candidates(const char*, size_t, int*);
+bool utilshell_history_match(int, const char*, size_t, bool);
+int utilshell_history_find(const char*, size_t, bool);
+int utilshell_history_expand(const char*, struct utilshell_buf*);
+void utilshell_memo_hash_init(struct utilshell_memo_hash*);
+void utilshell_memo_hash_block(struct utilshell_memo_hash*, const unsigned char*);
+void utilshell_memo_hash_update(struct utilshell_memo_hash*, const void*, size_t);
+void utilshell_memo_hash_string(struct utilshell_memo_hash*, const char*);
+void utilshell_memo_hash_stat(struct utilshell_memo_hash*, const struct stat*);
+int utilshell_memo_hash_fd(struct utilshell_memo_hash*, int, off_t, int);
+void utilshell_memo_hash_final(struct utilshell_memo_hash*, char*);
+int utilshell_memo_identity(struct utilshell_memo_hash*, const char*, bool);
+char *utilshell_memo_dir();
+void utilshell_memo_path(struct utilshell_buf*, const char*, const char*, const char*);
+int utilshell_memo_temp(const char*, const char*, struct utilshell_buf*);
+int utilshell_memo_replay(const char*, const char*, int*);
+int utilshell_memo_save(const char*, const char*, int, int*, struct utilshell_buf*);
+void utilshell_memo_evict(const char*);
+int utilshell_memo_scan(const char*, const char*, struct utilshell_memo_file**, int*);
+int utilshell_memo_file_compare(const void*, const void*);
+int utilshell_memo_age_compare(const void*, const void*);
+int utilshell_jobserver_create(int);
+int utilshell_jobserver_attach();
+int utilshell_jobserver_acquire();
+void utilshell_jobserver_release(int);
+void utilshell_jobserver_exit();
+bool utilshell_unescape(struct utilshell_buf*, const char*, size_t);
+int utilshell_test_primary(char**, int, int*);
+int utilshell_test_and(char**, int, int*);
+int utilshell_test_expr(char**, int, int*);
+unsigned int utilshell_hash_string(const char*);
+struct utilshell_hash_entry *utilshell_hash_find(const char*);
+struct utilshell_hash_entry *utilshell_hash_add(const char*, const char*);
+void utilshell_hash_forget(const char*);
+void utilshell_hash_clear();
+void utilshell_hash_sync();
+char *utilshell_path_search(const char*);
+unsigned int utilshell_var_hash(const char*, size_t);
+int utilshell_vars_init();
+struct utilshell_var *utilshell_var_find(const char*, size_t);
+const char *utilshell_var_get(const char*);
+struct utilshell_var *utilshell_var_set(const char*, size_t, const char*, bool);
+void utilshell_var_unset(const char*, size_t);
+bool utilshell_var_name(const char*, size_t);
+bool utilshell_export_take(const char*, size_t);
+char **utilshell_var_envp();
+char **utilshell_var_envp_with(char**, int, struct utilshell_arena*);
+struct utilshell_var *utilshell_vars_push(char**, int);
+void utilshell_vars_pop(char**, int, struct utilshell_var*);
+char *utilshell_expand_assign(struct utilshell_token*, struct utilshell_arena*);
+int utilshell_expand_here(struct utilshell_token*, bool, struct utilshell_buf*);
+int utilshell_here_open(const char*, size_t);
+int utilshell_var_compare(const void*, const void*);
+const char *utilshell_hash_lookup(const char*);
+int utilshell_ctx_start(struct shell_ctx*);
+void utilshell_ctx_serve(int);
+int utilshell_ctx_send(int, const void*, size_t);
+int utilshell_ctx_recv(int, void*, size_t);
+int utilshell_ctx_read(int, struct shell_buffer*);
 
 /* Ok, you may be wondering why I have two functions called exec (shell_exec and utilshell_exec).
  * Basically, shell_exec is called from main(), and in turn, it will do some magic stuff and then
@@ -46,10 +826,64 @@ int shell_init(int argc, char *argv[]) {
 
     utilshell_prompt_visible = true;
     utilshell_colors = true;
+    utilshell_use_fork = false;
+    utilshell_profile_fd = -1;
+    utilshell_history_fd = -1;
+    utilshell_jobserver_read = -1;
+    utilshell_jobserver_write = -1;
+    utilshell_memo_size = UTILSHELL_MEMO_SIZE;
+    if(fstat(STDIN_FILENO, &utilshell_memo_stdin) == -1)
+        memset(&utilshell_memo_stdin, 0, sizeof(utilshell_memo_stdin));
+
+    /* The shell hands the terminal to foreground jobs, so it must be able to take it back. It runs in its own
+     * process group and ignores the job control signals, which only its jobs should get.
+     */
+    utilshell_interactive = isatty(STDIN_FILENO);
+    if(utilshell_interactive) {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        setpgid(0, 0);
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        tcgetattr(STDIN_FILENO, &utilshell_tmodes);
+    }
+
+    // Set up the event loop that reaps the jobs.
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+    utilshell_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    utilshell_signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK|SFD_CLOEXEC);
+    if(utilshell_epoll_fd == -1 || utilshell_signal_fd == -1) {
+        int errsv = errno;
+        shell_error("Could not set up job control. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the signalfd, everything else is a struct utilshell_proc.
+    epoll_ctl(utilshell_epoll_fd, EPOLL_CTL_ADD, utilshell_signal_fd, &event);
+
+    int probe = utilshell_pidfd_open(getpid());
+    utilshell_have_pidfd = probe != -1;
+    if(probe != -1)
+        close(probe);
 
     // Parse arguments.
+        const char *command = NULL;
+        int jobs = 0;
+        int serve_fd = -1;
+        const struct option long_options[] = {
+            { "jobs", required_argument, NULL, 'j' },
+            { "serve", required_argument, NULL, 's' },
+            { NULL, 0, NULL, 0 }
+        };
         int c;
-        while((c = getopt(argc, argv, "tc")) != -1) {
+        while((c = getopt_long(argc, argv, "tcfae:p:j:", long_options, NULL)) != -1) {
             switch(c) {
                 case 't':
                     utilshell_prompt_visible = false;
@@ -59,6 +893,37 @@ int shell_init(int argc, char *argv[]) {
                     utilshell_colors = false;
                     break;
 
+                case 'f':
+                    utilshell_use_fork = true;
+                    break;
+
+                case 'a':
+                    utilshell_alloc_stats = true;
+                    break;
+
+                case 'e':
+                    command = optarg;
+                    break;
+
+                case 'p':
+                    if((utilshell_profile_fd = open(optarg, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644)) == -1) {
+                        int errsv = errno;
+                        shell_error("Could not open profile \"%s\". errno:%d\n", optarg, errsv);
+                        return EXIT_FAILURE;
+                    }
+                    break;
+
+                case 'j':
+                    if((jobs = atoi(optarg)) < 1) {
+                        shell_error("Invalid number of jobs \"%s\".\n", optarg);
+                        return EXIT_FAILURE;
+                    }
+                    break;
+
+                case 's':
+                    serve_fd = atoi(optarg);
+                    break;
+
                 case '?':
                     break;
 
@@ -69,33 +934,152 @@ int shell_init(int argc, char *argv[]) {
             }
 
         }
-    
+
+    /* Set up the input. Commands come from the -e command string, a script file named after the options, or stdin.
+     * The prompt is only shown when reading stdin.
+     */
+    memset(&utilshell_input, 0, sizeof(utilshell_input));
+    utilshell_input.released_at = -1;
+
+    if(command != NULL) {
+
+        utilshell_input.fd = -1;
+        utilshell_input.data = strdup(command);
+        utilshell_input.end = strlen(command);
+        utilshell_input.cap = utilshell_input.end + 1;
+        utilshell_input.eof = true;
+        utilshell_prompt_visible = false;
+
+    } else if(optind < argc) {
+
+        if((utilshell_input.fd = open(argv[optind], O_RDONLY|O_CLOEXEC)) == -1) {
+            int errsv = errno;
+            shell_error("Could not open script \"%s\". errno:%d\n", argv[optind], errsv);
+            return EXIT_FAILURE;
+        }
+        utilshell_prompt_visible = false;
+
+    } else {
+
+        // Commands may read the rest of stdin themselves, so it has to be rewound to the end of the current line.
+        utilshell_input.fd = STDIN_FILENO;
+        utilshell_input.seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) != -1;
+
+    }
+
+    if(utilshell_builtin_init() != EXIT_SUCCESS || utilshell_vars_init() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    utilshell_lex_level = utilshell_lex_best();
+
+    // Background jobs share the jobserver of --jobs, or of the make that started the shell.
+    if(jobs > 0 ? utilshell_jobserver_create(jobs) != EXIT_SUCCESS : utilshell_jobserver_attach() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if((utilshell_scratch_arena = utilshell_arena_create()) == NULL)
+        return EXIT_FAILURE;
+
+    // Look up everything the prompt needs that does not change while the shell runs.
+    struct passwd *pw = getpwuid(getuid());
+    const char *user = utilshell_var_get("USER");
+    if(user == NULL)
+        user = pw != NULL ? pw->pw_name : "?";
+    utilshell_user = strdup(user);
+
+    const char *home = utilshell_var_get("HOME");
+    if(home == NULL && pw != NULL)
+        home = pw->pw_dir;
+    utilshell_home = home != NULL ? strdup(home) : NULL;
+
+    char host_name[HOST_NAME_MAX + 1];
+    if(gethostname(host_name, HOST_NAME_MAX+1)) {
+        int errsv = errno;
+        shell_error("Could not retrieve host name. errno:%d\n", errsv);
+        strcpy(host_name, "?");
+    }
+    utilshell_host = strdup(host_name);
+
+    utilshell_prompt_refresh_cwd();
+
+    // The prompt format comes from $PS1 if it is set.
+    const char *format = utilshell_var_get("PS1");
+    if(format == NULL) {
+        if(utilshell_colors)
+            format = "\\e[1;32m\\u@\\H \\e[1;34m\\w$ \\e[0m";
+        else
+            format = "\\u@\\H \\w$ ";
+    }
+    if(utilshell_prompt_compile(format) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    // Lines typed at a terminal are edited in the shell, unless the terminal cannot move the cursor.
+    const char *term = utilshell_var_get("TERM");
+    utilshell_editing = utilshell_interactive && utilshell_input.fd == STDIN_FILENO && isatty(STDOUT_FILENO) &&
+        (term == NULL || strcmp(term, "dumb") != 0);
+
+    // Commands typed at a terminal go into the history. The file is opened now, but not read until it is needed.
+    utilshell_history_on = utilshell_interactive && utilshell_input.fd == STDIN_FILENO;
+    if(utilshell_history_on && utilshell_history_open() != EXIT_SUCCESS)
+        utilshell_history_on = false;
+
+    // The shell of a context (see shell_ctx_create()) takes its command lines from the socket instead.
+    if(serve_fd != -1)
+        utilshell_ctx_serve(serve_fd);
+
     return EXIT_SUCCESS;
 
 }
 
-// Displays prompt and retrieves user input. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
-int shell_prompt(char buffer[], const int BUFFER_LEN) {
+/* Displays prompt and retrieves the next line of user input. On success, *buffer points to the line (which stays
+ * valid until the next call) or is NULL once the input has ended. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int shell_prompt(char **buffer) {
 
-    if(utilshell_print_prompt() == EXIT_SUCCESS &&
-        utilshell_get_input(buffer, BUFFER_LEN) == EXIT_SUCCESS)
-        return EXIT_SUCCESS;
-    else
+    // Reap finished background jobs without blocking and report them.
+    utilshell_jobs_poll(0);
+    utilshell_jobs_notify();
+
+    if(utilshell_print_prompt() != EXIT_SUCCESS ||
+        utilshell_get_input(buffer) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    // The input ended in the middle of a command (see shell_tokenize()).
+    if(*buffer == NULL && utilshell_pending.len > 0) {
+        shell_error("Syntax error: unexpected end of input.\n");
+        utilshell_pending.len = 0;
+        utilshell_last_status = 2;
+    }
+
+    // Expand history references. The line is shown as it will run; a line with a reference that is not found is dropped.
+    if(*buffer != NULL && utilshell_history_on && strchr(*buffer, '!') != NULL) {
+        int expanded = utilshell_history_expand(*buffer, &utilshell_history_line);
+        if(expanded < 0) {
+            utilshell_history_line.len = 0;
+            utilshell_buf_append(&utilshell_history_line, "", 0);
+            *buffer = utilshell_history_line.data;
+            utilshell_last_status = EXIT_FAILURE;
+        } else if(expanded > 0) {
+            *buffer = utilshell_history_line.data;
+            printf("%s\n", *buffer);
+            fflush(stdout);
+        }
+    }
+
     return EXIT_SUCCESS;
 
 }
 
 /* Reads buffer and returns an array of tokens. A token can be:
- *  a) Command string (eg. cat *.c)
+ *  a) A word (eg. cat or *.c)
  *  b) A pipe (|)
- *  c) A redirect (< or >)
+ *  c) A redirect (<, >, >> or 2>)
  *  d) An ampersand (&)
- *  (to be added later)
- *  e) More redirects (2>, >>)
- * 
- * Returns a pointer to the list of tokens on success. Returns NULL otherwise.
+ *
+ * The words are kept as they were typed. They are expanded by shell_exec() every time they are run.
+ * Behind the list, the tokens are parsed once into a pipeline and lowered into a plan for running it (see
+ * utilshell_parse() and utilshell_lower()), so shell_exec() never has to look at the strings again.
+ *
+ * Returns a pointer to the list of tokens on success. Returns NULL otherwise, once the error (eg. a syntax error) has
+ * been reported.
  */
 char **shell_tokenize(char buffer[]) {
 
@@ -103,213 +1087,233 @@ char **shell_tokenize(char buffer[]) {
     if(buffer == NULL)
         return NULL;
 
-    int num_tokens = 0; // This is the current number of tokens in the list.
-    int max_tokens = 4; // This is the number of tokens that can be used before reallocating the list.
-    char **result = (char**)malloc((max_tokens+1)*sizeof(char*));
+    utilshell_arena_allocs = 0;
+    utilshell_heap_allocs = 0;
 
-    // Tokenizing will be achived using a simple state machine. These are the states.
-    const int NORMAL = 0;
-    const int READING_QUOTE = 1;
-    const int READING_ESCAPE = 2;
-    const int READING_ESCAPE_IN_QUOTE = 3;
+    // Everything allocated for this line comes from one arena. Reuse the arena of the previous line if possible.
+    struct utilshell_arena *arena = utilshell_spare_arena;
+    utilshell_spare_arena = NULL;
+    if(arena == NULL && (arena = utilshell_arena_create()) == NULL)
+        return NULL;
 
-    // The state should begin and end at NORMAL. If it is not NORMAL after tokenizing, return NULL.
-    int state = NORMAL;
+    /* A line that leaves a command unfinished (eg. an if without its fi, or an open quote) is kept in utilshell_pending
+     * and the next line is added to it, so the command is only parsed once it is complete. A backslash at the end of
+     * a line joins it with the next one.
+     */
+    if(utilshell_pending.len > 0) {
+        if(utilshell_pending_escape)
+            --utilshell_pending.len;
+        else
+            utilshell_buf_append(&utilshell_pending, "\n", 1);
+        utilshell_buf_append(&utilshell_pending, buffer, strlen(buffer));
+        buffer = utilshell_pending.data;
+    }
 
-    /* This is the index of the current token being read. Once the beginning of a new token is found,
-     * everything from this point up to the current point is added to the token list.
+    struct utilshell_token *tokens = NULL;
+    int num_tokens = 0;
+    bool escape = false;
+    int lexed = utilshell_lex(arena, buffer, &tokens, &num_tokens, &escape);
+    int result = lexed == UTILSHELL_PARSE_ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    bool incomplete = lexed == UTILSHELL_PARSE_INCOMPLETE;
+
+    // Parse the tokens and plan how to run them. An empty line has nothing to run.
+    struct utilshell_node *root = NULL;
+    if(result == EXIT_SUCCESS && !incomplete && num_tokens > 0) {
+        struct utilshell_parser parser = { tokens, num_tokens, 0, arena };
+        int status = utilshell_parse_list(&parser, &root, false);
+        if(status == UTILSHELL_PARSE_INCOMPLETE)
+            incomplete = true;
+        else if(status != UTILSHELL_PARSE_OK)
+            result = EXIT_FAILURE;
+    }
+
+    // A complete command goes into the history, even if it has a syntax error (so that it can be fixed).
+    if(utilshell_history_on && !(result == EXIT_SUCCESS && incomplete))
+        utilshell_history_add(buffer);
+
+    // Keep an unfinished command for the next line. Nothing runs until it is complete.
+    if(result == EXIT_SUCCESS && incomplete) {
+        if(buffer != utilshell_pending.data)
+            utilshell_buf_append(&utilshell_pending, buffer, strlen(buffer));
+        utilshell_pending_escape = escape;
+        root = NULL;
+        num_tokens = 0;
+    } else {
+        utilshell_pending.len = 0;
+    }
+
+    /* The list has two hidden slots in front of it: the arena and the parsed commands. They can be found from the
+     * list alone (see utilshell_tokens_arena() and utilshell_tokens_root()).
      */
-    int current_token_index = 0;
+    char **list = NULL;
+    if(result == EXIT_SUCCESS && (list = (char**)utilshell_arena_alloc(arena, (num_tokens+3)*sizeof(char*))) != NULL) {
+        list[0] = (char*)root;
+        list[1] = (char*)arena;
+        list += 2;
+        for(int k = 0; k < num_tokens; ++k)
+            list[k] = tokens[k].text;
+        list[num_tokens] = NULL;
+    }
 
-    // Iterate through the whole string using a simple state machine.
-    int i;
-    for(i = 0; buffer[i] != '\0'; ++i) {
+    if(list == NULL) {
+        utilshell_arena_reset(arena);
+        utilshell_spare_arena = arena;
+    }
 
-        switch(state) {
+    return list;
 
-            case NORMAL:
+}
 
-            char **new_tokens;
-            int n;
-            char *start;
-            bool redir_err;
-            bool redir_app;
-            switch(buffer[i]) {
+// Execute a list of tokens. The exit status of the last command is kept for $? and exit.
+int shell_exec(char **tokens) {
 
-                case '|':
-                case '>':
-                case '<':
-                case '&':
+    // A line that could not be tokenized fails with status 2, like a syntax error in other shells.
+    if(tokens == NULL) {
+        utilshell_last_status = 2;
+        return EXIT_SUCCESS;
+    }
 
-                redir_err = false;
-                redir_app = false;
+    return utilshell_run(utilshell_tokens_root(tokens));
 
-                if(buffer[i] == '>') {
-                    if(buffer[i+1] == '>')
-                        redir_app = true;
-                    else if(i > 1 && buffer[i-1] == '2' && isspace(buffer[i-2]))
-                        redir_err = true;
-                }
+}
 
-                // We have found a special symbol!
-                // If a previous token was being read, then add it.
-                if(i - current_token_index > 0) {
-
-                    // Add string to token list.
-                    n = i - current_token_index;
-                    if(redir_err)
-                        n = n - 1;
-                    new_tokens = utilshell_append_token(buffer+current_token_index, result, n, &num_tokens, &max_tokens);
-
-                    if(new_tokens == NULL) {
-                        shell_free_tokens(result);
-                        return NULL;
-                    } else {
-                        result = new_tokens;
-                    }
+/* Free the memory pointed to by tokens. The tokens (and everything else allocated for the line) live in one arena,
+ * which is reset in one step and kept for the next line.
+ */
+void shell_free_tokens(char **tokens) {
 
-                }
+    if(tokens == NULL)
+        return;
 
-                // Add the symbol to the token list.
-                start = buffer + i;
-                n = 1;
-                if(redir_err) {
-                    n = n + 1;
-                    start = start - 1;
-                } else if(redir_app) {
-                    n = n + 1;
-                }
-                new_tokens = utilshell_append_token(start, result, n, &num_tokens, &max_tokens);
+    if(utilshell_alloc_stats)
+        fprintf(stderr, "allocations: %d arena, %d malloc\n", utilshell_arena_allocs, utilshell_heap_allocs);
 
-                if(new_tokens == NULL) {
-                    shell_free_tokens(result);
-                    return NULL;
-                } else {
-                    result = new_tokens;
-                }
-                
-                // The next token starts right after this one.
-                current_token_index = i + n;
-                if(redir_app)
-                    ++i;
-                break;
+    struct utilshell_arena *arena = utilshell_tokens_arena(tokens);
+    utilshell_arena_reset(arena);
 
-                case '\\':
-                state = READING_ESCAPE;
-                break;
+    if(utilshell_spare_arena == NULL)
+        utilshell_spare_arena = arena;
+    else
+        utilshell_arena_destroy(arena);
 
-                case '\"':
-                state = READING_QUOTE;
-                break;
+}
 
-                default:
-                break;
-            }
-            break;
+// Returns the exit status of the last command, which is what the shell exits with at the end of its input.
+int shell_status() {
 
-            case READING_QUOTE:
-            switch(buffer[i]) {
-                case '\\':
-                state = READING_ESCAPE_IN_QUOTE;
-                break;
+    return utilshell_last_status;
 
-                case '\"':
-                state = NORMAL;
-                break;
+}
 
-                default:
-                break;
-            }
-            break;
+// Returns true if commands are typed at a terminal (not read from a script, a -e command string or a pipe).
+bool shell_interactive() {
 
-            case READING_ESCAPE:
-            state = NORMAL;
-            break;
+    return utilshell_interactive && utilshell_input.fd == STDIN_FILENO;
 
-            case READING_ESCAPE_IN_QUOTE:
-            state = READING_QUOTE;
-            break;
+}
 
-            default:
-            shell_error("An unexpected error has occured in tokenizing the input string.");
-            shell_free_tokens(result);
-            return NULL;
+/* Creates a context for running command lines with shell_run(), and starts its shell from the shell program at path.
+ * The path is used as is: it is not searched for in $PATH. Returns the context on success (free it with
+ * shell_ctx_free()). Returns NULL otherwise.
+ */
+struct shell_ctx *shell_ctx_create(const char *path) {
 
-        }
-    
+    if(path == NULL) {
+        shell_error("A context needs the path of a shell program.\n");
+        return NULL;
     }
 
-    // If state is not NORMAL, then there was an unfinished escape sequence or non-terminated quotes.
-    if(state != NORMAL) {
-        shell_error("Could not tokenize input. state:%d\n", state);
-        shell_free_tokens(result);
+    struct shell_ctx *ctx = (struct shell_ctx*)malloc(sizeof(struct shell_ctx));
+    if(ctx == NULL || (ctx->path = strdup(path)) == NULL) {
+        shell_error("Could not allocate a context.\n");
+        free(ctx);
+        return NULL;
+    }
+    ctx->pid = -1;
+    ctx->sock = -1;
+
+    // Every process that writes to the memfds (eg. two stages that share stderr) adds to the end of what is there.
+    ctx->out_fd = memfd_create("shell-stdout", MFD_CLOEXEC);
+    ctx->err_fd = memfd_create("shell-stderr", MFD_CLOEXEC);
+    if(ctx->out_fd == -1 || ctx->err_fd == -1 ||
+        fcntl(ctx->out_fd, F_SETFL, O_APPEND) == -1 || fcntl(ctx->err_fd, F_SETFL, O_APPEND) == -1) {
+        int errsv = errno;
+        shell_error("Could not create the output of a context. errno:%d\n", errsv);
+        shell_ctx_free(ctx);
         return NULL;
     }
 
-    // If we finished iterating through the buffer, then add last token to the list.
-    if(i - current_token_index > 0) {
-        char **new_tokens = utilshell_append_token(buffer+current_token_index, result, i - current_token_index, &num_tokens, &max_tokens);
-
-        if(new_tokens == NULL) {
-            shell_free_tokens(result);
-            return NULL;
-        } else {
-            result = new_tokens;
-        }
+    if(utilshell_ctx_start(ctx) != EXIT_SUCCESS) {
+        shell_ctx_free(ctx);
+        return NULL;
     }
 
-    return result;
+    return ctx;
 
 }
 
-// Execute a list of tokens.
-int shell_exec(char **tokens) {
-
-    int argc = 0;
-    for(int i = 0; tokens[i] != NULL; ++i)
-        ++argc;
-
-    if(strcmp(tokens[0], "exit") == 0) {
-
-        return shell_exit(argc, tokens);
-
-    } else if(strcmp(tokens[0], "cd") == 0) {
-
-        return shell_cd(argc, tokens);
+/* Runs a command line (which may be several lines long) in the shell of ctx and waits for it, as the shell would run
+ * it from a script. What it writes to stdout and stderr goes into result->out and result->err, which must either be
+ * zeroed or hold buffers from an earlier call. Background jobs keep running, and anything they write later is part of
+ * the output of a later call. If the command line exits the shell, its status is that of exit, and the next call
+ * starts a new shell. Returns EXIT_SUCCESS on success (whatever the status of the command line), EXIT_FAILURE on error.
+ */
+int shell_run(struct shell_ctx *ctx, const char *line, struct shell_result *result) {
 
-    } else {
+    result->status = EXIT_FAILURE;
+    result->out.len = 0;
+    result->err.len = 0;
 
-        bool background = false;
-        for(int i = 0; tokens[i] != NULL; ++i)
-            if(strcmp(tokens[i], "&") == 0)
-                background = true;
+    if(ctx->pid == -1 && utilshell_ctx_start(ctx) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-        if(fork() == 0) {
-            utilshell_exec(tokens, background);
-            exit(EXIT_SUCCESS);
-        } else {
-            if(!background)
-                wait(NULL);
-        }
+    if(ftruncate(ctx->out_fd, 0) == -1 || ftruncate(ctx->err_fd, 0) == -1) {
+        int errsv = errno;
+        shell_error("Could not clear the output of a context. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
 
+    // The shell answers with the status of the line once it is done, or closes the socket if the line exited it.
+    size_t len = strlen(line);
+    int status;
+    if(utilshell_ctx_send(ctx->sock, &len, sizeof(len)) != EXIT_SUCCESS ||
+        utilshell_ctx_send(ctx->sock, line, len) != EXIT_SUCCESS ||
+        utilshell_ctx_recv(ctx->sock, &status, sizeof(status)) != EXIT_SUCCESS) {
+        int wstatus;
+        status = EXIT_FAILURE;
+        if(waitpid(ctx->pid, &wstatus, 0) == ctx->pid)
+            status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+        close(ctx->sock);
+        ctx->sock = -1;
+        ctx->pid = -1;
     }
+    result->status = status;
+
+    if(utilshell_ctx_read(ctx->out_fd, &result->out) != EXIT_SUCCESS ||
+        utilshell_ctx_read(ctx->err_fd, &result->err) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
     return EXIT_SUCCESS;
 
 }
 
-// Free the memory pointed to by tokens.
-void shell_free_tokens(char **tokens) {
+// Stops the shell of ctx (once it has finished what it is running) and frees ctx. Background jobs keep running.
+void shell_ctx_free(struct shell_ctx *ctx) {
 
-    if(tokens == NULL)
+    if(ctx == NULL)
         return;
 
-    int i = 0;
-    while(tokens[i] != NULL) {
-        free(tokens[i]);
-        ++i;
-    }
-    free(tokens);
+    // The shell exits when the socket is closed.
+    if(ctx->sock != -1)
+        close(ctx->sock);
+    if(ctx->pid != -1)
+        waitpid(ctx->pid, NULL, 0);
+    if(ctx->out_fd != -1)
+        close(ctx->out_fd);
+    if(ctx->err_fd != -1)
+        close(ctx->err_fd);
+    free(ctx->path);
+    free(ctx);
 
 }
 
@@ -319,9 +1323,15 @@ void shell_free_tokens(char **tokens) {
 // Built in shell functions.
 // --------------------------------------------------------------
 
+// Exits the shell with the given status (or the status of the last command).
 int shell_exit(int argc, char **argv) {
 
-    exit(EXIT_SUCCESS);
+    int status = utilshell_last_status;
+    if(argc > 1)
+        status = atoi(argv[1]);
+
+    fflush(stdout);
+    exit(status);
     return EXIT_SUCCESS; // This is probably really excessive, but whatever.
 
 }
@@ -331,6 +1341,9 @@ int shell_cd(int argc, char **argv) {
     if(argc > 1) {
         if(chdir(argv[1])) {
             shell_error("Cannot change to directory %s\n", argv[1]);
+            return EXIT_FAILURE;
+        } else {
+            utilshell_prompt_refresh_cwd();
         }
     }
     
@@ -338,394 +1351,8378 @@ int shell_cd(int argc, char **argv) {
 
 }
 
+/* Lists, clears or fills the command hash table.
+ *    hash              Lists every remembered command and how many times it was used.
+ *    hash -r           Forgets every remembered command.
+ *    hash -d name ...  Forgets the given commands.
+ *    hash -p path name Remembers path as the location of name.
+ *    hash name ...     Looks up the given commands in $PATH and remembers them.
+ */
+int shell_hash(int argc, char **argv) {
 
+    if(argc < 2 || argv[1] == NULL) {
 
-// --------------------------------------------------------------
-// Other useful functions.
-// --------------------------------------------------------------
-
-int shell_error(const char *fmt, ...) {
-	va_list argp;
-	va_start(argp, fmt);
-	int result = shell_verror(fmt, argp);
-	va_end(argp);
-    return result;
-}
-
-int shell_verror(const char *fmt, va_list argp) {
-    if(utilshell_colors)
-        fprintf(stderr, "\033[4;31mERROR: ");
-    else
-        fprintf(stderr, "ERROR: ");
+        if(utilshell_hash_count == 0) {
+            printf("hash: hash table empty\n");
+        } else {
+            printf("hits\tcommand\n");
+            for(int b = 0; b < utilshell_hash_buckets; ++b)
+                for(struct utilshell_hash_entry *e = utilshell_hash_table[b]; e != NULL; e = e->next)
+                    printf("%4d\t%s\n", e->hits, e->path);
+        }
+        fflush(stdout);
+        return EXIT_SUCCESS;
 
-    vfprintf(stderr, fmt, argp);
+    }
 
-    if(utilshell_colors)
-        fprintf(stderr, "\033[0m");
-}
+    if(strcmp(argv[1], "-r") == 0) {
 
+        utilshell_hash_clear();
 
+    } else if(strcmp(argv[1], "-d") == 0) {
 
-// --------------------------------------------------------------
-// Utility functions.
-// --------------------------------------------------------------
+        for(int i = 2; i < argc && argv[i] != NULL; ++i)
+            utilshell_hash_forget(argv[i]);
 
-// Prints the prompt (unless utilshell_prompt_visible is false).
-int utilshell_print_prompt() {
-    bool found_error = false;
-    if(utilshell_prompt_visible) {
-        // Get current working directory.
-        char *cwd;
-        if((cwd = get_current_dir_name()) == NULL) {
-            int errsv = errno;
-            shell_error("Could not retrieve current working directory. errno:%d\n", errsv);
-            found_error = true;
-        }
+    } else if(strcmp(argv[1], "-p") == 0) {
 
-        // Get home directory.
-        char *home_dir;
-        if((getenv("HOME")) != NULL) {
-            int len = strlen(getenv("HOME"));
-            home_dir = (char*)malloc(len + 1);
-            strncpy(home_dir, getenv("HOME"), len + 1);
-        } else {
-            shell_error("Could not retrieve home directory.\n");
-            found_error = true;
-        }
-        
-        // Use tilde '~' in place of home in cwd.
-        char *dir_to_print;
-        if((dir_to_print = strstr(cwd, home_dir)) == NULL)
-            dir_to_print = cwd;
-        else {
-            dir_to_print += strlen(home_dir) - 1;
-            dir_to_print[0] = '~';
+        if(argc < 4 || argv[2] == NULL || argv[3] == NULL) {
+            shell_error("hash: usage: hash -p path name\n");
+            return EXIT_FAILURE;
         }
+        utilshell_hash_sync();
+        utilshell_hash_forget(argv[3]);
+        if(utilshell_hash_add(argv[3], argv[2]) == NULL)
+            return EXIT_FAILURE;
 
-        // Get username.
-        char *username;
-        if((getenv("USER")) != NULL) {
-            int len = strlen(getenv("USER"));
-            username = (char*)malloc(len + 1);
-            strncpy(username, getenv("USER"), len + 1);
-        } else {
-            shell_error("Could not retrieve user name.\n");
-            found_error = true;
-        }
+    } else {
 
-        // Get host name.
-        char host_name[HOST_NAME_MAX + 1];
-        if(gethostname(host_name, HOST_NAME_MAX+1)) {
-            int errsv = errno;
-            shell_error("Could not retrieve host name. errno:%d\n", errsv);
-            found_error = true;
+        int result = EXIT_SUCCESS;
+        for(int i = 1; i < argc && argv[i] != NULL; ++i) {
+            utilshell_hash_forget(argv[i]);
+            if(utilshell_hash_lookup(argv[i]) == NULL) {
+                shell_error("hash: %s: not found\n", argv[i]);
+                result = EXIT_FAILURE;
+            }
         }
+        return result;
 
-        // Print prompt.
-        if(!found_error) {
-            if(utilshell_colors)
-                printf("\033[1;32m%s@%s \033[1;34m%s$ \033[0m", username, host_name, dir_to_print);
-            else
-                printf("%s@%s %s$ ", username, host_name, dir_to_print);
-        } else
-            printf("$ ");
-
-        free(cwd);
-        free(home_dir);
-        free(username);
-        // No need to free host_name.
     }
 
-    return found_error ? EXIT_FAILURE : EXIT_SUCCESS;
+    return EXIT_SUCCESS;
+
 }
 
-// Retrieves user input.
-int utilshell_get_input(char buffer[], const int BUFFER_LEN) {
-    size_t line_len = 0;
-    if(fgets(buffer, BUFFER_LEN, stdin) == NULL) {
-        buffer[0] = '\0';
-        if(ferror(stdin)) {
-            shell_error("Could not read input.\n");
-            return EXIT_FAILURE;
+// Prints its arguments separated by spaces. -n suppresses the newline, -e interprets backslash escapes.
+int shell_echo(int argc, char **argv) {
+
+    bool newline = true;
+    bool escapes = false;
+
+    int i = 1;
+    for(; i < argc; ++i) {
+        if(argv[i][0] != '-' || argv[i][1] == '\0' || strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break;
+        for(char *f = argv[i] + 1; *f != '\0'; ++f) {
+            if(*f == 'n')
+                newline = false;
+            else
+                escapes = *f == 'e';
         }
     }
 
-    if(buffer[strlen(buffer) - 1] == '\n')
-        buffer[strlen(buffer) - 1] = '\0';
+    struct utilshell_buf out;
+    memset(&out, 0, sizeof(out));
+
+    for(int first = i; i < argc; ++i) {
+        if(i > first)
+            utilshell_buf_append(&out, " ", 1);
+        if(escapes && utilshell_unescape(&out, argv[i], strlen(argv[i])))
+            newline = false;
+        else if(!escapes)
+            utilshell_buf_append(&out, argv[i], strlen(argv[i]));
+    }
+    if(newline)
+        utilshell_buf_append(&out, "\n", 1);
+
+    int result = utilshell_write_all(STDOUT_FILENO, out.data, out.len);
+    free(out.data);
+    return result;
+
+}
+
+/* Formats and prints its arguments like printf(1). The format is reused until every argument has been consumed.
+ * Supports %s, %b, %c, %d, %i, %u, %o, %x, %X, %e, %f, %g and %% with flags, width and precision.
+ */
+int shell_printf(int argc, char **argv) {
+
+    if(argc < 2) {
+        shell_error("printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char *format = argv[1];
+    int next = 2;
+    int result = EXIT_SUCCESS;
+
+    struct utilshell_buf out;
+    memset(&out, 0, sizeof(out));
+
+    do {
+
+        bool consumed = false;
+
+        for(const char *p = format; *p != '\0'; ++p) {
+
+            if(*p == '\\' && p[1] >= '1' && p[1] <= '7') {
+                // The format also takes \NNN (one to three octal digits), besides the \0NNN of echo -e and %b.
+                char c = 0;
+                for(int k = 0; k < 3 && p[1] >= '0' && p[1] <= '7'; ++k)
+                    c = c * 8 + (*++p - '0');
+                utilshell_buf_append(&out, &c, 1);
+                continue;
+            }
+
+            if(*p == '\\') {
+                size_t n = 2;
+                if(p[1] == '0')
+                    n += strspn(p + 2, "01234567") > 3 ? 3 : strspn(p + 2, "01234567");
+                else if(p[1] == '\0')
+                    n = 1;
+                if(utilshell_unescape(&out, p, n))
+                    break;
+                p += n - 1;
+                continue;
+            }
+
+            if(*p != '%') {
+                utilshell_buf_append(&out, p, 1);
+                continue;
+            }
+
+            if(p[1] == '%') {
+                utilshell_buf_append(&out, "%", 1);
+                ++p;
+                continue;
+            }
+
+            // Copy the conversion spec (flags, width, precision and conversion character).
+            char spec[64];
+            size_t n = 1 + strspn(p + 1, "-+ #0123456789.");
+            if(n + 3 >= sizeof(spec) || p[n] == '\0') {
+                shell_error("printf: invalid format \"%s\"\n", format);
+                result = EXIT_FAILURE;
+                break;
+            }
+            char conversion = p[n];
+            memcpy(spec, p, n);
+            p += n;
+
+            const char *arg = next < argc ? argv[next++] : NULL;
+            consumed = true;
+            char tmp[512];
+            int len = 0;
+            char *end;
+
+            switch(conversion) {
+                case 's':
+                case 'c': {
+                    // %c is the first character of the argument, padded to the width like a string.
+                    char first[2] = { arg != NULL ? arg[0] : '\0', '\0' };
+                    const char *string = conversion == 'c' ? first : arg == NULL ? "" : arg;
+                    spec[n] = 's';
+                    spec[n+1] = '\0';
+                    len = snprintf(NULL, 0, spec, string);
+                    if(len >= 0) {
+                        char *formatted = (char*)malloc(len + 1);
+                        snprintf(formatted, len + 1, spec, string);
+                        utilshell_buf_append(&out, formatted, len);
+                        free(formatted);
+                    }
+                    len = 0;
+                    break;
+                }
+
+                case 'b':
+                    if(arg != NULL && utilshell_unescape(&out, arg, strlen(arg)))
+                        p = format + strlen(format) - 1;
+                    break;
+
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X': {
+                    spec[n] = 'l';
+                    spec[n+1] = 'l';
+                    spec[n+2] = conversion;
+                    spec[n+3] = '\0';
+                    long long value = 0;
+                    if(arg != NULL && (arg[0] == '\'' || arg[0] == '"')) {
+                        value = (unsigned char)arg[1];
+                    } else if(arg != NULL) {
+                        errno = 0;
+                        value = strtoll(arg, &end, 0);
+                        if(*end != '\0' || errno != 0) {
+                            shell_error("printf: %s: invalid number\n", arg);
+                            result = EXIT_FAILURE;
+                        }
+                    }
+                    len = snprintf(tmp, sizeof(tmp), spec, value);
+                    break;
+                }
+
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G': {
+                    spec[n] = conversion;
+                    spec[n+1] = '\0';
+                    double value = 0;
+                    if(arg != NULL) {
+                        value = strtod(arg, &end);
+                        if(*end != '\0') {
+                            shell_error("printf: %s: invalid number\n", arg);
+                            result = EXIT_FAILURE;
+                        }
+                    }
+                    len = snprintf(tmp, sizeof(tmp), spec, value);
+                    break;
+                }
+
+                default:
+                    shell_error("printf: %%%c: invalid conversion\n", conversion);
+                    free(out.data);
+                    return EXIT_FAILURE;
+            }
+
+            if(len > 0)
+                utilshell_buf_append(&out, tmp, (size_t)len < sizeof(tmp) ? len : sizeof(tmp) - 1);
+
+        }
+
+        // Stop if the format did not consume any argument, to avoid looping forever.
+        if(!consumed)
+            break;
+
+    } while(next < argc);
+
+    if(utilshell_write_all(STDOUT_FILENO, out.data, out.len) != EXIT_SUCCESS)
+        result = EXIT_FAILURE;
+    free(out.data);
+    return result;
+
+}
+
+// Does nothing, successfully.
+int shell_true(int, char**) {
 
     return EXIT_SUCCESS;
+
+}
+
+// Does nothing, unsuccessfully.
+int shell_false(int, char**) {
+
+    return EXIT_FAILURE;
+
 }
 
-/* Appends a token to the token list.
- *    token is a pointer to the beginning of the token.
- *    tokens is the actual token list.
- *    n is the length of the token.
- *    num_tokens is a pointer to the number of tokens currently in the list (it will be auto-incremented if needed).
- *    max_tokens is a pointer to the max number of tokens that can be put in the list before reallocation (it will be increased if needed).
- * Returns a pointer to the token list on success. This may not be the same as the original address passed to the function if reallocation
- * was necessary. On failure, the function returns NULL.
+/* Evaluates a conditional expression like test(1) and [. Returns 0 if it is true, 1 if it is false and 2 on error.
+ * Supports ! ( ) -a -o, the file tests -e -f -d -r -w -x -s -L -h -p -S -b -c, the string tests -z -n = != < >,
+ * and the integer comparisons -eq -ne -lt -le -gt -ge.
  */
-char **utilshell_append_token(char *token, char **tokens, int n, int *num_tokens, int *max_tokens) {
+int shell_test(int argc, char **argv) {
 
-    // Try to use word expansion on the token.
-    
-    int new_num_tokens; // This will be the new number of tokens in the list.
+    if(strcmp(argv[0], "[") == 0) {
+        if(strcmp(argv[argc-1], "]") != 0) {
+            shell_error("[: missing ]\n");
+            return 2;
+        }
+        --argc;
+    }
+
+    if(argc <= 1)
+        return EXIT_FAILURE;
+
+    int pos = 1;
+    int result = utilshell_test_expr(argv, argc, &pos);
+    if(result != 2 && pos != argc) {
+        shell_error("%s: unexpected argument \"%s\"\n", argv[0], argv[pos]);
+        return 2;
+    }
+
+    return result;
 
-    // Copy the token string and try to expand it.
-    char *just_token = (char*)malloc((n+1)*sizeof(char));
-    strncpy(just_token, token, n);
-    just_token[n] = '\0';
+}
 
-    wordexp_t p;
-    char **w;
+// Prints the current working directory.
+int shell_pwd(int, char**) {
 
-    int wp = wordexp(just_token, &p, 0);
+    char *cwd = get_current_dir_name();
+    if(cwd == NULL) {
+        int errsv = errno;
+        shell_error("pwd: Could not retrieve current working directory. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
 
-    // Was the expansion successful?
-    // If so, we are going to prepare to add all the tokens returned from wordexp.
-    // If not, we are going to prepare to add only the token passed to the function.
-    if(wp == 0) {
+    size_t len = strlen(cwd);
+    cwd[len] = '\n';
+    int result = utilshell_write_all(STDOUT_FILENO, cwd, len + 1);
+    free(cwd);
+    return result;
 
-        // If word expansion was successful ...
-        w = p.we_wordv;
+}
 
-        // Get number of tokens to add to list.
-        new_num_tokens = *num_tokens;
-        for(int i = 0; w[i] != NULL; ++i)
-            ++new_num_tokens;
+/* Exports variables to the environment of the commands run by the shell.
+ *    export             Lists the exported variables, sorted by name.
+ *    export NAME=value  Sets and exports NAME.
+ *    export NAME        Exports NAME, or marks it to be exported once it is set.
+ */
+int shell_export(int argc, char **argv) {
 
-    } else {
-        new_num_tokens = *num_tokens + 1;
+    if(argc < 2) {
+        char **envp = utilshell_var_envp();
+        if(envp == NULL)
+            return EXIT_FAILURE;
+        int count = 0;
+        while(envp[count] != NULL)
+            ++count;
+        char **sorted = (char**)malloc((count + 1)*sizeof(char*));
+        if(sorted == NULL) {
+            shell_error("export: could not allocate %d variables\n", count);
+            return EXIT_FAILURE;
+        }
+        memcpy(sorted, envp, count*sizeof(char*));
+        qsort(sorted, count, sizeof(char*), utilshell_var_compare);
+        struct utilshell_buf out;
+        memset(&out, 0, sizeof(out));
+        for(int i = 0; i < count; ++i) {
+            utilshell_buf_append(&out, "export ", 7);
+            utilshell_buf_append(&out, sorted[i], strlen(sorted[i]));
+            utilshell_buf_append(&out, "\n", 1);
+        }
+        for(int i = 0; i < utilshell_num_export_names; ++i) {
+            utilshell_buf_append(&out, "export ", 7);
+            utilshell_buf_append(&out, utilshell_export_names[i], strlen(utilshell_export_names[i]));
+            utilshell_buf_append(&out, "\n", 1);
+        }
+        free(sorted);
+        int result = utilshell_write_all(STDOUT_FILENO, out.data, out.len);
+        free(out.data);
+        return result;
     }
 
-    // Resize token list if needed.
-    if(new_num_tokens > *max_tokens) {
+    int result = EXIT_SUCCESS;
 
-        // Find a new size for the list that can hold all the tokens.
-        int new_max_tokens = *max_tokens * 2;
-        while(new_num_tokens > new_max_tokens)
-            new_max_tokens *= 2; 
-        
-        // Resize the list. Add one for the NULL terminator.
-        char **new_tokens = (char**)realloc(tokens, (new_max_tokens+1)*sizeof(char*));
-        if(new_tokens == NULL) {
-            shell_error("Error in reallocating token list from size %d to new size %d.\n", max_tokens, new_max_tokens);
-            return NULL;
+    for(int i = 1; i < argc; ++i) {
+
+        char *equals = strchr(argv[i], '=');
+        size_t name_len = equals == NULL ? strlen(argv[i]) : (size_t)(equals - argv[i]);
+
+        if(!utilshell_var_name(argv[i], name_len)) {
+            shell_error("export: \"%s\" is not a valid name\n", argv[i]);
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        // A name that is not set is only marked, the same as in other shells. It is exported once it is set.
+        struct utilshell_var *var = utilshell_var_find(argv[i], name_len);
+        if(equals == NULL && var == NULL) {
+            utilshell_export_take(argv[i], name_len); // So that a name is not listed twice.
+            char **names = (char**)realloc(utilshell_export_names, (utilshell_num_export_names + 1)*sizeof(char*));
+            if(names == NULL || (names[utilshell_num_export_names] = strdup(argv[i])) == NULL) {
+                shell_error("export: could not allocate \"%s\"\n", argv[i]);
+                if(names != NULL)
+                    utilshell_export_names = names;
+                result = EXIT_FAILURE;
+                continue;
+            }
+            utilshell_export_names = names;
+            ++utilshell_num_export_names;
+            continue;
+        }
+        if(equals != NULL)
+            var = utilshell_var_set(argv[i], name_len, equals + 1, true);
+        if(var == NULL) {
+            result = EXIT_FAILURE;
+        } else if(!var->exported) {
+            var->exported = true;
+            utilshell_envp_dirty = true;
         }
 
-        *max_tokens = new_max_tokens;
-        tokens = new_tokens;
     }
 
-    if(wp == 0) {
+    return result;
 
-        // If word expansion was successful, then copy those tokens.
-        for(int i = 0; i < new_num_tokens - *num_tokens; ++i) {
-            tokens[i + *num_tokens] = (char*)malloc((strlen(w[i]) + 1) * sizeof(char));
-            strncpy(tokens[i + *num_tokens], w[i], strlen(w[i]) + 1);
-        }
-        wordfree(&p);
+}
 
-    } else {
+// Removes variables from the shell (and the environment of commands).
+int shell_unset(int argc, char **argv) {
+
+    for(int i = 1; i < argc; ++i)
+        utilshell_var_unset(argv[i], strlen(argv[i]));
+
+    return EXIT_SUCCESS;
+
+}
+
+// Lists the jobs of the shell and their state. Finished jobs are removed once they have been listed.
+int shell_jobs(int, char**) {
 
-        // If word expansion was not successful, then copy the original token.
-        tokens[*num_tokens] = (char*)malloc((n+1)*sizeof(char));
-        strncpy(tokens[*num_tokens], just_token, n+1);
+    utilshell_jobs_poll(0);
+
+    for(int i = 0; i < utilshell_max_jobs; ++i) {
+        struct utilshell_job *job = utilshell_jobs[i];
+        if(job == NULL)
+            continue;
+        printf("[%d]%c %-24s %s\n", job->id, job->id == utilshell_current_job ? '+' : ' ', utilshell_job_state(job), job->command);
+        job->notify = false;
+        if(job->num_done == job->num_procs)
+            utilshell_job_remove(job);
     }
+    fflush(stdout);
+
+    return EXIT_SUCCESS;
+
+}
 
-    tokens[new_num_tokens] = NULL;
-    *num_tokens = new_num_tokens;
+// Continues a job in the foreground (the current job if none is given) and waits for it.
+int shell_fg(int argc, char **argv) {
 
-    free(just_token);
+    struct utilshell_job *job = utilshell_job_parse("fg", argc > 1 ? argv[1] : NULL);
+    if(job == NULL)
+        return EXIT_FAILURE;
 
-    return tokens;
+    printf("%s\n", job->command);
+    fflush(stdout);
+    return utilshell_job_foreground(job, true);
 
 }
 
-int utilshell_exec(char **tokens, bool background) {
+// Continues a stopped job in the background (the current job if none is given).
+int shell_bg(int argc, char **argv) {
 
-    if(tokens == NULL)
+    struct utilshell_job *job = utilshell_job_parse("bg", argc > 1 ? argv[1] : NULL);
+    if(job == NULL)
+        return EXIT_FAILURE;
+
+    for(int i = 0; i < job->num_procs; ++i)
+        job->procs[i].stopped = false;
+    job->num_stopped = 0;
+    job->background = true;
+    kill(-job->pgid, SIGCONT);
+
+    printf("[%d] %s &\n", job->id, job->command);
+    fflush(stdout);
+    return EXIT_SUCCESS;
+
+}
+
+/* Waits for jobs to finish.
+ *    wait             Waits for every job. Returns 0.
+ *    wait %n|pid ...  Waits for the given jobs. Returns the status of the last one.
+ */
+int shell_wait(int argc, char **argv) {
+
+    if(argc < 2) {
+        for(int i = 0; i < utilshell_max_jobs; ++i) {
+            struct utilshell_job *job = utilshell_jobs[i];
+            if(job == NULL)
+                continue;
+            utilshell_job_wait(job);
+            if(job->num_done == job->num_procs)
+                utilshell_job_remove(job);
+        }
         return EXIT_SUCCESS;
-    if(tokens[0] == NULL)
+    }
+
+    int status = EXIT_SUCCESS;
+    for(int i = 1; i < argc; ++i) {
+        struct utilshell_job *job = utilshell_job_parse("wait", argv[i]);
+        if(job == NULL) {
+            status = 127;
+            continue;
+        }
+        status = utilshell_job_wait(job);
+        if(job->num_done == job->num_procs) {
+            job->notify = false;
+            utilshell_job_remove(job);
+        }
+    }
+
+    return status;
+
+}
+
+/* Sends a signal to jobs or processes.
+ *    kill [-SIG | -s SIG] %n|pid ...  Sends SIG (SIGTERM by default) to the whole job or to the process.
+ *    kill -l                          Lists the signal names.
+ */
+int shell_kill(int argc, char **argv) {
+
+    int sig = SIGTERM;
+    int i = 1;
+
+    if(argc > 1 && strcmp(argv[1], "-l") == 0) {
+        for(int n = 1; n < NSIG; ++n)
+            if(sigabbrev_np(n) != NULL)
+                printf("%2d) SIG%s\n", n, sigabbrev_np(n));
+        fflush(stdout);
         return EXIT_SUCCESS;
+    }
 
-    bool found_error = false;
-    int errsv;
+    if(argc > 2 && strcmp(argv[1], "-s") == 0) {
+        sig = utilshell_signal_number(argv[2]);
+        i = 3;
+    } else if(argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        sig = utilshell_signal_number(argv[1] + 1);
+        i = 2;
+    }
 
-    int num_tokens;
-    // Allocate space for args.
-    num_tokens = 0;
-    for(int i = 0; tokens[i] != NULL; ++i)
-        ++num_tokens;
+    if(sig == -1) {
+        shell_error("kill: unknown signal \"%s\"\n", argv[i-1]);
+        return EXIT_FAILURE;
+    }
+    if(i >= argc) {
+        shell_error("kill: usage: kill [-SIG | -s SIG] %%n|pid ...\n");
+        return EXIT_FAILURE;
+    }
 
-    char **args = NULL;
-    args = (char**)malloc((num_tokens + 1)*sizeof(char**));
-    args[0] = NULL;
+    int result = EXIT_SUCCESS;
+    for(; i < argc; ++i) {
 
-    // Copy over args from tokens. Do not copy special symbols (eg. Do not copy '<' and its corresponding file arg).
-    char *redir_in = NULL;
-    char *redir_out = NULL;
-    char *redir_app = NULL;
-    char *redir_err = NULL;
-    char **after_pipe = NULL;
+        pid_t target;
+        if(argv[i][0] == '%') {
+            struct utilshell_job *job = utilshell_job_parse("kill", argv[i]);
+            if(job == NULL) {
+                result = EXIT_FAILURE;
+                continue;
+            }
+            target = -job->pgid;
+        } else {
+            char *end;
+            target = (pid_t)strtol(argv[i], &end, 10);
+            if(*end != '\0' || argv[i][0] == '\0') {
+                shell_error("kill: \"%s\" is not a job or pid\n", argv[i]);
+                result = EXIT_FAILURE;
+                continue;
+            }
+        }
 
-    for(int i = 0, j = 0; tokens[i] != NULL; ++i) {
+        if(kill(target, sig) == -1) {
+            int errsv = errno;
+            shell_error("kill: could not signal \"%s\". errno:%d\n", argv[i], errsv);
+            result = EXIT_FAILURE;
+        }
 
-        if(strcmp(tokens[i], "|") == 0) {
+    }
 
-            if(tokens[i+1] != NULL)
-                after_pipe = tokens + i + 1;
+    return result;
 
-            break; // We don't want to copy anything after the pipe to the args list.
+}
 
-        } else if(strcmp(tokens[i], "<") == 0) {
 
-            // If there is not an argument, we will not throw an error. It's not a big deal.
-            if(tokens[i+1] != NULL)
-                redir_in = tokens[i+1];
-            
-            // Skip next token.
-            ++i;
 
-        } else if(strcmp(tokens[i], ">") == 0) {
+/* Copies files (or stdin, if there are none or for "-") to stdout. The data is moved by the kernel when it can be
+ * (see utilshell_copy()), so cat < a > b copies a file without it ever passing through the shell.
+ */
+int shell_cat(int argc, char **argv) {
 
-            // If there is not an argument, we will not throw an error. It's not a big deal.
-            if(tokens[i+1] != NULL)
-                redir_out = tokens[i+1];
-            
-            // Skip next token.
-            ++i;
+    int result = EXIT_SUCCESS;
 
-        } else if(strcmp(tokens[i], ">>") == 0) {
+    for(int i = 1; i < argc || (i == 1 && argc <= 1); ++i) {
 
-            // If there is not an argument, we will not throw an error. It's not a big deal.
-            if(tokens[i+1] != NULL)
-                redir_app = tokens[i+1];
-            
-            // Skip next token.
-            ++i;
+        const char *name = i < argc ? argv[i] : "-";
+        int fd = STDIN_FILENO;
+        if(strcmp(name, "-") != 0 && (fd = open(name, O_RDONLY|O_CLOEXEC)) == -1) {
+            int errsv = errno;
+            shell_error("cat: Could not open \"%s\". errno:%d\n", name, errsv);
+            result = EXIT_FAILURE;
+            continue;
+        }
 
-        } else if(strcmp(tokens[i], "2>") == 0) {
+        if(utilshell_copy(fd, STDOUT_FILENO) != EXIT_SUCCESS)
+            result = EXIT_FAILURE;
 
-            // If there is not an argument, we will not throw an error. It's not a big deal.
-            if(tokens[i+1] != NULL)
-                redir_err = tokens[i+1];
-            
-            // Skip next token.
-            ++i;
+        if(fd != STDIN_FILENO)
+            close(fd);
+
+    }
+
+    return result;
+
+}
 
-        } else if(strcmp(tokens[i], "&") == 0) {
+/* Copies stdin to stdout and to every given file.
+ *    tee [-a] file ...  -a appends to the files instead of truncating them.
+ * The data is spliced into a pipe of the shell, duplicated for every output but the last with tee(2) and spliced
+ * out again, so it is never copied into the shell. Input that cannot be spliced is copied through a buffer.
+ */
+int shell_tee(int argc, char **argv) {
 
-            // Do nothing. This case is taken care of in shell_exec().
+    int flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+    int first = 1;
+    if(argc > 1 && strcmp(argv[1], "-a") == 0) {
+        flags = O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC;
+        first = 2;
+    }
 
+    int result = EXIT_SUCCESS;
+    int *fds = (int*)malloc((argc + 1)*sizeof(int));
+    if(fds == NULL) {
+        shell_error("tee: Could not allocate %d outputs.\n", argc);
+        return EXIT_FAILURE;
+    }
+    int num_fds = 0;
+    fds[num_fds++] = STDOUT_FILENO;
+    for(int i = first; i < argc; ++i) {
+        if((fds[num_fds] = open(argv[i], flags, 0644)) == -1) {
+            int errsv = errno;
+            shell_error("tee: Could not open \"%s\". errno:%d\n", argv[i], errsv);
+            result = EXIT_FAILURE;
         } else {
-            args[j] = tokens[i];
-            args[++j] = NULL;
+            ++num_fds;
         }
-
     }
 
-    // Execute.
-    if(args[0] != NULL) {
-        if(fork() == 0) {
+    // The input goes through data and is duplicated through copy, both pipes of the same size.
+    int data[2] = { -1, -1 };
+    int copy[2] = { -1, -1 };
+    size_t size = 0;
+    if(pipe2(data, O_CLOEXEC) == 0 && pipe2(copy, O_CLOEXEC) == 0) {
+        fcntl(data[1], F_SETPIPE_SZ, UTILSHELL_COPY_LEN);
+        fcntl(copy[1], F_SETPIPE_SZ, UTILSHELL_COPY_LEN);
+        int data_size = fcntl(data[1], F_GETPIPE_SZ);
+        int copy_size = fcntl(copy[1], F_GETPIPE_SZ);
+        if(data_size > 0 && copy_size >= data_size)
+            size = data_size;
+    }
 
-            int fd_in = -1;
-            int fd_out = -1;
-            int fd_app = -1;
-            int fd_err = -1;
+    bool spliced = size > 0;
+    while(spliced) {
 
-            // Handle redirects.
-            if(redir_in != NULL) {
-                fd_in = open(redir_in, O_RDONLY);
+        ssize_t n = splice(STDIN_FILENO, NULL, data[1], NULL, size, SPLICE_F_MOVE);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1 && errno == EINVAL) {
+            spliced = false; // stdin cannot be spliced (eg. a terminal).
+            break;
+        }
+        if(n <= 0) {
+            if(n == -1) {
+                int errsv = errno;
+                shell_error("tee: Could not read input. errno:%d\n", errsv);
+                result = EXIT_FAILURE;
+            }
+            break;
+        }
 
-                if(fd_in == -1) {
-                    shell_error("Could not open \"%s\" for reading.\n", redir_in);
-                } else {
-                    dup2(fd_in, fileno(stdin));
+        for(int k = 0; k < num_fds; ++k) {
+            int from = data[0];
+            if(k < num_fds - 1) {
+                if(tee(data[0], copy[1], n, 0) != n) {
+                    int errsv = errno;
+                    shell_error("tee: Could not duplicate input. errno:%d\n", errsv);
+                    result = EXIT_FAILURE;
+                    break;
                 }
+                from = copy[0];
             }
+            if(utilshell_splice_all(from, fds[k], n) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+        }
+        if(result != EXIT_SUCCESS)
+            break;
 
-            if(redir_out != NULL) {
-                fd_out = open(redir_out, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU);
+    }
 
-                if(fd_out == -1) {
-                    shell_error("Could not open \"%s\" for writing.\n", redir_out);
-                } else {
-                    dup2(fd_out, fileno(stdout));
-                }
+    if(!spliced && result == EXIT_SUCCESS) {
+        char *buffer = utilshell_copy_buffer();
+        ssize_t n;
+        while(buffer != NULL && (n = read(STDIN_FILENO, buffer, UTILSHELL_COPY_LEN)) != 0) {
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n == -1) {
+                int errsv = errno;
+                shell_error("tee: Could not read input. errno:%d\n", errsv);
+                result = EXIT_FAILURE;
+                break;
             }
+            for(int k = 0; k < num_fds; ++k)
+                if(utilshell_write_all(fds[k], buffer, n) != EXIT_SUCCESS)
+                    result = EXIT_FAILURE;
+        }
+    }
 
-            if(redir_app != NULL) {
-                fd_app = open(redir_app, O_WRONLY|O_CREAT|O_APPEND, S_IRWXU);
+    for(int k = 0; k < 2; ++k) {
+        if(data[k] != -1)
+            close(data[k]);
+        if(copy[k] != -1)
+            close(copy[k]);
+    }
+    for(int k = 1; k < num_fds; ++k)
+        close(fds[k]);
+    free(fds);
 
-                if(fd_app == -1) {
-                    shell_error("Could not open \"%s\" for writing.\n", redir_app);
-                } else {
-                    dup2(fd_app, fileno(stdout));
+    return result;
+
+}
+
+/* Sets shell options, or prints all of them if none are given.
+ *    set pipe-size=SIZE       Grows the pipes between stages to SIZE bytes (with a K or M suffix, 0 for the default).
+ *    set cpus=LIST            Pins every stage to the CPUs in LIST (eg. 0-3,6), so they do not migrate.
+ *    set cpus=spread[:LIST]   Pins stage n to the n-th CPU of LIST alone (by default the CPUs the shell may use).
+ *    set cpus=off             Lets stages run anywhere again.
+ *    set history=on|off       Starts or stops adding commands to the history and expanding ! references.
+ *    set memo-size=SIZE       Lets the memo cache grow to SIZE bytes before it evicts entries (with a K, M or G suffix).
+ */
+int shell_set(int argc, char **argv) {
+
+    if(argc <= 1) {
+        char cpus[32];
+        utilshell_cpus_format(&utilshell_cpus, cpus, sizeof(cpus));
+        if(utilshell_pipe_size > 0)
+            printf("pipe-size=%d\n", utilshell_pipe_size);
+        else
+            printf("pipe-size=default\n");
+        printf("cpus=%s%s\n", !utilshell_pinned ? "off" : utilshell_cpus_spread ? "spread:" : "", utilshell_pinned ? cpus : "");
+        printf("history=%s\n", utilshell_history_on ? "on" : "off");
+        printf("memo-size=%lld\n", utilshell_memo_size);
+        return EXIT_SUCCESS;
+    }
+
+    for(int i = 1; i < argc; ++i) {
+
+        const char *value = strchr(argv[i], '=');
+        if(value == NULL) {
+            shell_error("set: Expected option=value instead of \"%s\".\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        ++value;
+
+        if(strncmp(argv[i], "pipe-size=", 10) == 0) {
+
+            // F_SETPIPE_SZ takes an int, and no kernel allows pipes anywhere near 1GB.
+            long long size;
+            if(strcmp(value, "default") == 0)
+                size = 0;
+            else if(utilshell_size_parse(value, 1LL << 30, &size) != EXIT_SUCCESS) {
+                shell_error("set: Invalid pipe size \"%s\".\n", value);
+                return EXIT_FAILURE;
+            }
+
+            // Try the size on a pipe now, so that a size above /proc/sys/fs/pipe-max-size is reported once.
+            if(size > 0) {
+                int fds[2];
+                if(pipe2(fds, O_CLOEXEC) == -1) {
+                    int errsv = errno;
+                    shell_error("set: Could not create pipe. errno:%d\n", errsv);
+                    return EXIT_FAILURE;
+                }
+                int actual = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+                int errsv = errno;
+                close(fds[0]);
+                close(fds[1]);
+                if(actual == -1) {
+                    shell_error("set: Could not set pipe size to %lld. errno:%d\n", size, errsv);
+                    return EXIT_FAILURE;
                 }
+                size = actual; // The kernel rounds up to a power of two pages.
             }
+            utilshell_pipe_size = (int)size;
 
-            if(redir_err != NULL) {
-                fd_err = open(redir_err, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU);
+        } else if(strncmp(argv[i], "cpus=", 5) == 0) {
 
-                if(fd_err == -1) {
-                    shell_error("Could not open \"%s\" for writing.\n", redir_err);
-                } else {
-                    dup2(fd_err, fileno(stderr));
+            if(strcmp(value, "off") == 0) {
+                utilshell_pinned = false;
+                continue;
+            }
+
+            bool spread = strncmp(value, "spread", 6) == 0 && (value[6] == '\0' || value[6] == ':');
+            cpu_set_t allowed, cpus;
+            if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+                int errsv = errno;
+                shell_error("set: Could not get the CPUs of the shell. errno:%d\n", errsv);
+                return EXIT_FAILURE;
+            }
+            if(spread && value[6] == '\0')
+                cpus = allowed;
+            else if(utilshell_cpus_parse(spread ? value + 7 : value, &cpus) != EXIT_SUCCESS) {
+                shell_error("set: Invalid CPU list \"%s\".\n", spread ? value + 7 : value);
+                return EXIT_FAILURE;
+            }
+            for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if(CPU_ISSET(cpu, &cpus) && !CPU_ISSET(cpu, &allowed)) {
+                    shell_error("set: CPU %d is not available.\n", cpu);
+                    return EXIT_FAILURE;
                 }
             }
 
-            // Execute (pipe if needed).
-            if(after_pipe != NULL) {
+            utilshell_pinned = true;
+            utilshell_cpus_spread = spread;
+            utilshell_cpus = cpus;
 
-                int fd[2];
-                pipe(fd);
+        } else if(strncmp(argv[i], "history=", 8) == 0) {
 
-                if(fork() == 0) {
-                    
-                    close(fd[0]);
-                    dup2(fd[1], fileno(stdout));
+            if(strcmp(value, "off") == 0) {
+                utilshell_history_on = false;
+            } else if(strcmp(value, "on") == 0) {
+                if(utilshell_history_open() != EXIT_SUCCESS)
+                    return EXIT_FAILURE;
+                utilshell_history_on = true;
+            } else {
+                shell_error("set: Expected history=on or history=off instead of \"%s\".\n", argv[i]);
+                return EXIT_FAILURE;
+            }
 
-                    if(execvp(args[0], args) == -1) {
-                        errsv = errno;
-                        shell_error("Could not execute \"%s\". errno:%d\n", args[0], errsv);
-                        found_error = true;
-                    }
+        } else if(strncmp(argv[i], "memo-size=", 10) == 0) {
 
-                    close(fd[1]);
+            // The store is on disk, so it may be larger than memory (up to 1PB, which keeps the sums far from overflowing).
+            if(utilshell_size_parse(value, 1LL << 50, &utilshell_memo_size) != EXIT_SUCCESS) {
+                shell_error("set: Invalid memo size \"%s\".\n", value);
+                return EXIT_FAILURE;
+            }
 
-                } else {
+        } else {
 
-                    close(fd[1]);
-                    dup2(fd[0], fileno(stdin));
-                    wait(NULL);
+            shell_error("set: Unknown option \"%.*s\".\n", (int)(value - 1 - argv[i]), argv[i]);
+            return EXIT_FAILURE;
 
-                    utilshell_exec(after_pipe, background);
+        }
 
-                    close(fd[0]);
+    }
 
-                }
+    return EXIT_SUCCESS;
 
-            } else {
+}
 
-                if(execvp(args[0], args) == -1) {
-                    errsv = errno;
-                    shell_error("Could not execute \"%s\". errno:%d\n", args[0], errsv);
-                    found_error = true;
-                }
-            
-            }
 
-            close(fd_in);
-            close(fd_out);
 
+/* Runs a command once for every argument, several at a time.
+ *    parallel [-j N] [-s] command [args ...] [::: arg ...]
+ * Every {} in the command is replaced by the argument, or the argument is added at the end if there is no {}. The
+ * arguments follow :::, or without it are read from stdin, one per line. At most N jobs run at once (the number of
+ * CPUs by default), all with /dev/null as stdin. The output of the jobs comes out in the order of the arguments and
+ * never interleaves: the earliest job still running writes straight through, the others into a buffer that is
+ * written once it is their turn. -s prints the throughput and the latencies of the jobs to stderr at the end (with
+ * -p they are appended to the profile file as well). Returns EXIT_SUCCESS if every job succeeded.
+ */
+int shell_parallel(int argc, char **argv) {
+
+    int max_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool stats = false;
+    int first = 1;
+    while(first < argc && argv[first][0] == '-') {
+        if(strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+            max_jobs = atoi(argv[first + 1]);
+            first += 2;
+        } else if(strncmp(argv[first], "-j", 2) == 0 && argv[first][2] != '\0') {
+            max_jobs = atoi(argv[first] + 2);
+            ++first;
+        } else if(strcmp(argv[first], "-s") == 0) {
+            stats = true;
+            ++first;
+        } else if(strcmp(argv[first], "--") == 0) {
+            ++first;
+            break;
         } else {
-            if(!background)
-                wait(NULL);
+            shell_error("parallel: Unknown option \"%s\".\n", argv[first]);
+            return EXIT_FAILURE;
         }
     }
 
-    free(args);
+    if(max_jobs < 1) {
+        shell_error("parallel: Invalid number of jobs.\n");
+        return EXIT_FAILURE;
+    }
+
+    int num_words = 0;
+    while(first + num_words < argc && strcmp(argv[first + num_words], ":::") != 0)
+        ++num_words;
+    if(num_words == 0) {
+        shell_error("parallel: Expected a command.\n");
+        return EXIT_FAILURE;
+    }
+    bool inline_args = first + num_words < argc;
+    int next_arg = first + num_words + 1;
+
+    struct utilshell_reader args;
+    memset(&args, 0, sizeof(args));
+    args.fd = STDIN_FILENO;
+    args.released_at = -1;
+
+    struct utilshell_parallel_slot *slots = (struct utilshell_parallel_slot*)calloc(max_jobs, sizeof(struct utilshell_parallel_slot));
+    struct utilshell_arena *arena = utilshell_arena_create();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int null_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    if(slots == NULL || arena == NULL || epoll_fd == -1 || null_fd == -1) {
+        shell_error("parallel: Could not set up %d job slots.\n", max_jobs);
+        free(slots);
+        if(arena != NULL)
+            utilshell_arena_destroy(arena);
+        if(epoll_fd != -1)
+            close(epoll_fd);
+        if(null_fd != -1)
+            close(null_fd);
+        return EXIT_FAILURE;
+    }
+
+    // Anything printf() buffered must come out before the output of the jobs.
+    fflush(stdout);
+
+    long long latencies[UTILSHELL_LATENCY_BUCKETS];
+    memset(latencies, 0, sizeof(latencies));
+    double max_latency = 0;
+    long long next_job = 0;    // The number of jobs started.
+    long long next_output = 0; // The earliest job that is not done (its output is written straight through).
+    long long num_failed = 0;
+    bool more = true;
+    bool interrupted = false;
+    int result = EXIT_SUCCESS;
+
+    struct timespec started, ended;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    while(true) {
+
+        // Start jobs while there are free slots.
+        while(more && !interrupted && next_job - next_output < max_jobs) {
+
+            char *arg = NULL;
+            if(inline_args) {
+                if(next_arg < argc)
+                    arg = argv[next_arg++];
+            } else if(utilshell_reader_line(&args, &arg) != EXIT_SUCCESS) {
+                result = EXIT_FAILURE;
+            }
+            if(arg == NULL) {
+                more = false;
+                break;
+            }
+            if(arg[0] == '\0' && !inline_args)
+                continue;
+
+            int index = next_job % max_jobs;
+            char **job_argv = utilshell_parallel_argv(argv + first, num_words, arg, arena);
+            if(job_argv == NULL) {
+                shell_error("parallel: Could not allocate command.\n");
+                memset(&slots[index].started, 0, sizeof(struct timespec));
+                slots[index].fds[0] = slots[index].fds[1] = -1;
+                slots[index].exited = true;
+                slots[index].status = W_EXITCODE(127, 0);
+            } else {
+                utilshell_parallel_start(slots + index, job_argv, null_fd, epoll_fd, index);
+            }
+            utilshell_arena_reset(arena);
+            ++next_job;
+
+        }
+
+        // Finish the jobs that are done, in order, and write what the earliest running job has buffered so far.
+        while(next_output < next_job) {
+
+            struct utilshell_parallel_slot *slot = slots + next_output % max_jobs;
+            for(int k = 0; k < 2; ++k) {
+                if(slot->output[k].len > 0)
+                    utilshell_write_all(k + 1, slot->output[k].data, slot->output[k].len);
+                slot->output[k].len = 0;
+            }
+
+            // Without a pidfd, the end of the output is taken as the sign that the job is exiting.
+            if(!slot->exited && slot->pidfd == -1 && slot->fds[0] == -1 && slot->fds[1] == -1) {
+                while(wait4(slot->pid, &slot->status, 0, NULL) == -1 && errno == EINTR)
+                    ;
+                slot->exited = true;
+                clock_gettime(CLOCK_MONOTONIC, &slot->ended);
+            }
+            if(!slot->exited || slot->fds[0] != -1 || slot->fds[1] != -1)
+                break;
+
+            double latency = utilshell_seconds(slot->started, slot->ended);
+            int bucket = 0;
+            while(bucket < UTILSHELL_LATENCY_BUCKETS - 1 && latency * 1e6 >= (double)(1LL << bucket))
+                ++bucket;
+            ++latencies[bucket];
+            if(latency > max_latency)
+                max_latency = latency;
+
+            if(!WIFEXITED(slot->status) || WEXITSTATUS(slot->status) != 0)
+                ++num_failed;
+            // Ctrl-C reaches the jobs too (they run in the process group of the shell). Stop starting new ones.
+            if(WIFSIGNALED(slot->status) && WTERMSIG(slot->status) == SIGINT)
+                interrupted = true;
+            ++next_output;
+
+        }
+
+        if(next_output == next_job && (!more || interrupted))
+            break;
+        if(more && !interrupted && next_job - next_output < max_jobs)
+            continue; // Slots were freed, start more jobs first.
+
+        const int MAX_EVENTS = 64;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if(n == -1 && errno != EINTR) {
+            int errsv = errno;
+            shell_error("parallel: Could not wait for jobs. errno:%d\n", errsv);
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        // Each event is tagged with its slot and what became ready: 0 stdout, 1 stderr, 2 the pidfd.
+        for(int i = 0; i < n; ++i) {
+
+            int index = (int)(events[i].data.u64 >> 2);
+            int what = (int)(events[i].data.u64 & 3);
+            struct utilshell_parallel_slot *slot = slots + index;
+
+            if(what < 2) {
+                utilshell_parallel_read(slot, what, index == next_output % max_jobs);
+            } else if(wait4(slot->pid, &slot->status, WNOHANG, NULL) == slot->pid) {
+                slot->exited = true;
+                clock_gettime(CLOCK_MONOTONIC, &slot->ended);
+                close(slot->pidfd);
+                slot->pidfd = -1;
+            }
+
+        }
+
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+
+    // Only reached early on error. Do not leave anything running behind.
+    for(; next_output < next_job; ++next_output) {
+        struct utilshell_parallel_slot *slot = slots + next_output % max_jobs;
+        for(int k = 0; k < 2; ++k)
+            if(slot->fds[k] != -1)
+                close(slot->fds[k]);
+        if(slot->pidfd != -1)
+            close(slot->pidfd);
+        if(!slot->exited)
+            waitpid(slot->pid, NULL, 0);
+    }
+
+    long long num_jobs = next_job;
+    if(stats || utilshell_profile_fd != -1)
+        utilshell_parallel_report(argc, argv, num_jobs, num_failed, max_jobs, utilshell_seconds(started, ended),
+            latencies, max_latency, stats);
+
+    for(int i = 0; i < max_jobs; ++i) {
+        free(slots[i].output[0].data);
+        free(slots[i].output[1].data);
+    }
+    free(slots);
+    free(args.data);
+    utilshell_arena_destroy(arena);
+    close(epoll_fd);
+    close(null_fd);
+
+    if(interrupted)
+        return 128 + SIGINT;
+    if(num_failed > 0)
+        return EXIT_FAILURE;
+    return result;
+
+}
+
+/* Prints the history, shared with every other shell of the user (see utilshell_history_fd).
+ *    history [n]      Prints the last n entries (all of them by default) with their numbers.
+ *    history -s text  Prints the entries that contain text.
+ * Entries can be run again with !!, !n, !-n, !text and !?text? (see utilshell_history_expand()).
+ */
+int shell_history(int argc, char **argv) {
+
+    if(utilshell_history_index(UTILSHELL_HISTORY_ALL) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if(argc == 3 && strcmp(argv[1], "-s") == 0) {
+
+        size_t n = strlen(argv[2]);
+        int num;
+        int *candidates = utilshell_history_candidates(argv[2], n, &num);
+        int status = EXIT_SUCCESS;
+        if(candidates != NULL) {
+            for(int i = 0; i < num && status == EXIT_SUCCESS; ++i) {
+                if(utilshell_history_match(candidates[i], argv[2], n, false))
+                    status = utilshell_history_print(candidates[i]);
+            }
+            free(candidates);
+        } else {
+            for(int entry = 1; entry <= utilshell_history_count && status == EXIT_SUCCESS; ++entry) {
+                if(utilshell_history_match(entry, argv[2], n, false))
+                    status = utilshell_history_print(entry);
+            }
+        }
+        return status;
+
+    }
+
+    int count = utilshell_history_count;
+    if(argc == 2) {
+        char *end;
+        count = strtol(argv[1], &end, 10);
+        if(end == argv[1] || *end != '\0' || count < 0) {
+            shell_error("history: Invalid count \"%s\".\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    } else if(argc > 2) {
+        shell_error("history: usage: history [n] | history -s text\n");
+        return EXIT_FAILURE;
+    }
+
+    int first = count < utilshell_history_count ? utilshell_history_count - count + 1 : 1;
+    for(int entry = first; entry <= utilshell_history_count; ++entry) {
+        if(utilshell_history_print(entry) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+
+/* Runs a command, or replays what it printed if it ran before on the same inputs.
+ *    memo [-c] [-d file]... [-e name]... command [args ...]
+ * The key of a run covers the args, the current directory, the executable, the variables named with -e, stdin (a
+ * file by its inode, size, mtime and offset; a pipe by what comes through it) and every file given with -d. With -c,
+ * files are known by their contents instead. On a hit, the stdout, stderr and exit status of the command are replayed
+ * from the store ($MEMODIR, or ~/.cache/shell_memo) without running anything. On a miss, the command runs with its
+ * output going to the store, which then drops the least recently used runs if it is larger than set memo-size.
+ * Runs that are killed by a signal, or exit with 126 or 127 (the command could not be run), are not stored.
+ * Two limits: stdout and stderr are stored apart, so a replay writes all of stdout and then all of stderr (however
+ * the command interleaved them), and variables that are not named with -e are not part of the key (a command that
+ * reads eg. $LANG is replayed for any value of it).
+ */
+int shell_memo(int argc, char **argv) {
+
+    bool content = false;
+    int first = 1;
+    while(first < argc && argv[first][0] == '-') {
+        if(strcmp(argv[first], "-c") == 0) {
+            content = true;
+            ++first;
+        } else if((strcmp(argv[first], "-d") == 0 || strcmp(argv[first], "-e") == 0) && first + 1 < argc) {
+            first += 2;
+        } else if(strcmp(argv[first], "--") == 0) {
+            ++first;
+            break;
+        } else {
+            shell_error("memo: Unknown option \"%s\".\n", argv[first]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(first >= argc) {
+        shell_error("memo: usage: memo [-c] [-d file]... [-e name]... command [args ...]\n");
+        return EXIT_FAILURE;
+    }
+
+    struct utilshell_stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.args = argv + first;
+    stage.fds[STDIN_FILENO] = -1;
+    stage.builtin = utilshell_builtin_find(argv[first]);
+    if(stage.builtin == NULL && (stage.path = utilshell_hash_lookup(argv[first])) == NULL) {
+        shell_error("Could not execute \"%s\". errno:%d\n", argv[first], ENOENT);
+        return 127;
+    }
+
+    char *dir = utilshell_memo_dir();
+    if(dir == NULL)
+        return EXIT_FAILURE;
+
+    struct utilshell_memo_hash key;
+    utilshell_memo_hash_init(&key);
+    utilshell_memo_hash_string(&key, "memo 1");
+    int num_args = argc - first;
+    utilshell_memo_hash_update(&key, &num_args, sizeof(num_args));
+    for(int i = first; i < argc; ++i)
+        utilshell_memo_hash_string(&key, argv[i]);
+    utilshell_memo_hash_string(&key, utilshell_cwd != NULL ? utilshell_cwd : "");
+    int result = EXIT_SUCCESS;
+    if(stage.builtin != NULL)
+        utilshell_memo_hash_string(&key, "builtin");
+    else
+        result = utilshell_memo_identity(&key, stage.path, false);
+
+    for(int i = 1; i < first && result == EXIT_SUCCESS; ++i) {
+        if(strcmp(argv[i], "-e") == 0) {
+            const char *value = utilshell_var_get(argv[++i]);
+            utilshell_memo_hash_string(&key, argv[i]);
+            utilshell_memo_hash_string(&key, value != NULL ? "set" : "unset");
+            utilshell_memo_hash_string(&key, value != NULL ? value : "");
+        } else if(strcmp(argv[i], "-d") == 0) {
+            utilshell_memo_hash_string(&key, argv[++i]);
+            result = utilshell_memo_identity(&key, argv[i], content);
+        }
+    }
+
+    /* Stdin is only an input if it was redirected or piped into memo; the stdin of the shell itself (eg. the terminal)
+     * is not. A file is known by its identity and the offset the command would start reading at. Anything else that
+     * can be read to its end (a pipe or a socket) is copied into a temporary file, which the command then reads
+     * instead. A device (eg. /dev/null) is only known by its device number.
+     */
+    struct stat st;
+    if(result == EXIT_SUCCESS && fstat(STDIN_FILENO, &st) == -1) {
+        int errsv = errno;
+        shell_error("memo: Could not look at stdin. errno:%d\n", errsv);
+        result = EXIT_FAILURE;
+    }
+    if(result == EXIT_SUCCESS && st.st_ino == utilshell_memo_stdin.st_ino && st.st_dev == utilshell_memo_stdin.st_dev) {
+        utilshell_memo_hash_string(&key, "shell");
+    } else if(result == EXIT_SUCCESS && S_ISREG(st.st_mode)) {
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        utilshell_memo_hash_string(&key, "file");
+        utilshell_memo_hash_update(&key, &offset, sizeof(offset));
+        if(content)
+            result = utilshell_memo_hash_fd(&key, STDIN_FILENO, offset, -1);
+        else
+            utilshell_memo_hash_stat(&key, &st);
+    } else if(result == EXIT_SUCCESS && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+        struct utilshell_buf path = { NULL, 0, 0, NULL };
+        stage.fds[STDIN_FILENO] = utilshell_memo_temp(dir, "objects", &path);
+        if(stage.fds[STDIN_FILENO] != -1)
+            unlink(path.data);
+        free(path.data);
+        utilshell_memo_hash_string(&key, "stream");
+        if(stage.fds[STDIN_FILENO] == -1 || utilshell_memo_hash_fd(&key, STDIN_FILENO, -1, stage.fds[STDIN_FILENO]) != EXIT_SUCCESS)
+            result = EXIT_FAILURE;
+        else
+            lseek(stage.fds[STDIN_FILENO], 0, SEEK_SET);
+    } else if(result == EXIT_SUCCESS) {
+        utilshell_memo_hash_string(&key, "device");
+        utilshell_memo_hash_update(&key, &st.st_rdev, sizeof(st.st_rdev));
+    }
+
+    char hex[33];
+    utilshell_memo_hash_final(&key, hex);
+    int status = EXIT_FAILURE;
+    if(result != EXIT_SUCCESS || utilshell_memo_replay(dir, hex, &status) == EXIT_SUCCESS) {
+        if(stage.fds[STDIN_FILENO] != -1)
+            close(stage.fds[STDIN_FILENO]);
+        free(dir);
+        return status;
+    }
+
+    // A miss. The output goes to temporary files of the store first, and is copied out once the command is done.
+    struct utilshell_buf paths[2];
+    memset(paths, 0, sizeof(paths));
+    int fds[2];
+    fds[0] = utilshell_memo_temp(dir, "objects", paths);
+    fds[1] = utilshell_memo_temp(dir, "objects", paths + 1);
+    if(fds[0] != -1 && fds[1] != -1) {
+        stage.fds[STDOUT_FILENO] = fds[0];
+        stage.fds[STDERR_FILENO] = fds[1];
+        if(utilshell_use_fork || stage.builtin != NULL)
+            stage.pid = utilshell_launch_fork(&stage, getpgrp());
+        else
+            stage.pid = utilshell_launch_spawn(&stage, getpgrp());
+    } else {
+        stage.pid = -1;
+    }
+    if(stage.fds[STDIN_FILENO] != -1)
+        close(stage.fds[STDIN_FILENO]);
+
+    int wstatus = W_EXITCODE(127, 0);
+    if(stage.pid > 0) {
+        while(wait4(stage.pid, &wstatus, 0, NULL) == -1 && errno == EINTR)
+            ;
+    }
+    status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+
+    fflush(stdout);
+    for(int k = 0; k < 2; ++k)
+        if(fds[k] != -1 && lseek(fds[k], 0, SEEK_SET) == 0)
+            utilshell_copy(fds[k], k + 1);
+
+    if(stage.pid > 0 && WIFEXITED(wstatus) && status != 126 && status != 127 &&
+        utilshell_memo_save(dir, hex, status, fds, paths) == EXIT_SUCCESS)
+        utilshell_memo_evict(dir);
+
+    for(int k = 0; k < 2; ++k) {
+        if(fds[k] != -1)
+            close(fds[k]);
+        if(paths[k].data != NULL)
+            unlink(paths[k].data);
+        free(paths[k].data);
+    }
+    free(dir);
+
+    return status;
+
+}
+
+
+
+// --------------------------------------------------------------
+// Other useful functions.
+// --------------------------------------------------------------
+
+int shell_error(const char *fmt, ...) {
+	va_list argp;
+	va_start(argp, fmt);
+	int result = shell_verror(fmt, argp);
+	va_end(argp);
+    return result;
+}
+
+int shell_verror(const char *fmt, va_list argp) {
+    if(utilshell_colors)
+        fprintf(stderr, "\033[4;31mERROR: ");
+    else
+        fprintf(stderr, "ERROR: ");
+
+    int result = vfprintf(stderr, fmt, argp);
+
+    if(utilshell_colors)
+        fprintf(stderr, "\033[0m");
+    return result;
+}
+
+
+
+// --------------------------------------------------------------
+// Utility functions.
+// --------------------------------------------------------------
+
+/* Compiles a PS1-style prompt format into a list of segments. Everything that does not change while the shell
+ * runs (user, host, literal text) is folded into text segments here, so rendering only has to fill in the current
+ * directory. Supported escapes:
+ *    \u User name.             \h Host name up to the first '.'.  \H Host name.
+ *    \w Current directory.     \W Last component of \w.           \$ '#' for root, '$' otherwise.
+ *    \n Newline.               \e Escape character (033).         \\ Backslash.
+ *    \[ and \] are accepted (and ignored) for compatibility with bash.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_prompt_compile(const char *format) {
+
+    int max_segments = 4;
+    for(const char *p = format; *p != '\0'; ++p)
+        if(*p == '\\')
+            ++max_segments;
+
+    struct utilshell_prompt_segment *segments = (struct utilshell_prompt_segment*)calloc(max_segments, sizeof(struct utilshell_prompt_segment));
+    if(segments == NULL) {
+        shell_error("Could not compile prompt.\n");
+        return EXIT_FAILURE;
+    }
+
+    int num_segments = 0;
+    struct utilshell_buf text;
+    memset(&text, 0, sizeof(text));
+
+    for(const char *p = format; *p != '\0'; ++p) {
+
+        const char *literal = NULL;
+        int dynamic = -1;
+        char c;
+
+        if(*p != '\\' || p[1] == '\0') {
+            utilshell_buf_append(&text, p, 1);
+            continue;
+        }
+
+        switch(*++p) {
+            case 'u': literal = utilshell_user; break;
+            case 'H': literal = utilshell_host; break;
+            case 'h':
+                utilshell_buf_append(&text, utilshell_host, strcspn(utilshell_host, "."));
+                break;
+            case '$': literal = geteuid() == 0 ? "#" : "$"; break;
+            case 'n': literal = "\n"; break;
+            case 'e': literal = "\033"; break;
+            case '\\': literal = "\\"; break;
+            case '[':
+            case ']':
+                break;
+            case 'w': dynamic = UTILSHELL_PROMPT_CWD; break;
+            case 'W': dynamic = UTILSHELL_PROMPT_CWD_BASE; break;
+            default:
+                c = '\\';
+                utilshell_buf_append(&text, &c, 1);
+                utilshell_buf_append(&text, p, 1);
+                break;
+        }
+
+        if(literal != NULL)
+            utilshell_buf_append(&text, literal, strlen(literal));
+
+        if(dynamic != -1) {
+            if(text.len > 0) {
+                segments[num_segments].type = UTILSHELL_PROMPT_TEXT;
+                segments[num_segments].text = strndup(text.data, text.len);
+                segments[num_segments++].len = text.len;
+                text.len = 0;
+            }
+            segments[num_segments++].type = dynamic;
+        }
+
+    }
+
+    if(text.len > 0) {
+        segments[num_segments].type = UTILSHELL_PROMPT_TEXT;
+        segments[num_segments].text = strndup(text.data, text.len);
+        segments[num_segments++].len = text.len;
+    }
+    free(text.data);
+
+    for(int i = 0; i < utilshell_prompt_num_segments; ++i)
+        free(utilshell_prompt_segments[i].text);
+    free(utilshell_prompt_segments);
+
+    utilshell_prompt_segments = segments;
+    utilshell_prompt_num_segments = num_segments;
+    utilshell_prompt_dirty = true;
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Refreshes the cached current directory (shown with '~' in place of the home directory) and marks the prompt as
+ * needing to be rendered again. This is called once at startup and whenever cd succeeds.
+ */
+void utilshell_prompt_refresh_cwd() {
+
+    utilshell_prompt_dirty = true;
+
+    char *cwd;
+    if((cwd = get_current_dir_name()) == NULL) {
+        int errsv = errno;
+        shell_error("Could not retrieve current working directory. errno:%d\n", errsv);
+        cwd = strdup("?");
+    }
+
+    // Use tilde '~' in place of home in cwd.
+    size_t home_len = utilshell_home == NULL ? 0 : strlen(utilshell_home);
+    if(home_len > 1 && strncmp(cwd, utilshell_home, home_len) == 0 && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+        cwd[0] = '~';
+        memmove(cwd + 1, cwd + home_len, strlen(cwd + home_len) + 1);
+    }
+
+    free(utilshell_cwd);
+    utilshell_cwd = cwd;
+
+}
+
+// Renders the compiled prompt into utilshell_prompt_cache.
+void utilshell_prompt_render() {
+
+    utilshell_prompt_cache.len = 0;
+
+    for(int i = 0; i < utilshell_prompt_num_segments; ++i) {
+
+        struct utilshell_prompt_segment *segment = utilshell_prompt_segments + i;
+        const char *base;
+
+        switch(segment->type) {
+            case UTILSHELL_PROMPT_TEXT:
+                utilshell_buf_append(&utilshell_prompt_cache, segment->text, segment->len);
+                break;
+
+            case UTILSHELL_PROMPT_CWD:
+                utilshell_buf_append(&utilshell_prompt_cache, utilshell_cwd, strlen(utilshell_cwd));
+                break;
+
+            case UTILSHELL_PROMPT_CWD_BASE:
+                base = strrchr(utilshell_cwd, '/');
+                base = (base == NULL || base[1] == '\0') ? utilshell_cwd : base + 1;
+                utilshell_buf_append(&utilshell_prompt_cache, base, strlen(base));
+                break;
+        }
+
+    }
+
+    utilshell_prompt_dirty = false;
+
+}
+
+/* Prints the prompt (unless utilshell_prompt_visible is false). The prompt is only rendered again when something in
+ * it changed, and it is written with a single write().
+ */
+int utilshell_print_prompt() {
+
+    if(!utilshell_prompt_visible)
+        return EXIT_SUCCESS;
+
+    // Anything a builtin left in the stdio buffer has to come out before the prompt.
+    fflush(stdout);
+
+    size_t len;
+    const char *prompt = utilshell_prompt_text(&len);
+    if(write(STDOUT_FILENO, prompt, len) == -1) {
+        int errsv = errno;
+        shell_error("Could not print prompt. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Returns the prompt for the next line and sets *len to its length (the prompt is rendered again first if something
+ * in it changed). Returns "" if the prompt is hidden.
+ */
+const char *utilshell_prompt_text(size_t *len) {
+
+    if(!utilshell_prompt_visible) {
+        *len = 0;
+        return "";
+    }
+
+    // A command that goes on over several lines gets a short prompt for the lines after the first.
+    if(utilshell_pending.len > 0) {
+        *len = 2;
+        return "> ";
+    }
+
+    if(utilshell_prompt_dirty)
+        utilshell_prompt_render();
+    *len = utilshell_prompt_cache.len;
+    return utilshell_prompt_cache.data;
+
+}
+
+/* Retrieves the next line of user input. *buffer is set to the line without its newline, or to NULL at the end of
+ * the input. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_get_input(char **buffer) {
+
+    // Lines typed at a terminal are read with the line editor.
+    if(utilshell_editing)
+        return utilshell_edit_line(buffer);
+    return utilshell_reader_line(&utilshell_input, buffer);
+
+}
+
+/* Reads a line typed at the terminal with the line editor. *buffer is set to the line (valid until the next call), or
+ * to NULL at the end of the input (Ctrl-D on an empty line). Besides typing, the keys are:
+ *    Left, Right, Ctrl-B, Ctrl-F    Move the cursor.
+ *    Home, End, Ctrl-A, Ctrl-E      Move the cursor to the start or the end of the line.
+ *    Backspace, Delete, Ctrl-D      Delete the character before or under the cursor.
+ *    Ctrl-U, Ctrl-K, Ctrl-W         Delete everything before or after the cursor, or the word before it.
+ *    Ctrl-L                         Clear the screen.
+ *    Ctrl-C                         Drop the line (and the rest of an unfinished command).
+ *    Tab                            Complete the command or path before the cursor (see utilshell_complete()).
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_edit_line(char **buffer) {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+    *buffer = NULL;
+    ed->line.len = 0;
+    if(utilshell_buf_append(&ed->line, "", 0) != EXIT_SUCCESS) {
+        shell_error("Could not allocate line.\n");
+        return EXIT_FAILURE;
+    }
+    ed->pos = 0;
+    ed->cursor_row = 0;
+    ed->dirty = false;
+    ed->tab_failed = false;
+
+    // Keys come one at a time, without echo, and the shell handles Ctrl-C itself.
+    struct termios raw = utilshell_tmodes;
+    raw.c_iflag &= ~(ICRNL|IXON|BRKINT|ISTRIP|INPCK);
+    raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == -1) {
+        int errsv = errno;
+        shell_error("Could not switch the terminal to raw mode. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    const char *line = NULL;
+    bool done = false;
+    while(!done) {
+
+        int key = utilshell_editor_key();
+        bool tab_failed = ed->tab_failed;
+        ed->tab_failed = false;
+        size_t old_pos = ed->pos;
+        size_t pos = ed->pos;
+        size_t len = ed->line.len;
+        const char *data = ed->line.data;
+
+        switch(key) {
+
+            // The terminal is gone.
+            case -1:
+                done = true;
+                break;
+
+            case '\r':
+            case '\n':
+                ed->pos = len;
+                utilshell_editor_refresh();
+                utilshell_write_all(STDOUT_FILENO, "\n", 1);
+                line = ed->line.data;
+                done = true;
+                break;
+
+            case 1: // Ctrl-A
+                ed->pos = 0;
+                break;
+
+            case 5: // Ctrl-E
+                ed->pos = len;
+                break;
+
+            case 2: // Ctrl-B
+                while(ed->pos > 0 && (data[--ed->pos] & 0xc0) == 0x80);
+                break;
+
+            case 6: // Ctrl-F
+                while(ed->pos < len && (data[++ed->pos] & 0xc0) == 0x80);
+                break;
+
+            case 127:
+            case 8: // Ctrl-H
+                while(pos > 0 && (data[--pos] & 0xc0) == 0x80);
+                utilshell_editor_erase(pos, ed->pos);
+                break;
+
+            case 4: // Ctrl-D
+                if(len == 0) {
+                    utilshell_write_all(STDOUT_FILENO, "\n", 1);
+                    done = true;
+                    break;
+                }
+                while(pos < len && (data[++pos] & 0xc0) == 0x80);
+                utilshell_editor_erase(ed->pos, pos);
+                break;
+
+            case 11: // Ctrl-K
+                utilshell_editor_erase(pos, len);
+                break;
+
+            case 21: // Ctrl-U
+                utilshell_editor_erase(0, pos);
+                break;
+
+            case 23: // Ctrl-W
+                while(pos > 0 && data[pos-1] == ' ')
+                    --pos;
+                while(pos > 0 && data[pos-1] != ' ')
+                    --pos;
+                utilshell_editor_erase(pos, ed->pos);
+                break;
+
+            case 12: // Ctrl-L
+                utilshell_write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+                utilshell_print_prompt();
+                ed->cursor_row = 0;
+                break;
+
+            case 3: // Ctrl-C
+                ed->pos = len;
+                utilshell_editor_refresh();
+                utilshell_write_all(STDOUT_FILENO, "^C\n", 3);
+                ed->line.len = 0;
+                ed->line.data[0] = '\0';
+                ed->pos = 0;
+                utilshell_pending.len = 0;
+                utilshell_last_status = 128 + SIGINT;
+                utilshell_print_prompt();
+                ed->cursor_row = 0;
+                break;
+
+            case '\t':
+                utilshell_complete(tab_failed);
+                break;
+
+            // Escape sequences of the cursor keys: ESC [ or ESC O, numbers separated by ;, and a final byte.
+            case 27: {
+                int next = utilshell_editor_key();
+                if(next != '[' && next != 'O')
+                    break;
+                int param = 0;
+                int final = utilshell_editor_key();
+                while((final >= '0' && final <= '9') || final == ';') {
+                    if(final == ';')
+                        param = -param - 1; // Only the first number matters.
+                    else if(param >= 0)
+                        param = param * 10 + final - '0';
+                    final = utilshell_editor_key();
+                }
+                if(param < 0)
+                    param = -param - 1;
+                if(final == 'C')
+                    while(ed->pos < len && (data[++ed->pos] & 0xc0) == 0x80);
+                else if(final == 'D')
+                    while(ed->pos > 0 && (data[--ed->pos] & 0xc0) == 0x80);
+                else if(final == 'H' || (final == '~' && (param == 1 || param == 7)))
+                    ed->pos = 0;
+                else if(final == 'F' || (final == '~' && (param == 4 || param == 8)))
+                    ed->pos = len;
+                else if(final == '~' && param == 3) {
+                    while(pos < len && (data[++pos] & 0xc0) == 0x80);
+                    utilshell_editor_erase(ed->pos, pos);
+                }
+                break;
+            }
+
+            default:
+                if(key >= ' ') {
+                    char c = key;
+                    utilshell_editor_insert(&c, 1);
+                }
+                break;
+
+        }
+
+        if(ed->pos != old_pos)
+            ed->dirty = true;
+
+    }
+
+    if(tcsetattr(STDIN_FILENO, TCSADRAIN, &utilshell_tmodes) == -1) {
+        int errsv = errno;
+        shell_error("Could not restore the terminal. errno:%d\n", errsv);
+    }
+
+    *buffer = (char*)line;
+    return EXIT_SUCCESS;
+
+}
+
+/* Returns the next key typed at the terminal (one byte of it), or -1 at the end of the input or on error. The line
+ * is drawn again before waiting for keys, so a paste is drawn once and not for every key in it.
+ */
+int utilshell_editor_key() {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+
+    while(ed->next_key == ed->num_keys) {
+        if(ed->dirty)
+            utilshell_editor_refresh();
+        ssize_t n = read(STDIN_FILENO, ed->keys, sizeof(ed->keys));
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            if(n == -1) {
+                int errsv = errno;
+                shell_error("Could not read input. errno:%d\n", errsv);
+            }
+            return -1;
+        }
+        ed->num_keys = n;
+        ed->next_key = 0;
+    }
+
+    return ed->keys[ed->next_key++];
+
+}
+
+/* Draws the line being edited again, after the last line of the prompt, and puts the cursor where it belongs. A line
+ * wider than the terminal goes on over several rows.
+ */
+void utilshell_editor_refresh() {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+    ed->dirty = false;
+
+    size_t len;
+    const char *prompt = utilshell_prompt_text(&len);
+    const char *last = (const char*)memrchr(prompt, '\n', len);
+    if(last != NULL) {
+        len -= last + 1 - prompt;
+        prompt = last + 1;
+    }
+
+    int columns = utilshell_terminal_columns();
+    int prompt_width = utilshell_text_width(prompt, len);
+    int cursor = prompt_width + utilshell_text_width(ed->line.data, ed->pos);
+    int end = prompt_width + utilshell_text_width(ed->line.data, ed->line.len);
+
+    struct utilshell_buf out = { NULL, 0, 0, NULL };
+    char move[32];
+
+    // Go back to the row the prompt ends on and draw everything from there.
+    if(ed->cursor_row > 0)
+        utilshell_buf_append(&out, move, snprintf(move, sizeof(move), "\x1b[%dA", ed->cursor_row));
+    utilshell_buf_append(&out, "\r", 1);
+    utilshell_buf_append(&out, prompt, len);
+    utilshell_buf_append(&out, ed->line.data, ed->line.len);
+    utilshell_buf_append(&out, "\x1b[J", 3);
+
+    // At the edge of the terminal the cursor stays in the last column. It has to be moved on to the next row.
+    if(end > 0 && end % columns == 0)
+        utilshell_buf_append(&out, "\r\n", 2);
+
+    int row = cursor / columns;
+    if(end / columns > row)
+        utilshell_buf_append(&out, move, snprintf(move, sizeof(move), "\x1b[%dA", end / columns - row));
+    utilshell_buf_append(&out, "\r", 1);
+    if(cursor % columns > 0)
+        utilshell_buf_append(&out, move, snprintf(move, sizeof(move), "\x1b[%dC", cursor % columns));
+    ed->cursor_row = row;
+
+    if(out.data != NULL)
+        utilshell_write_all(STDOUT_FILENO, out.data, out.len);
+    free(out.data);
+
+}
+
+// Inserts text at the cursor of the line being edited and moves the cursor behind it.
+void utilshell_editor_insert(const char *s, size_t n) {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+    size_t tail = ed->line.len - ed->pos;
+
+    if(utilshell_buf_append(&ed->line, s, n) != EXIT_SUCCESS)
+        return;
+    memmove(ed->line.data + ed->pos + n, ed->line.data + ed->pos, tail);
+    memcpy(ed->line.data + ed->pos, s, n);
+    ed->pos += n;
+    ed->dirty = true;
+
+}
+
+// Deletes the bytes from from up to to from the line being edited.
+void utilshell_editor_erase(size_t from, size_t to) {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+    if(from >= to)
+        return;
+
+    memmove(ed->line.data + from, ed->line.data + to, ed->line.len - to + 1);
+    ed->line.len -= to - from;
+    if(ed->pos >= to)
+        ed->pos -= to - from;
+    else if(ed->pos > from)
+        ed->pos = from;
+    ed->dirty = true;
+
+}
+
+/* Returns the number of columns that text takes up on the terminal. Escape sequences (eg. colors) take none, and a
+ * UTF-8 character takes one.
+ */
+int utilshell_text_width(const char *s, size_t n) {
+
+    const unsigned char *text = (const unsigned char*)s;
+    int width = 0;
+
+    for(size_t i = 0; i < n; ++i) {
+        if(text[i] == 0x1b) {
+            // A CSI sequence (ESC [) ends with a byte from @ to ~.
+            if(i + 1 < n && text[i+1] == '[') {
+                i += 2;
+                while(i < n && (text[i] < 0x40 || text[i] > 0x7e))
+                    ++i;
+            } else {
+                ++i;
+            }
+        } else if(text[i] >= ' ' && (text[i] & 0xc0) != 0x80) {
+            ++width;
+        }
+    }
+
+    return width;
+
+}
+
+// Returns the width of the terminal in columns (80 if it is not known).
+int utilshell_terminal_columns() {
+
+    struct winsize size;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0)
+        return 80;
+    return size.ws_col;
+
+}
+
+/* Completes the word before the cursor. The first word of a command is completed from the builtins and the
+ * executables in $PATH (see utilshell_commands_refresh()), any other word, or a word with a / in it, from the names
+ * in its directory (see utilshell_listing_get()). A single completion is filled in completely, several as far as they
+ * agree. If they do not agree on anything more, the Tab after that (again is true) lists them.
+ */
+void utilshell_complete(bool again) {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+    const char *line = ed->line.data;
+
+    if(utilshell_complete_arena == NULL && (utilshell_complete_arena = utilshell_arena_create()) == NULL)
+        return;
+    struct utilshell_arena *arena = utilshell_complete_arena;
+    utilshell_arena_reset(arena);
+    struct utilshell_completions completions = { NULL, 0, 0, arena };
+
+    // Find the start of the word. A character after a backslash belongs to it.
+    const char *separators = " \t\n;|&<>()";
+    size_t start = ed->pos;
+    while(start > 0 && (strchr(separators, line[start-1]) == NULL || (start >= 2 && line[start-2] == '\\')))
+        --start;
+
+    // Take the word as it will be expanded: without its opening quote and the backslashes.
+    char quote = '\0';
+    size_t from = start;
+    if(from < ed->pos && (line[from] == '\'' || line[from] == '"'))
+        quote = line[from++];
+    struct utilshell_buf word = { NULL, 0, 0, arena };
+    utilshell_buf_append(&word, "", 0);
+    for(size_t i = from; i < ed->pos; ++i) {
+        if(line[i] == '\\' && quote == '\0' && i + 1 < ed->pos)
+            ++i;
+        utilshell_buf_append(&word, line + i, 1);
+    }
+    if(word.data == NULL)
+        return;
+
+    // Commands are completed for the first word of a command, which may follow a keyword.
+    bool command = strchr(word.data, '/') == NULL;
+    size_t end = start;
+    while(end > 0 && (line[end-1] == ' ' || line[end-1] == '\t'))
+        --end;
+    if(command && end > 0 && strchr(";|&(\n", line[end-1]) == NULL) {
+        const char *keywords[] = { "if", "then", "else", "elif", "while", "until", "do", "time", "!", NULL };
+        size_t begin = end;
+        while(begin > 0 && strchr(separators, line[begin-1]) == NULL)
+            --begin;
+        command = false;
+        for(int i = 0; keywords[i] != NULL; ++i) {
+            if(strlen(keywords[i]) == end - begin && strncmp(line + begin, keywords[i], end - begin) == 0)
+                command = true;
+        }
+    }
+
+    const char *base; // The part of the word that the completions start with.
+    size_t base_len;
+
+    if(command) {
+
+        base = word.data;
+        base_len = word.len;
+        for(int i = 0; i < UTILSHELL_NUM_BUILTINS; ++i) {
+            const char *name = utilshell_builtins[i].name;
+            if(strncmp(name, base, base_len) == 0)
+                utilshell_complete_add(&completions, name, strlen(name), false);
+        }
+
+        // Walk down the trie along the word. Every command below that node completes it.
+        if(utilshell_commands_refresh() == EXIT_SUCCESS) {
+            struct utilshell_trie *node = utilshell_commands;
+            for(size_t i = 0; i < base_len && node != NULL; ++i) {
+                node = node->child;
+                while(node != NULL && node->c != base[i])
+                    node = node->sibling;
+            }
+            struct utilshell_buf name = { NULL, 0, 0, arena };
+            if(node != NULL && utilshell_buf_append(&name, base, base_len) == EXIT_SUCCESS)
+                utilshell_trie_collect(node, &name, &completions);
+        }
+
+    } else {
+
+        const char *slash = strrchr(word.data, '/');
+        base = slash != NULL ? slash + 1 : word.data;
+        base_len = word.data + word.len - base;
+
+        // The directory of the word, where ~/ stands for the home directory.
+        struct utilshell_buf dir = { NULL, 0, 0, arena };
+        if(slash == NULL)
+            utilshell_buf_append(&dir, ".", 1);
+        else if(strncmp(word.data, "~/", 2) == 0 && utilshell_home != NULL) {
+            utilshell_buf_append(&dir, utilshell_home, strlen(utilshell_home));
+            utilshell_buf_append(&dir, word.data + 1, slash - word.data);
+        } else
+            utilshell_buf_append(&dir, word.data, slash + 1 - word.data);
+
+        struct utilshell_listing *listing = dir.data != NULL ? utilshell_listing_get(dir.data) : NULL;
+        if(listing != NULL) {
+
+            // The names that start with base are next to each other. Find the first one with a binary search.
+            int low = 0;
+            int high = listing->num_entries;
+            while(low < high) {
+                int middle = low + (high - low) / 2;
+                if(strcmp(listing->entries[middle].name, base) < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+
+            // Types that readdir() did not give are looked up with stat() (links are followed), a limited number per Tab.
+            int lookups = UTILSHELL_COMPLETE_LOOKUPS;
+            struct utilshell_buf path = { NULL, 0, 0, arena };
+            for(int i = low; i < listing->num_entries && strncmp(listing->entries[i].name, base, base_len) == 0; ++i) {
+                struct utilshell_dirent *entry = listing->entries + i;
+                // Hidden files only complete a word that starts with a dot.
+                if(entry->name[0] == '.' && base[0] != '.')
+                    continue;
+                if(entry->type == DT_UNKNOWN && lookups > 0) {
+                    --lookups;
+                    struct stat st;
+                    path.len = 0;
+                    utilshell_buf_append(&path, dir.data, dir.len);
+                    utilshell_buf_append(&path, "/", 1);
+                    utilshell_buf_append(&path, entry->name, strlen(entry->name));
+                    if(path.data != NULL && stat(path.data, &st) == 0)
+                        entry->type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+                }
+                utilshell_complete_add(&completions, entry->name, strlen(entry->name), entry->type == DT_DIR);
+            }
+
+        }
+
+    }
+
+    if(completions.num == 0) {
+        utilshell_write_all(STDOUT_FILENO, "\a", 1);
+        ed->tab_failed = true;
+        return;
+    }
+
+    // Builtins can be in $PATH too.
+    qsort(completions.names, completions.num, sizeof(char*), utilshell_string_compare);
+    int num = 1;
+    for(int i = 1; i < completions.num; ++i) {
+        if(strcmp(completions.names[i], completions.names[num-1]) != 0)
+            completions.names[num++] = completions.names[i];
+    }
+    completions.num = num;
+
+    // How far the completions agree.
+    const char *first = completions.names[0];
+    size_t common = strlen(first);
+    for(int i = 1; i < completions.num; ++i) {
+        size_t k = 0;
+        while(k < common && completions.names[i][k] == first[k])
+            ++k;
+        common = k;
+    }
+
+    if(common == base_len && completions.num > 1) {
+        if(again)
+            utilshell_complete_list(&completions);
+        else {
+            utilshell_write_all(STDOUT_FILENO, "\a", 1);
+            ed->tab_failed = true;
+        }
+        return;
+    }
+
+    // Insert the rest, with a backslash in front of anything the shell would take apart (unless it is quoted).
+    struct utilshell_buf insert = { NULL, 0, 0, arena };
+    for(size_t i = base_len; i < common; ++i) {
+        if(quote == '\0' && strchr(" \t\\'\"|&;<>()$`*?[]{}#~!", first[i]) != NULL)
+            utilshell_buf_append(&insert, "\\", 1);
+        utilshell_buf_append(&insert, first + i, 1);
+    }
+
+    // A single completion is finished off, unless it is a directory that the next Tab can go into.
+    if(completions.num == 1 && first[common-1] != '/') {
+        if(quote != '\0')
+            utilshell_buf_append(&insert, &quote, 1);
+        utilshell_buf_append(&insert, " ", 1);
+    }
+
+    if(insert.data != NULL)
+        utilshell_editor_insert(insert.data, insert.len);
+
+}
+
+// Adds a completion (with a / at the end if it is a directory). Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_complete_add(struct utilshell_completions *completions, const char *name, size_t n, bool dir) {
+
+    if(completions->num == completions->cap) {
+        int new_cap = completions->cap == 0 ? 64 : completions->cap * 2;
+        char **names = (char**)utilshell_arena_realloc(completions->arena, completions->names,
+            completions->cap*sizeof(char*), new_cap*sizeof(char*));
+        if(names == NULL)
+            return EXIT_FAILURE;
+        completions->names = names;
+        completions->cap = new_cap;
+    }
+
+    char *copy = (char*)utilshell_arena_alloc(completions->arena, n + 2);
+    if(copy == NULL)
+        return EXIT_FAILURE;
+    memcpy(copy, name, n);
+    if(dir)
+        copy[n++] = '/';
+    copy[n] = '\0';
+
+    completions->names[completions->num++] = copy;
+    return EXIT_SUCCESS;
+
+}
+
+/* Lists completions in columns below the line being edited (at most UTILSHELL_COMPLETE_LISTED of them), and draws the
+ * prompt and the line again below the list.
+ */
+void utilshell_complete_list(struct utilshell_completions *completions) {
+
+    struct utilshell_editor *ed = &utilshell_editor;
+
+    // Start below the end of the line.
+    size_t pos = ed->pos;
+    ed->pos = ed->line.len;
+    utilshell_editor_refresh();
+    ed->pos = pos;
+
+    int num = completions->num < UTILSHELL_COMPLETE_LISTED ? completions->num : UTILSHELL_COMPLETE_LISTED;
+    int width = 0;
+    for(int i = 0; i < num; ++i) {
+        int name_width = utilshell_text_width(completions->names[i], strlen(completions->names[i]));
+        if(name_width > width)
+            width = name_width;
+    }
+    width += 2;
+    int per_row = utilshell_terminal_columns() / width;
+    if(per_row < 1)
+        per_row = 1;
+    int rows = (num + per_row - 1) / per_row;
+
+    // The names go down the columns, like ls lists them.
+    struct utilshell_buf out = { NULL, 0, 0, completions->arena };
+    utilshell_buf_append(&out, "\n", 1);
+    for(int row = 0; row < rows; ++row) {
+        for(int column = 0; column < per_row; ++column) {
+            int i = column * rows + row;
+            if(i >= num)
+                break;
+            const char *name = completions->names[i];
+            size_t len = strlen(name);
+            utilshell_buf_append(&out, name, len);
+            if(column + 1 < per_row && i + rows < num) {
+                for(int pad = utilshell_text_width(name, len); pad < width; ++pad)
+                    utilshell_buf_append(&out, " ", 1);
+            }
+        }
+        utilshell_buf_append(&out, "\n", 1);
+    }
+    if(completions->num > num) {
+        char more[64];
+        utilshell_buf_append(&out, more, snprintf(more, sizeof(more), "(%d more)\n", completions->num - num));
+    }
+    if(out.data != NULL)
+        utilshell_write_all(STDOUT_FILENO, out.data, out.len);
+
+    utilshell_print_prompt();
+    ed->cursor_row = 0;
+    ed->dirty = true;
+
+}
+
+/* Makes sure that the trie in utilshell_commands lists the executables in $PATH. It is built again if $PATH or the
+ * mtime of one of its directories has changed since it was last built (so a command that was installed or removed is
+ * seen on the next Tab). Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_commands_refresh() {
+
+    const char *path = utilshell_var_get("PATH");
+    if(path == NULL)
+        path = "/usr/local/bin:/usr/bin:/bin";
+
+    // Split $PATH and look up the mtimes of its directories. An empty entry means the current directory.
+    int num_dirs = 1;
+    for(const char *p = path; *p != '\0'; ++p)
+        num_dirs += *p == ':';
+    char **dirs = (char**)utilshell_arena_alloc(utilshell_complete_arena, num_dirs*sizeof(char*));
+    struct timespec *mtimes = (struct timespec*)utilshell_arena_alloc(utilshell_complete_arena, num_dirs*sizeof(struct timespec));
+    if(dirs == NULL || mtimes == NULL)
+        return EXIT_FAILURE;
+
+    const char *p = path;
+    for(int i = 0; i < num_dirs; ++i) {
+        const char *end = strchrnul(p, ':');
+        dirs[i] = end > p ? utilshell_arena_strndup(utilshell_complete_arena, p, end - p) : (char*)".";
+        if(dirs[i] == NULL)
+            return EXIT_FAILURE;
+        struct stat st;
+        if(stat(dirs[i], &st) == 0)
+            mtimes[i] = st.st_mtim;
+        else
+            memset(&mtimes[i], 0, sizeof(mtimes[i]));
+        p = *end == ':' ? end + 1 : end;
+    }
+
+    bool current = utilshell_commands != NULL && strcmp(path, utilshell_commands_path) == 0 &&
+        num_dirs == utilshell_commands_dirs;
+    for(int i = 0; current && i < num_dirs; ++i) {
+        current = mtimes[i].tv_sec == utilshell_commands_mtimes[i].tv_sec &&
+            mtimes[i].tv_nsec == utilshell_commands_mtimes[i].tv_nsec;
+    }
+    if(current)
+        return EXIT_SUCCESS;
+
+    // Build the trie again. The mtimes were taken before reading, so a change while reading is seen next time.
+    char *saved_path = strdup(path);
+    struct timespec *saved_mtimes = (struct timespec*)realloc(utilshell_commands_mtimes, num_dirs*sizeof(struct timespec));
+    if(saved_mtimes != NULL)
+        utilshell_commands_mtimes = saved_mtimes;
+    if(saved_path == NULL || saved_mtimes == NULL ||
+        (utilshell_commands_arena == NULL && (utilshell_commands_arena = utilshell_arena_create()) == NULL)) {
+        free(saved_path);
+        return EXIT_FAILURE;
+    }
+    utilshell_arena_reset(utilshell_commands_arena);
+    utilshell_commands = (struct utilshell_trie*)utilshell_arena_alloc(utilshell_commands_arena, sizeof(struct utilshell_trie));
+    if(utilshell_commands == NULL) {
+        free(saved_path);
+        return EXIT_FAILURE;
+    }
+    memset(utilshell_commands, 0, sizeof(struct utilshell_trie));
+
+    for(int i = 0; i < num_dirs; ++i) {
+
+        DIR *dir = opendir(dirs[i]);
+        if(dir == NULL)
+            continue;
+
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL) {
+            if(entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                continue;
+            // Only executable files are commands (links are followed).
+            struct stat st;
+            if(fstatat(dirfd(dir), entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode) || (st.st_mode & 0111) == 0)
+                continue;
+            if(utilshell_trie_add(entry->d_name) != EXIT_SUCCESS) {
+                closedir(dir);
+                utilshell_commands = NULL;
+                free(saved_path);
+                return EXIT_FAILURE;
+            }
+        }
+
+        closedir(dir);
+
+    }
+
+    free(utilshell_commands_path);
+    utilshell_commands_path = saved_path;
+    memcpy(utilshell_commands_mtimes, mtimes, num_dirs*sizeof(struct timespec));
+    utilshell_commands_dirs = num_dirs;
+    return EXIT_SUCCESS;
+
+}
+
+// Adds a command name to the trie in utilshell_commands. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_trie_add(const char *name) {
+
+    struct utilshell_trie *node = utilshell_commands;
+
+    for(const char *p = name; *p != '\0'; ++p) {
+
+        // Children are kept sorted, so that completions come out in order.
+        struct utilshell_trie **link = &node->child;
+        while(*link != NULL && (unsigned char)(*link)->c < (unsigned char)*p)
+            link = &(*link)->sibling;
+
+        if(*link == NULL || (*link)->c != *p) {
+            struct utilshell_trie *child = (struct utilshell_trie*)utilshell_arena_alloc(utilshell_commands_arena, sizeof(struct utilshell_trie));
+            if(child == NULL)
+                return EXIT_FAILURE;
+            child->child = NULL;
+            child->sibling = *link;
+            child->c = *p;
+            child->terminal = false;
+            *link = child;
+        }
+
+        node = *link;
+
+    }
+
+    node->terminal = true;
+    return EXIT_SUCCESS;
+
+}
+
+/* Adds every command in the trie below node to completions. name holds the characters from the root to node.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_trie_collect(struct utilshell_trie *node, struct utilshell_buf *name, struct utilshell_completions *completions) {
+
+    if(node->terminal && utilshell_complete_add(completions, name->data, name->len, false) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    for(struct utilshell_trie *child = node->child; child != NULL; child = child->sibling) {
+        if(utilshell_buf_append(name, &child->c, 1) != EXIT_SUCCESS ||
+            utilshell_trie_collect(child, name, completions) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        --name->len;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Returns the listing of a directory from utilshell_listings. The directory is only read if it has no listing yet, or
+ * if its mtime changed since it was read. Returns NULL if it cannot be read.
+ */
+struct utilshell_listing *utilshell_listing_get(const char *path) {
+
+    struct stat st;
+    if(stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    // Find the listing of the directory, or else the least recently used one to replace.
+    struct utilshell_listing *listing = NULL;
+    struct utilshell_listing *oldest = &utilshell_listings[0];
+    for(int i = 0; i < UTILSHELL_LISTINGS && listing == NULL; ++i) {
+        struct utilshell_listing *slot = &utilshell_listings[i];
+        if(slot->arena != NULL && slot->dev == st.st_dev && slot->ino == st.st_ino)
+            listing = slot;
+        else if(slot->used < oldest->used)
+            oldest = slot;
+    }
+
+    if(listing != NULL && listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        listing->used = ++utilshell_listing_clock;
+        return listing;
+    }
+    if(listing == NULL)
+        listing = oldest;
+
+    // Read the directory (again). The mtime was taken before reading, so a change while reading is seen next time.
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+        return NULL;
+    if(listing->arena == NULL && (listing->arena = utilshell_arena_create()) == NULL) {
+        closedir(dir);
+        return NULL;
+    }
+    utilshell_arena_reset(listing->arena);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->entries = NULL;
+    listing->num_entries = 0;
+    listing->used = ++utilshell_listing_clock;
+
+    int cap = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if(listing->num_entries == cap) {
+            int new_cap = cap == 0 ? 256 : cap * 2;
+            struct utilshell_dirent *entries = (struct utilshell_dirent*)utilshell_arena_realloc(listing->arena,
+                listing->entries, cap*sizeof(struct utilshell_dirent), new_cap*sizeof(struct utilshell_dirent));
+            if(entries == NULL) {
+                closedir(dir);
+                listing->dev = 0;
+                listing->ino = 0;
+                return NULL;
+            }
+            listing->entries = entries;
+            cap = new_cap;
+        }
+
+        struct utilshell_dirent *dirent = listing->entries + listing->num_entries;
+        dirent->name = utilshell_arena_strndup(listing->arena, entry->d_name, strlen(entry->d_name));
+        if(dirent->name == NULL) {
+            closedir(dir);
+            listing->dev = 0;
+            listing->ino = 0;
+            return NULL;
+        }
+        // Links are looked up when they complete something, to see if they point to a directory.
+        dirent->type = entry->d_type == DT_LNK ? (unsigned char)DT_UNKNOWN : entry->d_type;
+        ++listing->num_entries;
+
+    }
+    closedir(dir);
+
+    qsort(listing->entries, listing->num_entries, sizeof(struct utilshell_dirent), utilshell_dirent_compare);
+    return listing;
+
+}
+
+// Orders strings (given as char**) for qsort().
+int utilshell_string_compare(const void *a, const void *b) {
+
+    return strcmp(*(char* const*)a, *(char* const*)b);
+
+}
+
+// Orders directory entries by name for qsort().
+int utilshell_dirent_compare(const void *a, const void *b) {
+
+    return strcmp(((const struct utilshell_dirent*)a)->name, ((const struct utilshell_dirent*)b)->name);
+
+}
+
+
+/* Retrieves the next line from a reader. *buffer is set to the line without its newline (valid until the next call),
+ * or to NULL at the end of the input. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_reader_line(struct utilshell_reader *in, char **buffer) {
+
+    const size_t BLOCK_LEN = 65536;
+
+    *buffer = NULL;
+
+    while(true) {
+
+        // Hand out the next complete line if there is one.
+        char *newline = (char*)memchr(in->data + in->start, '\n', in->end - in->start);
+        if(newline != NULL) {
+            *newline = '\0';
+            *buffer = in->data + in->start;
+            in->start = newline - in->data + 1;
+            return EXIT_SUCCESS;
+        }
+
+        // The last line of the input does not need a newline.
+        if(in->eof) {
+            if(in->start == in->end)
+                return EXIT_SUCCESS;
+            in->data[in->end] = '\0';
+            *buffer = in->data + in->start;
+            in->start = in->end;
+            return EXIT_SUCCESS;
+        }
+
+        // Move the partial line to the front of the buffer and make room for another block.
+        if(in->start > 0) {
+            memmove(in->data, in->data + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        if(in->end + BLOCK_LEN + 1 > in->cap) {
+            size_t new_cap = in->cap == 0 ? BLOCK_LEN + 1 : in->cap * 2;
+            while(in->end + BLOCK_LEN + 1 > new_cap)
+                new_cap *= 2;
+            char *new_data = (char*)realloc(in->data, new_cap);
+            if(new_data == NULL) {
+                shell_error("Could not grow input buffer to %zu bytes.\n", new_cap);
+                return EXIT_FAILURE;
+            }
+            in->data = new_data;
+            in->cap = new_cap;
+        }
+
+        ssize_t n = read(in->fd, in->data + in->end, BLOCK_LEN);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            int errsv = errno;
+            shell_error("Could not read input. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        if(n == 0)
+            in->eof = true;
+        in->end += n;
+
+    }
+
+}
+
+/* Rewinds stdin to the end of the current line before commands are started, so that a command reading stdin sees the
+ * rest of the input instead of the block the shell has buffered. Only possible if stdin is seekable.
+ */
+void utilshell_input_release() {
+
+    struct utilshell_reader *in = &utilshell_input;
+
+    if(!in->seekable || in->released_at != -1)
+        return;
+
+    in->released_at = lseek(in->fd, -(off_t)(in->end - in->start), SEEK_CUR);
+
+}
+
+/* Undoes utilshell_input_release() once the commands have finished. If no command moved the offset, the buffered
+ * input is still valid and the offset is restored. Otherwise the buffer is dropped and reading continues from
+ * wherever the commands left stdin.
+ */
+void utilshell_input_reclaim() {
+
+    struct utilshell_reader *in = &utilshell_input;
+
+    if(in->released_at == -1)
+        return;
+
+    if(lseek(in->fd, 0, SEEK_CUR) == in->released_at) {
+        lseek(in->fd, in->end - in->start, SEEK_CUR);
+    } else {
+        in->start = in->end;
+        in->eof = false;
+    }
+    in->released_at = -1;
+
+}
+
+// Creates an empty arena. Returns NULL on error.
+struct utilshell_arena *utilshell_arena_create() {
+
+    struct utilshell_arena *arena = (struct utilshell_arena*)calloc(1, sizeof(struct utilshell_arena));
+    if(arena == NULL)
+        shell_error("Could not allocate arena.\n");
+    return arena;
+
+}
+
+/* Allocates size bytes (aligned to 16 bytes) from an arena. A new block is added when the current one is full; it
+ * is at least twice as large as the previous one. Returns NULL on error.
+ */
+void *utilshell_arena_alloc(struct utilshell_arena *arena, size_t size) {
+
+    const size_t ALIGN = 16;
+    const size_t HEADER = (sizeof(struct utilshell_arena_block) + ALIGN - 1) & ~(ALIGN - 1);
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+
+    struct utilshell_arena_block *block = arena->head;
+
+    if(block == NULL || block->used + size > block->size) {
+
+        size_t block_size = block == NULL ? 4096 : block->size * 2;
+        while(block_size < size)
+            block_size *= 2;
+
+        block = (struct utilshell_arena_block*)malloc(HEADER + block_size);
+        if(block == NULL) {
+            shell_error("Could not grow arena by %zu bytes.\n", block_size);
+            return NULL;
+        }
+        ++utilshell_heap_allocs;
+
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+        arena->total += block_size;
+
+    }
+
+    void *result = (char*)block + HEADER + block->used;
+    block->used += size;
+    arena->last = result;
+    ++utilshell_arena_allocs;
+
+    return result;
+
+}
+
+/* Grows an allocation of an arena from old_size to new_size bytes. The most recent allocation is grown in place if
+ * there is room, anything else is copied to a new allocation (the old space is reclaimed when the arena is reset).
+ * Returns NULL on error.
+ */
+void *utilshell_arena_realloc(struct utilshell_arena *arena, void *ptr, size_t old_size, size_t new_size) {
+
+    if(ptr == NULL)
+        return utilshell_arena_alloc(arena, new_size);
+
+    const size_t ALIGN = 16;
+    const size_t HEADER = (sizeof(struct utilshell_arena_block) + ALIGN - 1) & ~(ALIGN - 1);
+    struct utilshell_arena_block *block = arena->head;
+
+    if(ptr == arena->last) {
+        size_t offset = (char*)ptr - ((char*)block + HEADER);
+        size_t aligned = (new_size + ALIGN - 1) & ~(ALIGN - 1);
+        if(offset + aligned <= block->size) {
+            block->used = offset + aligned;
+            return ptr;
+        }
+    }
+
+    void *result = utilshell_arena_alloc(arena, new_size);
+    if(result != NULL)
+        memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    return result;
+
+}
+
+// Copies n bytes of a string into an arena and NULL-terminates the copy. Returns NULL on error.
+char *utilshell_arena_strndup(struct utilshell_arena *arena, const char *s, size_t n) {
+
+    char *result = (char*)utilshell_arena_alloc(arena, n + 1);
+    if(result != NULL) {
+        memcpy(result, s, n);
+        result[n] = '\0';
+    }
+    return result;
+
+}
+
+/* Frees everything allocated from an arena in one step. If the arena had to grow over several blocks, they are
+ * replaced by a single block large enough for all of them, so the next line of the same size does not call malloc().
+ */
+void utilshell_arena_reset(struct utilshell_arena *arena) {
+
+    struct utilshell_arena_block *block = arena->head;
+
+    if(block != NULL && block->next != NULL) {
+
+        const size_t ALIGN = 16;
+        const size_t HEADER = (sizeof(struct utilshell_arena_block) + ALIGN - 1) & ~(ALIGN - 1);
+
+        while(block != NULL) {
+            struct utilshell_arena_block *next = block->next;
+            free(block);
+            block = next;
+        }
+
+        arena->head = (struct utilshell_arena_block*)malloc(HEADER + arena->total);
+        if(arena->head != NULL) {
+            arena->head->next = NULL;
+            arena->head->size = arena->total;
+        } else {
+            arena->total = 0;
+        }
+
+    }
+
+    if(arena->head != NULL)
+        arena->head->used = 0;
+    arena->last = NULL;
+
+}
+
+// Frees an arena and all of its blocks.
+void utilshell_arena_destroy(struct utilshell_arena *arena) {
+
+    struct utilshell_arena_block *block = arena->head;
+    while(block != NULL) {
+        struct utilshell_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+
+}
+
+// Returns the arena that owns a token list created by shell_tokenize(). It is stored in a hidden slot before the list.
+struct utilshell_arena *utilshell_tokens_arena(char **tokens) {
+
+    return (struct utilshell_arena*)tokens[-1];
+
+}
+
+// Returns the commands parsed by shell_tokenize() for a token list (NULL if there is nothing to run).
+struct utilshell_node *utilshell_tokens_root(char **tokens) {
+
+    return (struct utilshell_node*)tokens[-2];
+
+}
+
+/* Creates an empty list that utilshell_expand() can append words to, with room for max_tokens of them. The list
+ * lives in the given arena, which is stored in a hidden slot in front of it like for shell_tokenize().
+ * Returns NULL on error.
+ */
+char **utilshell_tokens_create(struct utilshell_arena *arena, int max_tokens) {
+
+    char **list = (char**)utilshell_arena_alloc(arena, (max_tokens+2)*sizeof(char*));
+    if(list == NULL)
+        return NULL;
+    list[0] = (char*)arena;
+    ++list;
+    list[0] = NULL;
+    return list;
+
+}
+
+/* Splits buffer into tokens allocated from arena (see shell_tokenize()). *escape is set if the buffer ends in the middle
+ * of a backslash escape. Returns UTILSHELL_PARSE_OK on success, UTILSHELL_PARSE_INCOMPLETE if a quote, escape or
+ * process substitution is left open, UTILSHELL_PARSE_ERROR on error.
+ */
+int utilshell_lex(struct utilshell_arena *arena, const char *buffer, struct utilshell_token **result_tokens, int *result_num_tokens, bool *escape) {
+
+    int num_tokens = 0; // This is the current number of tokens in the list.
+    int max_tokens = 0; // This is the number of tokens that can be used before reallocating the list.
+    struct utilshell_token *tokens = NULL;
+    bool unclosed = false; // True if a process substitution or here-document is not closed by the end of the buffer.
+    int heredocs = 0;      // The first token that may start a here-document whose body has not been read yet.
+
+    // Tokenizing will be achived using a simple state machine. These are the states.
+    const int NORMAL = 0;
+    const int READING_QUOTE = 1;
+    const int READING_ESCAPE = 2;
+    const int READING_ESCAPE_IN_QUOTE = 3;
+    const int READING_SINGLE_QUOTE = 4;
+
+    // The state should begin and end at NORMAL. If it is not NORMAL after tokenizing, the input is incomplete.
+    int state = NORMAL;
+
+    /* Without a classification (UTILSHELL_LEX_BYTES, or a line shorter than a block, where it would not pay off),
+     * utilshell_lex_next() does not skip anything.
+     */
+    int n = (int)strlen(buffer);
+    struct utilshell_lex_bits bits = { buffer, n, utilshell_lex_level, 0, NULL, NULL };
+    if(utilshell_lex_level != UTILSHELL_LEX_BYTES && n >= 64) {
+        size_t words = (n + 63) / 64;
+        bits.stops = (uint64_t*)utilshell_arena_alloc(arena, 2 * words * sizeof(uint64_t));
+        if(bits.stops == NULL)
+            return UTILSHELL_PARSE_ERROR;
+        bits.quotes = bits.stops + words;
+    }
+    const uint64_t *stops = bits.stops;
+    const uint64_t *quotes = bits.quotes;
+
+    /* This is the index of the current word being read, or -1 between words. Once the end of the word is found,
+     * everything from this point up to the current point is added to the token list.
+     */
+    int current_token_index = -1;
+
+    // Iterate through the whole string using a simple state machine.
+    int i;
+    int result = EXIT_SUCCESS;
+    for(i = 0; buffer[i] != '\0' && result == EXIT_SUCCESS && !unclosed; ++i) {
+
+        switch(state) {
+
+            case NORMAL:
+
+            enum utilshell_token_type type;
+            int len;
+            switch(buffer[i]) {
+
+                case '|':
+                case '>':
+                case '<':
+                case '&':
+                case ';':
+                case '\n':
+
+                // <(cmd) and >(cmd) are process substitutions. They are words, made of everything up to the ).
+                if((buffer[i] == '<' || buffer[i] == '>') && buffer[i+1] == '(') {
+                    if(current_token_index != -1)
+                        result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, UTILSHELL_TOKEN_WORD, buffer+current_token_index, i - current_token_index);
+                    current_token_index = -1;
+                    int end = utilshell_lex_paren(buffer, i + 1);
+                    if(end == -1)
+                        unclosed = true;
+                    else if(result == EXIT_SUCCESS)
+                        result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, UTILSHELL_TOKEN_WORD, buffer+i, end - i + 1);
+                    if(end != -1)
+                        i = end;
+                    break;
+                }
+
+                // We have found a special symbol!
+                len = 1;
+                if(buffer[i] == '|' && buffer[i+1] == '|') {
+                    type = UTILSHELL_TOKEN_OR;
+                    len = 2;
+                } else if(buffer[i] == '|') {
+                    type = UTILSHELL_TOKEN_PIPE;
+                } else if(buffer[i] == '<' && buffer[i+1] == '<') {
+                    type = buffer[i+2] == '<' ? UTILSHELL_TOKEN_HERESTRING : UTILSHELL_TOKEN_HEREDOC;
+                    len = buffer[i+2] == '<' || buffer[i+2] == '-' ? 3 : 2;
+                } else if(buffer[i] == '<') {
+                    type = UTILSHELL_TOKEN_REDIR_IN;
+                } else if(buffer[i] == '&' && buffer[i+1] == '&') {
+                    type = UTILSHELL_TOKEN_AND;
+                    len = 2;
+                } else if(buffer[i] == '&') {
+                    type = UTILSHELL_TOKEN_BACKGROUND;
+                } else if(buffer[i] == ';') {
+                    type = UTILSHELL_TOKEN_SEMICOLON;
+                } else if(buffer[i] == '\n') {
+                    type = UTILSHELL_TOKEN_NEWLINE;
+                } else if(buffer[i+1] == '>') {
+                    type = UTILSHELL_TOKEN_REDIR_APP;
+                    len = 2;
+                } else if(i > 0 && current_token_index == i - 1 && buffer[current_token_index] == '2') {
+                    // A lone 2 right in front of > is part of the redirect, not a word.
+                    type = UTILSHELL_TOKEN_REDIR_ERR;
+                    current_token_index = -1;
+                } else {
+                    type = UTILSHELL_TOKEN_REDIR_OUT;
+                }
+
+                // If a word was being read, then add it.
+                if(current_token_index != -1)
+                    result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, UTILSHELL_TOKEN_WORD, buffer+current_token_index, i - current_token_index);
+                current_token_index = -1;
+
+                // Add the symbol to the token list.
+                if(result == EXIT_SUCCESS && type == UTILSHELL_TOKEN_REDIR_ERR)
+                    result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, type, buffer+i-1, 2);
+                else if(result == EXIT_SUCCESS)
+                    result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, type, buffer+i, len);
+                i += len - 1;
+
+                // The here-documents of the line start on the next one.
+                if(result == EXIT_SUCCESS && type == UTILSHELL_TOKEN_NEWLINE) {
+                    int status = utilshell_lex_heredocs(arena, buffer, &i, tokens, heredocs, num_tokens);
+                    heredocs = num_tokens;
+                    if(status == UTILSHELL_PARSE_INCOMPLETE)
+                        unclosed = true;
+                    else if(status != UTILSHELL_PARSE_OK)
+                        result = EXIT_FAILURE;
+                }
+                break;
+
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\v':
+                case '\f':
+
+                // Whitespace ends the current word.
+                if(current_token_index != -1)
+                    result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, UTILSHELL_TOKEN_WORD, buffer+current_token_index, i - current_token_index);
+                current_token_index = -1;
+                break;
+
+                case '\\':
+                if(current_token_index == -1)
+                    current_token_index = i;
+                state = READING_ESCAPE;
+                break;
+
+                case '\"':
+                if(current_token_index == -1)
+                    current_token_index = i;
+                state = READING_QUOTE;
+                break;
+
+                case '\'':
+                if(current_token_index == -1)
+                    current_token_index = i;
+                state = READING_SINGLE_QUOTE;
+                break;
+
+                case '#':
+                // A # that starts a word starts a comment (eg. a #! line), which runs up to the end of the line.
+                if(current_token_index == -1) {
+                    while(buffer[i+1] != '\0' && buffer[i+1] != '\n')
+                        ++i;
+                    break;
+                }
+                // Inside a word it is part of the word.
+                // falls through
+                default:
+                if(current_token_index == -1)
+                    current_token_index = i;
+                // The rest of the word, up to the next byte that ends it or needs a look, is skipped at once.
+                i = utilshell_lex_next(&bits, stops, i + 1) - 1;
+                break;
+            }
+            break;
+
+            case READING_SINGLE_QUOTE:
+            // Only a quote ends it. Other quotes and backslashes are skipped over one by one.
+            while(quotes != NULL && (i = utilshell_lex_next(&bits, quotes, i)) < n && buffer[i] != '\'')
+                ++i;
+            if(i == n)
+                --i;
+            else if(buffer[i] == '\'')
+                state = NORMAL;
+            break;
+
+            case READING_QUOTE:
+            while(quotes != NULL && (i = utilshell_lex_next(&bits, quotes, i)) < n && buffer[i] == '\'')
+                ++i;
+            if(i == n) {
+                --i;
+                break;
+            }
+            switch(buffer[i]) {
+                case '\\':
+                state = READING_ESCAPE_IN_QUOTE;
+                break;
+
+                case '\"':
+                state = NORMAL;
+                break;
+
+                default:
+                break;
+            }
+            break;
+
+            case READING_ESCAPE:
+            state = NORMAL;
+            break;
+
+            case READING_ESCAPE_IN_QUOTE:
+            state = READING_QUOTE;
+            break;
+
+            default:
+            shell_error("An unexpected error has occured in tokenizing the input string.");
+            result = EXIT_FAILURE;
+            break;
+
+        }
+    
+    }
+
+    // If state is not NORMAL, then there was an unfinished escape sequence or non-terminated quotes.
+    bool incomplete = result == EXIT_SUCCESS && (state != NORMAL || unclosed);
+
+    // If we finished iterating through the buffer, then add last word to the list.
+    if(result == EXIT_SUCCESS && !incomplete && current_token_index != -1)
+        result = utilshell_lex_add(arena, &tokens, &num_tokens, &max_tokens, UTILSHELL_TOKEN_WORD, buffer+current_token_index, i - current_token_index);
+
+    // A here-document on the last line has its body on the lines still to come.
+    for(int k = heredocs; k < num_tokens && result == EXIT_SUCCESS && !incomplete; ++k) {
+        if(tokens[k].type != UTILSHELL_TOKEN_HEREDOC)
+            continue;
+        if(k + 1 == num_tokens || tokens[k+1].type != UTILSHELL_TOKEN_WORD) {
+            shell_error("Syntax error: here-document without a delimiter.\n");
+            result = EXIT_FAILURE;
+        }
+        incomplete = true;
+    }
+
+    *result_tokens = tokens;
+    *result_num_tokens = num_tokens;
+    *escape = state == READING_ESCAPE || state == READING_ESCAPE_IN_QUOTE;
+    if(result != EXIT_SUCCESS)
+        return UTILSHELL_PARSE_ERROR;
+    return incomplete ? UTILSHELL_PARSE_INCOMPLETE : UTILSHELL_PARSE_OK;
+
+}
+
+/* Returns the best way for utilshell_lex() to classify bytes on this CPU (see utilshell_lex_level).
+ */
+int utilshell_lex_best() {
+
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2"))
+        return UTILSHELL_LEX_AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return UTILSHELL_LEX_SSE2;
+#endif
+    return UTILSHELL_LEX_SCALAR;
+
+}
+
+// Returns the bits of a byte for utilshell_lex_classify(): 1 if it ends a word, 2 if it is a quote or a backslash.
+int utilshell_lex_class(unsigned char c) {
+
+    switch(c) {
+        case '\'':
+        case '"':
+        case '\\':
+        return 3;
+
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\v':
+        case '\f':
+        case '\r':
+        case '|':
+        case '&':
+        case ';':
+        case '<':
+        case '>':
+        return 1;
+
+        default:
+        return 0;
+    }
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Classifies 64 bytes with SSE2 (see utilshell_lex_classify()). SSE2 is not a given on 32-bit x86, as it is on x86-64.
+__attribute__((target("sse2"))) void utilshell_lex_classify_sse2(const char *block, uint64_t *stops, uint64_t *quotes) {
+
+    uint64_t stop_bits = 0;
+    uint64_t quote_bits = 0;
+    for(int k = 0; k < 4; ++k) {
+
+        __m128i b = _mm_loadu_si128((const __m128i*)(block + 16 * k));
+
+        // \t, \n, \v, \f and \r are 9 to 13.
+        __m128i t = _mm_sub_epi8(b, _mm_set1_epi8(9));
+        __m128i stop = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8(' ')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8('|')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8('&')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8(';')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8('<')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(b, _mm_set1_epi8('>')));
+        __m128i quote = _mm_cmpeq_epi8(b, _mm_set1_epi8('\''));
+        quote = _mm_or_si128(quote, _mm_cmpeq_epi8(b, _mm_set1_epi8('"')));
+        quote = _mm_or_si128(quote, _mm_cmpeq_epi8(b, _mm_set1_epi8('\\')));
+        stop = _mm_or_si128(stop, quote);
+
+        stop_bits |= (uint64_t)(unsigned int)_mm_movemask_epi8(stop) << (16 * k);
+        quote_bits |= (uint64_t)(unsigned int)_mm_movemask_epi8(quote) << (16 * k);
+
+    }
+    *stops = stop_bits;
+    *quotes = quote_bits;
+
+}
+
+// Classifies 64 bytes with AVX2 (see utilshell_lex_classify()).
+__attribute__((target("avx2"))) void utilshell_lex_classify_avx2(const char *block, uint64_t *stops, uint64_t *quotes) {
+
+    uint64_t stop_bits = 0;
+    uint64_t quote_bits = 0;
+    for(int k = 0; k < 2; ++k) {
+
+        __m256i b = _mm256_loadu_si256((const __m256i*)(block + 32 * k));
+
+        __m256i t = _mm256_sub_epi8(b, _mm256_set1_epi8(9));
+        __m256i stop = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(' ')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('|')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('&')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(';')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('<')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('>')));
+        __m256i quote = _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\''));
+        quote = _mm256_or_si256(quote, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('"')));
+        quote = _mm256_or_si256(quote, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\\')));
+        stop = _mm256_or_si256(stop, quote);
+
+        stop_bits |= (uint64_t)(unsigned int)_mm256_movemask_epi8(stop) << (32 * k);
+        quote_bits |= (uint64_t)(unsigned int)_mm256_movemask_epi8(quote) << (32 * k);
+
+    }
+    *stops = stop_bits;
+    *quotes = quote_bits;
+
+}
+
+// The loop of utilshell_lex_classify() for AVX2, compiled for it as a whole so that the blocks are inlined.
+__attribute__((target("avx2"))) int utilshell_lex_classify_blocks_avx2(const char *buffer, int n, uint64_t *stops, uint64_t *quotes) {
+
+    int w = 0;
+    for(; (w + 1) * 64 <= n; ++w)
+        utilshell_lex_classify_avx2(buffer + w * 64, stops + w, quotes + w);
+    return w;
+
+}
+
+#endif
+
+/* Classifies the n bytes of buffer into stops and quotes (see struct utilshell_lex_bits), which have room for
+ * (n + 63) / 64 words. The blocks of 64 bytes are classified with the given level (see utilshell_lex_level), and the
+ * bytes after the last one with utilshell_lex_class(). Returns the number of words that were classified in blocks.
+ */
+int utilshell_lex_classify(const char *buffer, int n, uint64_t *stops, uint64_t *quotes, int level) {
+
+    int w = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if(level == UTILSHELL_LEX_AVX2) {
+        w = utilshell_lex_classify_blocks_avx2(buffer, n, stops, quotes);
+    } else if(level == UTILSHELL_LEX_SSE2) {
+        for(; (w + 1) * 64 <= n; ++w)
+            utilshell_lex_classify_sse2(buffer + w * 64, stops + w, quotes + w);
+    }
+#endif
+    int blocks = w;
+
+    for(; w * 64 < n; ++w) {
+        uint64_t stop_bits = 0;
+        uint64_t quote_bits = 0;
+        for(int k = 0; k < 64 && w * 64 + k < n; ++k) {
+            int c = utilshell_lex_class((unsigned char)buffer[w * 64 + k]);
+            stop_bits |= (uint64_t)(c & 1) << k;
+            quote_bits |= (uint64_t)(c >> 1) << k;
+        }
+        stops[w] = stop_bits;
+        quotes[w] = quote_bits;
+    }
+
+    return blocks;
+
+}
+
+/* Returns the index of the first byte at or after from whose bit is set in map (bits->stops or bits->quotes),
+ * classifying more of the buffer as needed, or the length of the buffer if there is none. Without a map (see
+ * UTILSHELL_LEX_BYTES), returns from, so that the caller looks at every byte.
+ */
+int utilshell_lex_next(struct utilshell_lex_bits *bits, const uint64_t *map, int from) {
+
+    if(map == NULL || from >= bits->n)
+        return from < bits->n ? from : bits->n;
+
+    int w = from / 64;
+    uint64_t mask = ~0ULL << (from % 64);
+    while(true) {
+
+        while(w * 64 >= bits->classified) {
+            if(bits->classified == bits->n)
+                return bits->n;
+            int len = bits->classified > UTILSHELL_LEX_CHUNK ? bits->classified : UTILSHELL_LEX_CHUNK;
+            if(len > bits->n - bits->classified)
+                len = bits->n - bits->classified;
+            utilshell_lex_classify(bits->buffer + bits->classified, len, bits->stops + bits->classified / 64, bits->quotes + bits->classified / 64, bits->level);
+            bits->classified += len;
+        }
+
+        uint64_t word = map[w] & mask;
+        if(word != 0)
+            return w * 64 + __builtin_ctzll(word);
+        mask = ~0ULL;
+        ++w;
+
+    }
+
+}
+
+/* Tokenizes buffer with the given level (see utilshell_lex_level) and describes the result in a string that can be
+ * compared between levels: the status of utilshell_lex(), then one line per token with its type, whether it is
+ * literal, its text and the body of a here-document. Used by make fuzz. Returns a string to free(), or NULL on error.
+ */
+char *utilshell_lex_describe(const char *buffer, int level, int *status) {
+
+    struct utilshell_arena *arena = utilshell_arena_create();
+    if(arena == NULL)
+        return NULL;
+
+    int saved_level = utilshell_lex_level;
+    utilshell_lex_level = level;
+    struct utilshell_token *tokens = NULL;
+    int num_tokens = 0;
+    bool escape = false;
+    *status = utilshell_lex(arena, buffer, &tokens, &num_tokens, &escape);
+    utilshell_lex_level = saved_level;
+
+    struct utilshell_buf out;
+    memset(&out, 0, sizeof(out));
+    char line[64];
+    int result = utilshell_buf_append(&out, line, snprintf(line, sizeof(line), "status %d escape %d\n", *status, escape));
+    for(int k = 0; k < num_tokens && result == EXIT_SUCCESS; ++k) {
+        result = utilshell_buf_append(&out, line, snprintf(line, sizeof(line), "%d %d ", tokens[k].type, tokens[k].literal));
+        if(result == EXIT_SUCCESS)
+            result = utilshell_buf_append(&out, tokens[k].text, strlen(tokens[k].text));
+        if(result == EXIT_SUCCESS && tokens[k].here != NULL) {
+            result = utilshell_buf_append(&out, " <<", 3);
+            if(result == EXIT_SUCCESS)
+                result = utilshell_buf_append(&out, tokens[k].here, strlen(tokens[k].here));
+        }
+        if(result == EXIT_SUCCESS)
+            result = utilshell_buf_append(&out, "\n", 1);
+    }
+    utilshell_arena_destroy(arena);
+
+    if(result != EXIT_SUCCESS) {
+        free(out.data);
+        return NULL;
+    }
+    return out.data;
+
+}
+
+/* Returns the index of the ) that closes the ( at buffer[open], or -1 if the buffer ends first. Quotes and escapes
+ * are skipped, so a ) inside them does not count.
+ */
+int utilshell_lex_paren(const char *buffer, int open) {
+
+    int depth = 0;
+    char quote = '\0';
+
+    for(int i = open; buffer[i] != '\0'; ++i) {
+
+        char c = buffer[i];
+        if(c == '\\' && quote != '\'') {
+            if(buffer[i+1] == '\0')
+                return -1;
+            ++i;
+        } else if(quote != '\0') {
+            if(c == quote)
+                quote = '\0';
+        } else if(c == '\'' || c == '"') {
+            quote = c;
+        } else if(c == '(') {
+            ++depth;
+        } else if(c == ')' && --depth == 0) {
+            return i;
+        }
+
+    }
+
+    return -1;
+
+}
+
+
+/* Reads the bodies of the here-documents among tokens[first..num_tokens), whose line ends with the newline at
+ * buffer[*i]. Each body is made of the lines that follow, up to a line that holds only the delimiter (the word after
+ * << with its quotes removed), and is stored in the delimiter token. If the delimiter was quoted, the body is taken
+ * literally. With <<-, leading tabs are removed from every line. *i is moved to the end of the last body.
+ * Returns UTILSHELL_PARSE_OK on success, UTILSHELL_PARSE_INCOMPLETE if the buffer ends before a delimiter,
+ * UTILSHELL_PARSE_ERROR on error.
+ */
+int utilshell_lex_heredocs(struct utilshell_arena *arena, const char *buffer, int *i, struct utilshell_token *tokens, int first, int num_tokens) {
+
+    for(int k = first; k < num_tokens; ++k) {
+
+        if(tokens[k].type != UTILSHELL_TOKEN_HEREDOC)
+            continue;
+        if(k + 1 == num_tokens || tokens[k+1].type != UTILSHELL_TOKEN_WORD) {
+            shell_error("Syntax error: here-document without a delimiter.\n");
+            return UTILSHELL_PARSE_ERROR;
+        }
+
+        struct utilshell_token *word = tokens + k + 1;
+        bool strip_tabs = tokens[k].text[2] == '-';
+        bool quoted = strpbrk(word->text, "\"'\\") != NULL;
+
+        // Remove the quotes from the delimiter.
+        size_t len = strlen(word->text);
+        char *delim = (char*)utilshell_arena_alloc(arena, len + 1);
+        if(delim == NULL)
+            return UTILSHELL_PARSE_ERROR;
+        size_t delim_len = 0;
+        for(size_t j = 0; j < len; ++j) {
+            if(word->text[j] == '\\' && j + 1 < len)
+                delim[delim_len++] = word->text[++j];
+            else if(word->text[j] != '\'' && word->text[j] != '"')
+                delim[delim_len++] = word->text[j];
+        }
+        delim[delim_len] = '\0';
+
+        struct utilshell_buf body;
+        memset(&body, 0, sizeof(body));
+        body.arena = arena;
+        int line = *i + 1;
+        while(true) {
+
+            if(buffer[line] == '\0' && line > 0 && buffer[line-1] == '\n')
+                return UTILSHELL_PARSE_INCOMPLETE;
+            if(strip_tabs)
+                while(buffer[line] == '\t')
+                    ++line;
+            int end = line + (int)strcspn(buffer + line, "\n");
+            if(end - line == (int)delim_len && memcmp(buffer + line, delim, delim_len) == 0) {
+                *i = buffer[end] == '\0' ? end - 1 : end;
+                break;
+            }
+            if(buffer[end] == '\0')
+                return UTILSHELL_PARSE_INCOMPLETE;
+            if(utilshell_buf_append(&body, buffer + line, end - line + 1) != EXIT_SUCCESS)
+                return UTILSHELL_PARSE_ERROR;
+            line = end + 1;
+
+        }
+
+        word->here = body.data != NULL ? body.data : utilshell_arena_strndup(arena, "", 0);
+        word->literal = quoted || strpbrk(word->here, "$\\") == NULL;
+
+    }
+
+    return UTILSHELL_PARSE_OK;
+
+}
+
+/* Appends a token to the token list of shell_tokenize().
+ *    arena is the arena of the line.
+ *    tokens is a pointer to the token list (it will be reallocated if needed).
+ *    num_tokens is a pointer to the number of tokens currently in the list (it will be auto-incremented).
+ *    max_tokens is a pointer to the max number of tokens that can be put in the list before reallocation.
+ *    type, token and n are the type, the beginning and the length of the token.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_lex_add(struct utilshell_arena *arena, struct utilshell_token **tokens, int *num_tokens, int *max_tokens, enum utilshell_token_type type, const char *token, size_t n) {
+
+    // A command may go on on the next line after |, && and ||.
+    if(type == UTILSHELL_TOKEN_NEWLINE && *num_tokens > 0) {
+        enum utilshell_token_type last = (*tokens)[*num_tokens - 1].type;
+        if(last == UTILSHELL_TOKEN_PIPE || last == UTILSHELL_TOKEN_AND || last == UTILSHELL_TOKEN_OR)
+            return EXIT_SUCCESS;
+    }
+
+    if(*num_tokens == *max_tokens) {
+        int new_max_tokens = *max_tokens == 0 ? 8 : *max_tokens * 2;
+        struct utilshell_token *new_tokens = (struct utilshell_token*)utilshell_arena_realloc(arena, *tokens, *max_tokens*sizeof(struct utilshell_token), new_max_tokens*sizeof(struct utilshell_token));
+        if(new_tokens == NULL) {
+            shell_error("Error in reallocating token list from size %d to new size %d.\n", *max_tokens, new_max_tokens);
+            return EXIT_FAILURE;
+        }
+        *tokens = new_tokens;
+        *max_tokens = new_max_tokens;
+    }
+
+    struct utilshell_token *t = *tokens + (*num_tokens)++;
+    t->type = type;
+    t->text = utilshell_arena_strndup(arena, token, n);
+    if(t->text == NULL)
+        return EXIT_FAILURE;
+
+    // The same characters that send a word through the expansion code in utilshell_expand(). A word can only start
+    // with < or > if it is a process substitution, which is started when it is expanded.
+    t->literal = type == UTILSHELL_TOKEN_WORD && strpbrk(t->text, "~$\"'\\*?[") == NULL && t->text[0] != '<' && t->text[0] != '>';
+    t->subst = NULL;
+    t->here = NULL;
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Makes room for count more tokens in the token list (plus the NULL terminator).
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_reserve_tokens(char ***tokens, int num_tokens, int *max_tokens, int count) {
+
+    if(num_tokens + count <= *max_tokens)
+        return EXIT_SUCCESS;
+
+    // Find a new size for the list that can hold all the tokens.
+    int new_max_tokens = *max_tokens * 2;
+    while(num_tokens + count > new_max_tokens)
+        new_max_tokens *= 2;
+
+    // Resize the list. Add one for the NULL terminator and one for the hidden arena slot in front of the list.
+    struct utilshell_arena *arena = utilshell_tokens_arena(*tokens);
+    char **new_tokens = (char**)utilshell_arena_realloc(arena, *tokens - 1, (*max_tokens+2)*sizeof(char*), (new_max_tokens+2)*sizeof(char*));
+    if(new_tokens == NULL) {
+        shell_error("Error in reallocating token list from size %d to new size %d.\n", *max_tokens, new_max_tokens);
+        return EXIT_FAILURE;
+    }
+
+    *max_tokens = new_max_tokens;
+    *tokens = new_tokens + 1;
+    return EXIT_SUCCESS;
+
+}
+
+// Appends n bytes to a growable string. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_buf_append(struct utilshell_buf *buf, const char *s, size_t n) {
+
+    if(buf->len + n + 1 > buf->cap) {
+        size_t new_cap = buf->cap == 0 ? 64 : buf->cap * 2;
+        while(buf->len + n + 1 > new_cap)
+            new_cap *= 2;
+        char *new_data;
+        if(buf->arena != NULL)
+            new_data = (char*)utilshell_arena_realloc(buf->arena, buf->data, buf->cap, new_cap);
+        else
+            new_data = (char*)realloc(buf->data, new_cap);
+        if(new_data == NULL)
+            return EXIT_FAILURE;
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+    return EXIT_SUCCESS;
+
+}
+
+// Appends expanded text to a word. quoted is true if the text came from inside quotes.
+int utilshell_word_append(struct utilshell_word *word, const char *s, size_t n, bool quoted) {
+
+    word->started = true;
+
+    if(utilshell_buf_append(&word->value, s, n) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    for(size_t k = 0; k < n; ++k) {
+        if(strchr("*?[", s[k]) != NULL) {
+            if(!quoted)
+                word->has_glob = true;
+            else if(utilshell_buf_append(&word->pattern, "\\", 1) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+        } else if(s[k] == '\\' && utilshell_buf_append(&word->pattern, "\\", 1) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if(utilshell_buf_append(&word->pattern, s + k, 1) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Finishes a word and writes it (or the files it matches, if it is a glob pattern) into the token list. A glob
+ * pattern that matches nothing is kept as is. The word is reset so that it can be reused.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_word_finish(struct utilshell_word *word, char ***tokens, int *num_tokens, int *max_tokens) {
+
+    if(!word->started)
+        return EXIT_SUCCESS;
+
+    int result = EXIT_SUCCESS;
+    glob_t g;
+
+    if(word->has_glob && glob(word->pattern.data, 0, NULL, &g) == 0) {
+
+        if(utilshell_reserve_tokens(tokens, *num_tokens, max_tokens, g.gl_pathc) != EXIT_SUCCESS) {
+            result = EXIT_FAILURE;
+        } else {
+            struct utilshell_arena *arena = utilshell_tokens_arena(*tokens);
+            for(size_t k = 0; k < g.gl_pathc; ++k)
+                (*tokens)[(*num_tokens)++] = utilshell_arena_strndup(arena, g.gl_pathv[k], strlen(g.gl_pathv[k]));
+        }
+        globfree(&g);
+
+    } else {
+
+        if(utilshell_reserve_tokens(tokens, *num_tokens, max_tokens, 1) != EXIT_SUCCESS)
+            result = EXIT_FAILURE;
+        else
+            (*tokens)[(*num_tokens)++] = utilshell_arena_strndup(utilshell_tokens_arena(*tokens), word->value.data == NULL ? "" : word->value.data, word->value.len);
+
+    }
+
+    (*tokens)[*num_tokens] = NULL;
+
+    word->value.len = 0;
+    word->pattern.len = 0;
+    word->started = false;
+    word->has_glob = false;
+
+    return result;
+
+}
+
+/* Appends the value of an unquoted expansion to a word. The value is split into several words on whitespace,
+ * the same way an unquoted $VAR is split by other shells.
+ */
+int utilshell_word_append_split(struct utilshell_word *word, const char *s, char ***tokens, int *num_tokens, int *max_tokens) {
+
+    while(*s != '\0') {
+
+        if(isspace((unsigned char)*s)) {
+            if(utilshell_word_finish(word, tokens, num_tokens, max_tokens) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            while(isspace((unsigned char)*s))
+                ++s;
+            continue;
+        }
+
+        size_t n = 0;
+        while(s[n] != '\0' && !isspace((unsigned char)s[n]))
+            ++n;
+        if(utilshell_word_append(word, s, n, false) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        s += n;
+
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Reads the name of a parameter expansion that starts right after a '$'. Handles $NAME, ${NAME} and the special
+ * parameters $$ and $? (the exit status of the last command). On success, stores the value in *value (NULL if unset), advances *p past the expansion and returns
+ * true. Returns false if the '$' does not start an expansion, in which case it is kept literally.
+ */
+bool utilshell_expand_parameter(const char **p, const char *end, const char **value) {
+
+    static char pid_buf[16];
+    static char status_buf[16];
+    const char *s = *p;
+    size_t n = 0;
+
+    if(s < end && *s == '$') {
+        snprintf(pid_buf, sizeof(pid_buf), "%d", (int)getpid());
+        *value = pid_buf;
+        *p = s + 1;
+        return true;
+    }
+
+    if(s < end && *s == '?') {
+        snprintf(status_buf, sizeof(status_buf), "%d", utilshell_last_status);
+        *value = status_buf;
+        *p = s + 1;
+        return true;
+    }
+
+    bool braced = s < end && *s == '{';
+    if(braced)
+        ++s;
+
+    while(s + n < end && (isalnum((unsigned char)s[n]) || s[n] == '_'))
+        ++n;
+
+    if(n == 0 || isdigit((unsigned char)s[0]) || (braced && (s + n >= end || s[n] != '}')))
+        return false;
+
+    // The name is looked up where it is, without copying it out of the word.
+    struct utilshell_var *var = utilshell_var_find(s, n);
+    *value = var != NULL ? var->text + n + 1 : NULL;
+    *p = s + n + (braced ? 1 : 0);
+    return true;
+
+}
+
+/* Expands a tilde at the start of a word (~ or ~user, up to the first slash). On success, appends the home directory
+ * to the word, advances *p past the tilde prefix and returns true. Returns false if the prefix cannot be expanded.
+ */
+bool utilshell_expand_tilde(const char **p, const char *end, struct utilshell_word *word) {
+
+    const char *s = *p + 1;
+    size_t n = 0;
+    while(s + n < end && s[n] != '/' && !isspace((unsigned char)s[n]))
+        ++n;
+
+    const char *home = NULL;
+    if(n == 0) {
+        home = utilshell_var_get("HOME");
+    } else {
+        char user[256];
+        if(n >= sizeof(user))
+            return false;
+        memcpy(user, s, n);
+        user[n] = '\0';
+        struct passwd *pw = getpwnam(user);
+        if(pw != NULL)
+            home = pw->pw_dir;
+    }
+
+    if(home == NULL || utilshell_word_append(word, home, strlen(home), true) != EXIT_SUCCESS)
+        return false;
+
+    *p = s + n;
+    return true;
+
+}
+
+/* Splits a token into words and expands them, writing the results straight into the token list. This replaces
+ * wordexp() and runs entirely inside the shell. It handles:
+ *  a) Splitting on unquoted whitespace.
+ *  b) Tilde expansion (~ and ~user) at the start of a word.
+ *  c) Parameter expansion ($VAR, ${VAR} and $$). Unquoted values are split into words.
+ *  d) Quote removal ('...', "..." and backslash escapes).
+ *  e) Globbing (*, ? and [...]). Patterns that match nothing are kept as is.
+ * Words that contain none of these special characters are copied without going through the expansion code.
+ * Command substitution is not supported; $( and ` are kept literally. If split is false (for the value of an
+ * assignment), values are not split into words and globs are not expanded.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error (eg. an unterminated quote).
+ */
+int utilshell_expand(const char *token, int n, char ***tokens, int *num_tokens, int *max_tokens, bool split) {
+
+    const char *end = token + n;
+    const char *p = token;
+    int result = EXIT_SUCCESS;
+
+    // The scratch buffers of the word live in the arena of the line as well.
+    struct utilshell_word word;
+    memset(&word, 0, sizeof(word));
+    word.value.arena = utilshell_tokens_arena(*tokens);
+    word.pattern.arena = word.value.arena;
+
+    while(p < end && result == EXIT_SUCCESS) {
+
+        // Skip whitespace between words.
+        while(p < end && isspace((unsigned char)*p))
+            ++p;
+        if(p >= end)
+            break;
+
+        // Find the end of the word, if it has no quotes. Plain words are copied straight into the list.
+        const char *q = p;
+        while(q < end && !isspace((unsigned char)*q) && strchr("~$\"'\\*?[", *q) == NULL)
+            ++q;
+        if(q >= end || isspace((unsigned char)*q)) {
+            if(utilshell_reserve_tokens(tokens, *num_tokens, max_tokens, 1) != EXIT_SUCCESS) {
+                result = EXIT_FAILURE;
+                break;
+            }
+            (*tokens)[(*num_tokens)++] = utilshell_arena_strndup(utilshell_tokens_arena(*tokens), p, q - p);
+            (*tokens)[*num_tokens] = NULL;
+            p = q;
+            continue;
+        }
+
+        // Otherwise, expand the word character by character.
+        if(*p == '~')
+            utilshell_expand_tilde(&p, end, &word);
+
+        while(p < end && !isspace((unsigned char)*p) && result == EXIT_SUCCESS) {
+
+            const char *value;
+
+            if(*p == '\'') {
+
+                const char *close = (const char*)memchr(p + 1, '\'', end - p - 1);
+                if(close == NULL) {
+                    shell_error("Unterminated single quote.\n");
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                result = utilshell_word_append(&word, p + 1, close - p - 1, true);
+                p = close + 1;
+
+            } else if(*p == '"') {
+
+                ++p;
+                word.started = true;
+                while(p < end && *p != '"' && result == EXIT_SUCCESS) {
+                    if(*p == '\\' && p + 1 < end && strchr("$`\"\\", p[1]) != NULL) {
+                        result = utilshell_word_append(&word, p + 1, 1, true);
+                        p += 2;
+                    } else if(*p == '$') {
+                        ++p;
+                        if(utilshell_expand_parameter(&p, end, &value)) {
+                            if(value != NULL)
+                                result = utilshell_word_append(&word, value, strlen(value), true);
+                        } else {
+                            result = utilshell_word_append(&word, "$", 1, true);
+                        }
+                    } else {
+                        result = utilshell_word_append(&word, p, 1, true);
+                        ++p;
+                    }
+                }
+                if(p >= end) {
+                    shell_error("Unterminated double quote.\n");
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                ++p;
+
+            } else if(*p == '\\') {
+
+                if(p + 1 < end)
+                    result = utilshell_word_append(&word, p + 1, 1, true);
+                p += 2;
+
+            } else if(*p == '$') {
+
+                ++p;
+                if(utilshell_expand_parameter(&p, end, &value)) {
+                    if(value != NULL && split)
+                        result = utilshell_word_append_split(&word, value, tokens, num_tokens, max_tokens);
+                    else if(value != NULL)
+                        result = utilshell_word_append(&word, value, strlen(value), true);
+                } else {
+                    result = utilshell_word_append(&word, "$", 1, !split);
+                }
+
+            } else {
+
+                result = utilshell_word_append(&word, p, 1, !split);
+                ++p;
+
+            }
+
+        }
+
+        if(result == EXIT_SUCCESS)
+            result = utilshell_word_finish(&word, tokens, num_tokens, max_tokens);
+
+    }
+
+    return result;
+
+}
+
+/* Parses a list of commands separated by ;, & or newlines. At the top level the list runs to the end of the tokens;
+ * a nested list (eg. the body of a loop) ends at the keyword that closes it (then, elif, else, fi, do or done).
+ * Returns UTILSHELL_PARSE_OK, UTILSHELL_PARSE_ERROR or UTILSHELL_PARSE_INCOMPLETE.
+ */
+int utilshell_parse_list(struct utilshell_parser *parser, struct utilshell_node **list, bool nested) {
+
+    const char *terminators[] = { "then", "elif", "else", "fi", "do", "done" };
+    struct utilshell_node **tail = list;
+    *list = NULL;
+
+    while(true) {
+
+        while(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_NEWLINE)
+            ++parser->pos;
+
+        // A nested list needs the keyword that closes it.
+        if(parser->pos == parser->num_tokens)
+            return nested ? UTILSHELL_PARSE_INCOMPLETE : UTILSHELL_PARSE_OK;
+
+        for(int k = 0; k < 6; ++k) {
+            if(utilshell_parse_at(parser, terminators[k])) {
+                if(nested)
+                    return UTILSHELL_PARSE_OK;
+                shell_error("Syntax error near unexpected \"%s\".\n", terminators[k]);
+                return UTILSHELL_PARSE_ERROR;
+            }
+        }
+
+        struct utilshell_node *node;
+        int status = utilshell_parse_and_or(parser, &node);
+        if(status != UTILSHELL_PARSE_OK)
+            return status;
+        *tail = node;
+        tail = &node->next;
+
+        if(parser->pos == parser->num_tokens)
+            continue;
+
+        struct utilshell_token *token = parser->tokens + parser->pos;
+        if(token->type == UTILSHELL_TOKEN_BACKGROUND) {
+            if(node->type != UTILSHELL_NODE_PIPELINE) {
+                shell_error("Syntax error: only a pipeline can be run in the background.\n");
+                return UTILSHELL_PARSE_ERROR;
+            }
+            node->pipeline->background = true;
+        } else if(token->type != UTILSHELL_TOKEN_SEMICOLON && token->type != UTILSHELL_TOKEN_NEWLINE) {
+            shell_error("Syntax error near unexpected \"%s\".\n", token->text);
+            return UTILSHELL_PARSE_ERROR;
+        }
+        ++parser->pos;
+
+    }
+
+}
+
+// Parses commands joined by && and ||, which are run from left to right. Returns the same as utilshell_parse_list().
+int utilshell_parse_and_or(struct utilshell_parser *parser, struct utilshell_node **result) {
+
+    int status = utilshell_parse_command(parser, result);
+
+    while(status == UTILSHELL_PARSE_OK && parser->pos < parser->num_tokens) {
+
+        enum utilshell_token_type type = parser->tokens[parser->pos].type;
+        if(type != UTILSHELL_TOKEN_AND && type != UTILSHELL_TOKEN_OR)
+            break;
+
+        // The command after && or || may be on the next line.
+        ++parser->pos;
+        while(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_NEWLINE)
+            ++parser->pos;
+        if(parser->pos == parser->num_tokens)
+            return UTILSHELL_PARSE_INCOMPLETE;
+
+        struct utilshell_node *node = utilshell_parse_node(parser, type == UTILSHELL_TOKEN_AND ? UTILSHELL_NODE_AND : UTILSHELL_NODE_OR);
+        if(node == NULL)
+            return UTILSHELL_PARSE_ERROR;
+        node->left = *result;
+        status = utilshell_parse_command(parser, &node->right);
+        *result = node;
+
+    }
+
+    return status;
+
+}
+
+// Parses an if, while, until or for command, or a pipeline. Returns the same as utilshell_parse_list().
+int utilshell_parse_command(struct utilshell_parser *parser, struct utilshell_node **result) {
+
+    int status;
+    if(utilshell_parse_at(parser, "if"))
+        status = utilshell_parse_if(parser, result);
+    else if(utilshell_parse_at(parser, "while") || utilshell_parse_at(parser, "until"))
+        status = utilshell_parse_while(parser, result);
+    else if(utilshell_parse_at(parser, "for"))
+        status = utilshell_parse_for(parser, result);
+    else {
+        *result = utilshell_parse_node(parser, UTILSHELL_NODE_PIPELINE);
+        if(*result == NULL)
+            return UTILSHELL_PARSE_ERROR;
+        return utilshell_parse_pipeline(parser, &(*result)->pipeline);
+    }
+
+    // Compound commands cannot be part of a pipeline or have redirects of their own.
+    if(status == UTILSHELL_PARSE_OK && parser->pos < parser->num_tokens) {
+        enum utilshell_token_type type = parser->tokens[parser->pos].type;
+        if(type == UTILSHELL_TOKEN_WORD || type == UTILSHELL_TOKEN_PIPE || (type >= UTILSHELL_TOKEN_REDIR_IN && type <= UTILSHELL_TOKEN_HERESTRING)) {
+            shell_error("Syntax error near unexpected \"%s\".\n", parser->tokens[parser->pos].text);
+            return UTILSHELL_PARSE_ERROR;
+        }
+    }
+
+    return status;
+
+}
+
+// Parses if cond; then body; [elif cond; then body;] ... [else body;] fi. Returns the same as utilshell_parse_list().
+int utilshell_parse_if(struct utilshell_parser *parser, struct utilshell_node **result) {
+
+    // The if (or elif) keyword.
+    ++parser->pos;
+
+    struct utilshell_node *node = utilshell_parse_node(parser, UTILSHELL_NODE_IF);
+    if(node == NULL)
+        return UTILSHELL_PARSE_ERROR;
+    *result = node;
+
+    int status = utilshell_parse_list(parser, &node->cond, true);
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_expect(parser, "then");
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_list(parser, &node->body, true);
+    if(status != UTILSHELL_PARSE_OK)
+        return status;
+
+    // An elif is an if in the else branch, which also takes the fi.
+    if(utilshell_parse_at(parser, "elif"))
+        return utilshell_parse_if(parser, &node->else_body);
+
+    if(utilshell_parse_at(parser, "else")) {
+        ++parser->pos;
+        status = utilshell_parse_list(parser, &node->else_body, true);
+        if(status != UTILSHELL_PARSE_OK)
+            return status;
+    }
+
+    return utilshell_parse_expect(parser, "fi");
+
+}
+
+// Parses while cond; do body; done and until cond; do body; done. Returns the same as utilshell_parse_list().
+int utilshell_parse_while(struct utilshell_parser *parser, struct utilshell_node **result) {
+
+    struct utilshell_node *node = utilshell_parse_node(parser, UTILSHELL_NODE_WHILE);
+    if(node == NULL)
+        return UTILSHELL_PARSE_ERROR;
+    node->negate = utilshell_parse_at(parser, "until");
+    *result = node;
+    ++parser->pos;
+
+    int status = utilshell_parse_list(parser, &node->cond, true);
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_expect(parser, "do");
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_list(parser, &node->body, true);
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_expect(parser, "done");
+    return status;
+
+}
+
+/* Parses for name [in words ...]; do body; done. The words are expanded every time the loop starts.
+ * Returns the same as utilshell_parse_list().
+ */
+int utilshell_parse_for(struct utilshell_parser *parser, struct utilshell_node **result) {
+
+    struct utilshell_node *node = utilshell_parse_node(parser, UTILSHELL_NODE_FOR);
+    if(node == NULL)
+        return UTILSHELL_PARSE_ERROR;
+    *result = node;
+    ++parser->pos;
+
+    if(parser->pos == parser->num_tokens)
+        return UTILSHELL_PARSE_INCOMPLETE;
+    struct utilshell_token *name = parser->tokens + parser->pos;
+    bool valid = name->type == UTILSHELL_TOKEN_WORD && name->literal && !isdigit((unsigned char)name->text[0]);
+    for(const char *c = name->text; valid && *c != '\0'; ++c)
+        valid = isalnum((unsigned char)*c) || *c == '_';
+    if(!valid) {
+        shell_error("Syntax error: \"%s\" is not a valid loop variable.\n", name->text);
+        return UTILSHELL_PARSE_ERROR;
+    }
+    node->name = name;
+    ++parser->pos;
+
+    while(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_NEWLINE)
+        ++parser->pos;
+
+    // The words run up to the ; or newline in front of do.
+    if(utilshell_parse_at(parser, "in")) {
+        ++parser->pos;
+        node->words = (struct utilshell_token**)utilshell_arena_alloc(parser->arena, (parser->num_tokens - parser->pos + 1)*sizeof(struct utilshell_token*));
+        if(node->words == NULL)
+            return UTILSHELL_PARSE_ERROR;
+        while(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_WORD)
+            node->words[node->num_words++] = parser->tokens + parser->pos++;
+        if(parser->pos == parser->num_tokens)
+            return UTILSHELL_PARSE_INCOMPLETE;
+        enum utilshell_token_type type = parser->tokens[parser->pos].type;
+        if(type != UTILSHELL_TOKEN_SEMICOLON && type != UTILSHELL_TOKEN_NEWLINE) {
+            shell_error("Syntax error near unexpected \"%s\".\n", parser->tokens[parser->pos].text);
+            return UTILSHELL_PARSE_ERROR;
+        }
+        ++parser->pos;
+    } else if(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_SEMICOLON) {
+        ++parser->pos;
+    }
+
+    while(parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == UTILSHELL_TOKEN_NEWLINE)
+        ++parser->pos;
+
+    int status = utilshell_parse_expect(parser, "do");
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_list(parser, &node->body, true);
+    if(status == UTILSHELL_PARSE_OK)
+        status = utilshell_parse_expect(parser, "done");
+    return status;
+
+}
+
+// Returns true if the next token is the given keyword (a literal word).
+bool utilshell_parse_at(struct utilshell_parser *parser, const char *keyword) {
+
+    if(parser->pos == parser->num_tokens)
+        return false;
+    struct utilshell_token *token = parser->tokens + parser->pos;
+    return token->type == UTILSHELL_TOKEN_WORD && token->literal && strcmp(token->text, keyword) == 0;
+
+}
+
+// Skips the given keyword, which has to come next. Returns the same as utilshell_parse_list().
+int utilshell_parse_expect(struct utilshell_parser *parser, const char *keyword) {
+
+    if(parser->pos == parser->num_tokens)
+        return UTILSHELL_PARSE_INCOMPLETE;
+
+    if(!utilshell_parse_at(parser, keyword)) {
+        shell_error("Syntax error: expected \"%s\" near \"%s\".\n", keyword, parser->tokens[parser->pos].text);
+        return UTILSHELL_PARSE_ERROR;
+    }
+
+    ++parser->pos;
+    return UTILSHELL_PARSE_OK;
+
+}
+
+// Allocates an empty node. Returns NULL on error.
+struct utilshell_node *utilshell_parse_node(struct utilshell_parser *parser, enum utilshell_node_type type) {
+
+    struct utilshell_node *node = (struct utilshell_node*)utilshell_arena_alloc(parser->arena, sizeof(struct utilshell_node));
+    if(node == NULL)
+        return NULL;
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    return node;
+
+}
+
+/* Parses a pipeline (cmd | cmd | ...) that runs up to the next ;, &, &&, || or newline, and lowers it (see
+ * utilshell_lower()). Redirects are attached to the command they appear in. A leading "time" word marks the
+ * pipeline as timed and is dropped from the first command.
+ * Returns the same as utilshell_parse_list().
+ */
+int utilshell_parse_pipeline(struct utilshell_parser *parser, struct utilshell_pipeline **result) {
+
+    struct utilshell_arena *arena = parser->arena;
+    struct utilshell_token *tokens = parser->tokens + parser->pos;
+    int num_tokens = 0;
+    int max_commands = 1;
+    while(parser->pos + num_tokens < parser->num_tokens && tokens[num_tokens].type <= UTILSHELL_TOKEN_HERESTRING) {
+        if(tokens[num_tokens].type == UTILSHELL_TOKEN_PIPE)
+            ++max_commands;
+        ++num_tokens;
+    }
+    parser->pos += num_tokens;
+
+    if(num_tokens == 0) {
+        shell_error("Syntax error near unexpected \"%s\".\n", tokens[0].text);
+        return UTILSHELL_PARSE_ERROR;
+    }
+
+    struct utilshell_pipeline *pipeline = (struct utilshell_pipeline*)utilshell_arena_alloc(arena, sizeof(struct utilshell_pipeline));
+    struct utilshell_command *commands = (struct utilshell_command*)utilshell_arena_alloc(arena, max_commands*sizeof(struct utilshell_command));
+    struct utilshell_token **words = (struct utilshell_token**)utilshell_arena_alloc(arena, num_tokens*sizeof(struct utilshell_token*));
+    struct utilshell_buf text;
+    memset(&text, 0, sizeof(text));
+    text.arena = arena;
+    if(pipeline == NULL || commands == NULL || words == NULL) {
+        shell_error("Could not allocate pipeline of %d commands.\n", max_commands);
+        return UTILSHELL_PARSE_ERROR;
+    }
+    memset(pipeline, 0, sizeof(*pipeline));
+    memset(commands, 0, max_commands*sizeof(struct utilshell_command));
+    pipeline->commands = commands;
+    *result = pipeline;
+
+    struct utilshell_command *command = commands;
+    command->words = words;
+
+    // Process substitutions are parsed into pipelines of their own.
+    for(int i = 0; i < num_tokens; ++i)
+        if(tokens[i].type == UTILSHELL_TOKEN_WORD && (tokens[i].text[0] == '<' || tokens[i].text[0] == '>') && utilshell_parse_subst(parser, tokens + i) != UTILSHELL_PARSE_OK)
+            return UTILSHELL_PARSE_ERROR;
+
+    for(int i = 0; i < num_tokens; ++i) {
+
+        struct utilshell_token *token = tokens + i;
+        struct utilshell_token *target = i + 1 < num_tokens && tokens[i+1].type == UTILSHELL_TOKEN_WORD ? tokens + i + 1 : NULL;
+
+        // The command of the job, as it is shown by jobs.
+        if(text.len > 0)
+            utilshell_buf_append(&text, " ", 1);
+        utilshell_buf_append(&text, token->text, strlen(token->text));
+
+        switch(token->type) {
+
+            case UTILSHELL_TOKEN_WORD:
+            command->words[command->num_words++] = token;
+            break;
+
+            case UTILSHELL_TOKEN_PIPE:
+
+            // Every stage of a pipeline needs a command to run.
+            if(command->num_words == 0) {
+                shell_error("Syntax error: empty command in pipeline.\n");
+                return UTILSHELL_PARSE_ERROR;
+            }
+
+            // Start the next command. Its words start right after the ones of this command.
+            words += command->num_words;
+            command = commands + ++pipeline->num_commands;
+            command->words = words;
+            break;
+
+            // If there is not an argument, we will not throw an error. It's not a big deal.
+            case UTILSHELL_TOKEN_REDIR_IN:
+            case UTILSHELL_TOKEN_HEREDOC:
+            case UTILSHELL_TOKEN_HERESTRING:
+            if(target != NULL) {
+                command->redir_in = target;
+                command->redir_here = token->type != UTILSHELL_TOKEN_REDIR_IN;
+            }
+            break;
+
+            case UTILSHELL_TOKEN_REDIR_OUT:
+            if(target != NULL)
+                command->redir_out = target;
+            break;
+
+            case UTILSHELL_TOKEN_REDIR_APP:
+            if(target != NULL)
+                command->redir_app = target;
+            break;
+
+            case UTILSHELL_TOKEN_REDIR_ERR:
+            if(target != NULL)
+                command->redir_err = target;
+            break;
+
+            default:
+            break;
+
+        }
+
+        // The target of a redirect is not a word of the command.
+        if(token->type >= UTILSHELL_TOKEN_REDIR_IN && token->type <= UTILSHELL_TOKEN_HERESTRING && target != NULL) {
+            ++i;
+            utilshell_buf_append(&text, " ", 1);
+            utilshell_buf_append(&text, target->text, strlen(target->text));
+        }
+
+    }
+
+    // A trailing pipe leaves the last command empty. The next one may be on the next line.
+    ++pipeline->num_commands;
+    if(command->num_words == 0 && pipeline->num_commands > 1) {
+        if(parser->pos == parser->num_tokens)
+            return UTILSHELL_PARSE_INCOMPLETE;
+        shell_error("Syntax error: empty command in pipeline.\n");
+        return UTILSHELL_PARSE_ERROR;
+    }
+
+    if(commands[0].num_words > 0 && commands[0].words[0]->literal && strcmp(commands[0].words[0]->text, "time") == 0) {
+        pipeline->timed = true;
+        ++commands[0].words;
+        --commands[0].num_words;
+    }
+
+    pipeline->text = text.data != NULL ? text.data : utilshell_arena_strndup(arena, "", 0);
+
+    if(utilshell_lower(pipeline, arena) != EXIT_SUCCESS)
+        return UTILSHELL_PARSE_ERROR;
+    return UTILSHELL_PARSE_OK;
+
+}
+
+/* Parses the command of a process substitution (<(cmd) or >(cmd)) into token->subst. It has to be one pipeline that
+ * does not run in the background. Returns UTILSHELL_PARSE_OK on success, UTILSHELL_PARSE_ERROR on error.
+ */
+int utilshell_parse_subst(struct utilshell_parser *parser, struct utilshell_token *token) {
+
+    struct utilshell_arena *arena = parser->arena;
+    char *text = utilshell_arena_strndup(arena, token->text + 2, strlen(token->text) - 3);
+    if(text == NULL)
+        return UTILSHELL_PARSE_ERROR;
+
+    struct utilshell_token *tokens = NULL;
+    int num_tokens = 0;
+    bool escape;
+    int status = utilshell_lex(arena, text, &tokens, &num_tokens, &escape);
+    struct utilshell_node *root = NULL;
+    if(status == UTILSHELL_PARSE_OK && num_tokens > 0) {
+        struct utilshell_parser inner = { tokens, num_tokens, 0, arena };
+        status = utilshell_parse_list(&inner, &root, false);
+    }
+    if(status == UTILSHELL_PARSE_ERROR)
+        return UTILSHELL_PARSE_ERROR;
+
+    if(status == UTILSHELL_PARSE_INCOMPLETE || root == NULL || root->type != UTILSHELL_NODE_PIPELINE || root->next != NULL || root->pipeline->background) {
+        shell_error("Syntax error: %s must hold one pipeline.\n", token->text);
+        return UTILSHELL_PARSE_ERROR;
+    }
+
+    token->subst = root->pipeline;
+    return UTILSHELL_PARSE_OK;
+
+}
+
+/* Lowers a parsed pipeline into a plan for running it. The NAME=value words a command starts with are split off
+ * into its assignments. Commands whose words are all literal get their argv (and builtin) now, and the stages and
+ * pipes are allocated, so that running the pipeline allocates nothing for them.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_lower(struct utilshell_pipeline *pipeline, struct utilshell_arena *arena) {
+
+    for(int i = 0; i < pipeline->num_commands; ++i) {
+
+        struct utilshell_command *command = pipeline->commands + i;
+
+        // A quoted or escaped name is not an assignment, so the name has to be at the very start of the word.
+        command->assigns = command->words;
+        while(command->num_words > 0) {
+            const char *equals = strchr(command->words[0]->text, '=');
+            if(equals == NULL || !utilshell_var_name(command->words[0]->text, equals - command->words[0]->text))
+                break;
+            ++command->words;
+            --command->num_words;
+            ++command->num_assigns;
+        }
+
+        bool literal = true;
+        for(int j = 0; j < command->num_words; ++j)
+            literal = literal && command->words[j]->literal;
+        if(!literal)
+            continue;
+
+        command->argv = (char**)utilshell_arena_alloc(arena, (command->num_words+1)*sizeof(char*));
+        if(command->argv == NULL)
+            return EXIT_FAILURE;
+        for(int j = 0; j < command->num_words; ++j)
+            command->argv[j] = command->words[j]->text;
+        command->argv[command->num_words] = NULL;
+
+        if(command->num_words > 0)
+            command->builtin = utilshell_builtin_find(command->argv[0]);
+
+    }
+
+    int n = pipeline->num_commands;
+    pipeline->stages = (struct utilshell_stage*)utilshell_arena_alloc(arena, n*sizeof(struct utilshell_stage));
+    pipeline->pipes = (int*)utilshell_arena_alloc(arena, 2*n*sizeof(int));
+    if(pipeline->stages == NULL || pipeline->pipes == NULL) {
+        shell_error("Could not allocate pipeline of %d stages.\n", n);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+// Expands the words of a command into an argv allocated from arena. Returns NULL on error.
+char **utilshell_expand_words(struct utilshell_token **words, int num_words, struct utilshell_arena *arena) {
+
+    int num_tokens = 0;
+    int max_tokens = num_words > 4 ? num_words : 4;
+    char **argv = utilshell_tokens_create(arena, max_tokens);
+    if(argv == NULL)
+        return NULL;
+
+    for(int j = 0; j < num_words; ++j) {
+        // Only a process substitution can start with < or > (see utilshell_lex()).
+        bool subst = words[j]->text[0] == '<' || words[j]->text[0] == '>';
+        if(words[j]->literal || subst) {
+            char *word = subst ? utilshell_subst_start(words[j], arena) : words[j]->text;
+            if(word == NULL || utilshell_reserve_tokens(&argv, num_tokens, &max_tokens, 1) != EXIT_SUCCESS)
+                return NULL;
+            argv[num_tokens++] = word;
+            argv[num_tokens] = NULL;
+        } else if(utilshell_expand(words[j]->text, strlen(words[j]->text), &argv, &num_tokens, &max_tokens, true) != EXIT_SUCCESS) {
+            return NULL;
+        }
+    }
+
+    return argv;
+
+}
+
+/* Expands a word that has to stay a single word (eg. the file of a redirect). Returns the expanded word on success.
+ * Returns NULL on error, or if the word expands to nothing or to several words.
+ */
+char *utilshell_expand_word(struct utilshell_token *word, struct utilshell_arena *arena) {
+
+    if(word->literal)
+        return word->text;
+
+    char **argv = utilshell_expand_words(&word, 1, arena);
+    if(argv == NULL)
+        return NULL;
+    if(argv[0] == NULL || argv[1] != NULL) {
+        shell_error("Ambiguous redirect \"%s\".\n", word->text);
+        return NULL;
+    }
+    return argv[0];
+
+}
+
+/* Expands an assignment (NAME=value) into a single NAME=value string. The value is expanded like a word in double
+ * quotes, except that quotes may be used in it and a tilde at its start is expanded. Returns NULL on error.
+ */
+char *utilshell_expand_assign(struct utilshell_token *word, struct utilshell_arena *arena) {
+
+    if(word->literal)
+        return word->text;
+
+    const char *value = strchr(word->text, '=') + 1;
+    size_t name_len = value - word->text;
+    int num_tokens = 0;
+    int max_tokens = 4;
+    char **argv = utilshell_tokens_create(arena, max_tokens);
+    if(argv == NULL || utilshell_expand(value, strlen(value), &argv, &num_tokens, &max_tokens, false) != EXIT_SUCCESS)
+        return NULL;
+
+    // A value that expands to nothing (eg. FOO=$UNSET) sets the variable to an empty string.
+    size_t value_len = num_tokens > 0 ? strlen(argv[0]) : 0;
+    char *text = (char*)utilshell_arena_alloc(arena, name_len + value_len + 1);
+    if(text == NULL)
+        return NULL;
+    memcpy(text, word->text, name_len);
+    memcpy(text + name_len, num_tokens > 0 ? argv[0] : "", value_len + 1);
+    return text;
+
+}
+
+/* Expands the text of a here-document (the body stored in word->here) or here-string (the word after <<<) and appends
+ * it to out. A here-document gets $ expansions and the backslash escapes \\$, \\`, \\\\ and \\newline, like the inside of
+ * double quotes without the quotes. A here-string is expanded like the value of an assignment and ends with a newline.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_expand_here(struct utilshell_token *word, bool heredoc, struct utilshell_buf *out) {
+
+    if(!heredoc) {
+        int num_tokens = 0;
+        int max_tokens = 4;
+        char **argv = utilshell_tokens_create(out->arena, max_tokens);
+        if(argv == NULL || utilshell_expand(word->text, strlen(word->text), &argv, &num_tokens, &max_tokens, false) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if(num_tokens > 0 && utilshell_buf_append(out, argv[0], strlen(argv[0])) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        return utilshell_buf_append(out, "\n", 1);
+    }
+
+    const char *p = word->here;
+    const char *end = p + strlen(p);
+    if(word->literal)
+        return utilshell_buf_append(out, p, end - p);
+
+    int result = EXIT_SUCCESS;
+    while(p < end && result == EXIT_SUCCESS) {
+
+        const char *value;
+        size_t n = strcspn(p, "$\\");
+        if(n > 0) {
+            result = utilshell_buf_append(out, p, n);
+            p += n;
+        } else if(*p == '\\' && p + 1 < end && strchr("$`\\\n", p[1]) != NULL) {
+            if(p[1] != '\n')
+                result = utilshell_buf_append(out, p + 1, 1);
+            p += 2;
+        } else if(*p == '$') {
+            ++p;
+            if(!utilshell_expand_parameter(&p, end, &value))
+                result = utilshell_buf_append(out, "$", 1);
+            else if(value != NULL)
+                result = utilshell_buf_append(out, value, strlen(value));
+        } else {
+            result = utilshell_buf_append(out, p++, 1);
+        }
+
+    }
+
+    return result;
+
+}
+
+/* Returns an fd (close-on-exec) that reads the given text, without touching the file system or starting a process
+ * to feed it. Text that fits is written into a pipe and the write end is closed, so the command reads it and then
+ * the end of the file. Anything larger goes into a memfd that is sealed against changes and rewound, which the
+ * command can read at full speed or mmap. Returns -1 on error.
+ */
+int utilshell_here_open(const char *data, size_t len) {
+
+    int fds[2];
+    if(len <= (size_t)UTILSHELL_HERE_PIPE && pipe2(fds, O_CLOEXEC|O_NONBLOCK) == 0) {
+        ssize_t written = len > 0 ? write(fds[1], data, len) : 0;
+        close(fds[1]);
+        if(written == (ssize_t)len && fcntl(fds[0], F_SETFL, 0) == 0)
+            return fds[0];
+        close(fds[0]);
+    }
+
+    int fd = memfd_create("here-document", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if(fd == -1 || utilshell_write_all(fd, data, len) != EXIT_SUCCESS ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+        int errsv = errno;
+        shell_error("Could not create here-document. errno:%d\n", errsv);
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+
+}
+
+/* Opens the redirect files of a stage and stores them in stage->fds, which already holds the pipe ends of the
+ * stage (-1 for a stream that is inherited from the shell). Redirects take precedence over the pipeline. The files
+ * are opened in the shell itself (close-on-exec) so that both launch backends can wire them into the child the
+ * same way. Returns EXIT_SUCCESS on success, EXIT_FAILURE if a file could not be opened (the stage should not run).
+ */
+int utilshell_open_redirects(struct utilshell_stage *stage) {
+
+    struct utilshell_command *command = stage->command;
+    struct utilshell_token *words[4] = { command->redir_in, command->redir_out, command->redir_app, command->redir_err };
+    const int flags[4] = { O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_WRONLY|O_CREAT|O_APPEND, O_WRONLY|O_CREAT|O_TRUNC };
+    const int targets[4] = { STDIN_FILENO, STDOUT_FILENO, STDOUT_FILENO, STDERR_FILENO };
+
+    for(int k = 0; k < 4; ++k) {
+
+        if(words[k] == NULL)
+            continue;
+
+        // A here-document or here-string is fed to stdin from memory.
+        if(k == 0 && command->redir_here) {
+            struct utilshell_buf text;
+            memset(&text, 0, sizeof(text));
+            text.arena = utilshell_scratch_arena;
+            int fd;
+            if(utilshell_expand_here(words[k], words[k]->here != NULL, &text) != EXIT_SUCCESS ||
+                (fd = utilshell_here_open(text.data != NULL ? text.data : "", text.len)) == -1)
+                return EXIT_FAILURE;
+            if(stage->fds[STDIN_FILENO] != -1 && stage->owned[STDIN_FILENO])
+                close(stage->fds[STDIN_FILENO]);
+            stage->fds[STDIN_FILENO] = fd;
+            stage->owned[STDIN_FILENO] = true;
+            continue;
+        }
+
+        const char *path = utilshell_expand_word(words[k], utilshell_scratch_arena);
+        if(path == NULL)
+            return EXIT_FAILURE;
+
+        int fd = open(path, flags[k]|O_CLOEXEC, S_IRWXU);
+        if(fd == -1) {
+            if(k == 0)
+                shell_error("Could not open \"%s\" for reading.\n", path);
+            else
+                shell_error("Could not open \"%s\" for writing.\n", path);
+            return EXIT_FAILURE;
+        }
+
+        // Replace the pipe end (or an earlier redirect of the same stream).
+        if(stage->fds[targets[k]] != -1 && stage->owned[targets[k]])
+            close(stage->fds[targets[k]]);
+        stage->fds[targets[k]] = fd;
+        stage->owned[targets[k]] = true;
+
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Closes the redirect files opened by utilshell_open_redirects() and the ends of the process substitutions that were
+ * passed to the stage. Pipe ends of the pipeline are left alone.
+ */
+void utilshell_close_redirects(struct utilshell_stage *stage) {
+
+    for(int k = 0; k < 3; ++k) {
+        if(stage->owned[k])
+            close(stage->fds[k]);
+        stage->owned[k] = false;
+    }
+
+    for(int k = 0; k < stage->num_pass_fds; ++k)
+        close(stage->pass_fds[k]);
+    stage->num_pass_fds = 0;
+
+}
+
+/* Starts a stage with posix_spawn() on the path resolved through the command hash table. glibc implements it with clone(CLONE_VM|CLONE_VFORK), so the page tables of
+ * the shell are never copied. The pipe ends and redirects are wired in through file actions, and the process group
+ * and default signals through spawn attributes. Returns the pid of the stage, or -1 on error.
+ */
+pid_t utilshell_launch_spawn(struct utilshell_stage *stage, pid_t pgid) {
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdef;
+    sigset_t sigmask;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    for(int k = 0; k < 3; ++k)
+        if(stage->fds[k] != -1)
+            posix_spawn_file_actions_adddup2(&actions, stage->fds[k], k);
+    // A dup2() onto the same fd only clears close-on-exec.
+    for(int k = 0; k < stage->num_pass_fds; ++k)
+        posix_spawn_file_actions_adddup2(&actions, stage->pass_fds[k], stage->pass_fds[k]);
+
+    // Restore the signals the shell ignores and unblock SIGCHLD.
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGINT);
+    sigaddset(&sigdef, SIGQUIT);
+    sigaddset(&sigdef, SIGTSTP);
+    sigaddset(&sigdef, SIGTTIN);
+    sigaddset(&sigdef, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+
+    char **envp = stage->envp != NULL ? stage->envp : utilshell_var_envp();
+    int err = envp != NULL ? posix_spawn(&pid, stage->path, &actions, &attr, stage->args, envp) : ENOMEM;
+
+    // The remembered location of the command may have gone away. Forget it and look in $PATH again.
+    if((err == ENOENT || err == ENOTDIR) && strchr(stage->args[0], '/') == NULL) {
+        utilshell_hash_forget(stage->args[0]);
+        if((stage->path = utilshell_hash_lookup(stage->args[0])) != NULL)
+            err = posix_spawn(&pid, stage->path, &actions, &attr, stage->args, envp);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(err != 0) {
+        shell_error("Could not execute \"%s\". errno:%d\n", stage->args[0], err);
+        if(err == EACCES || err == ENOEXEC)
+            stage->status = 126;
+        return -1;
+    }
+
+    return pid;
+
+}
+
+/* Starts a stage with fork() and execve() on the resolved path. This is the fallback for when posix_spawn() cannot be
+ * used: with -f, and for builtins that run in a pipeline or in the background.
+ * Returns the pid of the stage, or -1 on error.
+ */
+pid_t utilshell_launch_fork(struct utilshell_stage *stage, pid_t pgid) {
+
+    // The environment is built before fork(), so that it is not built again in every child.
+    int errsv;
+    char **envp = stage->envp != NULL ? stage->envp : utilshell_var_envp();
+    pid_t pid = fork();
+
+    if(pid == 0) {
+
+        // Join the process group of the pipeline, restore the signals the shell ignores and unblock SIGCHLD.
+        setpgid(0, pgid);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        sigset_t sigmask;
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+        // The pipe ends and redirects are all close-on-exec, the copies made by dup2() are not.
+        for(int k = 0; k < 3; ++k)
+            if(stage->fds[k] != -1)
+                dup2(stage->fds[k], k);
+        for(int k = 0; k < stage->num_pass_fds; ++k)
+            fcntl(stage->pass_fds[k], F_SETFD, 0);
+
+        if(stage->builtin != NULL) {
+            // There is no exec() to close the rest of the shell's fds, and a pipe end left open would keep the next
+            // stage from ever seeing EOF. The profile file stays open for builtins that report to it (eg. parallel),
+            // and the history file for history.
+            int num_keep = 0;
+            int *keep = (int*)malloc((stage->num_pass_fds + 2)*sizeof(int));
+            if(keep != NULL) {
+                for(int k = 0; k < stage->num_pass_fds; ++k)
+                    keep[num_keep++] = stage->pass_fds[k];
+                keep[num_keep++] = utilshell_profile_fd;
+                keep[num_keep++] = utilshell_history_fd;
+            }
+            utilshell_close_fds(keep, num_keep);
+            // The assignments of the command only have to last as long as the child.
+            for(int k = 0; k < stage->num_assigns; ++k) {
+                const char *equals = strchr(stage->assigns[k], '=');
+                utilshell_var_set(stage->assigns[k], equals - stage->assigns[k], equals + 1, true);
+            }
+            int argc = 0;
+            while(stage->args[argc] != NULL)
+                ++argc;
+            int status = stage->builtin->func(argc, stage->args);
+            fflush(stdout);
+            _exit(status);
+        }
+
+        if(envp != NULL)
+            execve(stage->path, stage->args, envp);
+        errsv = errno;
+        shell_error("Could not execute \"%s\". errno:%d\n", stage->args[0], errsv);
+        _exit(errsv == EACCES || errsv == ENOEXEC ? 126 : 127);
+
+    } else if(pid == -1) {
+
+        errsv = errno;
+        shell_error("Could not start \"%s\". errno:%d\n", stage->args[0], errsv);
+
+    }
+
+    return pid;
+
+}
+
+/* Pins a started stage to the CPUs chosen with set cpus=... (if any). index is the position of the stage in its
+ * pipeline. This is done from the shell, since posix_spawn() has no attribute for it.
+ */
+void utilshell_stage_pin(struct utilshell_stage *stage, int index) {
+
+    if(!utilshell_pinned)
+        return;
+
+    cpu_set_t cpus = utilshell_cpus;
+    if(utilshell_cpus_spread) {
+        int n = index % CPU_COUNT(&utilshell_cpus);
+        int cpu = 0;
+        while(!CPU_ISSET(cpu, &utilshell_cpus) || n-- > 0)
+            ++cpu;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+    }
+
+    // The stage may already have exited, which is not an error.
+    if(sched_setaffinity(stage->pid, sizeof(cpus), &cpus) == -1) {
+        int errsv = errno;
+        if(errsv != ESRCH)
+            shell_error("Could not pin \"%s\" to CPUs. errno:%d\n", stage->args[0], errsv);
+        return;
+    }
+
+    utilshell_cpus_format(&cpus, stage->cpus, sizeof(stage->cpus));
+
+}
+
+/* Runs a list of parsed commands (see struct utilshell_node). The exit status of every command is kept in
+ * utilshell_last_status, which decides the branches of if, while, && and ||. A loop stops when one of its commands
+ * is interrupted with Ctrl-C.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE if a command could not be run.
+ */
+int utilshell_run(struct utilshell_node *node) {
+
+    int result = EXIT_SUCCESS;
+    int status;
+
+    for(; node != NULL; node = node->next) {
+
+        switch(node->type) {
+
+            case UTILSHELL_NODE_PIPELINE:
+            if(utilshell_exec(node->pipeline) != EXIT_SUCCESS) {
+                utilshell_last_status = EXIT_FAILURE;
+                result = EXIT_FAILURE;
+            }
+            break;
+
+            case UTILSHELL_NODE_AND:
+            case UTILSHELL_NODE_OR:
+            if(utilshell_run(node->left) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+            if((utilshell_last_status == EXIT_SUCCESS) == (node->type == UTILSHELL_NODE_AND) && utilshell_run(node->right) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+            break;
+
+            case UTILSHELL_NODE_IF:
+            if(utilshell_run(node->cond) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+            if(utilshell_last_status == EXIT_SUCCESS) {
+                if(utilshell_run(node->body) != EXIT_SUCCESS)
+                    result = EXIT_FAILURE;
+            } else if(node->else_body != NULL) {
+                if(utilshell_run(node->else_body) != EXIT_SUCCESS)
+                    result = EXIT_FAILURE;
+            } else {
+                utilshell_last_status = EXIT_SUCCESS;
+            }
+            break;
+
+            case UTILSHELL_NODE_WHILE:
+
+            // The status of a loop is the status of the last command of its body (0 if the body never ran).
+            status = EXIT_SUCCESS;
+            while(true) {
+                if(utilshell_run(node->cond) != EXIT_SUCCESS)
+                    result = EXIT_FAILURE;
+                if((utilshell_last_status == EXIT_SUCCESS) == node->negate || utilshell_last_status == 128 + SIGINT)
+                    break;
+                if(utilshell_run(node->body) != EXIT_SUCCESS)
+                    result = EXIT_FAILURE;
+                status = utilshell_last_status;
+                if(status == 128 + SIGINT)
+                    break;
+            }
+            utilshell_last_status = status;
+            break;
+
+            case UTILSHELL_NODE_FOR: {
+
+                /* The words are expanded into an arena of their own, since every pipeline of the body resets the
+                 * scratch arena. The loop variable is a shell variable (exported only if it already was).
+                 */
+                struct utilshell_arena *arena = utilshell_arena_create();
+                char **values = arena != NULL ? utilshell_expand_words(node->words, node->num_words, arena) : NULL;
+                if(values == NULL) {
+                    if(arena != NULL)
+                        utilshell_arena_destroy(arena);
+                    utilshell_last_status = EXIT_FAILURE;
+                    result = EXIT_FAILURE;
+                    break;
+                }
+
+                status = EXIT_SUCCESS;
+                for(int i = 0; values[i] != NULL; ++i) {
+                    if(utilshell_var_set(node->name->text, strlen(node->name->text), values[i], false) == NULL) {
+                        result = EXIT_FAILURE;
+                        break;
+                    }
+                    if(utilshell_run(node->body) != EXIT_SUCCESS)
+                        result = EXIT_FAILURE;
+                    status = utilshell_last_status;
+                    if(status == 128 + SIGINT)
+                        break;
+                }
+                utilshell_last_status = status;
+                utilshell_arena_destroy(arena);
+                break;
+
+            }
+
+        }
+
+    }
+
+    return result;
+
+}
+
+/* Runs a pipeline (cmd | cmd | ...). Every pipe is created and every stage is started at once, so the stages stream
+ * data to each other instead of running one after another. All stages are put in one process group (led by the
+ * first stage) and are reaped together unless the pipeline runs in the background. Process substitutions in the
+ * words of the stages are started while the words are expanded and become part of the same job.
+ */
+int utilshell_exec(struct utilshell_pipeline *pipeline) {
+
+    if(pipeline == NULL)
+        return EXIT_SUCCESS;
+
+    bool background = pipeline->background;
+    bool timed = pipeline->timed;
+
+    // The stages and pipes were allocated by utilshell_lower(). Words that need expanding go to the scratch arena.
+    int num_stages = pipeline->num_commands;
+    struct utilshell_stage *stages = pipeline->stages;
+    utilshell_arena_reset(utilshell_scratch_arena);
+    utilshell_substs = NULL;
+    utilshell_pgid = 0;
+
+    if(utilshell_expand_stages(pipeline) != EXIT_SUCCESS) {
+        for(int i = 0; i < num_stages; ++i)
+            utilshell_close_redirects(stages + i);
+        utilshell_substs_wait();
+        return EXIT_FAILURE;
+    }
+
+    // Nothing to execute (eg. the input only had redirects). Assignments on their own set shell variables.
+    if(stages[0].args[0] == NULL) {
+        for(int k = 0; k < stages[0].num_assigns && !background; ++k) {
+            const char *equals = strchr(stages[0].assigns[k], '=');
+            if(utilshell_var_set(stages[0].assigns[k], equals - stages[0].assigns[k], equals + 1, false) == NULL) {
+                utilshell_close_redirects(stages);
+                utilshell_substs_wait();
+                return EXIT_FAILURE;
+            }
+        }
+        utilshell_close_redirects(stages);
+        utilshell_substs_wait();
+        if(timed)
+            utilshell_time_report(0, 0, 0);
+        return EXIT_SUCCESS;
+    }
+
+    // A builtin on its own runs inside the shell. In a pipeline or in the background it runs in a child.
+    if(num_stages == 1 && !background && stages[0].builtin != NULL) {
+
+        // Builtins such as parallel start processes of their own, which are counted once they are reaped.
+        struct timespec started, ended;
+        struct rusage before, after, children_before, children_after;
+        if(timed) {
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            getrusage(RUSAGE_SELF, &before);
+            getrusage(RUSAGE_CHILDREN, &children_before);
+        }
+
+        // The assignments of the command are exported while the builtin runs (eg. for the commands of parallel).
+        struct utilshell_var *saved = NULL;
+        if(stages[0].num_assigns > 0 && (saved = utilshell_vars_push(stages[0].assigns, stages[0].num_assigns)) == NULL) {
+            utilshell_close_redirects(stages);
+            utilshell_substs_wait();
+            return EXIT_FAILURE;
+        }
+
+        // Builtins such as cat may read the rest of the input, the same as other commands.
+        utilshell_input_release();
+        utilshell_subst_stage = stages;
+        int status = utilshell_run_builtin(stages);
+        utilshell_subst_stage = NULL;
+        if(saved != NULL)
+            utilshell_vars_pop(stages[0].assigns, stages[0].num_assigns, saved);
+        utilshell_close_redirects(stages);
+        utilshell_substs_wait();
+        utilshell_last_status = status;
+        utilshell_input_reclaim();
+
+        if(timed) {
+            clock_gettime(CLOCK_MONOTONIC, &ended);
+            getrusage(RUSAGE_SELF, &after);
+            getrusage(RUSAGE_CHILDREN, &children_after);
+            utilshell_time_report(utilshell_seconds(started, ended),
+                utilshell_tv_seconds(after.ru_utime) - utilshell_tv_seconds(before.ru_utime)
+                    + utilshell_tv_seconds(children_after.ru_utime) - utilshell_tv_seconds(children_before.ru_utime),
+                utilshell_tv_seconds(after.ru_stime) - utilshell_tv_seconds(before.ru_stime)
+                    + utilshell_tv_seconds(children_after.ru_stime) - utilshell_tv_seconds(children_before.ru_stime));
+        }
+        return EXIT_SUCCESS;
+
+    }
+
+    // A background job has to get a jobserver token first (if there is a jobserver), which may mean waiting.
+    int jobserver_slot = background ? utilshell_jobserver_acquire() : -1;
+    if(jobserver_slot == UTILSHELL_JOBSERVER_INTERRUPTED) {
+        for(int i = 0; i < num_stages; ++i)
+            utilshell_close_redirects(stages + i);
+        utilshell_substs_wait();
+        utilshell_last_status = 128 + SIGINT;
+        return EXIT_SUCCESS;
+    }
+
+    // Start every stage.
+    struct rusage shell_usage;
+    getrusage(RUSAGE_SELF, &shell_usage);
+    utilshell_input_release();
+    int pipe_size = 0;
+    int num_started = utilshell_start_stages(pipeline, -1, -1, &pipe_size);
+    if(num_started == -1) {
+        utilshell_jobserver_release(jobserver_slot);
+        for(int i = 0; i < num_stages; ++i)
+            utilshell_close_redirects(stages + i);
+        utilshell_substs_wait();
+        utilshell_input_reclaim();
+        return EXIT_FAILURE;
+    }
+
+    // Every pipeline becomes a job. A foreground job owns the terminal until it exits or is stopped.
+    if(num_started > 0) {
+
+        int num_job_stages = num_stages;
+        struct utilshell_stage *job_stages = utilshell_substs_stages(stages, &num_job_stages);
+        struct utilshell_job *job = job_stages != NULL ? utilshell_job_add(job_stages, num_job_stages, utilshell_pgid, pipeline->text, background) : NULL;
+
+        if(job != NULL) {
+            job->timed = timed;
+            job->profiled = timed || utilshell_profile_fd != -1;
+            job->shell_usage = shell_usage;
+            job->pipe_size = pipe_size > 0 ? pipe_size : 0;
+            job->jobserver_slot = jobserver_slot;
+        }
+
+        if(job == NULL) {
+            utilshell_jobserver_release(jobserver_slot);
+            utilshell_last_status = 127;
+        } else if(background) {
+            utilshell_last_status = EXIT_SUCCESS;
+            if(utilshell_prompt_visible)
+                printf("[%d] %d\n", job->id, (int)job->pgid);
+        } else {
+            utilshell_last_status = utilshell_job_foreground(job, false);
+        }
+
+    } else {
+        utilshell_jobserver_release(jobserver_slot);
+        utilshell_substs_wait();
+        utilshell_last_status = background ? EXIT_SUCCESS : stages[num_stages - 1].status;
+    }
+
+    utilshell_input_reclaim();
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Expands the words of every stage of a pipeline, except for commands whose argv was built by utilshell_lower().
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_expand_stages(struct utilshell_pipeline *pipeline) {
+
+    int num_stages = pipeline->num_commands;
+    struct utilshell_stage *stages = pipeline->stages;
+    int result = EXIT_SUCCESS;
+
+    // Every stage is cleared first, so that the redirects of all of them can be closed if one fails.
+    memset(stages, 0, num_stages*sizeof(struct utilshell_stage));
+    for(int i = 0; i < num_stages; ++i)
+        stages[i].command = pipeline->commands + i;
+
+    for(int i = 0; i < num_stages && result == EXIT_SUCCESS; ++i) {
+
+        struct utilshell_stage *stage = stages + i;
+        struct utilshell_command *command = pipeline->commands + i;
+
+        utilshell_subst_stage = stage;
+        if(command->argv != NULL) {
+            stage->args = command->argv;
+            stage->builtin = command->builtin;
+        } else if((stage->args = utilshell_expand_words(command->words, command->num_words, utilshell_scratch_arena)) == NULL) {
+            result = EXIT_FAILURE;
+        } else if(stage->args[0] != NULL) {
+            stage->builtin = utilshell_builtin_find(stage->args[0]);
+        }
+        utilshell_subst_stage = NULL;
+
+        /* Assignments are expanded after the words, the same as in other shells, and from left to right: each one is
+         * set while the ones after it are expanded (eg. X=5 Y=$X gives Y=5). They are only set for good (or for the
+         * command) by the caller, so the earlier values are put back here.
+         */
+        if(result == EXIT_SUCCESS && command->num_assigns > 0) {
+            int n = command->num_assigns;
+            stage->assigns = (char**)utilshell_arena_alloc(utilshell_scratch_arena, n*sizeof(char*));
+            struct utilshell_var **saved = (struct utilshell_var**)utilshell_arena_alloc(utilshell_scratch_arena, n*sizeof(struct utilshell_var*));
+            if(stage->assigns == NULL || saved == NULL)
+                result = EXIT_FAILURE;
+            int pushed = 0;
+            for(int j = 0; j < n && result == EXIT_SUCCESS; ++j) {
+                if((stage->assigns[j] = utilshell_expand_assign(command->assigns[j], utilshell_scratch_arena)) == NULL)
+                    result = EXIT_FAILURE;
+                else
+                    ++stage->num_assigns;
+                // Nothing is expanded after the last one.
+                if(result == EXIT_SUCCESS && j < n - 1) {
+                    if((saved[j] = utilshell_vars_push(stage->assigns + j, 1)) == NULL)
+                        result = EXIT_FAILURE;
+                    else
+                        ++pushed;
+                }
+            }
+            for(int j = pushed - 1; j >= 0; --j)
+                utilshell_vars_pop(stage->assigns + j, 1, saved[j]);
+        }
+
+        // A command run from a file gets an environment with its assignments in it.
+        if(result == EXIT_SUCCESS && stage->num_assigns > 0 && stage->args[0] != NULL && stage->builtin == NULL &&
+            (stage->envp = utilshell_var_envp_with(stage->assigns, stage->num_assigns, utilshell_scratch_arena)) == NULL)
+            result = EXIT_FAILURE;
+
+        // Every stage of a pipeline needs a command to run, even after expansion.
+        if(result == EXIT_SUCCESS && stage->args[0] == NULL && num_stages > 1) {
+            shell_error("Syntax error: empty command in pipeline.\n");
+            utilshell_last_status = 2;
+            result = EXIT_FAILURE;
+        }
+
+    }
+
+    return result;
+
+}
+
+/* Starts every stage of a pipeline whose words have been expanded, with a pipe between each two of them. The first
+ * stage reads from in_fd and the last one writes to out_fd (-1 to inherit them from the shell). The stages join the
+ * process group utilshell_pgid, or start it if it is 0. *pipe_size is set to the size of the pipes.
+ * Returns the number of stages started, or -1 if the pipes could not be created.
+ */
+int utilshell_start_stages(struct utilshell_pipeline *pipeline, int in_fd, int out_fd, int *pipe_size) {
+
+    int num_stages = pipeline->num_commands;
+    struct utilshell_stage *stages = pipeline->stages;
+    int *pipes = pipeline->pipes;
+
+    // Create every pipe up front. pipes[2*i] is read by stage i+1 and pipes[2*i+1] is written by stage i.
+    int num_pipes = num_stages - 1;
+    for(int i = 0; i < num_pipes; ++i) {
+        if(pipe2(pipes + 2*i, O_CLOEXEC) == -1) {
+            int errsv = errno;
+            shell_error("Could not create pipe. errno:%d\n", errsv);
+            for(int k = 0; k < 2*i; ++k)
+                close(pipes[k]);
+            return -1;
+        }
+        // A larger pipe lets the stages move more data per context switch. If it cannot be grown, it still works.
+        if(utilshell_pipe_size > 0)
+            fcntl(pipes[2*i+1], F_SETPIPE_SZ, utilshell_pipe_size);
+    }
+    *pipe_size = num_pipes > 0 ? fcntl(pipes[0], F_GETPIPE_SZ) : 0;
+
+    int num_started = 0;
+    for(int i = 0; i < num_stages; ++i) {
+
+        struct utilshell_stage *stage = stages + i;
+
+        // Wire this stage into the pipeline.
+        stage->fds[STDIN_FILENO] = i > 0 ? pipes[2*(i-1)] : in_fd;
+        stage->fds[STDOUT_FILENO] = i < num_pipes ? pipes[2*i+1] : out_fd;
+        stage->fds[STDERR_FILENO] = -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &stage->started);
+
+        // Redirects may hold process substitutions of their own.
+        utilshell_subst_stage = stage;
+        stage->status = 127;
+        if(stage->builtin == NULL && (stage->path = utilshell_hash_lookup(stage->args[0])) == NULL) {
+            shell_error("Could not execute \"%s\". errno:%d\n", stage->args[0], ENOENT);
+            stage->pid = -1;
+        } else if(utilshell_open_redirects(stage) != EXIT_SUCCESS) {
+            stage->status = EXIT_FAILURE;
+            stage->pid = -1;
+        } else if(utilshell_use_fork || stage->builtin != NULL)
+            stage->pid = utilshell_launch_fork(stage, utilshell_pgid);
+        else
+            stage->pid = utilshell_launch_spawn(stage, utilshell_pgid);
+        utilshell_subst_stage = NULL;
+
+        utilshell_close_redirects(stage);
+
+        if(stage->pid > 0) {
+
+            // Set the process group from the parent as well so there is no race with the child.
+            if(utilshell_pgid == 0)
+                utilshell_pgid = stage->pid;
+            setpgid(stage->pid, utilshell_pgid);
+            utilshell_stage_pin(stage, i);
+            ++num_started;
+
+        }
+
+    }
+
+    // The shell does not need any of the pipe ends. Closing them lets the stages see EOF.
+    for(int i = 0; i < 2*num_pipes; ++i)
+        close(pipes[i]);
+
+    return num_started;
+
+}
+
+/* Starts the pipeline of a process substitution for the stage whose words are being expanded (utilshell_subst_stage).
+ * They are connected through a pipe: <(cmd) writes into it and >(cmd) reads from it. The stage gets the other end of
+ * the pipe under the same fd number, so the returned path (/dev/fd/N) opens it. Returns NULL on error.
+ */
+char *utilshell_subst_start(struct utilshell_token *word, struct utilshell_arena *arena) {
+
+    struct utilshell_stage *stage = utilshell_subst_stage;
+    if(stage == NULL || word->subst == NULL) {
+        shell_error("Process substitution %s is not allowed here.\n", word->text);
+        return NULL;
+    }
+
+    struct utilshell_subst *subst = (struct utilshell_subst*)utilshell_arena_alloc(arena, sizeof(struct utilshell_subst));
+    int *pass_fds = (int*)utilshell_arena_alloc(arena, (stage->num_pass_fds + 1)*sizeof(int));
+    if(subst == NULL || pass_fds == NULL) {
+        shell_error("Could not allocate process substitution.\n");
+        return NULL;
+    }
+
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) == -1) {
+        int errsv = errno;
+        shell_error("Could not create pipe. errno:%d\n", errsv);
+        return NULL;
+    }
+    bool input = word->text[0] == '<';
+    int keep = input ? fds[0] : fds[1];
+    int give = input ? fds[1] : fds[0];
+
+    // Process substitutions nested in the pipeline belong to its own stages.
+    struct utilshell_pipeline *pipeline = word->subst;
+    int pipe_size;
+    int num_started = 0;
+    if(utilshell_expand_stages(pipeline) == EXIT_SUCCESS && pipeline->stages[0].args[0] != NULL)
+        num_started = utilshell_start_stages(pipeline, input ? -1 : give, input ? give : -1, &pipe_size);
+    else
+        for(int i = 0; i < pipeline->num_commands; ++i)
+            utilshell_close_redirects(pipeline->stages + i);
+    utilshell_subst_stage = stage;
+    close(give);
+
+    if(num_started <= 0) {
+        close(keep);
+        return NULL;
+    }
+
+    subst->pipeline = pipeline;
+    subst->next = utilshell_substs;
+    utilshell_substs = subst;
+
+    if(stage->num_pass_fds > 0)
+        memcpy(pass_fds, stage->pass_fds, stage->num_pass_fds*sizeof(int));
+    pass_fds[stage->num_pass_fds++] = keep;
+    stage->pass_fds = pass_fds;
+
+    char path[32];
+    int n = snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+    return utilshell_arena_strndup(arena, path, n);
+
+}
+
+/* Returns the stages of a job: the stages of the process substitutions of the pipeline (from utilshell_scratch_arena),
+ * followed by the num_stages stages given (so the last stage still gives the status of the job). *num_stages is
+ * updated. Returns stages itself if there are no substitutions, NULL on error.
+ */
+struct utilshell_stage *utilshell_substs_stages(struct utilshell_stage *stages, int *num_stages) {
+
+    int count = *num_stages;
+    for(struct utilshell_subst *subst = utilshell_substs; subst != NULL; subst = subst->next)
+        count += subst->pipeline->num_commands;
+    if(count == *num_stages)
+        return stages;
+
+    struct utilshell_stage *all = (struct utilshell_stage*)utilshell_arena_alloc(utilshell_scratch_arena, count*sizeof(struct utilshell_stage));
+    if(all == NULL) {
+        shell_error("Could not allocate job of %d stages.\n", count);
+        return NULL;
+    }
+
+    int n = 0;
+    for(struct utilshell_subst *subst = utilshell_substs; subst != NULL; subst = subst->next)
+        for(int i = 0; i < subst->pipeline->num_commands; ++i)
+            all[n++] = subst->pipeline->stages[i];
+    memcpy(all + n, stages, *num_stages*sizeof(struct utilshell_stage));
+
+    *num_stages = count;
+    return all;
+
+}
+
+/* Waits for the process substitutions of a pipeline whose own stages did not start (eg. a builtin that ran inside the
+ * shell). They run as a job of their own in the foreground. utilshell_last_status is left alone.
+ */
+void utilshell_substs_wait() {
+
+    int num_stages = 0;
+    struct utilshell_stage *stages = utilshell_substs != NULL ? utilshell_substs_stages(NULL, &num_stages) : NULL;
+    utilshell_substs = NULL;
+    if(stages == NULL || utilshell_pgid == 0)
+        return;
+
+    int status = utilshell_last_status;
+    struct utilshell_job *job = utilshell_job_add(stages, num_stages, utilshell_pgid, "process substitution", false);
+    if(job != NULL)
+        utilshell_job_foreground(job, false);
+    utilshell_last_status = status;
+
+}
+
+
+// FNV-1a hash of a string.
+unsigned int utilshell_hash_string(const char *s) {
+
+    unsigned int h = 2166136261u;
+    for(; *s != '\0'; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+
+}
+
+// Returns the hash table entry of a command, or NULL if the command is not remembered.
+struct utilshell_hash_entry *utilshell_hash_find(const char *name) {
+
+    if(utilshell_hash_count == 0)
+        return NULL;
+
+    unsigned int b = utilshell_hash_string(name) & (utilshell_hash_buckets - 1);
+    for(struct utilshell_hash_entry *e = utilshell_hash_table[b]; e != NULL; e = e->next)
+        if(strcmp(e->name, name) == 0)
+            return e;
+
+    return NULL;
+
+}
+
+// Remembers path as the location of the command name. Returns the new entry, or NULL on error.
+struct utilshell_hash_entry *utilshell_hash_add(const char *name, const char *path) {
+
+    // Grow the table once it holds as many entries as it has buckets.
+    if(utilshell_hash_count >= utilshell_hash_buckets) {
+
+        int new_buckets = utilshell_hash_buckets == 0 ? 64 : utilshell_hash_buckets * 2;
+        struct utilshell_hash_entry **new_table = (struct utilshell_hash_entry**)calloc(new_buckets, sizeof(struct utilshell_hash_entry*));
+        if(new_table == NULL) {
+            shell_error("Could not grow command hash table to %d buckets.\n", new_buckets);
+            return NULL;
+        }
+
+        for(int b = 0; b < utilshell_hash_buckets; ++b) {
+            struct utilshell_hash_entry *e = utilshell_hash_table[b];
+            while(e != NULL) {
+                struct utilshell_hash_entry *next = e->next;
+                unsigned int nb = utilshell_hash_string(e->name) & (new_buckets - 1);
+                e->next = new_table[nb];
+                new_table[nb] = e;
+                e = next;
+            }
+        }
+
+        free(utilshell_hash_table);
+        utilshell_hash_table = new_table;
+        utilshell_hash_buckets = new_buckets;
+
+    }
+
+    struct utilshell_hash_entry *e = (struct utilshell_hash_entry*)malloc(sizeof(struct utilshell_hash_entry));
+    if(e == NULL)
+        return NULL;
+    e->name = strdup(name);
+    e->path = strdup(path);
+    e->hits = 0;
+
+    unsigned int b = utilshell_hash_string(name) & (utilshell_hash_buckets - 1);
+    e->next = utilshell_hash_table[b];
+    utilshell_hash_table[b] = e;
+    ++utilshell_hash_count;
+
+    return e;
+
+}
+
+// Forgets the location of a command.
+void utilshell_hash_forget(const char *name) {
+
+    if(utilshell_hash_count == 0)
+        return;
+
+    unsigned int b = utilshell_hash_string(name) & (utilshell_hash_buckets - 1);
+    for(struct utilshell_hash_entry **link = utilshell_hash_table + b; *link != NULL; link = &(*link)->next) {
+        struct utilshell_hash_entry *e = *link;
+        if(strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            --utilshell_hash_count;
+            return;
+        }
+    }
+
+}
+
+// Forgets the location of every command.
+void utilshell_hash_clear() {
+
+    for(int b = 0; b < utilshell_hash_buckets; ++b) {
+        struct utilshell_hash_entry *e = utilshell_hash_table[b];
+        while(e != NULL) {
+            struct utilshell_hash_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        utilshell_hash_table[b] = NULL;
+    }
+    utilshell_hash_count = 0;
+
+}
+
+/* Searches every directory of $PATH for an executable regular file called name, the same way execvp() would.
+ * Returns a malloc'd path on success, NULL if the command was not found.
+ */
+char *utilshell_path_search(const char *name) {
+
+    const char *path = utilshell_var_get("PATH");
+    if(path == NULL)
+        path = "/usr/local/bin:/usr/bin:/bin";
+
+    size_t name_len = strlen(name);
+    char *candidate = NULL;
+
+    while(true) {
+
+        // An empty entry in $PATH means the current directory.
+        const char *end = strchrnul(path, ':');
+        size_t dir_len = end - path;
+
+        char *new_candidate = (char*)realloc(candidate, dir_len + name_len + 3);
+        if(new_candidate == NULL)
+            break;
+        candidate = new_candidate;
+
+        if(dir_len == 0) {
+            strcpy(candidate, "./");
+        } else {
+            memcpy(candidate, path, dir_len);
+            candidate[dir_len] = '/';
+            candidate[dir_len + 1] = '\0';
+        }
+        strcat(candidate, name);
+
+        struct stat st;
+        if(stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+
+        if(*end == '\0')
+            break;
+        path = end + 1;
+
+    }
+
+    free(candidate);
+    return NULL;
+
+}
+
+// Forgets every remembered command if $PATH changed since the table was filled.
+void utilshell_hash_sync() {
+
+    const char *path = utilshell_var_get("PATH");
+    if(path == NULL)
+        path = "";
+    if(utilshell_hash_path == NULL || strcmp(utilshell_hash_path, path) != 0) {
+        utilshell_hash_clear();
+        free(utilshell_hash_path);
+        utilshell_hash_path = strdup(path);
+    }
+
+}
+
+/* Resolves a command name to the path that should be executed. Names containing a slash are used as is. Otherwise
+ * the command hash table is used, and filled from $PATH on a miss. The table is cleared whenever $PATH changes.
+ * Commands found through a relative $PATH entry are not remembered, since they depend on the current directory.
+ * Returns NULL if the command could not be found.
+ */
+const char *utilshell_hash_lookup(const char *name) {
+
+    if(strchr(name, '/') != NULL)
+        return name;
+
+    utilshell_hash_sync();
+
+    struct utilshell_hash_entry *e = utilshell_hash_find(name);
+
+    if(e == NULL) {
+
+        char *found = utilshell_path_search(name);
+        if(found == NULL)
+            return NULL;
+
+        if(found[0] != '/' || (e = utilshell_hash_add(name, found)) == NULL) {
+            // Hand out a path that stays valid until the next lookup of an unremembered command.
+            static char *uncached = NULL;
+            free(uncached);
+            uncached = found;
+            return uncached;
+        }
+        free(found);
+
+    }
+
+    ++e->hits;
+    return e->path;
+
+}
+
+// FNV-1a hash of the first n bytes of a variable name.
+unsigned int utilshell_var_hash(const char *name, size_t n) {
+
+    unsigned int h = 2166136261u;
+    for(size_t k = 0; k < n; ++k) {
+        h ^= (unsigned char)name[k];
+        h *= 16777619u;
+    }
+    return h;
+
+}
+
+/* Fills the variables from the environment the shell was started with. Every one of them is exported.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_vars_init() {
+
+    for(char **env = environ; *env != NULL; ++env) {
+        const char *equals = strchr(*env, '=');
+        if(equals == NULL || equals == *env)
+            continue;
+        if(utilshell_var_set(*env, equals - *env, equals + 1, true) == NULL)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+// Returns the variable called by the first n bytes of name, or NULL if it is not set.
+struct utilshell_var *utilshell_var_find(const char *name, size_t n) {
+
+    if(utilshell_var_count == 0)
+        return NULL;
+
+    unsigned int h = utilshell_var_hash(name, n);
+    unsigned int slot = h & (utilshell_var_slots - 1);
+    while(utilshell_vars[slot].text != NULL || utilshell_vars[slot].removed) {
+        struct utilshell_var *var = utilshell_vars + slot;
+        if(var->text != NULL && var->hash == h && var->name_len == n && memcmp(var->text, name, n) == 0)
+            return var;
+        slot = (slot + 1) & (utilshell_var_slots - 1);
+    }
+
+    return NULL;
+
+}
+
+// Returns the value of a variable, or NULL if it is not set.
+const char *utilshell_var_get(const char *name) {
+
+    size_t n = strlen(name);
+    struct utilshell_var *var = utilshell_var_find(name, n);
+    return var != NULL ? var->text + n + 1 : NULL;
+
+}
+
+/* Sets the variable called by the first n bytes of name to value. If exported is true, the variable is exported;
+ * otherwise it stays exported if it was. Returns the variable, or NULL on error.
+ */
+struct utilshell_var *utilshell_var_set(const char *name, size_t n, const char *value, bool exported) {
+
+    size_t value_len = strlen(value);
+    char *text = (char*)malloc(n + value_len + 2);
+    if(text == NULL) {
+        shell_error("Could not allocate variable of %zu bytes.\n", n + value_len + 2);
+        return NULL;
+    }
+    memcpy(text, name, n);
+    text[n] = '=';
+    memcpy(text + n + 1, value, value_len + 1);
+
+    struct utilshell_var *var = utilshell_var_find(name, n);
+    if(var != NULL) {
+        free(var->text);
+        var->text = text;
+        var->exported = var->exported || exported;
+        utilshell_envp_dirty = utilshell_envp_dirty || var->exported;
+        return var;
+    }
+
+    // A name marked by export NAME is exported once it is set.
+    if(utilshell_num_export_names > 0 && utilshell_export_take(name, n))
+        exported = true;
+
+    // Keep the table at most half full (counting removed variables, which are dropped when it grows).
+    if((utilshell_var_used + 1) * 2 > utilshell_var_slots) {
+        int new_slots = utilshell_var_slots == 0 ? 256 : utilshell_var_slots;
+        while((utilshell_var_count + 1) * 4 > new_slots)
+            new_slots *= 2;
+        struct utilshell_var *table = (struct utilshell_var*)calloc(new_slots, sizeof(struct utilshell_var));
+        if(table == NULL) {
+            shell_error("Could not grow the variables to %d slots.\n", new_slots);
+            free(text);
+            return NULL;
+        }
+        for(int i = 0; i < utilshell_var_slots; ++i) {
+            if(utilshell_vars[i].text == NULL)
+                continue;
+            unsigned int slot = utilshell_vars[i].hash & (new_slots - 1);
+            while(table[slot].text != NULL)
+                slot = (slot + 1) & (new_slots - 1);
+            table[slot] = utilshell_vars[i];
+        }
+        free(utilshell_vars);
+        utilshell_vars = table;
+        utilshell_var_slots = new_slots;
+        utilshell_var_used = utilshell_var_count;
+    }
+
+    // A removed variable is not the end of a probe, but its slot can take the new one.
+    unsigned int h = utilshell_var_hash(name, n);
+    unsigned int slot = h & (utilshell_var_slots - 1);
+    while(utilshell_vars[slot].text != NULL)
+        slot = (slot + 1) & (utilshell_var_slots - 1);
+    var = utilshell_vars + slot;
+    if(!var->removed)
+        ++utilshell_var_used;
+    var->text = text;
+    var->name_len = n;
+    var->hash = h;
+    var->exported = exported;
+    var->removed = false;
+    ++utilshell_var_count;
+    utilshell_envp_dirty = utilshell_envp_dirty || exported;
+    return var;
+
+}
+
+// Unsets the variable called by the first n bytes of name, if it is set.
+void utilshell_var_unset(const char *name, size_t n) {
+
+    // Unsetting a name also takes back export NAME.
+    if(utilshell_num_export_names > 0)
+        utilshell_export_take(name, n);
+
+    struct utilshell_var *var = utilshell_var_find(name, n);
+    if(var == NULL)
+        return;
+
+    utilshell_envp_dirty = utilshell_envp_dirty || var->exported;
+    free(var->text);
+    var->text = NULL;
+    var->exported = false;
+    var->removed = true;
+    --utilshell_var_count;
+
+}
+
+// Removes the first n bytes of name from the names marked by export NAME. Returns true if it was marked.
+bool utilshell_export_take(const char *name, size_t n) {
+
+    for(int i = 0; i < utilshell_num_export_names; ++i) {
+        if(strncmp(utilshell_export_names[i], name, n) == 0 && utilshell_export_names[i][n] == '\0') {
+            free(utilshell_export_names[i]);
+            utilshell_export_names[i] = utilshell_export_names[--utilshell_num_export_names];
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+// Returns true if the first n bytes of name are a valid variable name.
+bool utilshell_var_name(const char *name, size_t n) {
+
+    if(n == 0 || isdigit((unsigned char)name[0]))
+        return false;
+    for(size_t k = 0; k < n; ++k)
+        if(!isalnum((unsigned char)name[k]) && name[k] != '_')
+            return false;
+    return true;
+
+}
+
+/* Returns the environment of commands: the text of every exported variable, ending with NULL. It stays valid until an
+ * exported variable changes, and is only built again then. Returns NULL on error.
+ */
+char **utilshell_var_envp() {
+
+    if(utilshell_envp != NULL && !utilshell_envp_dirty)
+        return utilshell_envp;
+
+    char **envp = (char**)realloc(utilshell_envp, (utilshell_var_count + 1)*sizeof(char*));
+    if(envp == NULL) {
+        shell_error("Could not allocate environment of %d variables.\n", utilshell_var_count);
+        return NULL;
+    }
+    utilshell_envp = envp;
+
+    int count = 0;
+    for(int i = 0; i < utilshell_var_slots; ++i)
+        if(utilshell_vars[i].text != NULL && utilshell_vars[i].exported)
+            envp[count++] = utilshell_vars[i].text;
+    envp[count] = NULL;
+    utilshell_envp_dirty = false;
+    return envp;
+
+}
+
+/* Returns the environment of a command with assignments (NAME=value strings), allocated from arena: the environment
+ * of commands with the assigned variables replaced or added. Returns NULL on error.
+ */
+char **utilshell_var_envp_with(char **assigns, int num_assigns, struct utilshell_arena *arena) {
+
+    char **base = utilshell_var_envp();
+    if(base == NULL)
+        return NULL;
+    int count = 0;
+    while(base[count] != NULL)
+        ++count;
+
+    char **envp = (char**)utilshell_arena_alloc(arena, (count + num_assigns + 1)*sizeof(char*));
+    if(envp == NULL) {
+        shell_error("Could not allocate environment of %d variables.\n", count + num_assigns);
+        return NULL;
+    }
+
+    // If a name is assigned twice, the last assignment wins.
+    int n = 0;
+    for(int k = 0; k < num_assigns; ++k) {
+        size_t name_len = strchr(assigns[k], '=') - assigns[k];
+        bool again = false;
+        for(int j = k + 1; j < num_assigns && !again; ++j)
+            again = strncmp(assigns[j], assigns[k], name_len + 1) == 0;
+        if(!again)
+            envp[n++] = assigns[k];
+    }
+    for(int i = 0; i < count; ++i) {
+        bool assigned = false;
+        for(int k = 0; k < num_assigns && !assigned; ++k) {
+            size_t name_len = strchr(assigns[k], '=') - assigns[k];
+            assigned = strncmp(base[i], assigns[k], name_len + 1) == 0;
+        }
+        if(!assigned)
+            envp[n++] = base[i];
+    }
+    envp[n] = NULL;
+    return envp;
+
+}
+
+/* Sets and exports the variables of assignments (NAME=value strings) for as long as a builtin runs in the shell.
+ * Returns what utilshell_vars_pop() needs to restore them afterwards (malloc'd), or NULL on error.
+ */
+struct utilshell_var *utilshell_vars_push(char **assigns, int num_assigns) {
+
+    struct utilshell_var *saved = (struct utilshell_var*)calloc(num_assigns, sizeof(struct utilshell_var));
+    if(saved == NULL) {
+        shell_error("Could not allocate %d assignments.\n", num_assigns);
+        return NULL;
+    }
+
+    for(int k = 0; k < num_assigns; ++k) {
+        size_t name_len = strchr(assigns[k], '=') - assigns[k];
+        struct utilshell_var *var = utilshell_var_find(assigns[k], name_len);
+        if(var != NULL && (saved[k].text = strdup(var->text)) == NULL) {
+            shell_error("Could not save variable \"%s\".\n", assigns[k]);
+            utilshell_vars_pop(assigns, k, saved);
+            return NULL;
+        }
+        saved[k].exported = var != NULL && var->exported;
+        if(utilshell_var_set(assigns[k], name_len, assigns[k] + name_len + 1, true) == NULL) {
+            utilshell_vars_pop(assigns, k + 1, saved);
+            return NULL;
+        }
+    }
+
+    return saved;
+
+}
+
+// Restores the variables set by utilshell_vars_push() to what they were before, and frees saved.
+void utilshell_vars_pop(char **assigns, int num_assigns, struct utilshell_var *saved) {
+
+    // In reverse, so that a name assigned twice gets the value from before the first assignment.
+    for(int k = num_assigns - 1; k >= 0; --k) {
+        size_t name_len = strchr(assigns[k], '=') - assigns[k];
+        if(saved[k].text == NULL) {
+            utilshell_var_unset(assigns[k], name_len);
+            continue;
+        }
+        struct utilshell_var *var = utilshell_var_set(assigns[k], name_len, saved[k].text + name_len + 1, false);
+        if(var != NULL && var->exported != saved[k].exported) {
+            var->exported = saved[k].exported;
+            utilshell_envp_dirty = true;
+        }
+        free(saved[k].text);
+    }
+
+    free(saved);
+
+}
+
+// Compares two NAME=value strings by name, for qsort().
+int utilshell_var_compare(const void *a, const void *b) {
+
+    const char *s = *(const char**)a;
+    const char *t = *(const char**)b;
+    while(*s == *t && *s != '=' && *s != '\0') {
+        ++s;
+        ++t;
+    }
+    return (*s == '=' ? 0 : (unsigned char)*s) - (*t == '=' ? 0 : (unsigned char)*t);
+
+}
+
+/* Runs a builtin inside the shell. Its redirects are applied by saving the shell's own stdin/stdout/stderr, moving
+ * the redirect files in their place while the builtin runs, and restoring them afterwards.
+ * Returns the exit status of the builtin.
+ */
+int utilshell_run_builtin(struct utilshell_stage *stage) {
+
+    stage->fds[STDIN_FILENO] = -1;
+    stage->fds[STDOUT_FILENO] = -1;
+    stage->fds[STDERR_FILENO] = -1;
+    if(utilshell_open_redirects(stage) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    int saved[3] = { -1, -1, -1 };
+    fflush(stdout);
+    for(int k = 0; k < 3; ++k) {
+        if(stage->fds[k] != -1) {
+            saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 10);
+            dup2(stage->fds[k], k);
+        }
+    }
+
+    int argc = 0;
+    while(stage->args[argc] != NULL)
+        ++argc;
+    int status = stage->builtin->func(argc, stage->args);
+
+    fflush(stdout);
+    for(int k = 0; k < 3; ++k) {
+        if(saved[k] != -1) {
+            dup2(saved[k], k);
+            close(saved[k]);
+        } else if(stage->fds[k] != -1) {
+            close(k); // The stream was closed before the builtin ran.
+        }
+    }
+    utilshell_close_redirects(stage);
+
+    return status;
+
+}
+
+// Hash used by the builtin table. Only looks at the length and the first and last characters of the name.
+unsigned int utilshell_builtin_hash(const char *name, size_t len, unsigned int seed) {
+
+    unsigned int h = ((unsigned char)name[0] << 8 | (unsigned char)name[len - 1]) ^ (unsigned int)len << 16;
+    return (h * seed) >> 26; // The top 6 bits, one of UTILSHELL_BUILTIN_SLOTS.
+
+}
+
+/* Builds the perfect hash table of the builtins by trying seeds until every builtin lands in its own slot.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE if no seed works (the hash needs to look at more of the name).
+ */
+int utilshell_builtin_init() {
+
+    for(unsigned int seed = 2654435761u; seed != 2654435761u + 100000u; seed += 2) {
+
+        memset(utilshell_builtin_table, 0, sizeof(utilshell_builtin_table));
+
+        bool collision = false;
+        for(int i = 0; i < UTILSHELL_NUM_BUILTINS && !collision; ++i) {
+            const char *name = utilshell_builtins[i].name;
+            unsigned int slot = utilshell_builtin_hash(name, strlen(name), seed);
+            if(utilshell_builtin_table[slot] != NULL)
+                collision = true;
+            else
+                utilshell_builtin_table[slot] = utilshell_builtins + i;
+        }
+
+        if(!collision) {
+            utilshell_builtin_seed = seed;
+            return EXIT_SUCCESS;
+        }
+
+    }
+
+    shell_error("Could not build the builtin table.\n");
+    return EXIT_FAILURE;
+
+}
+
+// Returns the builtin called name, or NULL if there is none.
+const struct utilshell_builtin *utilshell_builtin_find(const char *name) {
+
+    size_t len = strlen(name);
+    if(len == 0)
+        return NULL;
+
+    const struct utilshell_builtin *builtin = utilshell_builtin_table[utilshell_builtin_hash(name, len, utilshell_builtin_seed)];
+    if(builtin == NULL || strcmp(builtin->name, name) != 0)
+        return NULL;
+
+    return builtin;
+
+}
+
+// Writes all n bytes of data to fd. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_write_all(int fd, const char *data, size_t n) {
+
+    while(n > 0) {
+        ssize_t written = write(fd, data, n);
+        if(written == -1) {
+            if(errno == EINTR)
+                continue;
+            int errsv = errno;
+            if(errsv != EPIPE)
+                shell_error("Could not write output. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        data += written;
+        n -= written;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Copies everything from in_fd to out_fd, moving the data inside the kernel when the two fds allow it:
+ *  a) copy_file_range() between regular files (which may share the blocks instead of copying them).
+ *  b) splice() if either side is a pipe.
+ *  c) sendfile() from a regular file to anything else (eg. a terminal or a socket).
+ *  d) A read()/write() loop through a large buffer for everything else, or if the calls above are not supported.
+ * A method is only given up on if it fails before moving any data. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_copy(int in_fd, int out_fd) {
+
+    struct stat in_st, out_st;
+    if(fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        int errsv = errno;
+        shell_error("Could not copy data. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    const int COPY_FILE_RANGE = 0;
+    const int SPLICE = 1;
+    const int SENDFILE = 2;
+    for(int method = COPY_FILE_RANGE; method <= SENDFILE; ++method) {
+
+        if(method == COPY_FILE_RANGE && !(S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)))
+            continue;
+        if(method == SPLICE && !S_ISFIFO(in_st.st_mode) && !S_ISFIFO(out_st.st_mode))
+            continue;
+        if(method == SENDFILE && !S_ISREG(in_st.st_mode))
+            continue;
+
+        bool moved = false;
+        while(true) {
+
+            ssize_t n;
+            if(method == COPY_FILE_RANGE)
+                n = copy_file_range(in_fd, NULL, out_fd, NULL, UTILSHELL_COPY_LEN, 0);
+            else if(method == SPLICE)
+                n = splice(in_fd, NULL, out_fd, NULL, UTILSHELL_COPY_LEN, SPLICE_F_MOVE);
+            else
+                n = sendfile(out_fd, in_fd, NULL, UTILSHELL_COPY_LEN);
+
+            if(n == 0)
+                return EXIT_SUCCESS;
+            if(n > 0) {
+                moved = true;
+                continue;
+            }
+            if(errno == EINTR)
+                continue;
+
+            // The fds do not support this method (eg. an O_APPEND file for copy_file_range()). Try the next one.
+            if(!moved)
+                break;
+
+            int errsv = errno;
+            if(errsv != EPIPE)
+                shell_error("Could not copy data. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+
+        }
+
+    }
+
+    char *buffer = utilshell_copy_buffer();
+    if(buffer == NULL)
+        return EXIT_FAILURE;
+
+    while(true) {
+        ssize_t n = read(in_fd, buffer, UTILSHELL_COPY_LEN);
+        if(n == 0)
+            return EXIT_SUCCESS;
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            int errsv = errno;
+            shell_error("Could not read input. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        if(utilshell_write_all(out_fd, buffer, n) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+
+}
+
+/* Moves n bytes from the pipe from_fd to out_fd with splice(), or through a buffer if out_fd does not support it.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_splice_all(int from_fd, int out_fd, size_t n) {
+
+    while(n > 0) {
+
+        ssize_t moved = splice(from_fd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+        if(moved > 0) {
+            n -= moved;
+            continue;
+        }
+        if(moved == -1 && errno == EINTR)
+            continue;
+
+        if(moved == -1 && errno == EINVAL) {
+            char *buffer = utilshell_copy_buffer();
+            while(buffer != NULL && n > 0) {
+                ssize_t r = read(from_fd, buffer, n < (size_t)UTILSHELL_COPY_LEN ? n : UTILSHELL_COPY_LEN);
+                if(r <= 0 || utilshell_write_all(out_fd, buffer, r) != EXIT_SUCCESS)
+                    return EXIT_FAILURE;
+                n -= r;
+            }
+            return buffer != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        int errsv = errno;
+        if(errsv != EPIPE)
+            shell_error("Could not write output. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+// Closes every fd above stderr except the num_keep fds in keep (which is sorted in place).
+void utilshell_close_fds(int *keep, int num_keep) {
+
+    for(int i = 1; i < num_keep; ++i)
+        for(int j = i; j > 0 && keep[j-1] > keep[j]; --j) {
+            int fd = keep[j];
+            keep[j] = keep[j-1];
+            keep[j-1] = fd;
+        }
+
+    // Close the ranges between the fds to keep.
+    unsigned int low = 3;
+    for(int k = 0; k <= num_keep; ++k) {
+        if(k < num_keep && keep[k] < (int)low) {
+            low = keep[k] >= 3 ? keep[k] + 1 : low;
+            continue;
+        }
+        unsigned int high = k < num_keep ? (unsigned int)keep[k] : ~0U;
+        if(high > low && close_range(low, high - 1, 0) == -1)
+            for(unsigned int fd = low; fd < high && fd < 1024; ++fd)
+                close(fd);
+        low = high + 1;
+    }
+
+}
+
+// Returns the buffer used by utilshell_copy() when the data has to pass through the shell (allocated once).
+char *utilshell_copy_buffer() {
+
+    static char *buffer = NULL;
+    if(buffer == NULL && (buffer = (char*)malloc(UTILSHELL_COPY_LEN)) == NULL)
+        shell_error("Could not allocate copy buffer of %d bytes.\n", UTILSHELL_COPY_LEN);
+    return buffer;
+
+}
+
+/* Parses a size in bytes, with an optional K, M or G suffix (eg. 1M). Returns EXIT_SUCCESS on success, EXIT_FAILURE if
+ * the size is not a number or larger than max.
+ */
+int utilshell_size_parse(const char *s, long long max, long long *size) {
+
+    char *end;
+    errno = 0;
+    long long n = strtoll(s, &end, 10);
+    if(end == s || n < 0 || errno != 0)
+        return EXIT_FAILURE;
+
+    int shift = 0;
+    if(*end == 'k' || *end == 'K')
+        shift = 10;
+    else if(*end == 'm' || *end == 'M')
+        shift = 20;
+    else if(*end == 'g' || *end == 'G')
+        shift = 30;
+    if(shift > 0)
+        ++end;
+    if(*end != '\0' || n > (max >> shift))
+        return EXIT_FAILURE;
+
+    *size = n << shift;
+    return EXIT_SUCCESS;
+
+}
+
+// Parses a list of CPUs and ranges of CPUs (eg. 0-3,6). Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_cpus_parse(const char *s, cpu_set_t *cpus) {
+
+    CPU_ZERO(cpus);
+
+    while(true) {
+
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if(end == s || first < 0)
+            return EXIT_FAILURE;
+        if(*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if(end == s || last < first)
+                return EXIT_FAILURE;
+        }
+        if(last >= CPU_SETSIZE)
+            return EXIT_FAILURE;
+
+        for(long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, cpus);
+
+        if(*end == '\0')
+            return EXIT_SUCCESS;
+        if(*end != ',')
+            return EXIT_FAILURE;
+        s = end + 1;
+
+    }
+
+}
+
+// Writes a set of CPUs to out as a list (eg. 0-3,6). A list that does not fit is cut short.
+void utilshell_cpus_format(const cpu_set_t *cpus, char *out, size_t size) {
+
+    size_t len = 0;
+    out[0] = '\0';
+
+    for(int cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu) {
+
+        if(!CPU_ISSET(cpu, cpus))
+            continue;
+
+        int last = cpu;
+        while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+            ++last;
+
+        int n;
+        if(last == cpu)
+            n = snprintf(out + len, size - len, "%s%d", len > 0 ? "," : "", cpu);
+        else
+            n = snprintf(out + len, size - len, "%s%d-%d", len > 0 ? "," : "", cpu, last);
+        len += n;
+        cpu = last;
+
+    }
+
+}
+
+/* Opens the history file ($HISTFILE, or ~/.shell_history) unless it is open already. Returns EXIT_SUCCESS on success,
+ * EXIT_FAILURE on error.
+ */
+int utilshell_history_open() {
+
+    if(utilshell_history_fd != -1)
+        return EXIT_SUCCESS;
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    const char *file = utilshell_var_get("HISTFILE");
+    if(file != NULL && file[0] != '\0')
+        utilshell_buf_append(&path, file, strlen(file));
+    else if(utilshell_home != NULL) {
+        utilshell_buf_append(&path, utilshell_home, strlen(utilshell_home));
+        utilshell_buf_append(&path, "/.shell_history", 15);
+    }
+    if(path.data == NULL) {
+        shell_error("Could not find the history file. Set $HISTFILE or $HOME.\n");
+        return EXIT_FAILURE;
+    }
+
+    utilshell_history_fd = open(path.data, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+    int errsv = errno;
+    if(utilshell_history_fd == -1)
+        shell_error("Could not open history \"%s\". errno:%d\n", path.data, errsv);
+    free(path.data);
+
+    return utilshell_history_fd != -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+
+// Adds a command to the history, unless it is blank. The entry is written with a single write().
+void utilshell_history_add(const char *command) {
+
+    const char *p = command;
+    while(isspace((unsigned char)*p))
+        ++p;
+    if(*p == '\0' || utilshell_history_open() != EXIT_SUCCESS)
+        return;
+
+    struct utilshell_buf entry = { NULL, 0, 0, NULL };
+    if(utilshell_buf_append(&entry, command, strlen(command)) != EXIT_SUCCESS ||
+        utilshell_buf_append(&entry, "\n", 1) != EXIT_SUCCESS) {
+        shell_error("Could not allocate history entry.\n");
+        free(entry.data);
+        return;
+    }
+    for(size_t i = 0; i + 1 < entry.len; ++i) {
+        if(entry.data[i] == '\n')
+            entry.data[i] = UTILSHELL_HISTORY_NEWLINE;
+    }
+
+    if(write(utilshell_history_fd, entry.data, entry.len) != (ssize_t)entry.len) {
+        int errsv = errno;
+        shell_error("Could not add to history. errno:%d\n", errsv);
+    }
+    free(entry.data);
+
+}
+
+/* Maps the history file again if it has grown since it was last mapped (the entries of other shells included). If it
+ * has shrunk (eg. it was cleared), the mapping and the indexes are dropped and built again. Returns EXIT_SUCCESS on
+ * success, EXIT_FAILURE on error.
+ */
+int utilshell_history_remap() {
+
+    if(utilshell_history_open() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    struct stat st;
+    if(fstat(utilshell_history_fd, &st) == -1) {
+        int errsv = errno;
+        shell_error("Could not stat history. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+    size_t size = st.st_size;
+
+    if(size < utilshell_history_mapped) {
+        munmap((void*)utilshell_history_map, utilshell_history_mapped);
+        utilshell_history_map = NULL;
+        utilshell_history_mapped = 0;
+        utilshell_history_len = 0;
+        utilshell_history_count = 0;
+        utilshell_history_start = 0;
+        utilshell_history_indexed = 0;
+        for(int i = 0; i < utilshell_trigram_slots; ++i)
+            free(utilshell_trigrams[i].deltas);
+        free(utilshell_trigrams);
+        utilshell_trigrams = NULL;
+        utilshell_trigram_slots = 0;
+        utilshell_trigram_used = 0;
+        utilshell_trigram_entries = 0;
+    }
+
+    if(size > utilshell_history_mapped) {
+        void *map;
+        if(utilshell_history_map == NULL)
+            map = mmap(NULL, size, PROT_READ, MAP_SHARED, utilshell_history_fd, 0);
+        else
+            map = mremap((void*)utilshell_history_map, utilshell_history_mapped, size, MREMAP_MAYMOVE);
+        if(map == MAP_FAILED) {
+            int errsv = errno;
+            shell_error("Could not map history. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        utilshell_history_map = (const char*)map;
+        utilshell_history_mapped = size;
+    }
+
+    // Another shell may be in the middle of writing an entry. Only complete entries are used.
+    if(utilshell_history_len < utilshell_history_mapped) {
+        const char *last = (const char*)memrchr(utilshell_history_map + utilshell_history_len, '\n',
+            utilshell_history_mapped - utilshell_history_len);
+        if(last != NULL)
+            utilshell_history_len = last - utilshell_history_map + 1;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Returns true if the history file still holds every entry of the mapping. Another shell may truncate the file (eg. to
+ * clear it), and reading a mapped page past the end of the file raises SIGBUS. utilshell_history_remap() notices that
+ * before the history is used; this is checked again before entries are read after anything that may take a while.
+ */
+bool utilshell_history_intact() {
+
+    struct stat st;
+    if(fstat(utilshell_history_fd, &st) == 0 && (size_t)st.st_size >= utilshell_history_len)
+        return true;
+    shell_error("The history file has been truncated.\n");
+    return false;
+
+}
+
+// Makes room for more entries in utilshell_history_offsets. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_history_grow(int more) {
+
+    if(utilshell_history_count + more <= utilshell_history_cap)
+        return EXIT_SUCCESS;
+
+    int new_cap = utilshell_history_cap == 0 ? 1024 : utilshell_history_cap;
+    while(new_cap < utilshell_history_count + more)
+        new_cap *= 2;
+    size_t *new_offsets = (size_t*)realloc(utilshell_history_offsets, new_cap*sizeof(size_t));
+    if(new_offsets == NULL) {
+        shell_error("Could not grow the history index to %d entries.\n", new_cap);
+        return EXIT_FAILURE;
+    }
+    utilshell_history_offsets = new_offsets;
+    utilshell_history_cap = new_cap;
+    return EXIT_SUCCESS;
+
+}
+
+/* Brings utilshell_history_offsets up to date with the history file, and extends it backwards until it has the last
+ * recent entries (or every entry, if there are fewer). Pass UTILSHELL_HISTORY_ALL where entries are numbered. Returns
+ * EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_history_index(int recent) {
+
+    if(utilshell_history_remap() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    // The first time, the index starts with the entries at the end of the file.
+    const char *map = utilshell_history_map;
+    if(utilshell_history_indexed == 0 && utilshell_history_len > (size_t)UTILSHELL_HISTORY_TAIL) {
+        const char *newline = (const char*)memrchr(map, '\n', utilshell_history_len - UTILSHELL_HISTORY_TAIL);
+        if(newline != NULL)
+            utilshell_history_start = utilshell_history_indexed = newline - map + 1;
+    }
+
+    while(utilshell_history_indexed < utilshell_history_len) {
+
+        if(utilshell_history_grow(1) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        utilshell_history_offsets[utilshell_history_count++] = utilshell_history_indexed;
+        const char *newline = (const char*)memchr(map + utilshell_history_indexed, '\n',
+            utilshell_history_len - utilshell_history_indexed);
+        utilshell_history_indexed = newline - map + 1;
+
+    }
+
+    while(utilshell_history_start > 0 && utilshell_history_count < recent) {
+
+        // Go back twice as far as the index reaches, to the start of the entry there.
+        size_t back = utilshell_history_indexed - utilshell_history_start;
+        if(back < (size_t)UTILSHELL_HISTORY_TAIL)
+            back = UTILSHELL_HISTORY_TAIL;
+        size_t start = 0;
+        if(utilshell_history_start > back) {
+            const char *newline = (const char*)memrchr(map, '\n', utilshell_history_start - back);
+            if(newline != NULL)
+                start = newline - map + 1;
+        }
+
+        int num = 0;
+        for(size_t pos = start; pos < utilshell_history_start; ++num)
+            pos = (const char*)memchr(map + pos, '\n', utilshell_history_start - pos) - map + 1;
+        if(utilshell_history_grow(num) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+
+        memmove(utilshell_history_offsets + num, utilshell_history_offsets, utilshell_history_count*sizeof(size_t));
+        size_t pos = start;
+        for(int i = 0; i < num; ++i) {
+            utilshell_history_offsets[i] = pos;
+            pos = (const char*)memchr(map + pos, '\n', utilshell_history_start - pos) - map + 1;
+        }
+        utilshell_history_count += num;
+        utilshell_history_start = start;
+
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Returns the text of entry n of the history (which must have been indexed) and sets *len to its length. The text is
+ * not terminated, and newlines in it are stored as UTILSHELL_HISTORY_NEWLINE.
+ */
+const char *utilshell_history_entry(int entry, size_t *len) {
+
+    size_t start = utilshell_history_offsets[entry - 1];
+    size_t end = entry < utilshell_history_count ? utilshell_history_offsets[entry] : utilshell_history_indexed;
+    *len = end - start - 1;
+    return utilshell_history_map + start;
+
+}
+
+/* Prints an entry of the history with its number, as the history builtin lists it. Returns EXIT_SUCCESS on success,
+ * EXIT_FAILURE if the history file has been truncated since it was indexed.
+ */
+int utilshell_history_print(int entry) {
+
+    if(!utilshell_history_intact())
+        return EXIT_FAILURE;
+
+    size_t len;
+    const char *text = utilshell_history_entry(entry, &len);
+    const char *end = text + len;
+
+    printf("%5d  ", entry);
+    while(text < end) {
+        const char *newline = (const char*)memchr(text, UTILSHELL_HISTORY_NEWLINE, end - text);
+        size_t n = newline != NULL ? newline - text : end - text;
+        fwrite(text, 1, n, stdout);
+        text += n;
+        if(newline != NULL) {
+            putchar('\n');
+            ++text;
+        }
+    }
+    putchar('\n');
+    return EXIT_SUCCESS;
+
+}
+
+/* Finds the slot of a trigram in utilshell_trigrams. If add is true, the trigram gets a slot (with an empty list) if
+ * it has none yet. Returns NULL if the trigram has no slot, or if the table could not be grown.
+ */
+struct utilshell_trigram *utilshell_trigram_find(unsigned int key, bool add) {
+
+    // Keep the table at most half full.
+    if(add && (utilshell_trigram_used + 1) * 2 > utilshell_trigram_slots) {
+        int new_slots = utilshell_trigram_slots == 0 ? 4096 : utilshell_trigram_slots * 2;
+        struct utilshell_trigram *table = (struct utilshell_trigram*)calloc(new_slots, sizeof(struct utilshell_trigram));
+        if(table == NULL) {
+            shell_error("Could not grow the history index to %d trigrams.\n", new_slots);
+            return NULL;
+        }
+        for(int i = 0; i < utilshell_trigram_slots; ++i) {
+            if(utilshell_trigrams[i].key == 0)
+                continue;
+            unsigned int h = utilshell_trigrams[i].key * 2654435761u;
+            unsigned int slot = (h ^ h >> 15) & (new_slots - 1);
+            while(table[slot].key != 0)
+                slot = (slot + 1) & (new_slots - 1);
+            table[slot] = utilshell_trigrams[i];
+        }
+        free(utilshell_trigrams);
+        utilshell_trigrams = table;
+        utilshell_trigram_slots = new_slots;
+    }
+
+    if(utilshell_trigram_slots == 0)
+        return NULL;
+
+    unsigned int h = key * 2654435761u;
+    unsigned int slot = (h ^ h >> 15) & (utilshell_trigram_slots - 1);
+    while(utilshell_trigrams[slot].key != 0) {
+        if(utilshell_trigrams[slot].key == key)
+            return &utilshell_trigrams[slot];
+        slot = (slot + 1) & (utilshell_trigram_slots - 1);
+    }
+
+    if(!add)
+        return NULL;
+    utilshell_trigrams[slot].key = key;
+    ++utilshell_trigram_used;
+    return &utilshell_trigrams[slot];
+
+}
+
+/* Brings the trigram index up to date with the history file. Every entry is added to the list of each trigram in it
+ * once. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_trigram_index() {
+
+    if(utilshell_history_index(UTILSHELL_HISTORY_ALL) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    while(utilshell_trigram_entries < utilshell_history_count) {
+
+        int entry = utilshell_trigram_entries + 1;
+        size_t len;
+        const unsigned char *text = (const unsigned char*)utilshell_history_entry(entry, &len);
+
+        for(size_t i = 0; i + 3 <= len; ++i) {
+
+            unsigned int key = (text[i] << 16 | text[i+1] << 8 | text[i+2]) + 1;
+            struct utilshell_trigram *trigram = utilshell_trigram_find(key, true);
+            if(trigram == NULL)
+                return EXIT_FAILURE;
+            if(trigram->count > 0 && trigram->last == entry)
+                continue;
+
+            // A delta takes at most 5 bytes.
+            if(trigram->len + 5 > trigram->cap) {
+                size_t new_cap = trigram->cap == 0 ? 8 : trigram->cap * 2;
+                unsigned char *new_deltas = (unsigned char*)realloc(trigram->deltas, new_cap);
+                if(new_deltas == NULL) {
+                    shell_error("Could not grow the history index.\n");
+                    return EXIT_FAILURE;
+                }
+                trigram->deltas = new_deltas;
+                trigram->cap = new_cap;
+            }
+
+            unsigned int delta = entry - trigram->last;
+            while(delta >= 0x80) {
+                trigram->deltas[trigram->len++] = (delta & 0x7f) | 0x80;
+                delta >>= 7;
+            }
+            trigram->deltas[trigram->len++] = delta;
+            trigram->last = entry;
+            ++trigram->count;
+
+        }
+
+        ++utilshell_trigram_entries;
+
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Narrows a search for text down with the trigram index: only the entries in the list of its rarest trigram can
+ * contain it. Returns these entries in ascending order (to be freed by the caller) and sets *num to their number.
+ * Returns NULL if the index cannot help (text is shorter than a trigram, or the index could not be built), and every
+ * entry has to be checked.
+ */
+int *utilshell_history_candidates(const char *text, size_t n, int *num) {
+
+    if(n < 3 || utilshell_trigram_index() != EXIT_SUCCESS)
+        return NULL;
+
+    const unsigned char *s = (const unsigned char*)text;
+    struct utilshell_trigram *rarest = NULL;
+    for(size_t i = 0; i + 3 <= n; ++i) {
+        unsigned int key = (s[i] << 16 | s[i+1] << 8 | s[i+2]) + 1;
+        struct utilshell_trigram *trigram = utilshell_trigram_find(key, false);
+        if(trigram == NULL) {
+            *num = 0;
+            return (int*)malloc(sizeof(int));
+        }
+        if(rarest == NULL || trigram->count < rarest->count)
+            rarest = trigram;
+    }
+
+    int *entries = (int*)malloc(rarest->count * sizeof(int));
+    if(entries == NULL)
+        return NULL;
+
+    int entry = 0;
+    size_t pos = 0;
+    for(int i = 0; i < rarest->count; ++i) {
+        unsigned int delta = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            byte = rarest->deltas[pos++];
+            delta |= (unsigned int)(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        entry += delta;
+        entries[i] = entry;
+    }
+
+    *num = rarest->count;
+    return entries;
+
+}
+
+// Returns true if an entry of the history contains text (or starts with it, if prefix is true).
+bool utilshell_history_match(int entry, const char *text, size_t n, bool prefix) {
+
+    size_t len;
+    const char *p = utilshell_history_entry(entry, &len);
+    if(prefix)
+        return len >= n && memcmp(p, text, n) == 0;
+    return memmem(p, len, text, n) != NULL;
+
+}
+
+/* Returns the index of the last entry of the history that contains text (or starts with it, if prefix is true), or
+ * 0 if there is none. Until the trigram index has been built, the latest UTILSHELL_HISTORY_RECENT entries are searched
+ * one by one first, as that is where most searches end, and the index is extended backwards only as far as they go.
+ */
+int utilshell_history_find(const char *text, size_t n, bool prefix) {
+
+    if(utilshell_history_index(1) != EXIT_SUCCESS)
+        return 0;
+
+    int found = 0;
+    if(utilshell_trigram_entries == 0) {
+        for(int searched = 0; searched < UTILSHELL_HISTORY_RECENT; ++searched) {
+            if(searched == utilshell_history_count) {
+                if(utilshell_history_start == 0 || utilshell_history_index(searched + 1) != EXIT_SUCCESS ||
+                    searched >= utilshell_history_count)
+                    return 0;
+            }
+            int entry = utilshell_history_count - searched;
+            if(utilshell_history_match(entry, text, n, prefix))
+                return entry;
+        }
+    }
+
+    if(utilshell_history_index(UTILSHELL_HISTORY_ALL) != EXIT_SUCCESS)
+        return 0;
+    int num;
+    int *candidates = utilshell_history_candidates(text, n, &num);
+    if(candidates != NULL) {
+        for(int i = num - 1; i >= 0 && found == 0; --i) {
+            if(utilshell_history_match(candidates[i], text, n, prefix))
+                found = candidates[i];
+        }
+        free(candidates);
+    } else {
+        for(int entry = utilshell_history_count; entry >= 1 && found == 0; --entry) {
+            if(utilshell_history_match(entry, text, n, prefix))
+                found = entry;
+        }
+    }
+
+    return found;
+
+}
+
+/* Expands the history references in a line of input into out:
+ *    !!          The last entry.
+ *    !n          Entry n.
+ *    !-n         The n-th last entry.
+ *    !?text[?]   The last entry that contains text.
+ *    !text       The last entry that starts with text (up to the next blank or operator).
+ * A ! inside single quotes, after a backslash, or followed by a blank, = or ( is left alone. Returns 1 if something
+ * was expanded, 0 if the line has no references, or -1 if a reference was not found (which has been reported).
+ */
+int utilshell_history_expand(const char *line, struct utilshell_buf *out) {
+
+    out->len = 0;
+    bool expanded = false;
+    bool single_quoted = false;
+    bool double_quoted = false;
+    const char *copied = line; // Everything in front of this is in out already.
+    const char *p = line;
+
+    while(*p != '\0') {
+
+        if(*p == '\'' && !double_quoted) {
+            single_quoted = !single_quoted;
+            ++p;
+            continue;
+        }
+        if(*p == '"' && !single_quoted)
+            double_quoted = !double_quoted;
+        if(*p == '\\' && !single_quoted && p[1] != '\0') {
+            p += 2;
+            continue;
+        }
+        const char *ref = p + 1;
+        if(*p != '!' || single_quoted || *ref == '\0' || isspace((unsigned char)*ref) || *ref == '=' || *ref == '(') {
+            ++p;
+            continue;
+        }
+
+        int entry = 0;
+        const char *end;
+        if(*ref == '!') {
+            if(utilshell_history_index(1) != EXIT_SUCCESS)
+                return -1;
+            entry = utilshell_history_count;
+            end = ref + 1;
+        } else if(isdigit((unsigned char)*ref) || (*ref == '-' && isdigit((unsigned char)ref[1]))) {
+            // !-n only needs the last n entries, !n needs them all to count from the first.
+            long long n = strtoll(ref, (char**)&end, 10);
+            if(utilshell_history_index(n < 0 && n > -UTILSHELL_HISTORY_ALL ? (int)-n : UTILSHELL_HISTORY_ALL) != EXIT_SUCCESS)
+                return -1;
+            if(n < 0)
+                n += utilshell_history_count + 1;
+            if(n >= 1 && n <= utilshell_history_count)
+                entry = n;
+        } else if(*ref == '?') {
+            const char *text = ref + 1;
+            const char *close = strchr(text, '?');
+            size_t n = close != NULL ? (size_t)(close - text) : strlen(text);
+            end = text + n + (close != NULL);
+            if(n > 0)
+                entry = utilshell_history_find(text, n, false);
+        } else {
+            end = ref;
+            while(*end != '\0' && !isspace((unsigned char)*end) && strchr(";|&<>()'\"`", *end) == NULL)
+                ++end;
+            if(end > ref)
+                entry = utilshell_history_find(ref, end - ref, true);
+        }
+
+        if(entry == 0) {
+            shell_error("%.*s: event not found.\n", (int)(end - p), p);
+            return -1;
+        }
+
+        if(!utilshell_history_intact())
+            return -1;
+
+        // Put the newlines of the entry back.
+        size_t len;
+        const char *text = utilshell_history_entry(entry, &len);
+        utilshell_buf_append(out, copied, p - copied);
+        size_t start = out->len;
+        utilshell_buf_append(out, text, len);
+        for(size_t i = start; i < out->len; ++i) {
+            if(out->data[i] == UTILSHELL_HISTORY_NEWLINE)
+                out->data[i] = '\n';
+        }
+
+        expanded = true;
+        copied = p = end;
+
+    }
+
+    if(!expanded)
+        return 0;
+    utilshell_buf_append(out, copied, p - copied);
+    return 1;
+
+}
+
+/* Builds the command line of a parallel job from the words of the command (from arena). Every {} is replaced by arg;
+ * if there is none, arg is added as the last word. Returns NULL on error.
+ */
+char **utilshell_parallel_argv(char **words, int num_words, const char *arg, struct utilshell_arena *arena) {
+
+    char **argv = (char**)utilshell_arena_alloc(arena, (num_words + 2)*sizeof(char*));
+    if(argv == NULL)
+        return NULL;
+
+    bool replaced = false;
+    size_t arg_len = strlen(arg);
+    for(int i = 0; i < num_words; ++i) {
+
+        const char *word = words[i];
+        const char *brace = strstr(word, "{}");
+        if(brace == NULL) {
+            argv[i] = words[i];
+            continue;
+        }
+
+        struct utilshell_buf buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.arena = arena;
+        for(; brace != NULL; word = brace + 2, brace = strstr(word, "{}"))
+            if(utilshell_buf_append(&buf, word, brace - word) != EXIT_SUCCESS || utilshell_buf_append(&buf, arg, arg_len) != EXIT_SUCCESS)
+                return NULL;
+        if(utilshell_buf_append(&buf, word, strlen(word)) != EXIT_SUCCESS)
+            return NULL;
+        argv[i] = buf.data;
+        replaced = true;
+
+    }
+
+    int argc = num_words;
+    if(!replaced)
+        argv[argc++] = (char*)arg;
+    argv[argc] = NULL;
+
+    return argv;
+
+}
+
+/* Starts a parallel job in a slot (slot number index): its stdout and stderr go into pipes, which are registered in
+ * epoll_fd together with the pidfd of the job. If the job cannot be started, the slot is marked as done with status
+ * 127. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_parallel_start(struct utilshell_parallel_slot *slot, char **argv, int null_fd, int epoll_fd, int index) {
+
+    slot->pid = -1;
+    slot->pidfd = -1;
+    slot->fds[0] = slot->fds[1] = -1;
+    slot->exited = false;
+    clock_gettime(CLOCK_MONOTONIC, &slot->started);
+
+    int out[2] = { -1, -1 };
+    int err[2] = { -1, -1 };
+    if(pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        int errsv = errno;
+        shell_error("parallel: Could not create pipe. errno:%d\n", errsv);
+    } else {
+
+        struct utilshell_stage stage;
+        memset(&stage, 0, sizeof(stage));
+        stage.args = argv;
+        stage.fds[STDIN_FILENO] = null_fd;
+        stage.fds[STDOUT_FILENO] = out[1];
+        stage.fds[STDERR_FILENO] = err[1];
+        stage.builtin = utilshell_builtin_find(argv[0]);
+
+        // The jobs join the process group of the shell, so that they get Ctrl-C when the shell is in the foreground.
+        if(stage.builtin == NULL && (stage.path = utilshell_hash_lookup(argv[0])) == NULL)
+            shell_error("Could not execute \"%s\". errno:%d\n", argv[0], ENOENT);
+        else if(utilshell_use_fork || stage.builtin != NULL)
+            slot->pid = utilshell_launch_fork(&stage, getpgrp());
+        else
+            slot->pid = utilshell_launch_spawn(&stage, getpgrp());
+
+    }
+
+    for(int k = 1; k >= 0; --k) {
+        if(out[k] != -1 && (k == 1 || slot->pid == -1))
+            close(out[k]);
+        if(err[k] != -1 && (k == 1 || slot->pid == -1))
+            close(err[k]);
+    }
+
+    if(slot->pid == -1) {
+        slot->exited = true;
+        slot->status = W_EXITCODE(127, 0);
+        slot->ended = slot->started;
+        return EXIT_FAILURE;
+    }
+
+    slot->fds[0] = out[0];
+    slot->fds[1] = err[0];
+    slot->pidfd = utilshell_have_pidfd ? utilshell_pidfd_open(slot->pid) : -1;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    for(int k = 0; k < 3; ++k) {
+        int fd = k < 2 ? slot->fds[k] : slot->pidfd;
+        if(fd == -1)
+            continue;
+        if(k < 2)
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+        event.data.u64 = ((uint64_t)index << 2) | k;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Reads what is available on stdout (k = 0) or stderr (k = 1) of a parallel job. It is written straight through if
+ * the job is the earliest one still running (head), and buffered in the slot otherwise.
+ */
+void utilshell_parallel_read(struct utilshell_parallel_slot *slot, int k, bool head) {
+
+    char *buffer = utilshell_copy_buffer();
+    if(buffer == NULL)
+        return;
+
+    while(slot->fds[k] != -1) {
+
+        ssize_t n = read(slot->fds[k], buffer, UTILSHELL_COPY_LEN);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1 && errno == EAGAIN)
+            return;
+
+        // End of the output (or an error, which ends it as well). Closing the pipe also removes it from epoll.
+        if(n <= 0) {
+            close(slot->fds[k]);
+            slot->fds[k] = -1;
+            return;
+        }
+
+        if(head)
+            utilshell_write_all(k + 1, buffer, n);
+        else if(utilshell_buf_append(&slot->output[k], buffer, n) != EXIT_SUCCESS)
+            shell_error("parallel: Could not buffer output of job %d.\n", (int)slot->pid);
+
+    }
+
+}
+
+/* Reports a finished parallel run: the number of jobs, the throughput and the latencies of the jobs, as percentiles
+ * and as a histogram. A percentile is the upper bound of the bucket it falls in (see UTILSHELL_LATENCY_BUCKETS). It
+ * is printed to stderr if print is true, and appended as a JSON line to the profile file with -p.
+ */
+void utilshell_parallel_report(int argc, char **argv, long long num_jobs, long long num_failed, int max_jobs, double seconds,
+    const long long *latencies, double max_latency, bool print) {
+
+    const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    const char *names[] = { "p50", "p90", "p99", "p99.9" };
+    const int NUM_PERCENTILES = 4;
+    double values[NUM_PERCENTILES];
+
+    for(int p = 0; p < NUM_PERCENTILES; ++p) {
+        long long rank = (long long)(percentiles[p] * num_jobs + 0.999999);
+        long long count = 0;
+        int bucket = 0;
+        while(bucket < UTILSHELL_LATENCY_BUCKETS - 1 && (count += latencies[bucket]) < rank)
+            ++bucket;
+        values[p] = (double)(1LL << bucket) / 1e6;
+        if(values[p] > max_latency)
+            values[p] = max_latency;
+    }
+
+    double jobs_per_s = seconds > 0 ? num_jobs / seconds : 0;
+    char text[32];
+
+    if(print) {
+
+        fprintf(stderr, "parallel: %lld jobs (%lld failed, %d at a time) in %.3fs, %.1f jobs/s\n",
+            num_jobs, num_failed, max_jobs, seconds, jobs_per_s);
+
+        if(num_jobs > 0) {
+
+            fprintf(stderr, "latency");
+            for(int p = 0; p < NUM_PERCENTILES; ++p) {
+                utilshell_duration_string(values[p], text, sizeof(text));
+                fprintf(stderr, " %s %s", names[p], text);
+            }
+            utilshell_duration_string(max_latency, text, sizeof(text));
+            fprintf(stderr, " max %s\n", text);
+
+            int low = 0;
+            int high = UTILSHELL_LATENCY_BUCKETS - 1;
+            long long most = 0;
+            while(latencies[low] == 0)
+                ++low;
+            while(latencies[high] == 0)
+                --high;
+            for(int k = low; k <= high; ++k)
+                if(latencies[k] > most)
+                    most = latencies[k];
+            for(int k = low; k <= high; ++k) {
+                utilshell_duration_string((double)(1LL << k) / 1e6, text, sizeof(text));
+                int width = (int)(40 * latencies[k] / most);
+                fprintf(stderr, "  < %-8s %10lld %.*s\n", text, latencies[k], width, "########################################");
+            }
+
+        }
+
+    }
+
+    if(utilshell_profile_fd == -1)
+        return;
+
+    struct utilshell_buf out;
+    memset(&out, 0, sizeof(out));
+    struct utilshell_buf command;
+    memset(&command, 0, sizeof(command));
+    for(int i = 0; i < argc; ++i) {
+        if(i > 0)
+            utilshell_buf_append(&command, " ", 1);
+        utilshell_buf_append(&command, argv[i], strlen(argv[i]));
+    }
+
+    char field[512];
+    utilshell_buf_append(&out, "{\"command\":", 11);
+    utilshell_json_string(&out, command.data);
+    snprintf(field, sizeof(field), ",\"jobs\":%lld,\"failed\":%lld,\"max_jobs\":%d,\"real\":%.6f,\"jobs_per_s\":%.1f,\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f,\"p999\":%.6f,\"max\":%.6f}\n",
+        num_jobs, num_failed, max_jobs, seconds, jobs_per_s, values[0], values[1], values[2], values[3], max_latency);
+    utilshell_buf_append(&out, field, strlen(field));
+
+    utilshell_write_all(utilshell_profile_fd, out.data, out.len);
+    free(out.data);
+    free(command.data);
+
+}
+
+// Writes a duration in seconds to out in a readable unit (eg. 250us, 1.5ms, 2.00s).
+void utilshell_duration_string(double seconds, char *out, size_t size) {
+
+    if(seconds < 1e-3)
+        snprintf(out, size, "%.0fus", seconds * 1e6);
+    else if(seconds < 1)
+        snprintf(out, size, "%.1fms", seconds * 1e3);
+    else
+        snprintf(out, size, "%.2fs", seconds);
+
+}
+
+/* The memo cache identifies outputs and runs by a 128-bit hash (MurmurHash3 x64, fed in pieces). It does not have to
+ * stand up to someone crafting collisions, only to tell apart the outputs and inputs of ordinary commands.
+ */
+void utilshell_memo_hash_init(struct utilshell_memo_hash *h) {
+
+    memset(h, 0, sizeof(*h));
+
+}
+
+// Mixes a block of 16 bytes into a hash.
+void utilshell_memo_hash_block(struct utilshell_memo_hash *h, const unsigned char *block) {
+
+    const unsigned long long c1 = 0x87c37b91114253d5ULL;
+    const unsigned long long c2 = 0x4cf5ad432745937fULL;
+    unsigned long long k1, k2;
+    memcpy(&k1, block, 8);
+    memcpy(&k2, block + 8, 8);
+
+    k1 *= c1;
+    k1 = (k1 << 31) | (k1 >> 33);
+    k1 *= c2;
+    h->h1 ^= k1;
+    h->h1 = (h->h1 << 27) | (h->h1 >> 37);
+    h->h1 += h->h2;
+    h->h1 = h->h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = (k2 << 33) | (k2 >> 31);
+    k2 *= c1;
+    h->h2 ^= k2;
+    h->h2 = (h->h2 << 31) | (h->h2 >> 33);
+    h->h2 += h->h1;
+    h->h2 = h->h2 * 5 + 0x38495ab5;
+
+}
+
+// Adds n bytes to a hash.
+void utilshell_memo_hash_update(struct utilshell_memo_hash *h, const void *data, size_t n) {
+
+    const unsigned char *p = (const unsigned char*)data;
+    h->len += n;
+
+    if(h->tail_len > 0) {
+        size_t take = n < 16 - h->tail_len ? n : 16 - h->tail_len;
+        memcpy(h->tail + h->tail_len, p, take);
+        h->tail_len += take;
+        p += take;
+        n -= take;
+        if(h->tail_len < 16)
+            return;
+        utilshell_memo_hash_block(h, h->tail);
+        h->tail_len = 0;
+    }
+
+    for(; n >= 16; p += 16, n -= 16)
+        utilshell_memo_hash_block(h, p);
+
+    memcpy(h->tail, p, n);
+    h->tail_len = n;
+
+}
+
+// Adds a string to a hash, with its length first, so that a sequence of strings hashes differently when split differently.
+void utilshell_memo_hash_string(struct utilshell_memo_hash *h, const char *s) {
+
+    unsigned long long n = strlen(s);
+    utilshell_memo_hash_update(h, &n, sizeof(n));
+    utilshell_memo_hash_update(h, s, n);
+
+}
+
+// Adds what identifies a file without reading it to a hash: its device, inode, type, size and mtime.
+void utilshell_memo_hash_stat(struct utilshell_memo_hash *h, const struct stat *st) {
+
+    unsigned long long fields[6] = {
+        (unsigned long long)st->st_dev, (unsigned long long)st->st_ino, (unsigned long long)st->st_mode,
+        (unsigned long long)st->st_size, (unsigned long long)st->st_mtim.tv_sec, (unsigned long long)st->st_mtim.tv_nsec
+    };
+    utilshell_memo_hash_update(h, fields, sizeof(fields));
+
+}
+
+/* Adds the contents of fd to a hash, from offset to the end (with pread(), so the offset of fd does not move), or with
+ * read() if offset is -1. If copy_fd is not -1, everything is written to it as well.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_memo_hash_fd(struct utilshell_memo_hash *h, int fd, off_t offset, int copy_fd) {
+
+    char *buffer = utilshell_copy_buffer();
+    if(buffer == NULL)
+        return EXIT_FAILURE;
+
+    while(true) {
+        ssize_t n = offset == -1 ? read(fd, buffer, UTILSHELL_COPY_LEN) : pread(fd, buffer, UTILSHELL_COPY_LEN, offset);
+        if(n == 0)
+            return EXIT_SUCCESS;
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            int errsv = errno;
+            shell_error("memo: Could not read input. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        utilshell_memo_hash_update(h, buffer, n);
+        if(copy_fd != -1 && utilshell_write_all(copy_fd, buffer, n) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if(offset != -1)
+            offset += n;
+    }
+
+}
+
+// Finishes a hash and writes it to hex as 32 hex digits (and a NUL).
+void utilshell_memo_hash_final(struct utilshell_memo_hash *h, char *hex) {
+
+    const unsigned long long c1 = 0x87c37b91114253d5ULL;
+    const unsigned long long c2 = 0x4cf5ad432745937fULL;
+    unsigned long long k1 = 0, k2 = 0;
+
+    for(size_t i = h->tail_len; i > 8; --i)
+        k2 ^= (unsigned long long)h->tail[i - 1] << ((i - 9) * 8);
+    if(h->tail_len > 8) {
+        k2 *= c2;
+        k2 = (k2 << 33) | (k2 >> 31);
+        k2 *= c1;
+        h->h2 ^= k2;
+    }
+    for(size_t i = h->tail_len < 8 ? h->tail_len : 8; i > 0; --i)
+        k1 ^= (unsigned long long)h->tail[i - 1] << ((i - 1) * 8);
+    if(h->tail_len > 0) {
+        k1 *= c1;
+        k1 = (k1 << 31) | (k1 >> 33);
+        k1 *= c2;
+        h->h1 ^= k1;
+    }
+
+    unsigned long long out[2] = { h->h1 ^ h->len, h->h2 ^ h->len };
+    out[0] += out[1];
+    out[1] += out[0];
+    for(int k = 0; k < 2; ++k) {
+        out[k] ^= out[k] >> 33;
+        out[k] *= 0xff51afd7ed558ccdULL;
+        out[k] ^= out[k] >> 33;
+        out[k] *= 0xc4ceb9fe1a85ec53ULL;
+        out[k] ^= out[k] >> 33;
+    }
+    out[0] += out[1];
+    out[1] += out[0];
+
+    snprintf(hex, 33, "%016llx%016llx", out[0], out[1]);
+
+}
+
+/* Adds what identifies the file at path to a hash: its contents if content is true, otherwise its stat() fields. A
+ * file that does not exist is an input as well. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_memo_identity(struct utilshell_memo_hash *h, const char *path, bool content) {
+
+    struct stat st;
+    if(stat(path, &st) == -1) {
+        utilshell_memo_hash_string(h, "missing");
+        return EXIT_SUCCESS;
+    }
+
+    if(!content || !S_ISREG(st.st_mode)) {
+        utilshell_memo_hash_string(h, "stat");
+        utilshell_memo_hash_stat(h, &st);
+        return EXIT_SUCCESS;
+    }
+
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if(fd == -1) {
+        int errsv = errno;
+        shell_error("memo: Could not open \"%s\". errno:%d\n", path, errsv);
+        return EXIT_FAILURE;
+    }
+    utilshell_memo_hash_string(h, "contents");
+    int result = utilshell_memo_hash_fd(h, fd, 0, -1);
+    close(fd);
+    return result;
+
+}
+
+/* Returns the directory of the memo store ($MEMODIR, or ~/.cache/shell_memo), malloc'd, after creating it and its
+ * subdirectories if needed. Returns NULL on error.
+ */
+char *utilshell_memo_dir() {
+
+    struct utilshell_buf dir = { NULL, 0, 0, NULL };
+    const char *memo_dir = utilshell_var_get("MEMODIR");
+    if(memo_dir != NULL && memo_dir[0] != '\0') {
+        utilshell_buf_append(&dir, memo_dir, strlen(memo_dir));
+    } else if(utilshell_home != NULL) {
+        utilshell_buf_append(&dir, utilshell_home, strlen(utilshell_home));
+        utilshell_buf_append(&dir, "/.cache", 7);
+        mkdir(dir.data, 0700);
+        utilshell_buf_append(&dir, "/shell_memo", 11);
+    }
+    if(dir.data == NULL) {
+        shell_error("memo: Could not find the store. Set $MEMODIR or $HOME.\n");
+        return NULL;
+    }
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    const char *subdirs[3] = { "", "objects", "entries" };
+    for(int k = 0; k < 3; ++k) {
+        utilshell_memo_path(&path, dir.data, subdirs[k], NULL);
+        if(path.data == NULL || (mkdir(path.data, 0700) == -1 && errno != EEXIST)) {
+            int errsv = errno;
+            shell_error("memo: Could not create \"%s\". errno:%d\n", path.data != NULL ? path.data : dir.data, errsv);
+            free(path.data);
+            free(dir.data);
+            return NULL;
+        }
+    }
+    free(path.data);
+
+    return dir.data;
+
+}
+
+// Sets path to dir/sub/name (or dir/sub without a name, or dir without either).
+void utilshell_memo_path(struct utilshell_buf *path, const char *dir, const char *sub, const char *name) {
+
+    path->len = 0;
+    utilshell_buf_append(path, dir, strlen(dir));
+    if(sub[0] != '\0') {
+        utilshell_buf_append(path, "/", 1);
+        utilshell_buf_append(path, sub, strlen(sub));
+    }
+    if(name != NULL) {
+        utilshell_buf_append(path, "/", 1);
+        utilshell_buf_append(path, name, strlen(name));
+    }
+
+}
+
+/* Creates a temporary file in a subdirectory of the store, so that it can be renamed into place once it is complete.
+ * Its path is stored in path. Returns the fd of the file (close-on-exec), or -1 on error.
+ */
+int utilshell_memo_temp(const char *dir, const char *sub, struct utilshell_buf *path) {
+
+    utilshell_memo_path(path, dir, sub, "tmp.XXXXXX");
+    int fd = path->data != NULL ? mkostemp(path->data, O_CLOEXEC) : -1;
+    if(fd == -1) {
+        int errsv = errno;
+        shell_error("memo: Could not create a file in the store. errno:%d\n", errsv);
+    }
+    return fd;
+
+}
+
+/* Replays the run stored under key: its stdout and stderr are copied out and *status is set to its exit status. Both
+ * outputs are opened before anything is written, so a run whose output has just been evicted is a miss and not half a
+ * hit. Returns EXIT_SUCCESS on a hit, EXIT_FAILURE on a miss.
+ */
+int utilshell_memo_replay(const char *dir, const char *key, int *status) {
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    utilshell_memo_path(&path, dir, "entries", key);
+    int entry_fd = path.data != NULL ? open(path.data, O_RDONLY|O_CLOEXEC) : -1;
+    if(entry_fd == -1) {
+        free(path.data);
+        return EXIT_FAILURE;
+    }
+
+    char line[128];
+    char outputs[2][33];
+    ssize_t n = read(entry_fd, line, sizeof(line) - 1);
+    line[n > 0 ? n : 0] = '\0';
+    int fds[2] = { -1, -1 };
+    if(sscanf(line, "%d %32s %32s", status, outputs[0], outputs[1]) == 3) {
+        for(int k = 0; k < 2; ++k) {
+            utilshell_memo_path(&path, dir, "objects", outputs[k]);
+            fds[k] = path.data != NULL ? open(path.data, O_RDONLY|O_CLOEXEC) : -1;
+        }
+    }
+    free(path.data);
+
+    int result = fds[0] != -1 && fds[1] != -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if(result == EXIT_SUCCESS) {
+        // The mtime of an entry is when it was last used (see utilshell_memo_evict()).
+        futimens(entry_fd, NULL);
+        fflush(stdout);
+        utilshell_copy(fds[0], STDOUT_FILENO);
+        utilshell_copy(fds[1], STDERR_FILENO);
+    }
+
+    close(entry_fd);
+    for(int k = 0; k < 2; ++k)
+        if(fds[k] != -1)
+            close(fds[k]);
+    return result;
+
+}
+
+/* Stores a run under key: the temporary files in paths (with the fds fds) are moved to objects/ under the hashes of
+ * their contents, and the entry is written. The paths of the files that were moved are freed.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_memo_save(const char *dir, const char *key, int status, int *fds, struct utilshell_buf *paths) {
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    char outputs[2][33];
+    int result = EXIT_SUCCESS;
+
+    // An output that is stored already is replaced by the same bytes.
+    for(int k = 0; k < 2 && result == EXIT_SUCCESS; ++k) {
+        struct utilshell_memo_hash h;
+        utilshell_memo_hash_init(&h);
+        if(utilshell_memo_hash_fd(&h, fds[k], 0, -1) != EXIT_SUCCESS) {
+            result = EXIT_FAILURE;
+            break;
+        }
+        utilshell_memo_hash_final(&h, outputs[k]);
+        utilshell_memo_path(&path, dir, "objects", outputs[k]);
+        if(path.data == NULL || rename(paths[k].data, path.data) == -1) {
+            int errsv = errno;
+            shell_error("memo: Could not store output. errno:%d\n", errsv);
+            result = EXIT_FAILURE;
+            break;
+        }
+        free(paths[k].data);
+        memset(paths + k, 0, sizeof(paths[k]));
+    }
+
+    char line[128];
+    int n = snprintf(line, sizeof(line), "%d %s %s\n", status, outputs[0], outputs[1]);
+    struct utilshell_buf temp = { NULL, 0, 0, NULL };
+    int fd = result == EXIT_SUCCESS ? utilshell_memo_temp(dir, "entries", &temp) : -1;
+    if(fd != -1) {
+        utilshell_memo_path(&path, dir, "entries", key);
+        if(utilshell_write_all(fd, line, n) != EXIT_SUCCESS || path.data == NULL || rename(temp.data, path.data) == -1) {
+            unlink(temp.data);
+            result = EXIT_FAILURE;
+        }
+        close(fd);
+    } else {
+        result = EXIT_FAILURE;
+    }
+
+    free(temp.data);
+    free(path.data);
+    return result;
+
+}
+
+/* Lists the files of a subdirectory of the store into *files (malloc'd), sorted by name. Temporary files that were left
+ * behind (eg. by a shell that was killed) are removed once they are a day old, and are not listed.
+ * Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_memo_scan(const char *dir, const char *sub, struct utilshell_memo_file **files, int *num_files) {
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    utilshell_memo_path(&path, dir, sub, NULL);
+    DIR *d = path.data != NULL ? opendir(path.data) : NULL;
+    free(path.data);
+    *files = NULL;
+    *num_files = 0;
+    if(d == NULL)
+        return EXIT_FAILURE;
+
+    int cap = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct dirent *e;
+    while((e = readdir(d)) != NULL) {
+
+        struct stat st;
+        if(e->d_name[0] == '.' || fstatat(dirfd(d), e->d_name, &st, 0) == -1)
+            continue;
+        if(strncmp(e->d_name, "tmp.", 4) == 0 || strlen(e->d_name) != 32) {
+            if(now.tv_sec - st.st_mtim.tv_sec > 24*60*60)
+                unlinkat(dirfd(d), e->d_name, 0);
+            continue;
+        }
+
+        if(*num_files == cap) {
+            cap = cap == 0 ? 256 : cap * 2;
+            struct utilshell_memo_file *grown = (struct utilshell_memo_file*)realloc(*files, cap*sizeof(struct utilshell_memo_file));
+            if(grown == NULL) {
+                shell_error("memo: Could not allocate %d files.\n", cap);
+                closedir(d);
+                return EXIT_FAILURE;
+            }
+            *files = grown;
+        }
+
+        struct utilshell_memo_file *file = *files + (*num_files)++;
+        memset(file, 0, sizeof(*file));
+        memcpy(file->name, e->d_name, 33);
+        file->size = st.st_size;
+        file->mtime = st.st_mtim;
+
+    }
+    closedir(d);
+
+    if(*num_files > 0)
+        qsort(*files, *num_files, sizeof(struct utilshell_memo_file), utilshell_memo_file_compare);
+    return EXIT_SUCCESS;
+
+}
+
+/* Shrinks the store to utilshell_memo_size. Entries are dropped from the least recently used one on, and an output
+ * as soon as no entry is left that uses it. Outputs that no entry used in the first place (eg. because another shell
+ * evicted the entry) go first, unless they are new enough to belong to an entry that is still being written.
+ */
+void utilshell_memo_evict(const char *dir) {
+
+    struct utilshell_memo_file *objects, *entries;
+    int num_objects, num_entries;
+    if(utilshell_memo_scan(dir, "objects", &objects, &num_objects) != EXIT_SUCCESS)
+        return;
+    if(utilshell_memo_scan(dir, "entries", &entries, &num_entries) != EXIT_SUCCESS) {
+        free(objects);
+        return;
+    }
+
+    // Sizes come from stat(), so a store that is small enough is left alone without reading any entry.
+    long long total = 0;
+    for(int i = 0; i < num_objects; ++i)
+        total += objects[i].size;
+    for(int i = 0; i < num_entries; ++i)
+        total += entries[i].size;
+    if(total <= utilshell_memo_size) {
+        free(objects);
+        free(entries);
+        return;
+    }
+
+    struct utilshell_buf path = { NULL, 0, 0, NULL };
+    for(int i = 0; i < num_entries; ++i) {
+        char line[128];
+        utilshell_memo_path(&path, dir, "entries", entries[i].name);
+        int fd = path.data != NULL ? open(path.data, O_RDONLY|O_CLOEXEC) : -1;
+        ssize_t n = fd != -1 ? read(fd, line, sizeof(line) - 1) : -1;
+        line[n > 0 ? n : 0] = '\0';
+        int status;
+        if(fd != -1)
+            close(fd);
+        if(sscanf(line, "%d %32s %32s", &status, entries[i].outputs[0], entries[i].outputs[1]) != 3)
+            continue;
+        for(int k = 0; k < 2; ++k) {
+            struct utilshell_memo_file *object = (struct utilshell_memo_file*)bsearch(entries[i].outputs[k], objects,
+                num_objects, sizeof(struct utilshell_memo_file), utilshell_memo_file_compare);
+            if(object != NULL)
+                ++object->refs;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(int i = 0; i < num_objects && total > utilshell_memo_size; ++i) {
+        if(objects[i].refs == 0 && now.tv_sec - objects[i].mtime.tv_sec > 60) {
+            utilshell_memo_path(&path, dir, "objects", objects[i].name);
+            if(path.data != NULL && unlink(path.data) == 0)
+                total -= objects[i].size;
+        }
+    }
+
+    qsort(entries, num_entries, sizeof(struct utilshell_memo_file), utilshell_memo_age_compare);
+    for(int i = 0; i < num_entries && total > utilshell_memo_size; ++i) {
+        utilshell_memo_path(&path, dir, "entries", entries[i].name);
+        if(path.data == NULL || unlink(path.data) == -1)
+            continue;
+        total -= entries[i].size;
+        for(int k = 0; k < 2; ++k) {
+            struct utilshell_memo_file *object = (struct utilshell_memo_file*)bsearch(entries[i].outputs[k], objects,
+                num_objects, sizeof(struct utilshell_memo_file), utilshell_memo_file_compare);
+            if(object == NULL || --object->refs > 0)
+                continue;
+            utilshell_memo_path(&path, dir, "objects", object->name);
+            if(path.data != NULL && unlink(path.data) == 0)
+                total -= object->size;
+        }
+    }
+
+    free(path.data);
+    free(objects);
+    free(entries);
+
+}
+
+// Compares two files of the store (or a name with a file) by name, for qsort() and bsearch().
+int utilshell_memo_file_compare(const void *a, const void *b) {
+
+    return strcmp((const char*)a, (const char*)b);
+
+}
+
+// Compares two entries of the store by when they were last used, for qsort().
+int utilshell_memo_age_compare(const void *a, const void *b) {
+
+    const struct utilshell_memo_file *x = (const struct utilshell_memo_file*)a;
+    const struct utilshell_memo_file *y = (const struct utilshell_memo_file*)b;
+    if(x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+
+}
+
+/* Appends a string to out with its backslash escapes (\n, \t, \\, \0NNN, ...) interpreted, as echo -e and printf do.
+ * Returns true if a \c was found, which means that no more output should be produced.
+ */
+bool utilshell_unescape(struct utilshell_buf *out, const char *s, size_t n) {
+
+    const char *end = s + n;
+
+    while(s < end) {
+
+        if(*s != '\\' || s + 1 >= end) {
+            utilshell_buf_append(out, s++, 1);
+            continue;
+        }
+
+        char c;
+        ++s;
+        switch(*s++) {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'e': c = '\033'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case '\\': c = '\\'; break;
+            case 'c': return true;
+            case '0':
+                c = 0;
+                for(int k = 0; k < 3 && s < end && *s >= '0' && *s <= '7'; ++k)
+                    c = c * 8 + (*s++ - '0');
+                break;
+            default:
+                // Not an escape; keep the backslash.
+                utilshell_buf_append(out, s - 2, 2);
+                continue;
+        }
+        utilshell_buf_append(out, &c, 1);
+
+    }
+
+    return false;
+
+}
+
+// Evaluates a unary or binary test primary starting at argv[*pos]. Returns 0 (true), 1 (false) or 2 (error).
+int utilshell_test_primary(char **argv, int argc, int *pos) {
+
+    if(*pos >= argc) {
+        shell_error("test: argument expected\n");
+        return 2;
+    }
+
+    const char *a = argv[*pos];
+
+    if(strcmp(a, "!") == 0) {
+        ++*pos;
+        int result = utilshell_test_primary(argv, argc, pos);
+        return result == 2 ? 2 : !result;
+    }
+
+    if(strcmp(a, "(") == 0) {
+        ++*pos;
+        int result = utilshell_test_expr(argv, argc, pos);
+        if(*pos >= argc || strcmp(argv[*pos], ")") != 0) {
+            shell_error("test: missing )\n");
+            return 2;
+        }
+        ++*pos;
+        return result;
+    }
+
+    // Binary operators.
+    if(*pos + 2 < argc) {
+
+        const char *op = argv[*pos + 1];
+        const char *b = argv[*pos + 2];
+        bool known = true;
+        bool result = false;
+
+        if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+            result = strcmp(a, b) == 0;
+        else if(strcmp(op, "!=") == 0)
+            result = strcmp(a, b) != 0;
+        else if(strcmp(op, "<") == 0)
+            result = strcmp(a, b) < 0;
+        else if(strcmp(op, ">") == 0)
+            result = strcmp(a, b) > 0;
+        else if(op[0] == '-' && strlen(op) == 3 && strchr("enlg", op[1]) != NULL) {
+            char *end_a, *end_b;
+            long long x = strtoll(a, &end_a, 10);
+            long long y = strtoll(b, &end_b, 10);
+            if(*a == '\0' || *end_a != '\0' || *b == '\0' || *end_b != '\0') {
+                shell_error("test: integer expression expected\n");
+                return 2;
+            }
+            if(strcmp(op, "-eq") == 0) result = x == y;
+            else if(strcmp(op, "-ne") == 0) result = x != y;
+            else if(strcmp(op, "-lt") == 0) result = x < y;
+            else if(strcmp(op, "-le") == 0) result = x <= y;
+            else if(strcmp(op, "-gt") == 0) result = x > y;
+            else if(strcmp(op, "-ge") == 0) result = x >= y;
+            else known = false;
+        } else
+            known = false;
+
+        if(known) {
+            *pos += 3;
+            return result ? 0 : 1;
+        }
+
+    }
+
+    // Unary operators.
+    if(a[0] == '-' && a[1] != '\0' && a[2] == '\0' && *pos + 1 < argc && strchr("efdrwxsLhpSbczn", a[1]) != NULL) {
+
+        const char *b = argv[*pos + 1];
+        *pos += 2;
+
+        if(a[1] == 'z')
+            return b[0] == '\0' ? 0 : 1;
+        if(a[1] == 'n')
+            return b[0] != '\0' ? 0 : 1;
+
+        struct stat st;
+        bool exists = (a[1] == 'L' || a[1] == 'h') ? lstat(b, &st) == 0 : stat(b, &st) == 0;
+        if(!exists)
+            return 1;
+
+        bool result = false;
+        switch(a[1]) {
+            case 'e': result = true; break;
+            case 'f': result = S_ISREG(st.st_mode); break;
+            case 'd': result = S_ISDIR(st.st_mode); break;
+            case 'L':
+            case 'h': result = S_ISLNK(st.st_mode); break;
+            case 'p': result = S_ISFIFO(st.st_mode); break;
+            case 'S': result = S_ISSOCK(st.st_mode); break;
+            case 'b': result = S_ISBLK(st.st_mode); break;
+            case 'c': result = S_ISCHR(st.st_mode); break;
+            case 's': result = st.st_size > 0; break;
+            case 'r': result = access(b, R_OK) == 0; break;
+            case 'w': result = access(b, W_OK) == 0; break;
+            case 'x': result = access(b, X_OK) == 0; break;
+        }
+        return result ? 0 : 1;
+
+    }
+
+    // A single string is true if it is not empty.
+    ++*pos;
+    return a[0] != '\0' ? 0 : 1;
+
+}
+
+// Evaluates a test expression of primaries joined by -a starting at argv[*pos]. Returns 0 (true), 1 (false) or 2 (error).
+int utilshell_test_and(char **argv, int argc, int *pos) {
+
+    int result = utilshell_test_primary(argv, argc, pos);
+
+    while(result != 2 && *pos < argc && strcmp(argv[*pos], "-a") == 0) {
+        ++*pos;
+        int rhs = utilshell_test_primary(argv, argc, pos);
+        if(rhs == 2)
+            return 2;
+        result = result == 0 && rhs == 0 ? 0 : 1;
+    }
+
+    return result;
+
+}
+
+// Evaluates a test expression (-o binds looser than -a) starting at argv[*pos]. Returns 0 (true), 1 (false) or 2 (error).
+int utilshell_test_expr(char **argv, int argc, int *pos) {
+
+    int result = utilshell_test_and(argv, argc, pos);
+
+    while(result != 2 && *pos < argc && strcmp(argv[*pos], "-o") == 0) {
+        ++*pos;
+        int rhs = utilshell_test_and(argv, argc, pos);
+        if(rhs == 2)
+            return 2;
+        result = result == 0 || rhs == 0 ? 0 : 1;
+    }
+
+    return result;
+
+}
+
+/* Creates a jobserver with room for jobs jobs at once, and exports it to the commands of the shell in $MAKEFLAGS (as
+ * "-jN --jobserver-auth=R,W", the form that make has understood since 4.2). The fds of the pipe are inherited by
+ * every command, which is how make finds them. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_jobserver_create(int jobs) {
+
+    int fds[2];
+    if(pipe(fds) == -1) {
+        int errsv = errno;
+        shell_error("Could not create jobserver. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    // One job runs on the slot of whoever starts it, so the pipe holds a token for every other one.
+    char tokens[256];
+    memset(tokens, '+', sizeof(tokens));
+    for(int left = jobs - 1; left > 0; left -= (int)sizeof(tokens)) {
+        if(utilshell_write_all(fds[1], tokens, left < (int)sizeof(tokens) ? left : sizeof(tokens)) != EXIT_SUCCESS) {
+            close(fds[0]);
+            close(fds[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char flags[64];
+    snprintf(flags, sizeof(flags), "-j%d --jobserver-auth=%d,%d", jobs, fds[0], fds[1]);
+    if(utilshell_var_set("MAKEFLAGS", 9, flags, true) == NULL) {
+        close(fds[0]);
+        close(fds[1]);
+        return EXIT_FAILURE;
+    }
+
+    return utilshell_jobserver_attach();
+
+}
+
+/* Starts using the jobserver named by --jobserver-auth (or --jobserver-fds, before make 4.2) in $MAKEFLAGS, if there
+ * is one: either a pair of inherited fds (R,W) or a named pipe (fifo:PATH). A jobserver that cannot be used is
+ * reported and ignored, as make does. Returns EXIT_SUCCESS unless something could not be allocated.
+ */
+int utilshell_jobserver_attach() {
+
+    const char *flags = utilshell_var_get("MAKEFLAGS");
+    if(flags == NULL)
+        return EXIT_SUCCESS;
+
+    // The last one counts.
+    const char *auth = NULL;
+    for(const char *p = flags; (p = strstr(p, "--jobserver-")) != NULL; ++p) {
+        if(strncmp(p, "--jobserver-auth=", 17) == 0)
+            auth = p + 17;
+        else if(strncmp(p, "--jobserver-fds=", 16) == 0)
+            auth = p + 16;
+    }
+    if(auth == NULL)
+        return EXIT_SUCCESS;
+
+    char *value = strndup(auth, strcspn(auth, " "));
+    if(value == NULL) {
+        shell_error("Could not allocate jobserver.\n");
+        return EXIT_FAILURE;
+    }
+
+    int read_fd, write_fd;
+    if(strncmp(value, "fifo:", 5) == 0) {
+        read_fd = open(value + 5, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+        write_fd = read_fd;
+    } else if(sscanf(value, "%d,%d", &read_fd, &write_fd) == 2 && fcntl(read_fd, F_GETFD) != -1 && fcntl(write_fd, F_GETFD) != -1) {
+        // A file description of our own, so that O_NONBLOCK does not change the pipe for everyone else.
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+        read_fd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    } else {
+        read_fd = -1;
+        errno = EBADF;
+    }
+
+    if(read_fd == -1) {
+        int errsv = errno;
+        shell_error("Could not use jobserver \"%s\", background jobs are not limited. errno:%d\n", value, errsv);
+    } else {
+        utilshell_jobserver_read = read_fd;
+        utilshell_jobserver_write = write_fd;
+        utilshell_jobserver_pid = getpid();
+        atexit(utilshell_jobserver_exit);
+    }
+    free(value);
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Gets a slot for a background job from the jobserver: the slot of the shell if it is free, or else a token, waiting
+ * for one if there is none. Jobs that exit in the meantime are reaped, which gives their slots back.
+ * Returns the slot (see struct utilshell_job), -1 if there is no jobserver, or UTILSHELL_JOBSERVER_INTERRUPTED if
+ * the wait was cut short with Ctrl-C.
+ */
+int utilshell_jobserver_acquire() {
+
+    if(utilshell_jobserver_read == -1)
+        return -1;
+
+    /* At a terminal the shell ignores SIGINT. While it waits for a token, SIGINT is let through to a signalfd
+     * instead, so that Ctrl-C can give up on the job. This is only set up once the shell actually has to wait.
+     */
+    bool catching = false;
+    int sigint_fd = -1;
+    sigset_t sigint, old_mask;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+
+    int slot;
+    while(true) {
+
+        if(!utilshell_jobserver_implicit) {
+            utilshell_jobserver_implicit = true;
+            slot = UTILSHELL_JOBSERVER_IMPLICIT;
+            break;
+        }
+
+        unsigned char token;
+        ssize_t n = read(utilshell_jobserver_read, &token, 1);
+        if(n == 1) {
+            slot = token;
+            break;
+        }
+        if(n == -1 && errno != EAGAIN && errno != EINTR) {
+            int errsv = errno;
+            shell_error("Could not get a jobserver token. errno:%d\n", errsv);
+            slot = -1;
+            break;
+        }
+
+        if(utilshell_interactive && !catching) {
+            catching = true;
+            sigprocmask(SIG_BLOCK, &sigint, &old_mask);
+            signal(SIGINT, SIG_DFL);
+            sigint_fd = signalfd(-1, &sigint, SFD_NONBLOCK|SFD_CLOEXEC);
+        }
+
+        // Wait for a token, for one of the jobs to change state or for Ctrl-C (poll() skips the fd if it is -1).
+        struct pollfd fds[3] = {
+            { utilshell_jobserver_read, POLLIN, 0 },
+            { utilshell_epoll_fd, POLLIN, 0 },
+            { sigint_fd, POLLIN, 0 }
+        };
+        int ready = poll(fds, 3, -1);
+        if(ready > 0 && (fds[2].revents & POLLIN)) {
+            slot = UTILSHELL_JOBSERVER_INTERRUPTED;
+            break;
+        }
+        if(ready > 0 && (fds[1].revents & POLLIN))
+            utilshell_jobs_poll(0);
+
+    }
+
+    // Ignoring SIGINT again also throws away the one that is pending, if any.
+    if(catching) {
+        signal(SIGINT, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        if(sigint_fd != -1)
+            close(sigint_fd);
+    }
+
+    return slot;
+
+}
+
+// Gives a slot from utilshell_jobserver_acquire() back (nothing happens for -1).
+void utilshell_jobserver_release(int slot) {
+
+    if(slot == UTILSHELL_JOBSERVER_IMPLICIT) {
+        utilshell_jobserver_implicit = false;
+    } else if(slot >= 0) {
+        unsigned char token = (unsigned char)slot;
+        if(write(utilshell_jobserver_write, &token, 1) != 1) {
+            int errsv = errno;
+            shell_error("Could not give a jobserver token back. errno:%d\n", errsv);
+        }
+    }
+
+}
+
+/* Gives back the tokens of the jobs that are still running when the shell exits (registered with atexit() by
+ * utilshell_jobserver_attach()). The jobs are not waited for any more, so their tokens would be lost for good.
+ * Children of the shell that exit (eg. exit in a pipeline) hold no tokens of their own, and leave them alone.
+ */
+void utilshell_jobserver_exit() {
+
+    if(getpid() != utilshell_jobserver_pid)
+        return;
+
+    for(int i = 0; i < utilshell_max_jobs; ++i) {
+        struct utilshell_job *job = utilshell_jobs[i];
+        if(job != NULL && job->jobserver_slot != -1) {
+            utilshell_jobserver_release(job->jobserver_slot);
+            job->jobserver_slot = -1;
+        }
+    }
+
+}
+
+// Returns a close-on-exec pidfd for a process, or -1 on error. Called through syscall() since not every libc wraps it.
+int utilshell_pidfd_open(pid_t pid) {
+
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if(fd != -1)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+
+}
+
+/* Adds the started stages of a pipeline to the job table as a new job. The pidfd of every process is registered with
+ * the event loop. Returns the job, or NULL on error.
+ */
+struct utilshell_job *utilshell_job_add(struct utilshell_stage *stages, int num_stages, pid_t pgid, const char *command, bool background) {
+
+    // Use the lowest free job number.
+    int index = 0;
+    while(index < utilshell_max_jobs && utilshell_jobs[index] != NULL)
+        ++index;
+
+    if(index == utilshell_max_jobs) {
+        int new_max_jobs = utilshell_max_jobs == 0 ? 16 : utilshell_max_jobs * 2;
+        struct utilshell_job **new_jobs = (struct utilshell_job**)realloc(utilshell_jobs, new_max_jobs*sizeof(struct utilshell_job*));
+        if(new_jobs == NULL) {
+            shell_error("Could not grow job table to %d jobs.\n", new_max_jobs);
+            return NULL;
+        }
+        for(int i = utilshell_max_jobs; i < new_max_jobs; ++i)
+            new_jobs[i] = NULL;
+        utilshell_jobs = new_jobs;
+        utilshell_max_jobs = new_max_jobs;
+    }
+
+    struct utilshell_job *job = (struct utilshell_job*)calloc(1, sizeof(struct utilshell_job));
+    struct utilshell_proc *procs = (struct utilshell_proc*)calloc(num_stages, sizeof(struct utilshell_proc));
+    if(job == NULL || procs == NULL) {
+        free(job);
+        free(procs);
+        shell_error("Could not allocate job.\n");
+        return NULL;
+    }
+
+    job->id = index + 1;
+    job->pgid = pgid;
+    job->procs = procs;
+    job->command = strdup(command);
+    job->background = background;
+    job->jobserver_slot = -1;
+
+    // Stages that could not be started are not processes of the job, but the last one still decides its status.
+    job->unstarted_status = stages[num_stages - 1].pid > 0 ? -1 : stages[num_stages - 1].status;
+
+    for(int i = 0; i < num_stages; ++i) {
+
+        if(stages[i].pid <= 0)
+            continue;
+
+        struct utilshell_proc *proc = procs + job->num_procs++;
+        proc->pid = stages[i].pid;
+        proc->job = job;
+        proc->started = stages[i].started;
+        snprintf(proc->name, sizeof(proc->name), "%s", stages[i].args[0]);
+        snprintf(proc->cpus, sizeof(proc->cpus), "%s", stages[i].cpus);
+        proc->cpu = -1;
+        proc->pidfd = utilshell_have_pidfd ? utilshell_pidfd_open(proc->pid) : -1;
+
+        if(proc->pidfd != -1) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = proc;
+            epoll_ctl(utilshell_epoll_fd, EPOLL_CTL_ADD, proc->pidfd, &event);
+        }
+
+        unsigned int b = (unsigned int)proc->pid % UTILSHELL_PROC_BUCKETS;
+        proc->hash_next = utilshell_proc_table[b];
+        utilshell_proc_table[b] = proc;
+
+    }
+
+    utilshell_jobs[index] = job;
+    utilshell_current_job = job->id;
+
+    return job;
+
+}
+
+// Removes a job from the job table and frees it. Its processes must all have exited.
+void utilshell_job_remove(struct utilshell_job *job) {
+
+    for(int i = 0; i < job->num_procs; ++i) {
+
+        struct utilshell_proc *proc = job->procs + i;
+        unsigned int b = (unsigned int)proc->pid % UTILSHELL_PROC_BUCKETS;
+        for(struct utilshell_proc **link = utilshell_proc_table + b; *link != NULL; link = &(*link)->hash_next) {
+            if(*link == proc) {
+                *link = proc->hash_next;
+                break;
+            }
+        }
+
+        if(proc->pidfd != -1)
+            close(proc->pidfd);
+
+    }
+
+    utilshell_jobs[job->id - 1] = NULL;
+
+    // The most recent remaining job becomes the current job.
+    if(utilshell_current_job == job->id) {
+        utilshell_current_job = 0;
+        for(int i = utilshell_max_jobs - 1; i >= 0 && utilshell_current_job == 0; --i)
+            if(utilshell_jobs[i] != NULL)
+                utilshell_current_job = i + 1;
+    }
+
+    free(job->procs);
+    free(job->command);
+    free(job);
+
+}
+
+/* Finds the job named by spec for a builtin: %n, %% or %+ (the current job), or the pid of one of its processes.
+ * If spec is NULL the current job is used. Reports an error and returns NULL if there is no such job.
+ */
+struct utilshell_job *utilshell_job_parse(const char *builtin, const char *spec) {
+
+    struct utilshell_job *job = NULL;
+
+    if(spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        if(utilshell_current_job > 0)
+            job = utilshell_jobs[utilshell_current_job - 1];
+    } else {
+        char *end;
+        long n = strtol(spec + (spec[0] == '%' ? 1 : 0), &end, 10);
+        if(*end == '\0' && spec[0] == '%') {
+            if(n > 0 && n <= utilshell_max_jobs)
+                job = utilshell_jobs[n - 1];
+        } else if(*end == '\0') {
+            struct utilshell_proc *proc = utilshell_proc_find((pid_t)n);
+            if(proc != NULL)
+                job = proc->job;
+        }
+    }
+
+    if(job == NULL)
+        shell_error("%s: %s: no such job\n", builtin, spec == NULL ? "current" : spec);
+
+    return job;
+
+}
+
+// Records that a process of a job was stopped by signal.
+void utilshell_proc_stop(struct utilshell_proc *proc, int signal) {
+
+    proc->stop_signal = signal;
+    if(!proc->stopped) {
+        proc->stopped = true;
+        ++proc->job->num_stopped;
+        proc->job->notify = true;
+    }
+
+}
+
+// Records that a stopped process of a job was continued.
+void utilshell_proc_continue(struct utilshell_proc *proc) {
+
+    if(proc->stopped) {
+        proc->stopped = false;
+        --proc->job->num_stopped;
+    }
+
+}
+
+// Records the exit of a process (its wait status) in the process and its job.
+void utilshell_proc_update(struct utilshell_proc *proc, int status) {
+
+    struct utilshell_job *job = proc->job;
+
+    if(proc->done)
+        return;
+
+    proc->done = true;
+    proc->status = status;
+    if(proc->stopped) {
+        proc->stopped = false;
+        --job->num_stopped;
+    }
+    ++job->num_done;
+
+    if(proc->pidfd != -1) {
+        epoll_ctl(utilshell_epoll_fd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+
+    // The status of the job is the status of its last process.
+    if(job->num_done == job->num_procs) {
+        int last = job->procs[job->num_procs - 1].status;
+        job->status = WIFEXITED(last) ? WEXITSTATUS(last) : 128 + WTERMSIG(last);
+        if(job->unstarted_status != -1)
+            job->status = job->unstarted_status;
+        job->notify = job->background;
+        if(job->profiled)
+            utilshell_job_report(job);
+        utilshell_jobserver_release(job->jobserver_slot);
+        job->jobserver_slot = -1;
+    }
+
+}
+
+// Returns the process with the given pid from the job table, or NULL if there is none.
+struct utilshell_proc *utilshell_proc_find(pid_t pid) {
+
+    for(struct utilshell_proc *proc = utilshell_proc_table[(unsigned int)pid % UTILSHELL_PROC_BUCKETS]; proc != NULL; proc = proc->hash_next)
+        if(proc->pid == pid)
+            return proc;
+
+    return NULL;
+
+}
+
+/* Runs one round of the event loop: waits up to timeout milliseconds (-1 for ever, 0 to only check) for processes to
+ * exit, stop or continue, and records what happened. Each exited process is reaped through its own pidfd, so the
+ * cost of a round is proportional to the number of events, not to the number of jobs.
+ */
+void utilshell_jobs_poll(int timeout) {
+
+    const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(utilshell_epoll_fd, events, MAX_EVENTS, timeout);
+
+    for(int i = 0; i < n; ++i) {
+
+        struct utilshell_proc *proc = (struct utilshell_proc*)events[i].data.ptr;
+
+        if(proc != NULL) {
+
+            // A pidfd is readable: its process exited and can be reaped without blocking.
+            utilshell_proc_reap(proc);
+
+        } else {
+
+            // SIGCHLD: collect stops and continues (and exits, if there are no pidfds).
+            struct signalfd_siginfo info;
+            while(read(utilshell_signal_fd, &info, sizeof(info)) == sizeof(info))
+                ;
+
+            /* Stops and continues are used up by waitid(), so the loop ends even if they are for children that are
+             * not in the job table. Exits are not waited for here, so that children of the shell that are not jobs
+             * are left to their own code.
+             */
+            siginfo_t child;
+            while(true) {
+                child.si_pid = 0;
+                if(waitid(P_ALL, 0, &child, WSTOPPED|WCONTINUED|WNOHANG) == -1 || child.si_pid == 0)
+                    break;
+
+                struct utilshell_proc *child_proc = utilshell_proc_find(child.si_pid);
+                if(child_proc == NULL)
+                    continue;
+
+                if(child.si_code == CLD_CONTINUED)
+                    utilshell_proc_continue(child_proc);
+                else
+                    utilshell_proc_stop(child_proc, child.si_status);
+            }
+
+            /* Processes without a pidfd (the kernel has no pidfd_open(), or it failed, eg. with EMFILE) are checked
+             * one by one. An exit is left in place by WNOWAIT and reaped with its usage.
+             */
+            for(int j = 0; j < utilshell_max_jobs; ++j) {
+                struct utilshell_job *job = utilshell_jobs[j];
+                for(int k = 0; job != NULL && k < job->num_procs; ++k) {
+                    struct utilshell_proc *job_proc = job->procs + k;
+                    if(job_proc->done || job_proc->pidfd != -1)
+                        continue;
+                    child.si_pid = 0;
+                    if(waitid(P_PID, job_proc->pid, &child, WEXITED|WNOHANG|WNOWAIT) == 0 && child.si_pid == job_proc->pid)
+                        utilshell_proc_reap(job_proc);
+                }
+            }
+
+        }
+
+    }
+
+}
+
+/* Reports background jobs that finished or stopped since the last prompt. Finished jobs are removed once reported.
+ * Without a prompt (eg. in a script) nothing is reported, and finished jobs stay until wait or jobs collects them.
+ */
+void utilshell_jobs_notify() {
+
+    if(!utilshell_prompt_visible)
+        return;
+
+    for(int i = 0; i < utilshell_max_jobs; ++i) {
+
+        struct utilshell_job *job = utilshell_jobs[i];
+        if(job == NULL || !job->notify)
+            continue;
+
+        job->notify = false;
+        printf("[%d]%c %-24s %s\n", job->id, job->id == utilshell_current_job ? '+' : ' ', utilshell_job_state(job), job->command);
+        fflush(stdout);
+
+        if(job->num_done == job->num_procs)
+            utilshell_job_remove(job);
+
+    }
+
+}
+
+// Runs the event loop until every process of a job has exited or the job is stopped. Returns the status of the job.
+int utilshell_job_wait(struct utilshell_job *job) {
+
+    while(job->num_done < job->num_procs && (job->num_stopped == 0 || job->num_done + job->num_stopped < job->num_procs))
+        utilshell_jobs_poll(-1);
+
+    for(int i = 0; i < job->num_procs && job->num_done < job->num_procs; ++i)
+        if(job->procs[i].stopped)
+            return 128 + job->procs[i].stop_signal;
+
+    return job->status;
+
+}
+
+/* Runs a job in the foreground: gives it the terminal, continues it if asked to, and waits until it exits (it is
+ * then removed) or is stopped (it then stays in the job table as a stopped job). Returns the status of the job.
+ */
+int utilshell_job_foreground(struct utilshell_job *job, bool cont) {
+
+    job->background = false;
+    job->notify = false;
+
+    if(utilshell_interactive)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+
+    if(cont) {
+        for(int i = 0; i < job->num_procs; ++i)
+            job->procs[i].stopped = false;
+        job->num_stopped = 0;
+        kill(-job->pgid, SIGCONT);
+    }
+
+    int status = utilshell_job_wait(job);
+
+    if(utilshell_interactive) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &utilshell_tmodes);
+    }
+
+    if(job->num_done == job->num_procs) {
+        // Move the prompt off the line where ^C was echoed.
+        int last = job->procs[job->num_procs - 1].status;
+        if(utilshell_interactive && WIFSIGNALED(last) && WTERMSIG(last) == SIGINT)
+            utilshell_write_all(STDOUT_FILENO, "\n", 1);
+        utilshell_job_remove(job);
+    } else {
+        // Stopped (eg. with Ctrl-Z). It can be continued with fg or bg.
+        job->background = true;
+        utilshell_current_job = job->id;
+        printf("\n[%d]+ %-24s %s\n", job->id, "Stopped", job->command);
+        fflush(stdout);
+        job->notify = false;
+    }
+
+    return status;
+
+}
+
+// Returns the state of a job as shown by jobs.
+const char *utilshell_job_state(struct utilshell_job *job) {
+
+    static char state[32];
+
+    if(job->num_done < job->num_procs)
+        return job->num_stopped > 0 ? "Stopped" : "Running";
+
+    int last = job->procs[job->num_procs - 1].status;
+    if(WIFSIGNALED(last))
+        snprintf(state, sizeof(state), "Killed (SIG%s)", sigabbrev_np(WTERMSIG(last)) != NULL ? sigabbrev_np(WTERMSIG(last)) : "?");
+    else if(job->status != 0)
+        snprintf(state, sizeof(state), "Exit %d", job->status);
+    else
+        snprintf(state, sizeof(state), "Done");
+
+    return state;
+
+}
+
+// Returns the number of a signal given by number or name (TERM or SIGTERM), or -1 if there is no such signal.
+int utilshell_signal_number(const char *name) {
+
+    char *end;
+    long n = strtol(name, &end, 10);
+    if(*end == '\0' && name[0] != '\0')
+        return n >= 0 && n < NSIG ? (int)n : -1;
+
+    if(strncmp(name, "SIG", 3) == 0)
+        name += 3;
+
+    for(int sig = 1; sig < NSIG; ++sig)
+        if(sigabbrev_np(sig) != NULL && strcasecmp(sigabbrev_np(sig), name) == 0)
+            return sig;
+
+    return -1;
+
+}
+
+/* Reaps a process that has exited with wait4(), which also collects its resource usage. If its job is profiled, the
+ * bytes it read and wrote are taken from /proc/<pid>/io first, while the process is still a zombie. rchar and wchar
+ * count every read() and write() (and the like) of the process, whatever the fd, and miss data moved inside the kernel
+ * (eg. with splice()), so they are not a measure of what went through its pipes alone.
+ */
+void utilshell_proc_reap(struct utilshell_proc *proc) {
+
+    clock_gettime(CLOCK_MONOTONIC, &proc->ended);
+
+    if(proc->job->profiled) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)proc->pid);
+        FILE *io = fopen(path, "re");
+        if(io != NULL) {
+            char line[128];
+            while(fgets(line, sizeof(line), io) != NULL) {
+                if(strncmp(line, "rchar: ", 7) == 0)
+                    proc->rchar = atoll(line + 7);
+                else if(strncmp(line, "wchar: ", 7) == 0)
+                    proc->wchar = atoll(line + 7);
+            }
+            fclose(io);
+        }
+
+        // The CPU it last ran on is field 39 of /proc/<pid>/stat, counting from the state after the command name.
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)proc->pid);
+        FILE *stat = fopen(path, "re");
+        if(stat != NULL) {
+            char line[1024];
+            char *field = NULL;
+            if(fgets(line, sizeof(line), stat) != NULL)
+                field = strrchr(line, ')');
+            for(int k = 0; field != NULL && k < 37; ++k)
+                field = strchr(field + 1, ' ');
+            if(field != NULL)
+                proc->cpu = atoi(field + 1);
+            fclose(stat);
+        }
+    }
+
+    int status;
+    if(wait4(proc->pid, &status, WNOHANG, &proc->usage) == proc->pid)
+        utilshell_proc_update(proc, status);
+
+}
+
+// Returns the number of seconds from start to end.
+double utilshell_seconds(struct timespec start, struct timespec end) {
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+}
+
+// Returns a timeval (eg. from struct rusage) in seconds.
+double utilshell_tv_seconds(struct timeval tv) {
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+
+}
+
+// Appends a string to out as a quoted JSON string.
+void utilshell_json_string(struct utilshell_buf *out, const char *s) {
+
+    utilshell_buf_append(out, "\"", 1);
+    for(; *s != '\0'; ++s) {
+        char escaped[8];
+        if(*s == '"' || *s == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = *s;
+            utilshell_buf_append(out, escaped, 2);
+        } else if((unsigned char)*s < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*s);
+            utilshell_buf_append(out, escaped, 6);
+        } else {
+            utilshell_buf_append(out, s, 1);
+        }
+    }
+    utilshell_buf_append(out, "\"", 1);
+
+}
+
+// Prints the totals of the time builtin to stderr.
+void utilshell_time_report(double real, double user, double sys) {
+
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+        (int)(real / 60), real - 60 * (int)(real / 60),
+        (int)(user / 60), user - 60 * (int)(user / 60),
+        (int)(sys / 60), sys - 60 * (int)(sys / 60));
+
+}
+
+/* Reports the cost of a finished job: wall, user and sys time, max RSS, context switches, bytes read/written (rchar
+ * and wchar, through any fd) and CPUs for every stage, plus the size of its pipes and the time the shell itself spent while the job ran. Timed jobs are printed to stderr; with -p a
+ * JSON line is appended to the profile file as well.
+ */
+void utilshell_job_report(struct utilshell_job *job) {
+
+    struct rusage shell_now;
+    getrusage(RUSAGE_SELF, &shell_now);
+    double shell_user = utilshell_tv_seconds(shell_now.ru_utime) - utilshell_tv_seconds(job->shell_usage.ru_utime);
+    double shell_sys = utilshell_tv_seconds(shell_now.ru_stime) - utilshell_tv_seconds(job->shell_usage.ru_stime);
+
+    struct timespec first = job->procs[0].started;
+    struct timespec last = job->procs[0].ended;
+    double user = 0;
+    double sys = 0;
+    for(int i = 0; i < job->num_procs; ++i) {
+        struct utilshell_proc *proc = job->procs + i;
+        if(utilshell_seconds(proc->ended, last) < 0)
+            last = proc->ended;
+        user += utilshell_tv_seconds(proc->usage.ru_utime);
+        sys += utilshell_tv_seconds(proc->usage.ru_stime);
+    }
+    double real = utilshell_seconds(first, last);
+
+    if(job->timed) {
+
+        utilshell_time_report(real, user, sys);
+        fprintf(stderr, "shell\t%.3fs user %.3fs sys\n", shell_user, shell_sys);
+        if(job->pipe_size > 0)
+            fprintf(stderr, "pipes\t%dKB\n", job->pipe_size >> 10);
+        for(int i = 0; i < job->num_procs; ++i) {
+            struct utilshell_proc *proc = job->procs + i;
+            fprintf(stderr, "[%d] %-12s real %.3fs user %.3fs sys %.3fs maxrss %ldKB csw %ld/%ld rchar %lldB wchar %lldB cpu %d%s%s\n",
+                i + 1, proc->name, utilshell_seconds(proc->started, proc->ended),
+                utilshell_tv_seconds(proc->usage.ru_utime), utilshell_tv_seconds(proc->usage.ru_stime),
+                proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw, proc->rchar, proc->wchar,
+                proc->cpu, proc->cpus[0] != '\0' ? " pinned " : "", proc->cpus);
+        }
+
+    }
+
+    if(utilshell_profile_fd == -1)
+        return;
+
+    struct utilshell_buf out;
+    memset(&out, 0, sizeof(out));
+    char field[512];
+
+    utilshell_buf_append(&out, "{\"command\":", 11);
+    utilshell_json_string(&out, job->command);
+    snprintf(field, sizeof(field), ",\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"shell_user\":%.6f,\"shell_sys\":%.6f,\"pipe_size\":%d,\"stages\":[",
+        job->status, real, user, sys, shell_user, shell_sys, job->pipe_size);
+    utilshell_buf_append(&out, field, strlen(field));
+
+    for(int i = 0; i < job->num_procs; ++i) {
+        struct utilshell_proc *proc = job->procs + i;
+        utilshell_buf_append(&out, i == 0 ? "{\"name\":" : ",{\"name\":", i == 0 ? 8 : 9);
+        utilshell_json_string(&out, proc->name);
+        int status = WIFEXITED(proc->status) ? WEXITSTATUS(proc->status) : 128 + WTERMSIG(proc->status);
+        snprintf(field, sizeof(field), ",\"pid\":%d,\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"rchar\":%lld,\"wchar\":%lld,\"cpu\":%d,\"cpus\":\"%s\"}",
+            (int)proc->pid, status, utilshell_seconds(proc->started, proc->ended),
+            utilshell_tv_seconds(proc->usage.ru_utime), utilshell_tv_seconds(proc->usage.ru_stime),
+            proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw, proc->rchar, proc->wchar,
+            proc->cpu, proc->cpus);
+        utilshell_buf_append(&out, field, strlen(field));
+    }
+    utilshell_buf_append(&out, "]}\n", 3);
+
+    // One write() per record, so records from several shells appending to the same file do not interleave.
+    utilshell_write_all(utilshell_profile_fd, out.data, out.len);
+    free(out.data);
+
+}
+
+/* Starts the shell of ctx: the shell program with --serve, with stdin from /dev/null, stdout and stderr to the memfds
+ * and the other end of the socket on fd 3. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int utilshell_ctx_start(struct shell_ctx *ctx) {
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) == -1) {
+        int errsv = errno;
+        shell_error("Could not create the socket of a context. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    // The shell starts with default signal handlers and no signals blocked, whatever the program does with them.
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigfillset(&signals);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+
+    // The fds of a context are above 2, so stdout and stderr can be set before fd 3 is.
+    posix_spawn_file_actions_adddup2(&actions, ctx->out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, ctx->err_fd, STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 3);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    char *argv[] = { ctx->path, (char*)"-t", (char*)"-c", (char*)"--serve", (char*)"3", NULL };
+    pid_t pid;
+    int error = posix_spawn(&pid, ctx->path, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if(error != 0) {
+        shell_error("Could not start the shell \"%s\" of a context. errno:%d\n", ctx->path, error);
+        close(fds[0]);
+        return EXIT_FAILURE;
+    }
+
+    ctx->pid = pid;
+    ctx->sock = fds[0];
+    return EXIT_SUCCESS;
+
+}
+
+/* The shell of a context (started with --serve sock, see utilshell_ctx_start()). It runs every command line that
+ * comes in on sock and answers with its exit status, until the socket is closed. Never returns.
+ */
+void utilshell_ctx_serve(int sock) {
+
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    while(true) {
+
+        size_t len;
+        if(utilshell_ctx_recv(sock, &len, sizeof(len)) != EXIT_SUCCESS)
+            break;
+        char *line = (char*)malloc(len + 1);
+        if(line == NULL || utilshell_ctx_recv(sock, line, len) != EXIT_SUCCESS)
+            break;
+        line[len] = '\0';
+
+        // The line is run as shell_prompt() and main() would run it, except that it has to be complete on its own.
+        utilshell_jobs_poll(0);
+        utilshell_jobs_notify();
+
+        char **tokens = shell_tokenize(line);
+        if(tokens == NULL) {
+            utilshell_last_status = 2;
+        } else if(utilshell_pending.len > 0) {
+            shell_error("Syntax error: unexpected end of input.\n");
+            utilshell_pending.len = 0;
+            utilshell_last_status = 2;
+        } else {
+            shell_exec(tokens);
+        }
+        shell_free_tokens(tokens);
+        free(line);
+
+        fflush(stdout);
+        fflush(stderr);
+        int status = utilshell_last_status;
+        if(utilshell_ctx_send(sock, &status, sizeof(status)) != EXIT_SUCCESS)
+            break;
+
+    }
+
+    exit(EXIT_SUCCESS);
+
+}
+
+// Sends all n bytes of data on the socket of a context. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_ctx_send(int sock, const void *data, size_t n) {
+
+    // MSG_NOSIGNAL, so that a shell that has exited gives an error here instead of a SIGPIPE to the program.
+    const char *p = (const char*)data;
+    while(n > 0) {
+        ssize_t sent = send(sock, p, n, MSG_NOSIGNAL);
+        if(sent == -1) {
+            if(errno == EINTR)
+                continue;
+            return EXIT_FAILURE;
+        }
+        p += sent;
+        n -= sent;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+/* Receives exactly n bytes from the socket of a context into data. Returns EXIT_SUCCESS on success, EXIT_FAILURE on
+ * error or if the other end was closed.
+ */
+int utilshell_ctx_recv(int sock, void *data, size_t n) {
+
+    char *p = (char*)data;
+    while(n > 0) {
+        ssize_t got = recv(sock, p, n, 0);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return EXIT_FAILURE;
+        p += got;
+        n -= got;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+// Reads all of the memfd fd into buf, growing it if needed. Returns EXIT_SUCCESS on success, EXIT_FAILURE on error.
+int utilshell_ctx_read(int fd, struct shell_buffer *buf) {
+
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        int errsv = errno;
+        shell_error("Could not read the output of a context. errno:%d\n", errsv);
+        return EXIT_FAILURE;
+    }
+
+    size_t size = st.st_size;
+    if(buf->data == NULL || buf->cap < size + 1) {
+        size_t cap = buf->cap * 2 > size + 1 ? buf->cap * 2 : size + 1;
+        char *data = (char*)realloc(buf->data, cap);
+        if(data == NULL) {
+            shell_error("Could not allocate %zu bytes for the output of a context.\n", cap);
+            return EXIT_FAILURE;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+
+    buf->len = 0;
+    while(buf->len < size) {
+        ssize_t got = pread(fd, buf->data + buf->len, size - buf->len, buf->len);
+        if(got == -1 && errno == EINTR)
+            continue;
+        if(got == -1) {
+            int errsv = errno;
+            shell_error("Could not read the output of a context. errno:%d\n", errsv);
+            return EXIT_FAILURE;
+        }
+        if(got == 0)
+            break;
+        buf->len += got;
+    }
+    buf->data[buf->len] = '\0';
 
     return EXIT_SUCCESS;
 
@@ -2,17 +2,69 @@
 #define SHELL_LIBRARY_H
 
 #include <stdarg.h>
+#include <stddef.h>
 
 // Functions for processing user input.
 int shell_init(int, char*[]);
-int shell_prompt(char[], const int);
+int shell_prompt(char**);
 char **shell_tokenize(char[]);
 int shell_exec(char**);
 void shell_free_tokens(char**);
+int shell_status();
+bool shell_interactive();
+
+/* Embedding the shell (libshell.a and libshell.so). The shell keeps its state in globals, so it cannot run inside the
+ * calling process more than once: a context is a child process instead, started from the shell program whose path is
+ * given to shell_ctx_create() (with --serve). It keeps its variables, working directory and background jobs from one
+ * shell_run() to the next, and shares none of them with the caller or other contexts. Each context can be used by one
+ * thread at a time; different contexts can be used from different threads at once.
+ *
+ * Creating a context costs a posix_spawn() of the shell, and each context is a process for as long as it lives. Every
+ * shell_run() is a round trip over a socket plus reading the output back from two memfds (tens of microseconds for a
+ * builtin, many times less than popen(), see make bench); what the line runs costs what it would in the shell.
+ */
+struct shell_ctx;
+
+// Text written by a command line. data is grown with realloc() as needed, stays null terminated and is the caller's to free().
+struct shell_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct shell_result {
+    int status;             // Exit status of the command line, as $? would give it.
+    struct shell_buffer out;
+    struct shell_buffer err;
+};
+
+struct shell_ctx *shell_ctx_create(const char*);
+int shell_run(struct shell_ctx*, const char*, struct shell_result*);
+void shell_ctx_free(struct shell_ctx*);
 
 // System functions for the shell.
 int shell_exit(int, char**);
 int shell_cd(int, char**);
+int shell_hash(int, char**);
+int shell_echo(int, char**);
+int shell_printf(int, char**);
+int shell_true(int, char**);
+int shell_false(int, char**);
+int shell_test(int, char**);
+int shell_pwd(int, char**);
+int shell_export(int, char**);
+int shell_unset(int, char**);
+int shell_jobs(int, char**);
+int shell_fg(int, char**);
+int shell_bg(int, char**);
+int shell_wait(int, char**);
+int shell_kill(int, char**);
+int shell_cat(int, char**);
+int shell_tee(int, char**);
+int shell_set(int, char**);
+int shell_parallel(int, char**);
+int shell_history(int, char**);
+int shell_memo(int, char**);
 
 // Other useful functions.
 int shell_error(const char*, ...);
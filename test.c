@@ -0,0 +1,330 @@
+#include "shell_library.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+/* Checks of the shell. Every command line is run by a shell of its own (the program given as the argument, ./shell by
+ * default), and what it writes to stdout and its exit status are compared with what is expected. The shells run in a
+ * new directory under /tmp ($TEST_DIR), which the checks leave empty, and find the shell under test in $TEST_SHELL.
+ * Then the same shell is run through the embedding API: a few command lines in one context, in order, so that they can
+ * rely on what an earlier one did, and then in several contexts from threads of their own at the same time.
+ * make test runs it with the shell that was just built.
+ */
+
+struct test_check {
+    const char *line;
+    const char *out;  // What the line writes to stdout (NULL for anything). stderr is dropped.
+    int status;
+};
+
+const struct test_check test_checks[] = {
+    { "echo hello | tr a-z A-Z", "HELLO\n", 0 },
+    { "yes | head -n 3", "y\ny\ny\n", 0 },
+    { "seq 100000 | sort -n | tail -n 1", "100000\n", 0 },
+    { "/bin/echo spawned > f\ncat < f | tr a-z A-Z\nrm f", "SPAWNED\n", 0 },
+    { "cat < missing | echo b", "b\n", 0 },
+    { "hash -p /bin/echo myecho\nmyecho hi\nmyecho there\nhash", "hi\nthere\nhits\tcommand\n   2\t/bin/echo\n", 0 },
+    { "hash tr\nhash -r\nhash", "hash: hash table empty\n", 0 },
+    { "echo 'a  b' \"c\"d e\\ f", "a  b cd e f\n", 0 },
+    { "echo $TEST_WORDS \"$TEST_WORDS\" ${TEST_WORDS}c $UNSET_VAR. \\$HOME", "a b a  b a bc . $HOME\n", 0 },
+    { "echo ~root /bin/ech? '/bin/ech?'", "/root /bin/echo /bin/ech?\n", 0 },
+    { "printf 'echo a b | cat\\necho a b | cat\\nexit\\n' > f\n$TEST_SHELL -t -c -a < f 2> g\ntail -n 1 g | grep -c ', 0 malloc'\nrm f g",
+        "a b\na b\n1\n", 0 },
+    { "printf 'cd /\\nexit\\n' > f\ncd /usr\nenv PS1='[\\W] \\w> ' $TEST_SHELL -c < $TEST_DIR/f\nrm $TEST_DIR/f", "[usr] /usr> [/] /> ", 0 },
+    { "false", "", 1 },
+    { "false\ntrue", "", 0 },
+    { "true\nexit 3\necho no", "", 3 },
+    { "false\nexit", "", 1 },
+    { "nonexistent_cmd", "", 127 },
+    { "echo 'a\necho b", "", 2 },
+    { "$TEST_SHELL -e false", "", 1 },
+    { "printf 'rm s\\nfalse\\n' > s\n$TEST_SHELL s", "", 1 },
+    { "echo false | $TEST_SHELL -t", "", 1 },
+    { "$TEST_SHELL -f -e 'echo forked | tr a-z A-Z'", "FORKED\n", 0 },
+    { "#!/bin/shell\n# A comment.\necho a # and another\necho b#c '#d'", "a\nb#c #d\n", 0 },
+    { "printf '\\101[%3c][%-3c]%d|%5.2f|%s\\n' a bc 42 3.14159 x", "A[  a][b  ]42| 3.14|x\n", 0 },
+    { "printf '%s,' a b c\nprintf '%b|%s\\n' 'x\\ty' 'x\\ty'", "a,b,c,x\ty|x\\ty\n", 0 },
+    { "echo -e 'a\\0102c\\tx'\necho -n n\necho", "aBc\tx\nn\n", 0 },
+    { "test 3 -lt 4", "", 0 },
+    { "[ abc = abd ]", "", 1 },
+    { "cd /usr\npwd", "/usr\n", 0 },
+    { "export FOO=bar\nenv | grep ^FOO=\nunset FOO\nenv | grep -c ^FOO=", "FOO=bar\n0\n", 1 },
+    { "echo redirected > f\ncat f\nrm f", "redirected\n", 0 },
+    { "sleep 5 &\njobs\nkill %1\nwait %1", "[1]+ Running                  sleep 5\n", 143 },
+    { "sh -c 'exit 3' &\nwait %1", "", 3 },
+    { "sleep 5 &\nkill -STOP %1\nsleep 0.2\njobs\nkill -CONT %1\nsleep 0.2\njobs\nkill %1",
+        "[1]+ Stopped                  sleep 5\n[1]+ Running                  sleep 5\n", 0 },
+    { "echo hi | nonexistent_cmd", "", 127 },
+    { "echo hi | /dev/null", "", 126 },
+    { "nonexistent_cmd | true", "", 0 },
+    { "time seq 3 | wc -l", "3\n", 0 },
+    { "time false", "", 1 },
+    { "$TEST_SHELL -e 'time seq 1000 | wc -l' 2> e\ngrep -c '^\\[[12]\\] .* rchar [0-9]*B wchar [0-9]*B' e\nrm e", "1000\n2\n", 0 },
+    { "$TEST_SHELL -p p -e 'echo hi | cat'\ngrep -o '\"name\":\"[a-z]*\"' p\ngrep -c '\"rchar\":[0-9]*,\"wchar\":[0-9]*' p\nrm p",
+        "hi\n\"name\":\"echo\"\n\"name\":\"cat\"\n1\n", 0 },
+    { "head -c 100000000 /dev/zero | cat | cat | wc -c", "100000000\n", 0 },
+    { "$TEST_SHELL -c -e 'echo a | | cat' 2> e\ncat e\nrm e", "ERROR: Syntax error: empty command in pipeline.\n", 0 },
+    { "$TEST_SHELL -c -e 'echo \"a' 2> e\ncat e\nrm e", "ERROR: Syntax error: unexpected end of input.\n", 0 },
+    { "echo a |", "", 2 },
+    { "echo x>f 2>e\ncat<f\nrm f e", "x\n", 0 },
+    { "cd /nonexistent && echo no", "", 1 },
+    { "cd /nonexistent || echo yes; echo $?", "yes\n0\n", 0 },
+    { "false; echo $?; true && echo and || echo or", "1\nand\n", 0 },
+    { "if false; then echo a; elif true; then echo b; else echo c; fi", "b\n", 0 },
+    { "for x in 1 2 3; do if [ $x != 2 ]; then echo $x; fi; done", "1\n3\n", 0 },
+    { "touch f; while [ -f f ]; do echo once; rm f; done; until true; do echo never; done", "once\n", 0 },
+    { "for x in a b\ndo\n    echo $x |\n    tr a-z A-Z\ndone", "A\nB\n", 0 },
+    { "if true; then # it's true\n    echo yes # so\nfi # done", "yes\n", 0 },
+    { "for x in 1 2 # no 3\ndo echo $x; done", "1\n2\n", 0 },
+    { "seq 3 > f; cat f f | tee g > /dev/null; cat g; rm f g", "1\n2\n3\n1\n2\n3\n", 0 },
+    { "echo a > f; echo b | tee -a f; cat f; rm f", "b\na\nb\n", 0 },
+    { "seq 200000 > f; cat < f | cat | tee g | wc -l; cmp f g && rm f g", "200000\n", 0 },
+    { "cat missing", "", 1 },
+    { "set; set pipe-size=1M cpus=0; set",
+        "pipe-size=default\ncpus=off\nhistory=off\nmemo-size=268435456\npipe-size=1048576\ncpus=0\nhistory=off\nmemo-size=268435456\n", 0 },
+    { "set pipe-size=abc", "", 1 },
+    { "$TEST_SHELL -e 'set pipe-size=1M cpus=spread:0; time seq 100000 | wc -l' 2> e\ngrep -c '^pipes\t1024KB$\\|pinned 0$' e\nrm e",
+        "100000\n3\n", 0 },
+    { "parallel echo ::: a b c", "a\nb\nc\n", 0 },
+    { "parallel -j 3 sh -c 'sleep 0.{}; echo {}' ::: 3 1 2", "3\n1\n2\n", 0 },
+    { "parallel -j 2 sh -c 'exit {}' ::: 0 1 0", "", 1 },
+    { "printf 'x\\ny\\n' | parallel echo got", "got x\ngot y\n", 0 },
+    { "cat <(echo hi) <(echo there)", "hi\nthere\n", 0 },
+    { "diff <(seq 3) <(seq 3) && echo same", "same\n", 0 },
+    { "seq 5 | tee >(wc -l > c) > /dev/null; cat c; rm c", "5\n", 0 },
+    { "env HISTFILE=h $TEST_SHELL -e 'set history=on\necho one\n!!\nhistory -s one'\ncat h\nrm h",
+        "one\necho one\none\n    1  echo one\n    2  echo one\n    3  history -s one\necho one\necho one\nhistory -s one\n", 0 },
+    { "echo completed > completeme\nsh -c 'sleep 0.5; printf \"cat complet\\t\\nexit\\n\"' |\n"
+        "env TERM=xterm HISTFILE=/dev/null script -qec \"$TEST_SHELL -t -c\" /dev/null | grep -c ^completed\nrm completeme", "1\n", 0 },
+    { "X=5 Y=$X; echo $Y", "5\n", 0 },
+    { "X=1; X=2 Y=$X; echo $X $Y \"[$UNSET_VAR]\"", "2 2 []\n", 0 },
+    { "unset A; A=1 B=$A env | grep ^B=; echo \"[$A]\"", "B=1\n[]\n", 0 },
+    { "export LATER; env | grep -c ^LATER=; LATER=1; env | grep ^LATER=", "0\nLATER=1\n", 0 },
+    { "PATH=/nonexistent; ls", "", 127 },
+    { "MEMODIR=m; echo 1 > d; memo -d d sh -c 'echo ran >> log; echo out; exit 3'; memo -d d sh -c 'echo ran >> log; echo out; exit 3'\n"
+        "echo $?; echo 22 > d; memo -d d sh -c 'echo ran >> log; echo out'; cat log; rm -r m log d", "out\nout\n3\nout\nran\nran\n", 0 },
+    { "$TEST_SHELL -j 2 -e 'env | grep -c \"^MAKEFLAGS=-j2 --jobserver-auth=[0-9]*,[0-9]*$\"'", "1\n", 0 },
+    { "$TEST_SHELL -j 1 -e \"sh -c 'sleep 0.3; echo a' &\nsh -c 'echo b' &\nwait\"", "a\nb\n", 0 },
+    { "cat <<-EOF | tr a-z A-Z\n\tone $TEST_WORDS\n\t\ttwo\n\tEOF\ncat <<'X'\n$TEST_WORDS\nX", "ONE A  B\nTWO\n$TEST_WORDS\n", 0 },
+    { "tr a-z A-Z <<< \"hi $TEST_WORDS\"; wc -c <<< ''", "HI A  B\n1\n", 0 },
+    { "seq -s ' ' 100000 | sed 's/^/echo \"a  b\" x\\\\ y /; s/$/ # end/' > s\n$TEST_SHELL s > o\n"
+        "seq -s ' ' 100000 | sed 's/^/a  b x y /' | cmp - o && echo same\nrm s o", "same\n", 0 },
+};
+const int TEST_NUM_CHECKS = sizeof(test_checks) / sizeof(test_checks[0]);
+
+// Command lines run one after the other in the same context. stderr is dropped here too.
+const struct test_check test_ctx_checks[] = {
+    { "echo hello | tr a-z A-Z", "HELLO\n", 0 },
+    { "cd /; X=kept", "", 0 },
+    { "pwd; echo $X", "/\nkept\n", 0 },
+    { "false", "", 1 },
+    { "echo a\necho b", "a\nb\n", 0 },
+    { "seq 100000 | tail -n 1", "100000\n", 0 },
+    { "exit 7", "", 7 },
+    { "echo $? \"[$X]\"", "0 []\n", 0 },
+};
+const int TEST_NUM_CTX_CHECKS = sizeof(test_ctx_checks) / sizeof(test_ctx_checks[0]);
+
+// Contexts run at once, and the command lines each of them runs.
+const int TEST_THREADS = 8;
+const int TEST_RUNS = 100;
+
+// How long a check may run before its shell is killed (with SIGALRM).
+const int TEST_TIMEOUT = 10;
+
+const char *test_shell_path;
+char test_dir[] = "/tmp/shell_test.XXXXXX";
+
+/* Runs a command line in a new shell (with -e) and collects its stdout (up to size - 1 bytes, null terminated) and exit
+ * status. The shell's stdin is /dev/null. Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int test_run(const char *line, char *out, size_t size, int *status) {
+
+    int out_pipe[2];
+    if(pipe(out_pipe) == -1)
+        return EXIT_FAILURE;
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        if(chdir(test_dir) == -1)
+            _exit(127);
+        alarm(TEST_TIMEOUT);
+        execl(test_shell_path, test_shell_path, "-t", "-c", "-e", line, (char*)NULL);
+        _exit(127);
+    }
+
+    close(out_pipe[1]);
+    if(pid == -1) {
+        close(out_pipe[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t length = 0;
+    ssize_t n;
+    while((n = read(out_pipe[0], out + length, size - 1 - length)) != 0) {
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1)
+            break;
+        length += n;
+        if(length == size - 1)
+            break;
+    }
+    out[length] = '\0';
+    close(out_pipe[0]);
+
+    int wait_status;
+    while(waitpid(pid, &wait_status, 0) == -1)
+        if(errno != EINTR)
+            return EXIT_FAILURE;
+    *status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+    return EXIT_SUCCESS;
+
+}
+
+// Prints a failed check to stderr.
+void test_report(const char *line, int status, const char *out, const struct test_check *check) {
+
+    fprintf(stderr, "test: \"%s\" gave status %d and stdout \"%s\", expected status %d and stdout \"%s\".\n",
+        line, status, out, check->status, check->out != NULL ? check->out : "(anything)");
+
+}
+
+/* Runs test_ctx_checks in one context. A context needs the path of its shell, so one cannot be created without it.
+ * Returns the number of checks that failed.
+ */
+int test_ctx() {
+
+    int failures = 0;
+    if(shell_ctx_create(NULL) != NULL) {
+        fprintf(stderr, "test: shell_ctx_create(NULL) gave a context.\n");
+        ++failures;
+    }
+
+    struct shell_ctx *ctx = shell_ctx_create(test_shell_path);
+    if(ctx == NULL)
+        return failures + 1;
+
+    struct shell_result result;
+    memset(&result, 0, sizeof(result));
+    for(int k = 0; k < TEST_NUM_CTX_CHECKS; ++k) {
+        const struct test_check *check = test_ctx_checks + k;
+        if(shell_run(ctx, check->line, &result) != EXIT_SUCCESS || result.status != check->status ||
+            (check->out != NULL && strcmp(result.out.data, check->out) != 0)) {
+            test_report(check->line, result.status, result.out.data != NULL ? result.out.data : "", check);
+            ++failures;
+        }
+    }
+
+    free(result.out.data);
+    free(result.err.data);
+    shell_ctx_free(ctx);
+    return failures;
+
+}
+
+/* Runs the same pipeline over and over in a context of its own, with a variable that is different in every context.
+ * Returns NULL on success, or a non-NULL value if a run gave the wrong output.
+ */
+void *test_thread(void *arg) {
+
+    long id = (long)arg;
+    struct shell_ctx *ctx = shell_ctx_create(test_shell_path);
+    if(ctx == NULL)
+        return arg;
+
+    struct shell_result result;
+    memset(&result, 0, sizeof(result));
+    char line[64], out[32], err[32];
+    snprintf(line, sizeof(line), "export ID=%ld", id);
+    bool failed = shell_run(ctx, line, &result) != EXIT_SUCCESS;
+
+    snprintf(out, sizeof(out), "%ld\n", id);
+    snprintf(err, sizeof(err), "e%ld\n", id);
+    struct test_check check = { "echo $ID | cat; sh -c 'echo e$ID >&2'", out, EXIT_SUCCESS };
+    for(int i = 0; i < TEST_RUNS && !failed; ++i) {
+        if(shell_run(ctx, check.line, &result) != EXIT_SUCCESS || result.status != check.status ||
+            strcmp(result.out.data, out) != 0 || strcmp(result.err.data, err) != 0) {
+            test_report(check.line, result.status, result.out.data != NULL ? result.out.data : "", &check);
+            failed = true;
+        }
+    }
+
+    free(result.out.data);
+    free(result.err.data);
+    shell_ctx_free(ctx);
+    return failed ? arg : NULL;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    // The shell is run from the directory of the checks, so it needs an absolute path.
+    test_shell_path = realpath(argc > 1 ? argv[1] : "./shell", NULL);
+    if(test_shell_path == NULL || mkdtemp(test_dir) == NULL) {
+        perror("test");
+        return EXIT_FAILURE;
+    }
+    setenv("TEST_SHELL", test_shell_path, 1);
+    setenv("TEST_DIR", test_dir, 1);
+    setenv("TEST_WORDS", "a  b", 1); // For checks of word splitting.
+
+    int failures = 0;
+    char out[65536];
+    for(int k = 0; k < TEST_NUM_CHECKS; ++k) {
+        const struct test_check *check = test_checks + k;
+        int status = -1;
+        if(test_run(check->line, out, sizeof(out), &status) != EXIT_SUCCESS || status != check->status ||
+            (check->out != NULL && strcmp(out, check->out) != 0)) {
+            test_report(check->line, status, out, check);
+            ++failures;
+        }
+    }
+
+    if(rmdir(test_dir) == -1) {
+        fprintf(stderr, "test: the checks left files in %s.\n", test_dir);
+        ++failures;
+    }
+
+    failures += test_ctx();
+
+    // A context that could not be started is a failure like one that gave the wrong output.
+    pthread_t threads[TEST_THREADS];
+    bool started[TEST_THREADS];
+    for(long i = 0; i < TEST_THREADS; ++i) {
+        started[i] = pthread_create(threads + i, NULL, test_thread, (void*)(i + 1)) == 0;
+        if(!started[i]) {
+            fprintf(stderr, "test: could not start thread %ld.\n", i + 1);
+            ++failures;
+        }
+    }
+    for(int i = 0; i < TEST_THREADS; ++i) {
+        void *failed;
+        if(started[i] && pthread_join(threads[i], &failed) == 0 && failed != NULL)
+            ++failures;
+    }
+
+    int num_checks = TEST_NUM_CHECKS + TEST_NUM_CTX_CHECKS + TEST_THREADS;
+    if(failures > 0) {
+        fprintf(stderr, "test: %d of %d checks failed.\n", failures, num_checks);
+        return EXIT_FAILURE;
+    }
+    printf("test: %d checks passed, %d of them in contexts (%d from threads at once, running %d command lines each).\n",
+        num_checks, TEST_NUM_CTX_CHECKS + TEST_THREADS, TEST_THREADS, TEST_RUNS);
+    return EXIT_SUCCESS;
+
+}